@@ -0,0 +1,124 @@
+/*******************************************************************************
+ * Copyright Arrow Electronics, Inc., 2019
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ ******************************************************************************/
+
+#ifndef __INCLUDE_ADVERT_INGEST_H
+#define __INCLUDE_ADVERT_INGEST_H
+
+#include "app.h"
+#include "bg_types.h"
+#include "gecko_bglib.h"
+#include <stdbool.h>
+
+// Advertisers tracked at once. With the table full, a new address takes
+// the slot of the advertiser not heard of for longest if that was over
+// ADVERTISER_TIMEOUT_MS ago, otherwise its adverts are counted as
+// untracked.
+#ifndef ADVERT_MAX_BEACONS
+#define ADVERT_MAX_BEACONS 256
+#endif
+
+// Company ID of the manufacturer specific data carrying sensor records,
+// Silicon Labs by default
+#ifndef ADVERT_COMPANY_ID
+#define ADVERT_COMPANY_ID 0x02FF
+#endif
+
+#define AD_FLAGS 0x01
+#define AD_SHORT_LOCAL_NAME 0x08
+#define AD_COMPLETE_LOCAL_NAME 0x09
+#define AD_SERVICE_DATA_16 0x16
+#define AD_MANUFACTURER_DATA 0xFF
+
+#define EDDYSTONE_UUID 0xFEAA
+#define EDDYSTONE_TLM_FRAME 0x20
+#define EDDYSTONE_TLM_LENGTH 14
+
+// One AD structure of an advertisement, data is length bytes after the type
+typedef struct AdvertField {
+  uint8_t type;
+  uint8_t length;
+  const uint8_t *data;
+} AdvertField;
+
+// Latest advert and reading of one advertising address. sensors has a bit
+// per registry sensor index that was ever decoded from its adverts, fields
+// of the other sensors are 0. The Eddystone-TLM values are valid once
+// has_tlm is set. attempted_us is when a connection to the address was last
+// tried, 0 if never. updates counts the adverts values were decoded from.
+typedef struct AdvertReading {
+  bd_addr address;
+  char name[MAX_NAME_LENGTH];
+  int8_t rssi;
+  uint64_t last_seen_us;
+  uint64_t attempted_us;
+  uint32_t adverts;
+  uint32_t updates;
+  uint32_t sensors;
+  SensorValues values;
+
+  bool has_tlm;
+  uint16_t battery_mv;
+  double temperature;
+  uint32_t advert_count;
+  uint32_t uptime_s;
+} AdvertReading;
+
+// evicted counts the advertisers whose slot went to a new address,
+// overwritten the readings replaced by a newer one of the same address
+// before they were taken
+typedef struct AdvertStats {
+  uint32_t adverts;
+  uint32_t decoded;
+  uint32_t untracked;
+  uint32_t evicted;
+  uint32_t overwritten;
+} AdvertStats;
+
+// Step through the AD structures of data from *offset, false at the end or
+// at a structure running past it
+bool advert_next_field(const uint8_t *data, uint32_t length, uint32_t *offset,
+                       AdvertField *field);
+
+// Sensor values of the advert go into the reading of its address. False
+// if the advert carries none or the table is full.
+//
+// Values come from service data with a 16-bit UUID (AD type 0x16) where the
+// UUID is that of a registry sensor, from manufacturer specific data of
+// ADVERT_COMPANY_ID holding records of a 16-bit sensor UUID followed by the
+// value in the length the registry gives, and from unencrypted
+// Eddystone-TLM frames. Only registry sensors with a 16-bit UUID can be
+// sent this way.
+bool advert_ingest(const struct gecko_msg_le_gap_scan_response_evt_t *scan,
+                   uint64_t now_us);
+
+// Record name, RSSI and time of the advert without decoding it and copy
+// the reading of its address to tracked. False if the table is full.
+bool advert_track(const struct gecko_msg_le_gap_scan_response_evt_t *scan,
+                  uint64_t now_us, AdvertReading *tracked);
+
+// Copy reading index of the table, false past the end. Indexes only stay
+// the same until the next advert, which may replace a quiet advertiser.
+uint32_t advert_reading_count();
+bool advert_reading(uint32_t index, AdvertReading *reading);
+
+// A connection to address was tried at now_us
+void advert_set_attempted(const bd_addr *address, uint64_t now_us);
+
+// Copy every reading updated since the last call into readings, which has
+// room for ADVERT_MAX_BEACONS, for the upload thread. Returns how many.
+uint32_t advert_take(AdvertReading *readings);
+
+void advert_get_stats(AdvertStats *stats);
+
+// Log adverts per second and table use since the last call
+void advert_log_stats();
+
+#endif // __INCLUDE_ADVERT_INGEST_H
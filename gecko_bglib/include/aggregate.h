@@ -0,0 +1,83 @@
+/*******************************************************************************
+ * Copyright Arrow Electronics, Inc., 2019
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ ******************************************************************************/
+
+#ifndef __INCLUDE_AGGREGATE_H
+#define __INCLUDE_AGGREGATE_H
+
+#include "app.h"
+#include "sensor_history.h"
+#include "sensor_registry.h"
+#include <stdint.h>
+
+// Window length and step used unless set otherwise, a window of 0 for
+// none and a step as long as the window for tumbling windows
+#ifndef AGGREGATE_WINDOW_MS
+#define AGGREGATE_WINDOW_MS 0
+#endif
+
+#ifndef AGGREGATE_STEP_MS
+#define AGGREGATE_STEP_MS AGGREGATE_WINDOW_MS
+#endif
+
+// Steps a window may span
+#ifndef AGGREGATE_MAX_PANES
+#define AGGREGATE_MAX_PANES 16
+#endif
+
+// Statistics of one field over a pane or a window, mean and m2 (the sum of
+// squared differences from the mean) kept as Welford's algorithm does
+typedef struct FieldStats {
+  uint32_t count;
+  double min;
+  double max;
+  double mean;
+  double m2;
+} FieldStats;
+
+// Running statistics of one board. Time is cut into panes one step long,
+// starting at event loop time 0, and a window is the panes of its last
+// window length. Each sample updates the stats of its pane only, a window
+// merges its panes when it is reported. Slot n % AGGREGATE_MAX_PANES holds
+// pane n, pane[slot] is the pane held + 1, 0 if none. Windows ending
+// before pane next were reported.
+typedef struct Aggregate {
+  char name[MAX_NAME_LENGTH];
+  uint64_t next;
+  uint32_t late;
+  uint64_t pane[AGGREGATE_MAX_PANES];
+  FieldStats stats[AGGREGATE_MAX_PANES][MAX_SENSOR_FIELDS];
+} Aggregate;
+
+// Called for every window that ended with samples in it, start_us being
+// its start in event loop time and stats one per registry field
+typedef void (*AggregateReport)(const char *name, uint64_t start_us,
+                                const FieldStats *stats);
+
+// Window length and step for all boards, the window a multiple of the step
+// of at most AGGREGATE_MAX_PANES steps. Returns 0 on success. Must be
+// called before the first aggregate_history.
+int aggregate_set_window(uint32_t window_ms, uint32_t step_ms);
+
+uint32_t aggregate_window_ms();
+
+// Add the samples of history not taken before, values being their fields
+// converted as sensor_history_values gives them, then report every window
+// that ended by now_us, oldest first. history is NULL if the board took
+// no samples since the last call. Once the board in the slot changes, the
+// statistics start over.
+void aggregate_history(Aggregate *aggregate, const SensorHistory *history,
+                       double (*values)[SENSOR_HISTORY_LENGTH], uint64_t now_us,
+                       AggregateReport report);
+
+// Sample standard deviation, 0 for fewer than two samples
+double field_stats_stddev(const FieldStats *stats);
+
+#endif // __INCLUDE_AGGREGATE_H
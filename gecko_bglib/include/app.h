@@ -20,22 +20,92 @@
 #include "bg_types.h"
 #include "gecko_bglib.h"
 #include "main.h"
+#include "sensor_registry.h"
 #include <stdbool.h>
 
-#define MAX_UUID_LENGTH 16
 #define MAX_NAME_LENGTH 32
 #define MAX_NUM_SERVICES 32
 #define MAX_NUM_CHARACTERISTICS 64
 #define VALUE_PAYLOAD_LENGTH 64
-#define NUM_THUNDERBOARD_SENSORS 10
+#define HANDLE_MAP_SIZE 256
 #define ADVERTISEMENT_TIMEOUT_SECONDS (1 * 60)
+#define THUNDERBOARD_NAME_PREFIX "Thunder Sense #"
+#define ATT_DEFAULT_MTU 23
 
-typedef void (*state_handler)(uint32_t, struct gecko_cmd_packet *, bool);
+// Boards connected at once, must not exceed the connections the NCP
+// firmware is built for
+#ifndef MAX_THUNDERBOARDS
+#define MAX_THUNDERBOARDS 4
+#endif
 
+// Connection interval in 1.25 ms units from connecting until the first
+// reading, while discovery and reads are back to back, and the one asked
+// for after that. Supervision timeout in 10 ms units.
+#ifndef FAST_CONNECTION_INTERVAL
+#define FAST_CONNECTION_INTERVAL 6
+#endif
+#ifndef SLOW_CONNECTION_INTERVAL
+#define SLOW_CONNECTION_INTERVAL 40
+#endif
+#ifndef CONNECTION_TIMEOUT
+#define CONNECTION_TIMEOUT 200
+#endif
+
+// A board whose link dropped is reconnected to after RECONNECT_MIN_MS,
+// twice as long after every failed attempt up to RECONNECT_MAX_MS. After
+// RECONNECT_ATTEMPTS failures its slot goes back to discovery, or the NCP
+// is reset if no other board is connected or advertising either. Any
+// connection attempt is given up after CONNECT_TIMEOUT_MS.
+#ifndef RECONNECT_MIN_MS
+#define RECONNECT_MIN_MS 100
+#endif
+#ifndef RECONNECT_MAX_MS
+#define RECONNECT_MAX_MS 5000
+#endif
+#ifndef RECONNECT_ATTEMPTS
+#define RECONNECT_ATTEMPTS 6
+#endif
+#ifndef CONNECT_TIMEOUT_MS
+#define CONNECT_TIMEOUT_MS 3000
+#endif
+
+// Scanning goes on alongside the connections, which take precedence over
+// it. Every SCAN_INTERVAL the radio listens on the next advertising channel
+// for SCAN_WINDOW, both in 0.625 ms units. A shorter window takes longer to
+// hear a board. A board last heard of more than ADVERTISER_TIMEOUT_MS ago is
+// not connected to from the advertiser table.
+#ifndef SCAN_INTERVAL
+#define SCAN_INTERVAL 160
+#endif
+#ifndef SCAN_WINDOW
+#define SCAN_WINDOW 160
+#endif
+#ifndef ADVERTISER_TIMEOUT_MS
+#define ADVERTISER_TIMEOUT_MS 10000
+#endif
+
+// Each sensor is read every period_ms of its registry entry, the one
+// whose deadline is earliest first. Sensors due within SAMPLE_BATCH_MS
+// after that are read in the same read multiple request, a little early,
+// to save ATT exchanges.
+#ifndef SAMPLE_BATCH_MS
+#define SAMPLE_BATCH_MS 100
+#endif
+
+// Largest ATT MTU offered, the stack exchanges it on every connection
+#ifndef GATT_MAX_MTU
+#define GATT_MAX_MTU 247
+#endif
+
+// INIT and DISCOVERY are states of the radio, the others of each board. A
+// board slot in STATE_INIT is free, one in STATE_RECONNECT waits to connect
+// again to a board whose link dropped.
 typedef enum AppState {
   STATE_INIT = 0,
   STATE_DISCOVERY,
+  STATE_RECONNECT,
   STATE_CONNECT,
+  STATE_VALIDATE_CACHE,
   STATE_DISCOVER_SERVICES,
   STATE_DISCOVER_CHARACTERISTICS,
   STATE_SUBSCRIBE_CHARACTERISTICS,
@@ -44,16 +114,17 @@ typedef enum AppState {
   NUM_STATES
 } AppState;
 
+// Whether a notification stands in for the read due: when polling, every
+// readable sensor is read on its period and notifications come on top.
+// When sampling from notifications, a sensor that notifies is only read
+// once its notifications fall behind its period.
+typedef enum SamplingMode { SAMPLING_POLL = 0, SAMPLING_NOTIFY } SamplingMode;
+
 typedef struct GattServiceList {
   uint32_t length;
   uint32_t list[MAX_NUM_SERVICES];
 } GattServiceList;
 
-typedef struct UUID {
-  uint32_t length;
-  uint8_t bytes[MAX_UUID_LENGTH];
-} UUID;
-
 typedef union CharacteristicProperties {
   struct {
     uint8_t broadcast : 1;
@@ -82,7 +153,13 @@ typedef struct CharacteristicList {
   Characteristic list[MAX_NUM_CHARACTERISTICS];
 } CharacteristicList;
 
+// Values of the sensor registry fields, in registry order
+typedef struct SensorValues {
+  double fields[MAX_SENSOR_FIELDS];
+} SensorValues;
+
 typedef struct ThunderBoardDevice {
+  AppState state;
   char name[MAX_NAME_LENGTH];
   bd_addr address;
   int8_t rssi;
@@ -90,37 +167,91 @@ typedef struct ThunderBoardDevice {
   GattServiceList services;
   CharacteristicList characteristics;
 
-  union {
-    struct {
-      Characteristic *temperature_sensor;
-      Characteristic *pressure_sensor;
-      Characteristic *humidity_sensor;
-      Characteristic *co2_sensor;
-      Characteristic *voc_sensor;
-      Characteristic *light_sensor;
-      Characteristic *uv_sensor;
-      Characteristic *sound_sensor;
-      Characteristic *acceleration_sensor;
-      Characteristic *orientation_sensor;
-    };
-    Characteristic *all_sensors[NUM_THUNDERBOARD_SENSORS];
-  };
+  // Characteristic of each registry sensor, NULL until found
+  Characteristic *all_sensors[MAX_SENSORS];
+
+  // all_sensors index + 1 of the characteristic at handle_base + i, 0 for
+  // any other handle. Built once discovery is done. handle_map_partial is
+  // set if some sensor handle lies beyond the map.
+  uint16_t handle_base;
+  bool handle_map_partial;
+  uint8_t handle_map[HANDLE_MAP_SIZE];
 
+  // Progress of the state machine. cache_check is the device name
+  // characteristic read to confirm that handles loaded from the GATT cache
+  // still apply. Discovery looks up only the sensor services and
+  // characteristics and the device name by UUID unless full_discovery is
+  // set after that missed some.
+  Characteristic *cache_check;
+  bool cache_valid;
+  bool full_discovery;
+  uint32_t service_index;
+  uint32_t sensor_index;
+  bool read_pending;
+
+  // Sampling schedule in registry order: when each sensor is due next, and
+  // the samples it got, read or notified, since the connection opened
+  uint64_t due_us[MAX_SENSORS];
+  uint32_t samples[MAX_SENSORS];
+
+  // Sensors of the outstanding read multiple request, in request order.
+  // read_multiple is cleared if the board rejects the procedure.
+  uint16_t mtu;
+  bool read_multiple;
+  uint8_t group_length;
+  uint8_t group[MAX_SENSORS];
+
+  // Throughput since the connection opened
+  uint64_t connected_us;
+  uint64_t read_start_us;
+  uint64_t read_total_us;
+  uint32_t reads;
+  uint32_t readings;
+  uint32_t value_events;
+  uint32_t value_bytes;
+
+  // Link as the stack last reported it: interval in 1.25 ms units, PHY and
+  // link layer payload size. slow_link is set once the steady state
+  // interval was asked for.
+  uint16_t interval;
+  uint8_t phy;
+  uint16_t txsize;
+  bool slow_link;
+
+  // Event loop timer id + 1 of the pending reconnect or connection timeout,
+  // 0 for none. dropped_us is when the link was lost, 0 while connected,
+  // and reconnect_attempts the attempts that failed since. reconnects and
+  // reconnect_total_us add up the drops recovered from.
+  int timer;
+  uint64_t dropped_us;
+  uint32_t reconnect_attempts;
+  uint32_t reconnects;
+  uint64_t reconnect_total_us;
 } ThunderBoardDevice;
 
-typedef struct SensorValues {
-  uint32_t id;
-  double temperature;
-  double pressure;
-  double humidity;
-  double co2;
-  double voc;
-  double light;
-  double sound;
-  double acceleration[3];
-  double orientation[3];
-} SensorValues;
+typedef void (*state_handler)(ThunderBoardDevice *, uint32_t,
+                              struct gecko_cmd_packet *, bool);
 
 void handle_event(struct gecko_cmd_packet *event);
 
+// Connect to at most count boards, up to MAX_THUNDERBOARDS
+void app_set_max_devices(uint32_t count);
+
+void app_set_sampling_mode(SamplingMode mode);
+
+// Decode sensor values from advertisements instead of connecting to boards,
+// see advert_ingest.h
+void app_set_advert_ingest(bool enable);
+
+// Send scan requests and receive scan responses as well, instead of only
+// listening to adverts
+void app_set_active_scan(bool enable);
+
+// Board in slot index, NULL if the slot is free
+ThunderBoardDevice *app_get_device(uint32_t index);
+
+// Log readings per second, read latency, bytes per second and the samples
+// per second of each sensor of every connected board
+void app_log_device_stats();
+
 #endif // __INCLUDE_APP_H
\ No newline at end of file
@@ -0,0 +1,70 @@
+/*******************************************************************************
+ * Copyright Arrow Electronics, Inc., 2019
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ ******************************************************************************/
+
+#ifndef __INCLUDE_BGAPI_TRACE_H
+#define __INCLUDE_BGAPI_TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Trace file: TRACE_MAGIC, version byte, 3 reserved bytes, then records of
+// a TraceRecordHeader (little endian) followed by length bytes of data
+#define TRACE_MAGIC "BGTR"
+#define TRACE_VERSION 1
+#define TRACE_FILE_HEADER_LENGTH 8
+#define TRACE_RECORD_HEADER_LENGTH 8
+
+typedef enum TraceDirection {
+  TRACE_FROM_NCP = '<',
+  TRACE_TO_NCP = '>'
+} TraceDirection;
+
+typedef struct TraceRecordHeader {
+  uint32_t delta_us; // since the previous record
+  uint16_t length;
+  uint8_t direction;
+  uint8_t reserved;
+} TraceRecordHeader;
+
+typedef struct TraceReplayStats {
+  uint32_t records;
+  uint32_t bytes_in;
+  uint32_t outputs;
+  uint32_t output_mismatches; // commands that differ from the recording
+} TraceReplayStats;
+
+// Recording sits between gecko_bglib and the serial functions: pass the
+// real ones to trace_wrap() and the trace_* ones to BGLIB_INITIALIZE_*.
+// Nothing is written until trace_record_start().
+void trace_wrap(void (*output)(uint32_t, uint8_t *),
+                int32_t (*input)(uint32_t, uint8_t *),
+                int32_t (*read)(uint32_t, uint8_t *), int32_t (*peek)(void));
+void trace_output(uint32_t length, uint8_t *data);
+int32_t trace_input(uint32_t length, uint8_t *data);
+int32_t trace_read(uint32_t length, uint8_t *data);
+int32_t trace_peek(void);
+int trace_record_start(const char *path);
+void trace_record_stop();
+
+// Replay feeds a trace back as the NCP. Input recorded after a command is
+// held back until the application has sent that command, so the state
+// machine sees the same sequence however fast it runs. With realtime the
+// recorded gaps are kept, otherwise input is delivered as fast as possible.
+int trace_replay_open(const char *path, bool realtime);
+void trace_replay_close();
+void replay_output(uint32_t length, uint8_t *data);
+int32_t replay_input(uint32_t length, uint8_t *data);
+int32_t replay_read(uint32_t length, uint8_t *data);
+int32_t replay_peek(void);
+bool trace_replay_finished();
+void trace_replay_get_stats(TraceReplayStats *stats);
+
+#endif // __INCLUDE_BGAPI_TRACE_H
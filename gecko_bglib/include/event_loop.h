@@ -0,0 +1,40 @@
+/*******************************************************************************
+ * Copyright Arrow Electronics, Inc., 2019
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ ******************************************************************************/
+
+#ifndef __INCLUDE_EVENT_LOOP_H
+#define __INCLUDE_EVENT_LOOP_H
+
+#include <stdint.h>
+
+#define EVENT_LOOP_MAX_FDS 8
+#define EVENT_LOOP_MAX_TIMERS 16
+
+typedef void (*event_loop_callback)(void *context);
+
+// Returns nonzero when the source has work buffered in user space, so the
+// loop dispatches it instead of sleeping in poll()
+typedef int (*event_loop_pending)(void *context);
+
+int event_loop_add_fd(int fd, event_loop_callback callback,
+                      event_loop_pending pending, void *context);
+void event_loop_remove_fd(int fd);
+
+// Schedule callback after delay_ms, then every period_ms (0 for one shot).
+// Returns a timer id or -1 when all timers are in use.
+int event_loop_add_timer(uint32_t delay_ms, uint32_t period_ms,
+                         event_loop_callback callback, void *context);
+void event_loop_cancel_timer(int timer_id);
+
+uint64_t event_loop_now_us();
+void event_loop_run();
+void event_loop_stop();
+
+#endif // __INCLUDE_EVENT_LOOP_H
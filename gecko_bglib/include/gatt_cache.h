@@ -0,0 +1,38 @@
+/*******************************************************************************
+ * Copyright Arrow Electronics, Inc., 2019
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ ******************************************************************************/
+
+#ifndef __INCLUDE_GATT_CACHE_H
+#define __INCLUDE_GATT_CACHE_H
+
+#include "app.h"
+#include "bg_types.h"
+
+#ifndef GATT_CACHE_DIR
+#define GATT_CACHE_DIR "/data/gatt_cache"
+#endif
+
+// One file per board named after its address: GATT_CACHE_MAGIC, version
+// byte, service count, characteristic count, reserved byte, the service
+// handles as little endian uint32, then per characteristic a little endian
+// uint16 handle, properties, UUID length and the UUID
+#define GATT_CACHE_MAGIC "GATC"
+#define GATT_CACHE_VERSION 1
+#define GATT_CACHE_HEADER_LENGTH 8
+
+// Discovered services and characteristics of the board at address, 0 on a
+// hit. Only handles, properties and UUIDs are kept.
+int gatt_cache_load(const bd_addr *address, GattServiceList *services,
+                    CharacteristicList *characteristics);
+int gatt_cache_store(const bd_addr *address, const GattServiceList *services,
+                     const CharacteristicList *characteristics);
+void gatt_cache_remove(const bd_addr *address);
+
+#endif // __INCLUDE_GATT_CACHE_H
@@ -16,8 +16,42 @@
  *  any events are received during response waiting, they are queued and
  *  delivered next time gecko_wait_event is called.
  *
- *  Queue length is controlled by defining macro "BGLIB_QUEUE_LEN", default is 30.
- *  Queue length depends on use cases and allowed host memory usage.
+ *  Queue size in bytes is controlled by defining macro "BGLIB_QUEUE_BYTES"
+ *  (power of two, default 8192). Events are packed into it with their actual
+ *  length, so small events such as procedure_completed take 8 bytes while a
+ *  scan response takes about 50. Queue size depends on use cases and allowed
+ *  host memory usage.
+ *
+ *  In buffered mode received bytes are collected into a receive ring of
+ *  "BGLIB_RX_BUFFER_LEN" bytes (power of two, default 2048). Each read pulls
+ *  everything the device has available and frames are parsed out of the ring,
+ *  so a burst of events costs one read instead of three per event.
+ *
+ *  Buffered mode can hand the device to a reader thread with
+ *  gecko_reader_start(). The thread frames every message and passes it to the
+ *  application through a lock-free single producer/single consumer queue of
+ *  "BGLIB_READER_QUEUE_LEN" messages (power of two, default 256), so input is
+ *  drained while the application is busy. gecko_reader_fd() becomes readable
+ *  when messages are waiting. When the queue is full events are dropped,
+ *  command responses wait until the application makes room.
+ *
+ *  Events can be filtered before they are queued: by message ID, and scan
+ *  responses by address allowlist or advertised name prefix. Queued scan
+ *  responses can be coalesced so only the newest one per address is kept.
+ *  With the reader thread, rejected events never leave the thread.
+ *
+ *  All of this state belongs to a bglib_context. The default context serves
+ *  a single NCP, further ones come from bglib_context_create(), so one
+ *  process can drive several NCPs, each with its own serial handle and
+ *  reader thread. The bglib_* functions take the context to work on, their
+ *  gecko_* counterparts work on the selected one. Commands, the gecko_cmd_*
+ *  wrappers in host_gecko.h, always go to the selected context: pick it
+ *  with bglib_select() or GECKO_CTX() around the command.
+ *
+ *  Selection is not thread-safe. Select and send commands from one thread
+ *  only; other threads may only call bglib_* functions on contexts of
+ *  their own. Async callbacks run by bglib_get_event() that send commands
+ *  must select their context first.
  *
  *  BGLIB usage:
  *      Define library, it must be defined globally:
@@ -35,6 +69,13 @@
  *      Initialize library,and provide output and input function:
  *          BGLIB_INITIALIZE(my_output,my_input);
  *
+ *      Or provide a bulk read function for buffered mode, prototype is:
+ *          int32_t my_read(uint32_t len,uint8_t* data);
+ *          Function reads at most "len" bytes, whatever is available, to
+ *          pointer "data". Returns amount read, 0 on timeout or negative on
+ *          failure.
+ *          BGLIB_INITIALIZE_BUFFERED(my_output,my_read,my_peek);
+ *
  *
  *  Receiving event:
  *   Events are received by gecko_wait_event-function.
@@ -44,7 +85,9 @@
  *
  *   Event ID can be read from header of event by BGLIB_MSG_ID-macro.
  *
- *   Event data can be accessed thru returned pointer.
+ *   Event data can be accessed thru returned pointer. The pointer refers to
+ *   the event inside the queue and stays valid until the next call to
+ *   gecko_wait_event, gecko_peek_event or gecko_get_event.
  *
  *   Example:
  *       struct gecko_cmd_packet *p;
@@ -76,32 +119,133 @@
 
 #include "host_gecko.h"
 
-#ifndef BGLIB_QUEUE_LEN
-#define BGLIB_QUEUE_LEN 30
+#ifndef BGLIB_QUEUE_BYTES
+#define BGLIB_QUEUE_BYTES 8192
+#endif
+
+#if (BGLIB_QUEUE_BYTES & (BGLIB_QUEUE_BYTES - 1)) != 0
+#error "BGLIB_QUEUE_BYTES must be a power of two"
 #endif
 
-#define BGLIB_DEFINE()                                      \
-  struct gecko_cmd_packet _gecko_cmd_msg;                   \
-  struct gecko_cmd_packet _gecko_rsp_msg;                   \
-  struct gecko_cmd_packet *gecko_cmd_msg = &_gecko_cmd_msg; \
-  struct gecko_cmd_packet *gecko_rsp_msg = &_gecko_rsp_msg; \
-  void (*bglib_output)(uint32_t len1, uint8_t* data1);      \
-  int32_t (*bglib_input)(uint32_t len1, uint8_t* data1);    \
-  int32_t (*bglib_peek)(void);                              \
-  struct gecko_cmd_packet gecko_queue[BGLIB_QUEUE_LEN];     \
-  int    gecko_queue_w = 0;                                 \
-  int    gecko_queue_r = 0;
+#ifndef BGLIB_RX_BUFFER_LEN
+#define BGLIB_RX_BUFFER_LEN 2048
+#endif
+
+#if (BGLIB_RX_BUFFER_LEN & (BGLIB_RX_BUFFER_LEN - 1)) != 0
+#error "BGLIB_RX_BUFFER_LEN must be a power of two"
+#endif
+
+#ifndef BGLIB_ASYNC_MAX_PENDING
+#define BGLIB_ASYNC_MAX_PENDING 8
+#endif
+
+#ifndef BGLIB_LATENCY_IDS
+#define BGLIB_LATENCY_IDS 32
+#endif
 
-extern struct gecko_cmd_packet gecko_queue[BGLIB_QUEUE_LEN];
-extern int    gecko_queue_w;
-extern int    gecko_queue_r;
+#define BGLIB_LATENCY_BUCKETS 20
+
+#ifndef BGLIB_FILTER_MAX_IDS
+#define BGLIB_FILTER_MAX_IDS 8
+#endif
+
+#ifndef BGLIB_FILTER_MAX_ADDRESSES
+#define BGLIB_FILTER_MAX_ADDRESSES 16
+#endif
+
+#define BGLIB_FILTER_NAME_LEN 32
+#define BGLIB_COALESCE_SLOTS 64
+
+#ifndef BGLIB_READER_QUEUE_LEN
+#define BGLIB_READER_QUEUE_LEN 256
+#endif
+
+#if (BGLIB_READER_QUEUE_LEN & (BGLIB_READER_QUEUE_LEN - 1)) != 0
+#error "BGLIB_READER_QUEUE_LEN must be a power of two"
+#endif
+
+/**
+ * Library state of one NCP: command and response buffers, event queue,
+ * receive ring, reader thread, async pipeline, filters, I/O functions and
+ * serial handle. Every gecko_* function, including the gecko_cmd_* wrappers
+ * in host_gecko.h, works on the selected context, the bglib_* functions on
+ * the one passed.
+ */
+struct bglib_context;
+
+/**
+ * The library state lives in gecko_bglib.c, kept for existing callers
+ */
+#define BGLIB_DEFINE() extern struct gecko_cmd_packet* gecko_cmd_msg
+
+/**
+ * Create a context for another NCP, it has no I/O functions yet
+ * @return context or NULL if out of memory
+ */
+struct bglib_context* bglib_context_create(void);
+
+/**
+ * Stop the reader thread of ctx and free it. The default context can't be
+ * destroyed, if ctx was selected the default context is selected instead.
+ */
+void bglib_context_destroy(struct bglib_context* ctx);
+
+/**
+ * @return context used until another one is selected
+ */
+struct bglib_context* bglib_default_context(void);
+
+/**
+ * Direct following gecko_* calls to ctx. Not thread-safe: the selection is
+ * one pointer for the whole process and gecko_cmd_msg and gecko_rsp_msg
+ * point into the selected context, so select and send from one thread.
+ * Reader threads only touch their own context.
+ */
+void bglib_select(struct bglib_context* ctx);
+
+/**
+ * @return selected context
+ */
+struct bglib_context* bglib_selected(void);
+
+/**
+ * Select CTX and send COMMAND to it, e.g.
+ *     GECKO_CTX(radio2, gecko_cmd_le_gap_end_procedure())->result
+ * @param CTX context of the NCP
+ * @param COMMAND gecko_cmd_* call
+ */
+#define GECKO_CTX(CTX, COMMAND) (bglib_select(CTX), (COMMAND))
+
+/**
+ * Set the I/O functions of a context, see the BGLIB_INITIALIZE* macros
+ */
+void bglib_initialize(struct bglib_context* ctx,
+                      void (*output)(uint32_t len1, uint8_t* data1),
+                      int32_t (*input)(uint32_t len1, uint8_t* data1),
+                      int32_t (*read)(uint32_t len1, uint8_t* data1),
+                      int32_t (*peek)(void));
+
+/**
+ * Initialize a context in buffered mode on a serial handle of its own, the
+ * functions get the handle as first argument (uartTxPort,
+ * uartRxNonBlockingPort and uartRxPeekPort in uart.h)
+ * @param ctx context of the NCP
+ * @param handle serial port handle
+ * @param tx write function
+ * @param read read function returning whatever is available, up to len bytes
+ * @param peek function returning the number of bytes waiting
+ */
+void bglib_initialize_serial(struct bglib_context* ctx, int32_t handle,
+                             int32_t (*tx)(int32_t handle, uint32_t len1, uint8_t* data1),
+                             int32_t (*read)(int32_t handle, uint32_t len1, uint8_t* data1),
+                             int32_t (*peek)(int32_t handle));
 
 /**
  * Initialize BGLIB
  * @param OFUNC
  * @param IFUNC
  */
-#define BGLIB_INITIALIZE(OFUNC, IFUNC) bglib_output = OFUNC; bglib_input = IFUNC; bglib_peek = NULL;
+#define BGLIB_INITIALIZE(OFUNC, IFUNC) bglib_initialize(bglib_selected(), OFUNC, IFUNC, NULL, NULL)
 
 /**
  * Initialize BGLIB to support nonblocking mode
@@ -109,10 +253,187 @@ extern int    gecko_queue_r;
  * @param IFUNC
  * @param PFUNC peek function to check if there is data to be read from UART
  */
-#define BGLIB_INITIALIZE_NONBLOCK(OFUNC, IFUNC, PFUNC) bglib_output = OFUNC; bglib_input = IFUNC; bglib_peek = PFUNC;
+#define BGLIB_INITIALIZE_NONBLOCK(OFUNC, IFUNC, PFUNC) bglib_initialize(bglib_selected(), OFUNC, IFUNC, NULL, PFUNC)
 
-extern void(*bglib_output)(uint32_t len1, uint8_t* data1);
-extern int32_t (*bglib_input)(uint32_t len1, uint8_t* data1);
-extern int32_t(*bglib_peek)(void);
+/**
+ * Initialize BGLIB to drain the device in bulk through the receive ring
+ * @param OFUNC
+ * @param RFUNC read function returning whatever is available, up to len bytes
+ * @param PFUNC peek function to check if there is data to be read from UART
+ */
+#define BGLIB_INITIALIZE_BUFFERED(OFUNC, RFUNC, PFUNC) bglib_initialize(bglib_selected(), OFUNC, NULL, RFUNC, PFUNC)
+
+/**
+ * Next event of ctx, see gecko_wait_event() and gecko_peek_event(). Async
+ * callbacks of ctx due before it run first.
+ * @param ctx context of the NCP
+ * @param block nonzero to wait for an event
+ * @return event or NULL if none is waiting and not blocking
+ */
+struct gecko_cmd_packet* bglib_get_event(struct bglib_context* ctx, int block);
+struct gecko_cmd_packet* gecko_get_event(int block);
+
+/**
+ * Events of ctx are waiting or bytes in its device, see gecko_event_pending()
+ * @return nonzero if processing required
+ */
+int bglib_event_pending(struct bglib_context* ctx);
+
+/**
+ * Events are waiting in the queue or complete messages in the receive ring,
+ * without checking the device. Used by poll() based callers, which watch the
+ * device themselves.
+ *
+ * @return nonzero if processing required
+ */
+int bglib_event_buffered(struct bglib_context* ctx);
+int gecko_event_buffered(void);
+
+/**
+ * Receive path counters
+ */
+struct gecko_rx_stats {
+    uint32_t input_calls;  // calls into bglib_input/bglib_read
+    uint32_t bytes;        // bytes pulled from the device
+    uint32_t frames;       // complete messages parsed
+    uint32_t dropped;      // events dropped because the queue was full
+    uint32_t filtered;     // events rejected by the filters
+    uint32_t coalesced;    // scan responses merged into a queued one
+};
+
+/**
+ * Copy receive path counters
+ * @param stats destination
+ */
+void bglib_get_rx_stats(struct bglib_context* ctx, struct gecko_rx_stats *stats);
+void gecko_get_rx_stats(struct gecko_rx_stats *stats);
+
+typedef void (*gecko_command_callback)(struct gecko_cmd_packet* response, void* context);
+
+/**
+ * Send COMMAND, a gecko_cmd_* call, without waiting for its response
+ * @param CALLBACK called with the response
+ * @param CONTEXT passed to the callback
+ * @param COMMAND gecko_cmd_* call, its return value must not be used
+ */
+#define GECKO_ASYNC(CALLBACK, CONTEXT, COMMAND) \
+    do { gecko_async_begin(CALLBACK, CONTEXT); (void)(COMMAND); gecko_async_end(); } while (0)
+
+void gecko_async_begin(gecko_command_callback callback, void* context);
+void gecko_async_end(void);
+
+/**
+ * @return number of async commands whose callback has not run yet
+ */
+int bglib_async_pending(struct bglib_context* ctx);
+int gecko_async_pending(void);
+
+/**
+ * Round trip latency of one command ID. Bucket n counts responses that took
+ * [2^n, 2^(n+1)) microseconds, the last bucket everything above.
+ */
+struct gecko_latency_histogram {
+    uint32_t msg_id;
+    uint32_t count;
+    uint32_t max_us;
+    uint32_t buckets[BGLIB_LATENCY_BUCKETS];
+};
+
+/**
+ * Copy latency histograms of the commands sent so far
+ * @param histograms destination
+ * @param max size of destination
+ * @return number of histograms copied
+ */
+int bglib_get_latency_histograms(struct bglib_context* ctx,
+                                 struct gecko_latency_histogram* histograms, int max);
+int gecko_get_latency_histograms(struct gecko_latency_histogram* histograms, int max);
+
+/**
+ * Start reader thread, requires buffered mode
+ * @return 0 on success
+ */
+int bglib_reader_start(struct bglib_context* ctx);
+int gecko_reader_start(void);
+
+/**
+ * Stop reader thread, messages still queued for the application and bytes
+ * not yet framed are lost
+ */
+void bglib_reader_stop(struct bglib_context* ctx);
+void gecko_reader_stop(void);
+
+/**
+ * File descriptor that becomes readable when the reader thread has queued
+ * messages. Drained by gecko_peek_event() once the queue is empty.
+ * @return descriptor or -1 when the reader thread is not running
+ */
+int bglib_reader_fd(struct bglib_context* ctx);
+int gecko_reader_fd(void);
+
+/**
+ * Reader thread handoff counters
+ */
+struct gecko_reader_stats {
+    uint32_t frames;         // messages handed to the application
+    uint32_t dropped;        // events dropped because the queue was full
+    uint32_t high_water;     // highest queue level seen
+    uint32_t level;          // current queue level
+    uint32_t wakeup_errors;  // failed writes to the wakeup pipe
+};
+
+/**
+ * Copy reader thread handoff counters
+ * @param stats destination
+ */
+void bglib_get_reader_stats(struct bglib_context* ctx,
+                            struct gecko_reader_stats *stats);
+void gecko_get_reader_stats(struct gecko_reader_stats *stats);
+
+/**
+ * Drop events with this message ID before they are queued
+ * @param msg_id event ID, e.g. gecko_evt_le_connection_rssi_id
+ * @return 0 on success, -1 if BGLIB_FILTER_MAX_IDS are already dropped
+ */
+int bglib_filter_drop_event(struct bglib_context* ctx, uint32_t msg_id);
+int gecko_filter_drop_event(uint32_t msg_id);
+
+/**
+ * Let scan responses from address through. Once an address or a name
+ * prefix is set, scan responses must match one of them to be queued.
+ * @return 0 on success, -1 if the allowlist is full
+ */
+int bglib_filter_allow_address(struct bglib_context* ctx, const bd_addr* address);
+int gecko_filter_allow_address(const bd_addr* address);
+
+/**
+ * Let scan responses advertising a local name starting with prefix through
+ * @param prefix name prefix, NULL or "" to remove it
+ * @return 0 on success, -1 if longer than BGLIB_FILTER_NAME_LEN - 1
+ */
+int bglib_filter_name_prefix(struct bglib_context* ctx, const char* prefix);
+int gecko_filter_name_prefix(const char* prefix);
+
+/**
+ * Keep only the newest queued scan response per address
+ * @param enable nonzero to coalesce
+ */
+void bglib_filter_coalesce_scans(struct bglib_context* ctx, int enable);
+void gecko_filter_coalesce_scans(int enable);
+
+/**
+ * Remove all filters and stop coalescing
+ */
+void bglib_filter_clear(struct bglib_context* ctx);
+void gecko_filter_clear(void);
+
+/**
+ * Check the link by sending system_hello, requires the reader thread.
+ * Events received meanwhile stay queued for the application.
+ * @param timeout_ms time to wait for the response
+ * @return 0 if the NCP answered, -1 otherwise
+ */
+int bglib_hello(struct bglib_context* ctx, int timeout_ms);
+int gecko_hello(int timeout_ms);
 
 #endif
@@ -20,22 +20,56 @@
 #include <stdint.h>
 #include <stdbool.h>
 
-#define USAGE "Usage: %s [-n] [-b baud rate] [-s serial port] [-l log level]\n\n"
+#define USAGE \
+  "Usage: %s [-n] [-f] [-b baud rate] [-s serial port] [-l log level]\n" \
+  "       [-c boards | -a] [-A] [-m poll|notify] [-w seconds [-W seconds]]\n" \
+  "       [-S] [-r trace file | -p trace file [-x]]\n\n"
 #define HELP_MESSAGE \
   "Run G300 Bluetooth to Azure Demo\n" \
   " -b <baud rate>    Set baud rate for uart to mighty gecko (default: 115200)\n" \
+  "                   Falls back to lower rates if the NCP does not answer\n" \
+  " -f                Enable RTS/CTS hardware flow control\n" \
   " -s <serial port>  Specify serial port to mighty gecko (default: /dev/ttyS1)\n" \
   " -l <log level>    Set logging level\n" \
   " -n                Disable log file creation\n" \
+  " -c <boards>       Connect up to this many Thunderboards at once\n" \
+  "                   (default and maximum: the NCP connection limit)\n" \
+  " -a                Decode sensor values from beacon advertisements and\n" \
+  "                   connect to no board\n" \
+  " -A                Scan actively, asking advertisers for scan responses\n" \
+  " -m <poll|notify>  Read every sensor on its period (default), or read a\n" \
+  "                   sensor that notifies only when notifications lag\n" \
+  " -w <seconds>      Upload the minimum, maximum, mean, standard deviation\n" \
+  "                   and count of each field over windows this long\n" \
+  "                   instead of the samples (default: no windows)\n" \
+  " -W <seconds>      Start a window this often, for sliding windows\n" \
+  "                   (default: as long as the window)\n" \
+  " -S                Upload every sample of each board under \"samples\",\n" \
+  "                   in version 2 messages, not only the latest values\n" \
+  " -r <trace file>   Record all BGAPI traffic to a trace file\n" \
+  " -p <trace file>   Replay a trace instead of using the serial port,\n" \
+  "                   nothing is uploaded\n" \
+  " -x                Replay as fast as possible instead of recorded speed\n" \
   " -h  or  --help    Print Help (this message) and exit\n"
 
 #define LOG_FILE_PATH "/data/g300.log"
 
 typedef struct G300Args {
   uint32_t baudrate;
+  bool flow_control;
   char serial_port[32];
   uint8_t log_level;
   bool disable_log_file;
+  uint32_t max_devices;
+  bool notify_sampling;
+  bool advert_ingest;
+  bool active_scan;
+  uint32_t window_ms;
+  uint32_t step_ms;
+  bool upload_samples;
+  char record_path[64];
+  char replay_path[64];
+  bool replay_fast;
 } G300Args;
 
 void serial_write(uint32_t length, uint8_t* data);
@@ -0,0 +1,68 @@
+/*******************************************************************************
+ * Copyright Arrow Electronics, Inc., 2019
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ ******************************************************************************/
+
+#ifndef __INCLUDE_SENSOR_HISTORY_H
+#define __INCLUDE_SENSOR_HISTORY_H
+
+#include "app.h"
+#include "sensor_registry.h"
+#include <stdint.h>
+
+// Samples kept per sensor of each board until they are uploaded, a power
+// of two. Once a sensor has this many waiting, each new sample overwrites
+// its oldest one, which is counted as lost.
+#ifndef SENSOR_HISTORY_LENGTH
+#define SENSOR_HISTORY_LENGTH 128
+#endif
+
+// Samples of one board slot, stored as structure of arrays: a ring of
+// timestamps per sensor and a ring of raw field integers per registry
+// field, in step with the ring of the field's sensor. Sample n of a sensor
+// is at n % SENSOR_HISTORY_LENGTH, samples read[i] up to written[i] of
+// sensor i are the ones not taken yet. lost counts the samples overwritten
+// before they were taken since the board was named.
+typedef struct SensorHistory {
+  char name[MAX_NAME_LENGTH];
+  uint32_t written[MAX_SENSORS];
+  uint32_t read[MAX_SENSORS];
+  uint32_t lost;
+  uint64_t time_us[MAX_SENSORS][SENSOR_HISTORY_LENGTH];
+  uint32_t raw[MAX_SENSOR_FIELDS][SENSOR_HISTORY_LENGTH];
+} SensorHistory;
+
+typedef struct SensorHistoryStats {
+  uint32_t written;
+  uint32_t lost;
+} SensorHistoryStats;
+
+// A new board took the slot, samples of the board before that were not
+// taken yet are lost
+void sensor_history_open(uint32_t board, const char *name);
+
+// Store the value of sensor read or notified at time_us, event loop time.
+// Only the integers of its fields are taken out, see sensor_field_raw.
+void sensor_history_add(uint32_t board, uint32_t sensor, uint64_t time_us,
+                        const uint8_t *value, uint32_t length);
+
+// Copy the samples of the board not taken before into samples, at the same
+// ring slots, and mark them taken. Returns their count. Other slots of
+// samples keep what they held.
+uint32_t sensor_history_take(uint32_t board, SensorHistory *samples);
+
+// Values of field, a field of sensor, in the samples of history not
+// taken before it, oldest first. Returns their count.
+uint32_t sensor_history_values(const SensorHistory *history, uint32_t sensor,
+                               uint32_t field, double *values);
+
+// Totals over all boards since the start
+void sensor_history_get_stats(SensorHistoryStats *stats);
+
+#endif // __INCLUDE_SENSOR_HISTORY_H
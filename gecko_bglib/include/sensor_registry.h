@@ -0,0 +1,107 @@
+/*******************************************************************************
+ * Copyright Arrow Electronics, Inc., 2019
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ ******************************************************************************/
+
+#ifndef __INCLUDE_SENSOR_REGISTRY_H
+#define __INCLUDE_SENSOR_REGISTRY_H
+
+#include <stdint.h>
+
+#ifndef SENSOR_REGISTRY_PATH
+#define SENSOR_REGISTRY_PATH "/data/sensors.json"
+#endif
+
+// Sampling period of a sensor the registry gives none for
+#ifndef SENSOR_PERIOD_MS
+#define SENSOR_PERIOD_MS 1000
+#endif
+
+#define MAX_UUID_LENGTH 16
+#define MAX_SENSORS 16
+#define MAX_SENSOR_FIELDS 32
+#define MAX_SENSOR_SERVICES 8
+#define MAX_SENSOR_NAME_LENGTH 24
+
+typedef struct UUID {
+  uint32_t length;
+  uint8_t bytes[MAX_UUID_LENGTH];
+} UUID;
+
+typedef enum SensorFieldType {
+  FIELD_UINT8 = 0,
+  FIELD_INT8,
+  FIELD_UINT16,
+  FIELD_INT16,
+  FIELD_UINT32,
+  FIELD_INT32,
+
+  NUM_FIELD_TYPES
+} SensorFieldType;
+
+// One uploaded value: the little endian integer at position in the
+// characteristic value, times scale plus offset
+typedef struct SensorField {
+  char name[MAX_SENSOR_NAME_LENGTH];
+  uint8_t position;
+  SensorFieldType type;
+  double scale;
+  double offset;
+} SensorField;
+
+// A sensor characteristic and the service it is in. length is the value
+// length, 0 if it varies. Its fields are the field_count registry fields
+// from first_field. period_ms is how often the sensor is to be sampled, 0
+// for as often as the link allows.
+typedef struct SensorProfile {
+  char name[MAX_SENSOR_NAME_LENGTH];
+  UUID service;
+  UUID uuid;
+  uint32_t period_ms;
+  uint8_t length;
+  uint8_t first_field;
+  uint8_t field_count;
+} SensorProfile;
+
+// The registry file is a JSON object with a "sensors" array of at least
+// one sensor. Each sensor has "name", "service" and "uuid" (as printed,
+// "2a6e" or "efd658ae-c401-ef33-76e7-91b00019103b"), "length" of at most
+// VALUE_PAYLOAD_LENGTH bytes, an optional "period" in ms and a "fields"
+// array of {"name", "position", "type" ("uint8" ... "int32"), "scale",
+// "offset"} where scale and offset are optional. Without the file the
+// built-in Thunderboard Sense profile is used, as it is if the file is
+// invalid.
+void sensor_registry_load(const char *path);
+
+uint32_t sensor_count();
+const SensorProfile *sensor_profile(uint32_t index);
+
+// Registry index of the sensor with this characteristic UUID, -1 if none
+int sensor_find(const UUID *uuid);
+
+uint32_t sensor_field_count();
+const SensorField *sensor_field(uint32_t index);
+double sensor_field_decode(const SensorField *field, const uint8_t *value,
+                           uint32_t length);
+
+// Decoding in two steps: the little endian integer of the field in value,
+// sign extended for the signed types and 0 if the value is too short, and
+// then count of those integers scaled to values at once
+uint32_t sensor_field_raw(const SensorField *field, const uint8_t *value,
+                          uint32_t length);
+void sensor_field_convert(const SensorField *field, const uint32_t *raw,
+                          uint32_t count, double *values);
+
+// Distinct services of the sensors, with a bit per sensor index for the
+// sensors each one holds
+uint32_t sensor_service_count();
+const UUID *sensor_service(uint32_t index);
+uint32_t sensor_service_members(uint32_t index);
+
+#endif // __INCLUDE_SENSOR_REGISTRY_H
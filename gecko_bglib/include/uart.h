@@ -92,6 +92,46 @@ int32_t uartRxPeek(void);
  **************************************************************************************************/
 int32_t uartTx(uint32_t dataLength, uint8_t* data);
 
+/***********************************************************************************************//**
+ *  \brief  Return the file descriptor of the open serial port, for use with poll().
+ *  \return  The file descriptor or -1 if the port is not open.
+ **************************************************************************************************/
+int32_t uartGetHandle(void);
+
+/***********************************************************************************************//**
+ *  \brief  Open another serial port. Unlike uartOpen() the port is not the one used by the
+ *          functions above, it is passed to the *Port functions below by handle.
+ *  \param[in]  port Serial port to use.
+ *  \param[in]  baudRate Baud rate to use.
+ *  \param[in]  rtsCts Enable/disable hardware flow control.
+ *  \param[in]  timeout Constant used to calculate the total time-out period for read operations, in
+ *              milliseconds.
+ *  \return  Handle of the port on success, -1 on failure.
+ **************************************************************************************************/
+int32_t uartOpenPort(int8_t* port, uint32_t baudRate, uint32_t rtsCts, int32_t timeout);
+
+/***********************************************************************************************//**
+ *  \brief  Close a serial port opened with uartOpenPort().
+ *  \param[in]  handle Handle of the port.
+ *  \return  0 on success, -1 on failure.
+ **************************************************************************************************/
+int32_t uartClosePort(int32_t handle);
+
+/***********************************************************************************************//**
+ *  \brief  uartRxNonBlocking() on the port with this handle.
+ **************************************************************************************************/
+int32_t uartRxNonBlockingPort(int32_t handle, uint32_t dataLength, uint8_t* data);
+
+/***********************************************************************************************//**
+ *  \brief  uartRxPeek() on the port with this handle.
+ **************************************************************************************************/
+int32_t uartRxPeekPort(int32_t handle);
+
+/***********************************************************************************************//**
+ *  \brief  uartTx() on the port with this handle.
+ **************************************************************************************************/
+int32_t uartTxPort(int32_t handle, uint32_t dataLength, uint8_t* data);
+
 /** @} (end addtogroup uart) */
 /** @} (end addtogroup platform_hw) */
 
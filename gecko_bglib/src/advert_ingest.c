@@ -0,0 +1,386 @@
+/*******************************************************************************
+ * Copyright Arrow Electronics, Inc., 2019
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ ******************************************************************************/
+
+#include "advert_ingest.h"
+#include "event_loop.h"
+#include "log.h"
+
+#include <pthread.h>
+#include <string.h>
+
+// Open addressing with linear probing, kept at most a quarter full
+#define ADVERT_HASH_SIZE (4 * ADVERT_MAX_BEACONS)
+
+// Everything below is written from the event loop and read by the
+// uploader, always under the mutex
+static pthread_mutex_t _advert_mutex = PTHREAD_MUTEX_INITIALIZER;
+static AdvertReading _readings[ADVERT_MAX_BEACONS];
+static uint32_t _reading_count = 0;
+// updates of each reading at the last take
+static uint32_t _taken[ADVERT_MAX_BEACONS];
+// Reading index + 1, 0 for a free slot
+static uint16_t _reading_hash[ADVERT_HASH_SIZE];
+static AdvertStats _stats = {0};
+static AdvertStats _logged_stats = {0};
+static uint64_t _logged_us = 0;
+
+// FNV-1a
+static uint32_t address_hash(const bd_addr *address) {
+  uint32_t hash = 2166136261u;
+  uint32_t i;
+
+  for (i = 0; i < sizeof(address->addr); i++) {
+    hash = (hash ^ address->addr[i]) * 16777619u;
+  }
+  return hash;
+}
+
+// Hash slot of address, or the free slot ending its probe sequence
+static uint32_t hash_slot(const bd_addr *address) {
+  uint32_t slot;
+
+  for (slot = address_hash(address) % ADVERT_HASH_SIZE; _reading_hash[slot];
+       slot = (slot + 1) % ADVERT_HASH_SIZE) {
+    const AdvertReading *reading = &_readings[_reading_hash[slot] - 1];
+    if (memcmp(reading->address.addr, address->addr, sizeof(address->addr)) ==
+        0) {
+      break;
+    }
+  }
+  return slot;
+}
+
+// Free the slot of address, moving back the entries after it that would
+// no longer be found past the gap
+static void hash_remove(const bd_addr *address) {
+  uint32_t gap = hash_slot(address);
+  uint32_t slot;
+
+  _reading_hash[gap] = 0;
+  for (slot = (gap + 1) % ADVERT_HASH_SIZE; _reading_hash[slot];
+       slot = (slot + 1) % ADVERT_HASH_SIZE) {
+    uint32_t home =
+        address_hash(&_readings[_reading_hash[slot] - 1].address) %
+        ADVERT_HASH_SIZE;
+    // home is not cyclically in (gap, slot]
+    if ((slot - home + ADVERT_HASH_SIZE) % ADVERT_HASH_SIZE >=
+        (slot - gap + ADVERT_HASH_SIZE) % ADVERT_HASH_SIZE) {
+      _reading_hash[gap] = _reading_hash[slot];
+      _reading_hash[slot] = 0;
+      gap = slot;
+    }
+  }
+}
+
+// Reading not heard of for longest if that was over ADVERTISER_TIMEOUT_MS
+// ago, -1 if none
+static int stale_reading(uint64_t now_us) {
+  uint64_t oldest_us = now_us;
+  int stale = -1;
+  uint32_t i;
+
+  for (i = 0; i < _reading_count; i++) {
+    if (_readings[i].last_seen_us + ADVERTISER_TIMEOUT_MS * 1000ull < now_us &&
+        _readings[i].last_seen_us < oldest_us) {
+      oldest_us = _readings[i].last_seen_us;
+      stale = i;
+    }
+  }
+  return stale;
+}
+
+static AdvertReading *get_reading(const bd_addr *address, uint64_t now_us) {
+  uint32_t slot = hash_slot(address);
+  uint32_t index = _reading_count;
+
+  if (_reading_hash[slot]) {
+    return &_readings[_reading_hash[slot] - 1];
+  }
+
+  if (_reading_count == ADVERT_MAX_BEACONS) {
+    int stale = stale_reading(now_us);
+    if (stale < 0) {
+      if (_stats.untracked++ == 0) {
+        log_warn("Tracking %u advertisers, ignoring any other",
+                 ADVERT_MAX_BEACONS);
+      }
+      return NULL;
+    }
+    // gone quiet, its slot goes to the new address
+    index = stale;
+    hash_remove(&_readings[index].address);
+    slot = hash_slot(address);
+    _stats.evicted++;
+  } else {
+    _reading_count++;
+  }
+
+  AdvertReading *reading = &_readings[index];
+  memset(reading, 0, sizeof(*reading));
+  reading->address = *address;
+  _taken[index] = 0;
+  _reading_hash[slot] = index + 1;
+  return reading;
+}
+
+static uint16_t get_be16(const uint8_t *buffer) {
+  return (buffer[0] << 8) | buffer[1];
+}
+
+static uint32_t get_be32(const uint8_t *buffer) {
+  return ((uint32_t)get_be16(buffer) << 16) | get_be16(buffer + 2);
+}
+
+// Registry sensor with this over the air 16-bit UUID, -1 if none
+static int find_sensor(const uint8_t *uuid_bytes) {
+  UUID uuid = {2, {uuid_bytes[0], uuid_bytes[1]}};
+
+  return sensor_find(&uuid);
+}
+
+static void decode_sensor(AdvertReading *reading, uint32_t index,
+                          const uint8_t *value, uint32_t length) {
+  const SensorProfile *profile = sensor_profile(index);
+  uint32_t field;
+
+  for (field = profile->first_field;
+       field < profile->first_field + profile->field_count; field++) {
+    reading->values.fields[field] =
+        sensor_field_decode(sensor_field(field), value, length);
+  }
+  reading->sensors |= 1u << index;
+}
+
+// Version 0 frames only, version 1 is encrypted
+static bool is_tlm(const uint8_t *frame, uint32_t length) {
+  return length >= EDDYSTONE_TLM_LENGTH && frame[0] == EDDYSTONE_TLM_FRAME &&
+         frame[1] == 0;
+}
+
+static void decode_tlm(AdvertReading *reading, const uint8_t *frame) {
+  reading->has_tlm = true;
+  reading->battery_mv = get_be16(&frame[2]);
+  reading->temperature = (int16_t)get_be16(&frame[4]) / 256.0;
+  reading->advert_count = get_be32(&frame[6]);
+  reading->uptime_s = get_be32(&frame[10]) / 10;
+}
+
+static void advert_seen(AdvertReading *reading,
+                        const struct gecko_msg_le_gap_scan_response_evt_t *scan,
+                        const AdvertField *name, uint64_t now_us) {
+  if (name->data) {
+    uint32_t length =
+        name->length < MAX_NAME_LENGTH ? name->length : MAX_NAME_LENGTH - 1;
+    memcpy(reading->name, name->data, length);
+    reading->name[length] = '\0';
+  }
+  reading->rssi = scan->rssi;
+  reading->last_seen_us = now_us;
+  reading->adverts++;
+}
+
+bool advert_next_field(const uint8_t *data, uint32_t length, uint32_t *offset,
+                       AdvertField *field) {
+  // A zero length structure is padding to the end
+  if (*offset + 1 >= length || data[*offset] == 0 ||
+      *offset + 1 + data[*offset] > length) {
+    return false;
+  }
+  field->type = data[*offset + 1];
+  field->length = data[*offset] - 1;
+  field->data = &data[*offset + 2];
+  *offset += data[*offset] + 1;
+  return true;
+}
+
+// Count the advert, the mutex held
+static void advert_count(uint64_t now_us) {
+  _stats.adverts++;
+  if (_logged_us == 0) {
+    _logged_us = now_us;
+  }
+}
+
+bool advert_ingest(const struct gecko_msg_le_gap_scan_response_evt_t *scan,
+                   uint64_t now_us) {
+  AdvertReading *reading = NULL;
+  AdvertField name = {0};
+  AdvertField field;
+  uint32_t offset = 0;
+  int index;
+
+  pthread_mutex_lock(&_advert_mutex);
+  advert_count(now_us);
+  while (advert_next_field(scan->data.data, scan->data.len, &offset, &field)) {
+    switch (field.type) {
+    case AD_SHORT_LOCAL_NAME:
+    case AD_COMPLETE_LOCAL_NAME:
+      name = field;
+      break;
+
+    case AD_SERVICE_DATA_16:
+      if (field.length < 2) {
+        break;
+      }
+      if ((field.data[0] | (field.data[1] << 8)) == EDDYSTONE_UUID) {
+        if (is_tlm(&field.data[2], field.length - 2) &&
+            (reading || (reading = get_reading(&scan->address, now_us)))) {
+          decode_tlm(reading, &field.data[2]);
+        }
+      } else if ((index = find_sensor(field.data)) >= 0 &&
+                 (reading ||
+                  (reading = get_reading(&scan->address, now_us)))) {
+        decode_sensor(reading, index, &field.data[2], field.length - 2);
+      }
+      break;
+
+    case AD_MANUFACTURER_DATA: {
+      uint32_t position = 2;
+
+      if (field.length < 2 ||
+          (field.data[0] | (field.data[1] << 8)) != ADVERT_COMPANY_ID) {
+        break;
+      }
+      // Records are as long as the registry says, an unknown UUID or a
+      // sensor of varying length ends them
+      while (position + 2 <= field.length &&
+             (index = find_sensor(&field.data[position])) >= 0) {
+        uint8_t value_length = sensor_profile(index)->length;
+        if (value_length == 0 ||
+            position + 2 + value_length > field.length ||
+            !(reading || (reading = get_reading(&scan->address, now_us)))) {
+          break;
+        }
+        decode_sensor(reading, index, &field.data[position + 2],
+                      value_length);
+        position += 2 + value_length;
+      }
+    } break;
+
+    default:
+      break;
+    }
+  }
+
+  if (reading) {
+    advert_seen(reading, scan, &name, now_us);
+    reading->updates++;
+    _stats.decoded++;
+  }
+  pthread_mutex_unlock(&_advert_mutex);
+  return reading != NULL;
+}
+
+bool advert_track(const struct gecko_msg_le_gap_scan_response_evt_t *scan,
+                  uint64_t now_us, AdvertReading *tracked) {
+  AdvertReading *reading;
+  AdvertField name = {0};
+  AdvertField field;
+  uint32_t offset = 0;
+
+  while (advert_next_field(scan->data.data, scan->data.len, &offset, &field)) {
+    if (field.type == AD_SHORT_LOCAL_NAME ||
+        field.type == AD_COMPLETE_LOCAL_NAME) {
+      name = field;
+    }
+  }
+  pthread_mutex_lock(&_advert_mutex);
+  advert_count(now_us);
+  reading = get_reading(&scan->address, now_us);
+  if (reading) {
+    advert_seen(reading, scan, &name, now_us);
+    *tracked = *reading;
+  }
+  pthread_mutex_unlock(&_advert_mutex);
+  return reading != NULL;
+}
+
+uint32_t advert_reading_count() {
+  uint32_t count;
+
+  pthread_mutex_lock(&_advert_mutex);
+  count = _reading_count;
+  pthread_mutex_unlock(&_advert_mutex);
+  return count;
+}
+
+bool advert_reading(uint32_t index, AdvertReading *reading) {
+  bool found;
+
+  pthread_mutex_lock(&_advert_mutex);
+  found = index < _reading_count;
+  if (found) {
+    *reading = _readings[index];
+  }
+  pthread_mutex_unlock(&_advert_mutex);
+  return found;
+}
+
+void advert_set_attempted(const bd_addr *address, uint64_t now_us) {
+  uint32_t slot;
+
+  pthread_mutex_lock(&_advert_mutex);
+  slot = hash_slot(address);
+  if (_reading_hash[slot]) {
+    _readings[_reading_hash[slot] - 1].attempted_us = now_us;
+  }
+  pthread_mutex_unlock(&_advert_mutex);
+}
+
+uint32_t advert_take(AdvertReading *readings) {
+  uint32_t count = 0;
+  uint32_t i;
+
+  pthread_mutex_lock(&_advert_mutex);
+  for (i = 0; i < _reading_count; i++) {
+    if (_readings[i].updates != _taken[i]) {
+      _stats.overwritten += _readings[i].updates - _taken[i] - 1;
+      readings[count++] = _readings[i];
+      _taken[i] = _readings[i].updates;
+    }
+  }
+  pthread_mutex_unlock(&_advert_mutex);
+  return count;
+}
+
+void advert_get_stats(AdvertStats *stats) {
+  pthread_mutex_lock(&_advert_mutex);
+  *stats = _stats;
+  pthread_mutex_unlock(&_advert_mutex);
+}
+
+void advert_log_stats() {
+  uint64_t now = event_loop_now_us();
+  AdvertStats stats;
+  AdvertStats logged;
+  uint32_t count;
+  double seconds;
+  uint32_t adverts;
+
+  pthread_mutex_lock(&_advert_mutex);
+  stats = _stats;
+  logged = _logged_stats;
+  count = _reading_count;
+  seconds = (now - _logged_us) / 1000000.0;
+  _logged_stats = stats;
+  _logged_us = now;
+  pthread_mutex_unlock(&_advert_mutex);
+
+  adverts = stats.adverts - logged.adverts;
+  log_info("Adverts: %u received (%.0f/s), %u with sensor values, %u "
+           "advertisers, %u untracked, %u replaced after going quiet, %u "
+           "readings overwritten before upload",
+           adverts, seconds > 0 ? adverts / seconds : 0.0,
+           stats.decoded - logged.decoded, count,
+           stats.untracked - logged.untracked,
+           stats.evicted - logged.evicted,
+           stats.overwritten - logged.overwritten);
+}
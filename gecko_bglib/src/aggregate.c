@@ -0,0 +1,188 @@
+/*******************************************************************************
+ * Copyright Arrow Electronics, Inc., 2019
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ ******************************************************************************/
+
+#include "aggregate.h"
+#include "log.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#define SLOT(pane) ((pane) % AGGREGATE_MAX_PANES)
+
+// Set by aggregate_set_window
+static uint64_t _step_us;
+static uint32_t _panes;
+
+int aggregate_set_window(uint32_t window_ms, uint32_t step_ms) {
+  if (step_ms == 0 || window_ms % step_ms ||
+      window_ms / step_ms > AGGREGATE_MAX_PANES) {
+    log_error("A window of %u ms is not a multiple of at most %u steps of %u "
+              "ms",
+              window_ms, AGGREGATE_MAX_PANES, step_ms);
+    return -1;
+  }
+  _step_us = step_ms * 1000ull;
+  _panes = window_ms / step_ms;
+  return 0;
+}
+
+uint32_t aggregate_window_ms() { return _panes * (_step_us / 1000); }
+
+static void stats_add(FieldStats *stats, double value) {
+  double delta = value - stats->mean;
+
+  if (stats->count == 0 || value < stats->min) {
+    stats->min = value;
+  }
+  if (stats->count == 0 || value > stats->max) {
+    stats->max = value;
+  }
+  stats->count++;
+  stats->mean += delta / stats->count;
+  stats->m2 += delta * (value - stats->mean);
+}
+
+// Chan et al.'s combination of two sets of Welford statistics
+static void stats_merge(FieldStats *stats, const FieldStats *other) {
+  uint32_t count = stats->count + other->count;
+  double delta = other->mean - stats->mean;
+
+  if (other->count == 0) {
+    return;
+  }
+  if (stats->count == 0) {
+    *stats = *other;
+    return;
+  }
+  if (other->min < stats->min) {
+    stats->min = other->min;
+  }
+  if (other->max > stats->max) {
+    stats->max = other->max;
+  }
+  stats->mean += delta * other->count / count;
+  stats->m2 += other->m2 +
+               delta * delta * stats->count / count * other->count;
+  stats->count = count;
+}
+
+double field_stats_stddev(const FieldStats *stats) {
+  return stats->count > 1 ? sqrt(stats->m2 / (stats->count - 1)) : 0;
+}
+
+// Sample n not taken before of sensor, which fell in pane. Samples of a pane
+// whose windows were all reported are late and left out.
+static void add_sample(Aggregate *aggregate,
+                       double (*values)[SENSOR_HISTORY_LENGTH], uint32_t sensor,
+                       uint32_t n, uint64_t pane) {
+  const SensorProfile *profile = sensor_profile(sensor);
+  uint32_t slot = SLOT(pane);
+  uint32_t field;
+
+  if (pane + _panes <= aggregate->next || aggregate->pane[slot] > pane + 1) {
+    aggregate->late++;
+    return;
+  }
+  if (aggregate->pane[slot] != pane + 1) {
+    memset(aggregate->stats[slot], 0, sizeof(aggregate->stats[slot]));
+    aggregate->pane[slot] = pane + 1;
+  }
+  for (field = profile->first_field;
+       field < profile->first_field + profile->field_count; field++) {
+    stats_add(&aggregate->stats[slot][field], values[field][n]);
+  }
+}
+
+// The window ending with pane next
+static void report_window(Aggregate *aggregate, AggregateReport report) {
+  FieldStats window[MAX_SENSOR_FIELDS];
+  uint64_t last = aggregate->next;
+  uint64_t first = last + 1 >= _panes ? last + 1 - _panes : 0;
+  uint32_t count = 0;
+  uint32_t field;
+  uint64_t pane;
+
+  memset(window, 0, sizeof(window));
+  for (pane = first; pane <= last; pane++) {
+    uint32_t slot = SLOT(pane);
+    if (aggregate->pane[slot] != pane + 1) {
+      continue;
+    }
+    for (field = 0; field < sensor_field_count(); field++) {
+      stats_merge(&window[field], &aggregate->stats[slot][field]);
+      count += aggregate->stats[slot][field].count;
+    }
+  }
+  if (count) {
+    report(aggregate->name, first * _step_us, window);
+  }
+}
+
+// Pane of the oldest sample not taken before, the board's first pane
+static uint64_t first_pane(const SensorHistory *history, uint64_t now_us) {
+  uint64_t oldest_us = now_us;
+  uint32_t i;
+
+  for (i = 0; i < sensor_count(); i++) {
+    uint64_t time_us =
+        history->time_us[i][history->read[i] % SENSOR_HISTORY_LENGTH];
+    if (history->written[i] != history->read[i] && time_us < oldest_us) {
+      oldest_us = time_us;
+    }
+  }
+  return oldest_us / _step_us;
+}
+
+void aggregate_history(Aggregate *aggregate, const SensorHistory *history,
+                       double (*values)[SENSOR_HISTORY_LENGTH], uint64_t now_us,
+                       AggregateReport report) {
+  uint32_t taken[MAX_SENSORS] = {0};
+  uint64_t open = now_us / _step_us;
+  uint32_t i;
+
+  if (history && strcmp(aggregate->name, history->name)) {
+    if (aggregate->late) {
+      log_warn("%s: %u samples came too late for their windows",
+               aggregate->name, aggregate->late);
+    }
+    memset(aggregate, 0, sizeof(*aggregate));
+    snprintf(aggregate->name, sizeof(aggregate->name), "%s", history->name);
+    aggregate->next = first_pane(history, now_us);
+  }
+  if (aggregate->name[0] == '\0') {
+    return;
+  }
+
+  // Pane by pane, so that no window is reported before all its samples
+  // are in and no pane is reused while a window still needs it
+  while (1) {
+    uint64_t end_us = (aggregate->next + 1) * _step_us;
+
+    for (i = 0; history && i < sensor_count(); i++) {
+      uint32_t count = history->written[i] - history->read[i];
+      while (taken[i] < count) {
+        uint64_t time_us = history->time_us[i][(history->read[i] + taken[i]) %
+                                               SENSOR_HISTORY_LENGTH];
+        if (time_us >= end_us && aggregate->next < open) {
+          break;
+        }
+        add_sample(aggregate, values, i, taken[i], time_us / _step_us);
+        taken[i]++;
+      }
+    }
+    if (aggregate->next >= open) {
+      break;
+    }
+    report_window(aggregate, report);
+    aggregate->next++;
+  }
+}
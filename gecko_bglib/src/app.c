@@ -15,71 +15,496 @@
  *******************************************************************************/
 
 #include "app.h"
+#include "advert_ingest.h"
 #include "bg_types.h"
+#include "event_loop.h"
+#include "gatt_cache.h"
 #include "gecko_bglib.h"
 #include "led_worker.h"
 #include "log.h"
+#include "sensor_history.h"
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
 #include <unistd.h>
 
-static void handle_state_transition(AppState new_state);
+static void handle_state_transition(ThunderBoardDevice *device,
+                                    AppState new_state);
 static void print_message_info(struct gecko_cmd_packet *event);
-static bool handle_advertisement(struct gecko_cmd_packet *event);
-static void refresh_sensor_values();
-static Characteristic *get_characteristic_by_handle(uint16_t handle);
+static bool handle_advertisement(struct gecko_cmd_packet *event,
+                                 ThunderBoardDevice *found);
+static void register_sensor(ThunderBoardDevice *device,
+                            Characteristic *new_characteristic);
+static int get_sensor_by_handle(ThunderBoardDevice *device, uint16_t handle);
+static void sample_taken(ThunderBoardDevice *device, uint32_t sensor_index,
+                         bool notified);
+static void read_due_sensors(ThunderBoardDevice *device);
 static void bytes_to_hex_string(uint32_t length, uint8_t *data, bool reversed,
                                 char *buffer);
+static void resume_discovery();
+static bool next_advertiser(AdvertReading *best);
 
-static void state_handler_init(uint32_t message_id,
+static void state_handler_init(ThunderBoardDevice *device, uint32_t message_id,
                                struct gecko_cmd_packet *event, bool entry);
-static void state_handler_discovery(uint32_t message_id,
+static void state_handler_discovery(ThunderBoardDevice *device,
+                                    uint32_t message_id,
                                     struct gecko_cmd_packet *event, bool entry);
-static void state_handler_connect(uint32_t message_id,
+static void state_handler_reconnect(ThunderBoardDevice *device,
+                                    uint32_t message_id,
+                                    struct gecko_cmd_packet *event,
+                                    bool entry);
+static void state_handler_connect(ThunderBoardDevice *device,
+                                  uint32_t message_id,
                                   struct gecko_cmd_packet *event, bool entry);
-static void state_handler_service_discovery(uint32_t message_id,
+static void state_handler_cache_validation(ThunderBoardDevice *device,
+                                           uint32_t message_id,
+                                           struct gecko_cmd_packet *event,
+                                           bool entry);
+static void state_handler_service_discovery(ThunderBoardDevice *device,
+                                            uint32_t message_id,
                                             struct gecko_cmd_packet *event,
                                             bool entry);
 static void state_handler_characteristic_discovery(
-    uint32_t message_id, struct gecko_cmd_packet *event, bool entry);
+    ThunderBoardDevice *device, uint32_t message_id,
+    struct gecko_cmd_packet *event, bool entry);
 static void state_handler_subscribe_characteristics(
-    uint32_t message_id, struct gecko_cmd_packet *event, bool entry);
-static void state_handler_read_characteristics(uint32_t message_id,
+    ThunderBoardDevice *device, uint32_t message_id,
+    struct gecko_cmd_packet *event, bool entry);
+static void state_handler_read_characteristics(ThunderBoardDevice *device,
+                                               uint32_t message_id,
                                                struct gecko_cmd_packet *event,
                                                bool entry);
 
-SensorValues _sensor_values = {0};
+// Radio state, the boards each have their own
 static AppState _state = STATE_INIT;
-static ThunderBoardDevice _thunderboard = {0};
+static ThunderBoardDevice _devices[MAX_THUNDERBOARDS] = {0};
+static uint32_t _max_devices = MAX_THUNDERBOARDS;
+// Board in STATE_CONNECT, the NCP connects to one at a time
+static ThunderBoardDevice *_connecting = NULL;
+static bool _scanning = false;
+static SamplingMode _sampling_mode = SAMPLING_POLL;
+static bool _advert_ingest = false;
+static bool _active_scan = false;
+// Looked up along with the sensor services, the cached handles are checked
+// by reading the device name
+static const UUID _generic_access_uuid = {2, {0x00, 0x18}};
+static const UUID _device_name_uuid = {2, {0x00, 0x2A}};
 static state_handler _state_handlers[NUM_STATES] = {
     &state_handler_init,
     &state_handler_discovery,
+    &state_handler_reconnect,
     &state_handler_connect,
+    &state_handler_cache_validation,
     &state_handler_service_discovery,
     &state_handler_characteristic_discovery,
     &state_handler_subscribe_characteristics,
     &state_handler_read_characteristics};
 static char *_state_names[NUM_STATES] = {"INIT",
                                          "DISCOVERY",
+                                         "RECONNECT",
                                          "CONNECT",
+                                         "VALIDATE CACHE",
                                          "DISCOVER SERVICES",
                                          "DISCOVER CHARACTERISTICS",
                                          "SUBSCRIBE CHARACTERISTICS",
                                          "READ CHARACTERISTIC VALUES"};
 
-void handle_event(struct gecko_cmd_packet *event) {
-  if (_state < NUM_STATES) {
-    if (event == NULL) {
-      log_error("NULL event pointer in state %s.", _state_names[_state]);
+void app_set_max_devices(uint32_t count) {
+  _max_devices = (count && count < MAX_THUNDERBOARDS) ? count
+                                                      : MAX_THUNDERBOARDS;
+}
+
+void app_set_sampling_mode(SamplingMode mode) { _sampling_mode = mode; }
+
+void app_set_advert_ingest(bool enable) { _advert_ingest = enable; }
+
+void app_set_active_scan(bool enable) { _active_scan = enable; }
+
+ThunderBoardDevice *app_get_device(uint32_t index) {
+  if (index >= MAX_THUNDERBOARDS || _devices[index].state == STATE_INIT) {
+    return NULL;
+  }
+  return &_devices[index];
+}
+
+void app_log_device_stats() {
+  uint64_t now = event_loop_now_us();
+  char rates[1024];
+
+  for (uint32_t i = 0; i < MAX_THUNDERBOARDS; i++) {
+    ThunderBoardDevice *device = &_devices[i];
+    if (device->state < STATE_DISCOVER_SERVICES) {
+      continue;
+    }
+    double seconds = (now - device->connected_us) / 1000000.0;
+    uint32_t reads = device->reads ? device->reads : 1;
+    uint32_t reconnects = device->reconnects ? device->reconnects : 1;
+    log_info("%s (connection %d): %u readings (%.2f/s), %u reads (%.1f ms "
+             "each), %u values (%.0f bytes/s), %.2f ms interval, %s PHY, %u "
+             "reconnects (%.1f ms each)",
+             device->name, device->connection, device->readings,
+             device->readings / seconds, device->reads,
+             device->read_total_us / 1000.0 / reads, device->value_events,
+             device->value_bytes / seconds, device->interval * 1.25,
+             device->phy == le_gap_phy_2m ? "2M" : "1M", device->reconnects,
+             device->reconnect_total_us / 1000.0 / reconnects);
+
+    uint32_t length = 0;
+    rates[0] = '\0';
+    for (uint32_t j = 0; j < sensor_count() && length < sizeof(rates); j++) {
+      if (device->all_sensors[j] == NULL) {
+        continue;
+      }
+      length += snprintf(&rates[length], sizeof(rates) - length,
+                         "%s%s %.2f/s (%u ms)", length ? ", " : "",
+                         sensor_profile(j)->name, device->samples[j] / seconds,
+                         sensor_profile(j)->period_ms);
+    }
+    log_info("%s samples: %s", device->name, rates);
+  }
+}
+
+// A board waiting to reconnect has no connection, its old handle may be
+// in use by another board already
+static ThunderBoardDevice *get_device_by_connection(uint8_t connection) {
+  for (uint32_t i = 0; i < MAX_THUNDERBOARDS; i++) {
+    if (_devices[i].state > STATE_RECONNECT &&
+        _devices[i].connection == connection) {
+      return &_devices[i];
+    }
+  }
+  return NULL;
+}
+
+static ThunderBoardDevice *get_device_by_address(bd_addr *address) {
+  for (uint32_t i = 0; i < MAX_THUNDERBOARDS; i++) {
+    if (_devices[i].state != STATE_INIT &&
+        memcmp(&_devices[i].address, address, sizeof(bd_addr)) == 0) {
+      return &_devices[i];
+    }
+  }
+  return NULL;
+}
+
+static uint32_t get_device_count() {
+  uint32_t in_use = 0;
+
+  for (uint32_t i = 0; i < MAX_THUNDERBOARDS; i++) {
+    if (_devices[i].state != STATE_INIT) {
+      in_use++;
+    }
+  }
+  return in_use;
+}
+
+// Free board slot, NULL once max devices are connected
+static ThunderBoardDevice *get_free_device() {
+  if (get_device_count() >= _max_devices) {
+    return NULL;
+  }
+  for (uint32_t i = 0; i < MAX_THUNDERBOARDS; i++) {
+    if (_devices[i].state == STATE_INIT) {
+      return &_devices[i];
+    }
+  }
+  return NULL;
+}
+
+// Connection of the board the event is about, false for radio events
+static bool event_connection(uint32_t message_id,
+                             struct gecko_cmd_packet *event,
+                             uint8_t *connection) {
+  switch (message_id) {
+  case gecko_evt_le_connection_opened_id:
+    *connection = event->data.evt_le_connection_opened.connection;
+    return true;
+  case gecko_evt_le_connection_closed_id:
+    *connection = event->data.evt_le_connection_closed.connection;
+    return true;
+  case gecko_evt_le_connection_parameters_id:
+    *connection = event->data.evt_le_connection_parameters.connection;
+    return true;
+  case gecko_evt_le_connection_phy_status_id:
+    *connection = event->data.evt_le_connection_phy_status.connection;
+    return true;
+  case gecko_evt_gatt_mtu_exchanged_id:
+    *connection = event->data.evt_gatt_mtu_exchanged.connection;
+    return true;
+  case gecko_evt_gatt_service_id:
+    *connection = event->data.evt_gatt_service.connection;
+    return true;
+  case gecko_evt_gatt_characteristic_id:
+    *connection = event->data.evt_gatt_characteristic.connection;
+    return true;
+  case gecko_evt_gatt_procedure_completed_id:
+    *connection = event->data.evt_gatt_procedure_completed.connection;
+    return true;
+  case gecko_evt_gatt_characteristic_value_id:
+    *connection = event->data.evt_gatt_characteristic_value.connection;
+    return true;
+  default:
+    return false;
+  }
+}
+
+static void cancel_device_timer(ThunderBoardDevice *device) {
+  if (device->timer) {
+    event_loop_cancel_timer(device->timer - 1);
+    device->timer = 0;
+  }
+}
+
+// One shot timer of the board, replacing the one it had. The callback must
+// clear device->timer.
+static void set_device_timer(ThunderBoardDevice *device, uint32_t delay_ms,
+                             event_loop_callback callback) {
+  cancel_device_timer(device);
+  int timer = event_loop_add_timer(delay_ms, 0, callback, device);
+  if (timer < 0) {
+    log_fatal("No timer left for %s", device->name);
+    flash_led();
+    return;
+  }
+  device->timer = timer + 1;
+}
+
+// Fresh state for a new connection, keeping which board it is and its
+// reconnect history
+static void reset_connection_state(ThunderBoardDevice *device) {
+  ThunderBoardDevice board = *device;
+
+  memset(device, 0, sizeof(*device));
+  device->state = board.state;
+  memcpy(device->name, board.name, sizeof(device->name));
+  device->address = board.address;
+  device->rssi = board.rssi;
+  device->timer = board.timer;
+  device->dropped_us = board.dropped_us;
+  device->reconnect_attempts = board.reconnect_attempts;
+  device->reconnects = board.reconnects;
+  device->reconnect_total_us = board.reconnect_total_us;
+  device->mtu = ATT_DEFAULT_MTU;
+  device->read_multiple = true;
+}
+
+// Board slot is free again, look for another board if discovery is running
+static void release_device(ThunderBoardDevice *device) {
+  log_info("Released %s (connection %d)", device->name, device->connection);
+  if (_connecting == device) {
+    _connecting = NULL;
+  }
+  handle_state_transition(device, STATE_INIT);
+  resume_discovery();
+}
+
+static uint32_t get_connected_count() {
+  uint32_t connected = 0;
+
+  for (uint32_t i = 0; i < MAX_THUNDERBOARDS; i++) {
+    if (_devices[i].state > STATE_CONNECT) {
+      connected++;
+    }
+  }
+  return connected;
+}
+
+// The link of a board that was working dropped. Unless the gateway closed
+// it, the board keeps its slot and is reconnected to.
+static void connection_lost(ThunderBoardDevice *device,
+                            struct gecko_cmd_packet *event) {
+  uint16_t reason = event->data.evt_le_connection_closed.reason;
+
+  if (reason == bg_err_bt_connection_terminated_by_local_host) {
+    release_device(device);
+    return;
+  }
+  log_warn("%s: link lost - 0x%X", device->name, reason);
+  device->dropped_us = event_loop_now_us();
+  device->reconnect_attempts = 0;
+  handle_state_transition(device, STATE_RECONNECT);
+}
+
+// Back off and try again, give up on the board after RECONNECT_ATTEMPTS.
+// Then the radio is reset if no board is connected and no other one heard
+// of either, as the NCP itself may be what fails.
+static void reconnect_failed(ThunderBoardDevice *device) {
+  device->reconnect_attempts++;
+  if (device->reconnect_attempts < RECONNECT_ATTEMPTS) {
+    handle_state_transition(device, STATE_RECONNECT);
+    resume_discovery();
+    return;
+  }
+
+  AdvertReading advertiser;
+  log_error("%s: no reconnect in %u attempts", device->name,
+            device->reconnect_attempts);
+  if (get_connected_count() > 0 || next_advertiser(&advertiser)) {
+    release_device(device);
+    return;
+  }
+  log_warn("No board connected, resetting the radio");
+  for (uint32_t i = 0; i < MAX_THUNDERBOARDS; i++) {
+    if (_devices[i].state != STATE_INIT) {
+      handle_state_transition(&_devices[i], STATE_INIT);
+    }
+  }
+  _connecting = NULL;
+  _scanning = false;
+  handle_state_transition(NULL, STATE_INIT);
+}
+
+// Every GATT command response starts with its uint16 result
+static uint16_t response_result(struct gecko_cmd_packet *response) {
+  return response->data.payload[0] | (response->data.payload[1] << 8);
+}
+
+// Completion of GATT commands sent with GECKO_ASYNC, context is the
+// connection handle
+static void gatt_command_completed(struct gecko_cmd_packet *response,
+                                   void *context) {
+  uint16_t result = response_result(response);
+  ThunderBoardDevice *device =
+      get_device_by_connection((uint8_t)(uintptr_t)context);
+
+  // Connection already gone, the board's slot has been released
+  if (result == 0 || device == NULL || device->state <= STATE_CONNECT) {
+    return;
+  }
+
+  log_error("%s: command 0x%08X failed - 0x%X", device->name,
+            BGLIB_MSG_ID(response->header), result);
+  if (result == bg_err_invalid_conn_handle) {
+    log_debug("Invalid connection handle. Releasing %s", device->name);
+    release_device(device);
+  } else {
+    // Give up on this board, the others carry on
+    gecko_cmd_le_connection_close(device->connection);
+  }
+}
+
+#define GATT_ASYNC(DEVICE, COMMAND)                                            \
+  GECKO_ASYNC(gatt_command_completed,                                          \
+              (void *)(uintptr_t)(DEVICE)->connection, COMMAND)
+
+// Completion of link tuning commands. The board keeps working on the link
+// it has if the NCP or the board turns one down.
+static void link_command_completed(struct gecko_cmd_packet *response,
+                                   void *context) {
+  uint16_t result = response_result(response);
+  ThunderBoardDevice *device =
+      get_device_by_connection((uint8_t)(uintptr_t)context);
+
+  if (result != 0 && device != NULL) {
+    log_warn("%s: link command 0x%08X failed - 0x%X", device->name,
+             BGLIB_MSG_ID(response->header), result);
+  }
+}
+
+#define LINK_ASYNC(DEVICE, COMMAND)                                            \
+  GECKO_ASYNC(link_command_completed,                                          \
+              (void *)(uintptr_t)(DEVICE)->connection, COMMAND)
+
+// Short interval for discovery and the first reading, then a longer one
+// that still keeps up with the readings uploaded
+static void set_connection_interval(ThunderBoardDevice *device,
+                                    uint16_t interval) {
+  log_debug("%s: asking for a %.2f ms connection interval", device->name,
+            interval * 1.25);
+  LINK_ASYNC(device, gecko_cmd_le_connection_set_parameters(
+                         device->connection, interval, interval, 0,
+                         CONNECTION_TIMEOUT));
+}
+
+static void read_characteristic(ThunderBoardDevice *device,
+                                Characteristic *characteristic) {
+  log_trace("Requesting characteristic: %d", characteristic->characteristic);
+  GATT_ASYNC(device, gecko_cmd_gatt_read_characteristic_value(
+                         device->connection, characteristic->characteristic));
+  device->read_pending = true;
+  device->reads++;
+}
+
+static void read_characteristics(ThunderBoardDevice *device) {
+  uint8_t handles[2 * MAX_SENSORS];
+  uint32_t i;
+
+  for (i = 0; i < device->group_length; i++) {
+    uint16_t handle = device->all_sensors[device->group[i]]->characteristic;
+    handles[2 * i] = handle & 0xFF;
+    handles[2 * i + 1] = handle >> 8;
+  }
+  log_trace("Requesting %u characteristics", device->group_length);
+  GATT_ASYNC(device, gecko_cmd_gatt_read_multiple_characteristic_values(
+                         device->connection, 2 * device->group_length,
+                         handles));
+  device->read_pending = true;
+  device->reads++;
+}
+
+// Split a read multiple response back into the sensors it was requested for
+static void store_characteristics(ThunderBoardDevice *device,
+                                  const uint8array *value) {
+  uint32_t offset = 0;
+  uint32_t i;
+
+  for (i = 0; i < device->group_length; i++) {
+    uint8_t sensor_index = device->group[i];
+    Characteristic *sensor = device->all_sensors[sensor_index];
+    uint8_t length = sensor_profile(sensor_index)->length;
+
+    if (offset + length > value->len) {
+      log_error("Read multiple response too short: %u bytes", value->len);
+      break;
     }
+    sensor->value_length =
+        length < VALUE_PAYLOAD_LENGTH ? length : VALUE_PAYLOAD_LENGTH;
+    memcpy(sensor->value, &value->data[offset], sensor->value_length);
+    sample_taken(device, sensor_index, false);
+    offset += length;
+  }
+  device->group_length = 0;
+}
 
-    print_message_info(event);
+void handle_event(struct gecko_cmd_packet *event) {
+  if (event == NULL) {
+    log_error("NULL event pointer in state %s.", _state_names[_state]);
+    return;
+  }
+
+  print_message_info(event);
 
-    uint32_t message_id = BGLIB_MSG_ID(event->header);
+  uint32_t message_id = BGLIB_MSG_ID(event->header);
+  uint8_t connection;
+
+  if (event_connection(message_id, event, &connection)) {
+    ThunderBoardDevice *device = get_device_by_connection(connection);
+    if (device == NULL) {
+      log_warn("Event %X for unknown connection %d", message_id, connection);
+    } else if (message_id == gecko_evt_gatt_mtu_exchanged_id) {
+      device->mtu = event->data.evt_gatt_mtu_exchanged.mtu;
+      log_debug("%s MTU: %u", device->name, device->mtu);
+    } else if (message_id == gecko_evt_le_connection_parameters_id) {
+      device->interval = event->data.evt_le_connection_parameters.interval;
+      device->txsize = event->data.evt_le_connection_parameters.txsize;
+      log_debug("%s interval: %.2f ms, link layer payload: %u", device->name,
+                device->interval * 1.25, device->txsize);
+    } else if (message_id == gecko_evt_le_connection_phy_status_id) {
+      device->phy = event->data.evt_le_connection_phy_status.phy;
+      log_debug("%s PHY: %s", device->name,
+                device->phy == le_gap_phy_2m ? "2M" : "1M");
+    } else if (device->state < NUM_STATES) {
+      _state_handlers[device->state](device, message_id, event, false);
+    } else {
+      log_error("Unhandled State: %d", device->state);
+      flash_led();
+    }
+    return;
+  }
 
-    _state_handlers[_state](message_id, event, false);
+  if (_state < NUM_STATES) {
+    _state_handlers[_state](NULL, message_id, event, false);
   } else {
     log_error("Unhandled State: %d", _state);
     flash_led();
@@ -188,136 +613,93 @@ print_characteristic(struct gecko_msg_gatt_characteristic_evt_t *characteristic,
   log_trace("  UUID: %s", uuid_buffer);
 }
 
-static Characteristic *get_characteristic_by_handle(uint16_t handle) {
-  Characteristic *requested_characteristic = NULL;
-  uint16_t sensor_index = 0;
-
-  for (sensor_index = 0; sensor_index < NUM_THUNDERBOARD_SENSORS;
-       sensor_index++) {
-    if (_thunderboard.all_sensors[sensor_index]->characteristic == handle) {
-      requested_characteristic = _thunderboard.all_sensors[sensor_index];
-      break;
+// Index the sensors by handle from the lowest one, the sensor handles of a
+// board lie close together
+static void build_handle_map(ThunderBoardDevice *device) {
+  uint32_t base = UINT16_MAX;
+  uint32_t i;
+
+  memset(device->handle_map, 0, sizeof(device->handle_map));
+  device->handle_map_partial = false;
+  for (i = 0; i < sensor_count(); i++) {
+    if (device->all_sensors[i] &&
+        device->all_sensors[i]->characteristic < base) {
+      base = device->all_sensors[i]->characteristic;
     }
   }
+  device->handle_base = base;
 
-  return requested_characteristic;
-}
-
-static double translate_value(double value, double input_range_min,
-                              double input_range_max, double output_range_min,
-                              double output_range_max) {
-  double input_span = input_range_max - input_range_min;
-  double output_span = output_range_max - output_range_min;
-
-  double scaled_value = (value - input_range_min) / input_span;
-
-  return output_range_min + (scaled_value * output_span);
+  for (i = 0; i < sensor_count(); i++) {
+    if (device->all_sensors[i] == NULL) {
+      continue;
+    }
+    uint32_t offset = device->all_sensors[i]->characteristic - base;
+    if (offset < HANDLE_MAP_SIZE) {
+      device->handle_map[offset] = i + 1;
+    } else {
+      log_warn("%s handle %u beyond the handle map", sensor_profile(i)->name,
+               device->all_sensors[i]->characteristic);
+      device->handle_map_partial = true;
+    }
+  }
 }
 
-static void refresh_sensor_values() {
-  _sensor_values.id++;
+// Registry index of the sensor at handle, -1 if the handle is no sensor
+static int get_sensor_by_handle(ThunderBoardDevice *device, uint16_t handle) {
+  uint32_t offset = (uint32_t)handle - device->handle_base;
+  uint32_t sensor_index;
 
-  char buff[64];
-
-
-  _sensor_values.temperature =
-      ((double)(*((int16_t *)_thunderboard.temperature_sensor->value))) * 0.01;
-  bytes_to_hex_string(_thunderboard.temperature_sensor->value_length, _thunderboard.temperature_sensor->value, false, buff);
-  log_trace("Temperature: (%f) %s",_sensor_values.temperature,buff);
-  
-  _sensor_values.pressure =
-      ((double)(*((uint32_t *)_thunderboard.pressure_sensor->value))) * 0.1;
-  bytes_to_hex_string(_thunderboard.pressure_sensor->value_length, _thunderboard.pressure_sensor->value, false, buff);
-  log_trace("Pressure: (%f) %s",_sensor_values.pressure,buff);
-
-  _sensor_values.humidity =
-      ((double)(*((uint16_t *)_thunderboard.humidity_sensor->value))) * 0.01;
-  bytes_to_hex_string(_thunderboard.humidity_sensor->value_length, _thunderboard.humidity_sensor->value, false, buff);
-  log_trace("Humidity: (%f) %s",_sensor_values.humidity,buff);
-
-  _sensor_values.co2 = (double)(*((uint16_t *)_thunderboard.co2_sensor->value));
-  bytes_to_hex_string(_thunderboard.co2_sensor->value_length, _thunderboard.co2_sensor->value, false, buff);
-  log_trace("CO2: (%f) %s",_sensor_values.co2,buff);
-
-  _sensor_values.voc =
-      ((double)(*((uint16_t *)_thunderboard.voc_sensor->value))) * 0.01;
-  bytes_to_hex_string(_thunderboard.voc_sensor->value_length, _thunderboard.voc_sensor->value, false, buff);
-  log_trace("VOC: (%f) %s",_sensor_values.voc,buff);
-
-  _sensor_values.light =
-      ((double)(*((uint32_t *)_thunderboard.light_sensor->value))) * 0.001;
-  bytes_to_hex_string(_thunderboard.light_sensor->value_length, _thunderboard.light_sensor->value, false, buff);
-  log_trace("Light: (%f) %s",_sensor_values.light,buff);
-
-  _sensor_values.sound =
-      ((double)(*((uint16_t *)_thunderboard.sound_sensor->value))) * 0.01;
-  bytes_to_hex_string(_thunderboard.sound_sensor->value_length, _thunderboard.sound_sensor->value, false, buff);
-  log_trace("Sound: (%f) %s",_sensor_values.sound,buff);
-
-  _sensor_values.acceleration[0] =
-      ((double)(*(
-          (uint16_t *)(_thunderboard.acceleration_sensor->value + 0)))) *
-      0.001;
-  _sensor_values.acceleration[1] =
-      ((double)(*(
-          (uint16_t *)(_thunderboard.acceleration_sensor->value + 2)))) *
-      0.001;
-  _sensor_values.acceleration[2] =
-      ((double)(*(
-          (uint16_t *)(_thunderboard.acceleration_sensor->value + 4)))) *
-      0.001;
-
-  _sensor_values.orientation[0] = translate_value(
-      *((uint16_t *)(_thunderboard.orientation_sensor->value + 0)), 0,
-      UINT16_MAX, -180, 180);
-  _sensor_values.orientation[1] = translate_value(
-      *((uint16_t *)(_thunderboard.orientation_sensor->value + 2)), 0,
-      UINT16_MAX, -90, 90);
-  _sensor_values.orientation[2] = translate_value(
-      *((uint16_t *)(_thunderboard.orientation_sensor->value + 4)), 0,
-      UINT16_MAX, -180, 180);
+  if (offset < HANDLE_MAP_SIZE && device->handle_map[offset]) {
+    return device->handle_map[offset] - 1;
+  }
+  if (!device->handle_map_partial) {
+    return -1;
+  }
 
-  return;
+  for (sensor_index = 0; sensor_index < sensor_count(); sensor_index++) {
+    if (device->all_sensors[sensor_index] &&
+        device->all_sensors[sensor_index]->characteristic == handle) {
+      return sensor_index;
+    }
+  }
+  return -1;
 }
 
-static bool handle_advertisement(struct gecko_cmd_packet *event) {
-  int length = 0;
-  int offset = 0;
-  int type = 0;
-  uint8_t *data;
+static bool handle_advertisement(struct gecko_cmd_packet *event,
+                                 ThunderBoardDevice *found) {
+  struct gecko_msg_le_gap_scan_response_evt_t *scan =
+      &event->data.evt_le_gap_scan_response;
+  AdvertField field;
+  uint32_t offset = 0;
+  uint32_t length;
   bool found_thunderboard = false;
-  char *thunderboard_prefix = "Thunder Sense #";
+  char *thunderboard_prefix = THUNDERBOARD_NAME_PREFIX;
   char name_buffer[MAX_NAME_LENGTH] = "UNKNOWN";
 
-  while (offset < event->data.evt_le_gap_scan_response.data.len) {
-    length = event->data.evt_le_gap_scan_response.data.data[offset];
-    type = event->data.evt_le_gap_scan_response.data.data[offset + 1];
-    data = event->data.evt_le_gap_scan_response.data.data;
-
-    switch (type) {
-    case 0x08: // Short Local Name
-    case 0x09: // Complete Local Name
-      memcpy(name_buffer, &data[offset + 2], length - 1);
+  while (advert_next_field(scan->data.data, scan->data.len, &offset, &field)) {
+    switch (field.type) {
+    case AD_SHORT_LOCAL_NAME:
+    case AD_COMPLETE_LOCAL_NAME:
+      length =
+          field.length < MAX_NAME_LENGTH ? field.length : MAX_NAME_LENGTH - 1;
+      memcpy(name_buffer, field.data, length);
       name_buffer[length] = '\0';
       break;
 
     default:
       break;
     }
-
-    offset += (length + 1);
   }
 
-  print_advertisement(&event->data.evt_le_gap_scan_response, name_buffer);
+  print_advertisement(scan, name_buffer);
 
   uint32_t name_length = strlen(name_buffer);
   if (name_length > strlen(thunderboard_prefix)) {
     if (memcmp(thunderboard_prefix, name_buffer, strlen(thunderboard_prefix)) ==
         0) {
-      memcpy(_thunderboard.name, name_buffer, name_length);
-      _thunderboard.rssi = event->data.evt_le_gap_scan_response.rssi;
-      memcpy(_thunderboard.address.addr,
-             event->data.evt_le_gap_scan_response.address.addr, 6);
+      memcpy(found->name, name_buffer, name_length + 1);
+      found->rssi = scan->rssi;
+      memcpy(found->address.addr, scan->address.addr, 6);
       found_thunderboard = true;
     }
   }
@@ -325,35 +707,146 @@ static bool handle_advertisement(struct gecko_cmd_packet *event) {
   return found_thunderboard;
 }
 
-static void handle_state_transition(AppState new_state) {
+static void handle_state_transition(ThunderBoardDevice *device,
+                                    AppState new_state) {
+  AppState *state = device ? &device->state : &_state;
+
   if (new_state >= NUM_STATES) {
     log_error("ERROR: Unhandled State: %d", new_state);
     flash_led();
   }
 
-  log_debug("State Transition: %s --> %s", _state_names[_state],
+  log_debug("State Transition%s%s: %s --> %s", device ? " " : "",
+            device ? device->name : "", _state_names[*state],
             _state_names[new_state]);
 
-  _state = new_state;
-  _state_handlers[_state](0, NULL, true);
+  *state = new_state;
+  _state_handlers[*state](device, 0, NULL, true);
 
   return;
 }
 
-static void state_handler_init(uint32_t message_id,
+static void start_discovery() {
+  struct gecko_msg_le_gap_set_discovery_timing_rsp_t *set_timing_response;
+  struct gecko_msg_le_gap_set_discovery_type_rsp_t *set_discovery_response;
+  struct gecko_msg_le_gap_start_discovery_rsp_t *start_discovery_response;
+
+  set_timing_response = gecko_cmd_le_gap_set_discovery_timing(
+      le_gap_phy_1m, SCAN_INTERVAL, SCAN_WINDOW);
+  if (set_timing_response->result != 0) {
+    log_warn("gecko_cmd_le_gap_set_discovery_timing failure - 0x%X",
+             set_timing_response->result);
+  }
+  set_discovery_response =
+      gecko_cmd_le_gap_set_discovery_type(le_gap_phy_1m, _active_scan);
+  if (set_discovery_response->result == 0) {
+    start_discovery_response = gecko_cmd_le_gap_start_discovery(
+        le_gap_phy_1m, le_gap_general_discoverable);
+    if (start_discovery_response->result != 0) {
+      log_error("gecko_cmd_le_gap_start_discovery failure - %d",
+                start_discovery_response->result);
+      flash_led();
+    }
+  } else {
+    log_error("gecko_cmd_le_gap_set_discovery_type failure - %d",
+              set_discovery_response->result);
+    flash_led();
+  }
+  _scanning = true;
+}
+
+// The NCP does not scan while it opens a connection
+static bool stop_discovery() {
+  if (!_scanning) {
+    return true;
+  }
+  struct gecko_msg_le_gap_end_procedure_rsp_t *response =
+      gecko_cmd_le_gap_end_procedure();
+  if (response->result != 0) {
+    log_error("gecko_cmd_le_gap_end_procedure failure - %d", response->result);
+    return false;
+  }
+  _scanning = false;
+  return true;
+}
+
+static void connect_advertiser(ThunderBoardDevice *free_device,
+                               const AdvertReading *advertiser) {
+  if (!stop_discovery()) {
+    return;
+  }
+  advert_set_attempted(&advertiser->address, event_loop_now_us());
+  memset(free_device, 0, sizeof(*free_device));
+  memcpy(free_device->name, advertiser->name, sizeof(advertiser->name));
+  free_device->address = advertiser->address;
+  free_device->rssi = advertiser->rssi;
+  reset_connection_state(free_device);
+  sensor_history_open(free_device - _devices, free_device->name);
+  _connecting = free_device;
+  handle_state_transition(free_device, STATE_CONNECT);
+}
+
+// Strongest board heard of lately that has no slot and advertised again
+// since the last attempt to connect to it, copied to best. Beacons are
+// never connected to.
+static bool next_advertiser(AdvertReading *best) {
+  uint64_t now = event_loop_now_us();
+  AdvertReading advertiser;
+  bool found = false;
+
+  if (_advert_ingest) {
+    return false;
+  }
+
+  for (uint32_t i = 0; advert_reading(i, &advertiser); i++) {
+    if (advertiser.last_seen_us + ADVERTISER_TIMEOUT_MS * 1000ULL < now ||
+        advertiser.attempted_us >= advertiser.last_seen_us ||
+        get_device_by_address(&advertiser.address) ||
+        (found && best->rssi >= advertiser.rssi)) {
+      continue;
+    }
+    *best = advertiser;
+    found = true;
+  }
+  return found;
+}
+
+// Once a connection attempt is over connect the next board already heard
+// of if a slot is free, otherwise scan on alongside the connections
+static void resume_discovery() {
+  if (_state != STATE_DISCOVERY || _connecting) {
+    return;
+  }
+  ThunderBoardDevice *free_device = get_free_device();
+  AdvertReading advertiser;
+  if (free_device && next_advertiser(&advertiser)) {
+    log_debug("Connecting to %s, heard %.1f ms ago", advertiser.name,
+              (event_loop_now_us() - advertiser.last_seen_us) / 1000.0);
+    connect_advertiser(free_device, &advertiser);
+  } else if (!_scanning) {
+    log_debug("Resuming discovery");
+    start_discovery();
+  }
+}
+
+static void state_handler_init(ThunderBoardDevice *device, uint32_t message_id,
                                struct gecko_cmd_packet *event, bool entry) {
 
   if (entry) {
+    // A board slot was released
+    if (device) {
+      cancel_device_timer(device);
+      return;
+    }
     sleep(5);
     gecko_cmd_system_reset(0);
-    _thunderboard.characteristics.length = 0;
     return;
   }
 
   switch (message_id) {
   case gecko_evt_system_boot_id:
     log_debug("System Booted");
-    handle_state_transition(STATE_DISCOVERY);
+    handle_state_transition(NULL, STATE_DISCOVERY);
     break;
 
   default:
@@ -362,60 +855,80 @@ static void state_handler_init(uint32_t message_id,
   }
 }
 
-static void state_handler_discovery(uint32_t message_id,
+static void state_handler_discovery(ThunderBoardDevice *device,
+                                    uint32_t message_id,
                                     struct gecko_cmd_packet *event,
                                     bool entry) {
   static time_t discovery_start_time;
 
   if (entry) {
     discovery_start_time = time(NULL);
-    struct gecko_msg_le_gap_set_discovery_type_rsp_t *set_discovery_response;
-    struct gecko_msg_le_gap_start_discovery_rsp_t *start_discovery_response;
-
-    //memset(&_thunderboard, 0, sizeof(_thunderboard));
-   
-
-    set_discovery_response =
-        gecko_cmd_le_gap_set_discovery_type(le_gap_phy_1m, 0);
-    if (set_discovery_response->result == 0) {
-      start_discovery_response = gecko_cmd_le_gap_start_discovery(
-          le_gap_phy_1m, le_gap_general_discoverable);
-      if (start_discovery_response->result != 0) {
-        log_error("gecko_cmd_le_gap_start_discovery failure - %d",
-                  start_discovery_response->result);
-        flash_led();
-      }
-    } else {
-      log_error("gecko_cmd_le_gap_set_discovery_type failure - %d",
-                set_discovery_response->result);
-      flash_led();
+
+    // Every connection from now on opens with the short interval and
+    // exchanges the largest MTU
+    struct gecko_msg_le_gap_set_conn_parameters_rsp_t *parameters_response =
+        gecko_cmd_le_gap_set_conn_parameters(
+            FAST_CONNECTION_INTERVAL, FAST_CONNECTION_INTERVAL, 0,
+            CONNECTION_TIMEOUT);
+    if (parameters_response->result != 0) {
+      log_warn("gecko_cmd_le_gap_set_conn_parameters failure - 0x%X",
+               parameters_response->result);
+    }
+    struct gecko_msg_gatt_set_max_mtu_rsp_t *mtu_response =
+        gecko_cmd_gatt_set_max_mtu(GATT_MAX_MTU);
+    if (mtu_response->result != 0) {
+      log_warn("gecko_cmd_gatt_set_max_mtu failure - 0x%X",
+               mtu_response->result);
     }
 
+    _scanning = false;
+    start_discovery();
     return;
   }
 
-  // Wait a maximum of ADVERTISEMENT_TIMEOUT_SECONDS seconds for a matching
-  // advertisement packet
-  if ((time(NULL) - discovery_start_time) > ADVERTISEMENT_TIMEOUT_SECONDS) {
+  // Wait a maximum of ADVERTISEMENT_TIMEOUT_SECONDS seconds for the first
+  // matching advertisement packet
+  if (_scanning && get_device_count() == 0 && advert_reading_count() == 0 &&
+      (time(NULL) - discovery_start_time) > ADVERTISEMENT_TIMEOUT_SECONDS) {
     log_error("Advertisement timeout exceeded.");
     flash_led();
   }
 
   switch (message_id) {
-  case gecko_evt_le_gap_scan_response_id:
-    if (handle_advertisement(event)) {
-      struct gecko_msg_le_gap_end_procedure_rsp_t *response =
-          gecko_cmd_le_gap_end_procedure();
-      if (response->result == 0) {
-        handle_state_transition(STATE_CONNECT);
-      } else {
-        log_error("gecko_cmd_le_gap_end_procedure failure - %d",
-                  response->result);
-      }
+  case gecko_evt_le_gap_scan_response_id: {
+    ThunderBoardDevice found = {0};
+    ThunderBoardDevice *free_device = get_free_device();
+    AdvertReading advertiser;
+
+    // Beacons are only listened to, every advert with sensor values is a
+    // new reading of its address
+    if (_advert_ingest) {
+      advert_ingest(&event->data.evt_le_gap_scan_response,
+                    event_loop_now_us());
+      break;
     }
-    break;
 
-  case gecko_evt_gatt_procedure_completed_id:
+    if (!handle_advertisement(event, &found)) {
+      break;
+    }
+    if (advert_track(&event->data.evt_le_gap_scan_response,
+                     event_loop_now_us(), &advertiser) &&
+        _scanning && !_connecting && free_device &&
+        !get_device_by_address(&advertiser.address)) {
+      connect_advertiser(free_device, &advertiser);
+    }
+  } break;
+
+  case gecko_evt_system_boot_id:
+    // The NCP restarted, every connection is gone
+    log_warn("Unexpected boot, releasing all boards");
+    for (uint32_t i = 0; i < MAX_THUNDERBOARDS; i++) {
+      if (_devices[i].state != STATE_INIT) {
+        handle_state_transition(&_devices[i], STATE_INIT);
+      }
+    }
+    _connecting = NULL;
+    handle_state_transition(NULL, STATE_DISCOVERY);
     break;
 
   default:
@@ -426,16 +939,79 @@ static void state_handler_discovery(uint32_t message_id,
   return;
 }
 
-static void state_handler_connect(uint32_t message_id,
+static void reconnect_timer_expired(void *context) {
+  ThunderBoardDevice *device = context;
+
+  device->timer = 0;
+  if (device->state != STATE_RECONNECT) {
+    return;
+  }
+  // The NCP connects to one board at a time
+  if (_connecting) {
+    set_device_timer(device, RECONNECT_MIN_MS, reconnect_timer_expired);
+    return;
+  }
+  if (!stop_discovery()) {
+    set_device_timer(device, RECONNECT_MIN_MS, reconnect_timer_expired);
+    return;
+  }
+
+  log_debug("Reconnecting to %s, attempt %u", device->name,
+            device->reconnect_attempts + 1);
+  _connecting = device;
+  handle_state_transition(device, STATE_CONNECT);
+}
+
+// Connect straight to the known address, no scan and no NCP reset needed
+static void state_handler_reconnect(ThunderBoardDevice *device,
+                                    uint32_t message_id,
+                                    struct gecko_cmd_packet *event,
+                                    bool entry) {
+  if (entry) {
+    uint32_t delay_ms = RECONNECT_MAX_MS;
+    if (device->reconnect_attempts < 16) {
+      delay_ms = RECONNECT_MIN_MS << device->reconnect_attempts;
+    }
+    if (delay_ms > RECONNECT_MAX_MS) {
+      delay_ms = RECONNECT_MAX_MS;
+    }
+    reset_connection_state(device);
+    set_device_timer(device, delay_ms, reconnect_timer_expired);
+    return;
+  }
+
+  // Without a connection no event is routed here
+  log_warn("Unhandled Event: %X", message_id);
+}
+
+static void connect_timer_expired(void *context) {
+  ThunderBoardDevice *device = context;
+
+  device->timer = 0;
+  if (device->state != STATE_CONNECT) {
+    return;
+  }
+  // Cancels the attempt, the closed event follows
+  log_warn("%s: no connection in %u ms", device->name, CONNECT_TIMEOUT_MS);
+  gecko_cmd_le_connection_close(device->connection);
+}
+
+static void state_handler_connect(ThunderBoardDevice *device,
+                                  uint32_t message_id,
                                   struct gecko_cmd_packet *event, bool entry) {
   if (entry) {
     LedJob flash_green_job = {LED_JOB_ON_OFF, 500, {LED_GREEN, 0, 0}, 1};
     push_led_job(flash_green_job);
 
     struct gecko_msg_le_gap_connect_rsp_t *response = gecko_cmd_le_gap_connect(
-        _thunderboard.address, le_gap_address_type_public, le_gap_phy_1m);
+        device->address, le_gap_address_type_public, le_gap_phy_1m);
     if (response->result == 0) {
-      _thunderboard.connection = response->connection;
+      device->connection = response->connection;
+      set_device_timer(device, CONNECT_TIMEOUT_MS, connect_timer_expired);
+    } else if (device->dropped_us) {
+      log_warn("gecko_cmd_le_gap_connect failed - 0x%X", response->result);
+      _connecting = NULL;
+      reconnect_failed(device);
     } else {
       log_fatal("gecko_cmd_le_gap_connect failed - 0x%X", response->result);
       flash_led();
@@ -445,16 +1021,133 @@ static void state_handler_connect(uint32_t message_id,
 
   switch (message_id) {
   case gecko_evt_le_connection_opened_id:
-    handle_state_transition(STATE_DISCOVER_SERVICES);
+    cancel_device_timer(device);
+    device->connected_us = event_loop_now_us();
+    if (device->dropped_us) {
+      uint64_t reconnect_us = device->connected_us - device->dropped_us;
+      device->reconnects++;
+      device->reconnect_total_us += reconnect_us;
+      log_info("%s reconnected %.1f ms after the link was lost, %u failed "
+               "attempts",
+               device->name, reconnect_us / 1000.0,
+               device->reconnect_attempts);
+      device->dropped_us = 0;
+      device->reconnect_attempts = 0;
+    }
+    device->interval = FAST_CONNECTION_INTERVAL;
+    device->phy = le_gap_phy_1m;
+    _connecting = NULL;
+    // Stays on 1M unless both sides support 2M
+    LINK_ASYNC(device,
+               gecko_cmd_le_connection_set_phy(device->connection,
+                                               le_gap_phy_2m));
+    if (gatt_cache_load(&device->address, &device->services,
+                        &device->characteristics) == 0) {
+      handle_state_transition(device, STATE_VALIDATE_CACHE);
+    } else {
+      handle_state_transition(device, STATE_DISCOVER_SERVICES);
+    }
+    resume_discovery();
     break;
 
   case gecko_evt_le_connection_closed_id:
-    handle_state_transition(STATE_INIT);
+    cancel_device_timer(device);
+    if (device->dropped_us) {
+      _connecting = NULL;
+      reconnect_failed(device);
+    } else {
+      release_device(device);
+    }
     break;
 
-  case gecko_evt_le_gap_scan_response_id:
-    // Ignore scan response message
-  break;
+  default:
+    log_warn("Unhandled Event: %X", message_id);
+    break;
+  }
+
+  return;
+}
+
+static void forget_gatt_handles(ThunderBoardDevice *device) {
+  memset(&device->services, 0, sizeof(device->services));
+  memset(&device->characteristics, 0, sizeof(device->characteristics));
+  memset(device->all_sensors, 0, sizeof(device->all_sensors));
+  memset(device->handle_map, 0, sizeof(device->handle_map));
+  device->handle_map_partial = false;
+}
+
+// The cached handles are trusted if the device name reads back as
+// advertised. A value length alone would not tell one sensor's handle from
+// another's.
+static bool cache_check_passed(ThunderBoardDevice *device,
+                               const uint8array *value) {
+  return value->len == strlen(device->name) &&
+         memcmp(value->data, device->name, value->len) == 0;
+}
+
+static void state_handler_cache_validation(ThunderBoardDevice *device,
+                                           uint32_t message_id,
+                                           struct gecko_cmd_packet *event,
+                                           bool entry) {
+  if (entry) {
+    uint32_t i;
+
+    device->cache_check = NULL;
+    device->cache_valid = false;
+    for (i = 0; i < device->characteristics.length; i++) {
+      Characteristic *characteristic = &device->characteristics.list[i];
+      register_sensor(device, characteristic);
+      if (characteristic->uuid.length == _device_name_uuid.length &&
+          memcmp(characteristic->uuid.bytes, _device_name_uuid.bytes,
+                 _device_name_uuid.length) == 0 &&
+          characteristic->properties.read) {
+        device->cache_check = characteristic;
+      }
+    }
+
+    // Caches written before the device name was looked up have none
+    if (device->cache_check == NULL) {
+      log_warn("GATT cache of %s has nothing to check", device->name);
+      gatt_cache_remove(&device->address);
+      forget_gatt_handles(device);
+      handle_state_transition(device, STATE_DISCOVER_SERVICES);
+      return;
+    }
+    GATT_ASYNC(device, gecko_cmd_gatt_read_characteristic_value(
+                           device->connection,
+                           device->cache_check->characteristic));
+    return;
+  }
+
+  switch (message_id) {
+  case gecko_evt_gatt_characteristic_value_id: {
+    struct gecko_msg_gatt_characteristic_value_evt_t *value =
+        &event->data.evt_gatt_characteristic_value;
+    if (value->att_opcode == gatt_read_response &&
+        value->characteristic == device->cache_check->characteristic) {
+      device->cache_valid = cache_check_passed(device, &value->value);
+    }
+  } break;
+
+  case gecko_evt_gatt_procedure_completed_id:
+    if (device->cache_valid) {
+      log_info("Using cached GATT handles of %s", device->name);
+      handle_state_transition(device, STATE_SUBSCRIBE_CHARACTERISTICS);
+    } else {
+      log_warn("GATT cache of %s is stale, discovering", device->name);
+      gatt_cache_remove(&device->address);
+      forget_gatt_handles(device);
+      handle_state_transition(device, STATE_DISCOVER_SERVICES);
+    }
+    break;
+
+  case gecko_evt_le_connection_closed_id:
+    connection_lost(device, event);
+    break;
+
+  case gecko_evt_le_connection_parameters_id:
+  case gecko_evt_le_connection_phy_status_id:
+    break;
 
   default:
     log_warn("Unhandled Event: %X", message_id);
@@ -464,38 +1157,69 @@ static void state_handler_connect(uint32_t message_id,
   return;
 }
 
-static void state_handler_service_discovery(uint32_t message_id,
+// Look up the next service holding sensors and then Generic Access, false
+// once all were looked up
+static bool discover_next_sensor_service(ThunderBoardDevice *device) {
+  if (device->service_index > sensor_service_count()) {
+    return false;
+  }
+  const UUID *uuid = device->service_index < sensor_service_count()
+                         ? sensor_service(device->service_index)
+                         : &_generic_access_uuid;
+  GATT_ASYNC(device, gecko_cmd_gatt_discover_primary_services_by_uuid(
+                         device->connection, uuid->length, uuid->bytes));
+  return true;
+}
+
+static void state_handler_service_discovery(ThunderBoardDevice *device,
+                                            uint32_t message_id,
                                             struct gecko_cmd_packet *event,
                                             bool entry) {
   if (entry) {
-    struct gecko_msg_gatt_discover_primary_services_rsp_t *response =
-        gecko_cmd_gatt_discover_primary_services(_thunderboard.connection);
-    if (response->result != 0) {
-      log_fatal("gecko_cmd_gatt_discover_primary_services failed - 0x%X",
-                response->result);
-      flash_led();
+    device->service_index = 0;
+    if (device->full_discovery) {
+      GATT_ASYNC(device,
+                 gecko_cmd_gatt_discover_primary_services(device->connection));
+    } else {
+      // services.list follows the registry services, then Generic Access,
+      // 0 for one not found
+      device->services.length = sensor_service_count() + 1;
+      discover_next_sensor_service(device);
     }
     return;
   }
 
   switch (message_id) {
   case gecko_evt_gatt_service_id:
-    log_trace("Found Service[%d]: %d", _thunderboard.services.length,
+    if (!device->full_discovery) {
+      log_trace("Found Sensor Service[%d]: %d", device->service_index,
+                event->data.evt_gatt_service.service);
+      device->services.list[device->service_index] =
+          event->data.evt_gatt_service.service;
+      break;
+    }
+    log_trace("Found Service[%d]: %d", device->services.length,
               event->data.evt_gatt_service.service);
-    if (_thunderboard.services.length == MAX_NUM_SERVICES) {
+    if (device->services.length == MAX_NUM_SERVICES) {
       log_fatal("Max Services Exceeded");
       flash_led();
     }
-    _thunderboard.services.list[_thunderboard.services.length++] =
+    device->services.list[device->services.length++] =
         event->data.evt_gatt_service.service;
     break;
 
   case gecko_evt_gatt_procedure_completed_id:
-    handle_state_transition(STATE_DISCOVER_CHARACTERISTICS);
+    if (!device->full_discovery) {
+      device->service_index++;
+      if (discover_next_sensor_service(device)) {
+        break;
+      }
+    }
+    handle_state_transition(device, STATE_DISCOVER_CHARACTERISTICS);
     break;
 
   case gecko_evt_le_connection_closed_id:
-    handle_state_transition(STATE_INIT);
+    connection_lost(device, event);
     break;
 
   case gecko_evt_le_connection_parameters_id:
@@ -512,33 +1236,119 @@ static void state_handler_service_discovery(uint32_t message_id,
   return;
 }
 
-static void state_handler_characteristic_discovery(
-    uint32_t message_id, struct gecko_cmd_packet *event, bool entry) {
-  static uint32_t service_index = 0;
+// Point the sensor the characteristic belongs to at it, if it is one
+static void register_sensor(ThunderBoardDevice *device,
+                            Characteristic *new_characteristic) {
+  int i = sensor_find(&new_characteristic->uuid);
 
-  if (entry) {
-     //_thunderboard.characteristics.length = 0;
-    struct gecko_msg_gatt_discover_characteristics_rsp_t *response =
-        gecko_cmd_gatt_discover_characteristics(
-            _thunderboard.connection,
-            _thunderboard.services.list[service_index]);
-    if (response->result != 0) {
-      log_fatal("gecko_cmd_gatt_discover_characteristics failed - 0x%X",
-                response->result);
-      flash_led();
+  if (i >= 0 && device->all_sensors[i] == NULL) {
+    device->all_sensors[i] = new_characteristic;
+    log_debug("Registered %s Characteristic: %d", sensor_profile(i)->name,
+              new_characteristic->characteristic);
+  }
+}
+
+// Bit per all_sensors index of the sensors not found yet
+static uint32_t missing_sensors(ThunderBoardDevice *device) {
+  uint32_t missing = 0;
+  uint32_t i;
+
+  for (i = 0; i < sensor_count(); i++) {
+    if (device->all_sensors[i] == NULL) {
+      missing |= 1u << i;
+    }
+  }
+  return missing;
+}
+
+// Discover the characteristics of the next service, false if none is left.
+// Without full_discovery only services holding missing sensors are looked
+// at, by UUID where a single sensor is missing, and the device name in
+// Generic Access. Several are discovered at once as each lookup by UUID
+// walks the whole service anyway.
+static bool discover_next_characteristics(ThunderBoardDevice *device) {
+  for (; device->service_index < device->services.length;
+       device->service_index++) {
+    uint32_t service = device->services.list[device->service_index];
+    uint32_t missing;
+    uint32_t i;
+
+    if (device->full_discovery) {
+      GATT_ASYNC(device, gecko_cmd_gatt_discover_characteristics(
+                             device->connection, service));
+      return true;
     }
 
+    if (service && device->service_index == sensor_service_count()) {
+      GATT_ASYNC(device, gecko_cmd_gatt_discover_characteristics_by_uuid(
+                             device->connection, service,
+                             _device_name_uuid.length,
+                             _device_name_uuid.bytes));
+      return true;
+    }
+    missing = device->service_index < sensor_service_count()
+                  ? missing_sensors(device) &
+                        sensor_service_members(device->service_index)
+                  : 0;
+    if (service == 0 || missing == 0) {
+      continue;
+    }
+    if (missing & (missing - 1)) {
+      GATT_ASYNC(device, gecko_cmd_gatt_discover_characteristics(
+                             device->connection, service));
+      return true;
+    }
+    for (i = 0; !(missing & (1u << i)); i++) {
+    }
+    const UUID *uuid = &sensor_profile(i)->uuid;
+    GATT_ASYNC(device, gecko_cmd_gatt_discover_characteristics_by_uuid(
+                           device->connection, service, uuid->length,
+                           uuid->bytes));
+    return true;
+  }
+  return false;
+}
+
+static void finish_characteristic_discovery(ThunderBoardDevice *device) {
+  uint32_t missing = missing_sensors(device);
+
+  if (missing && !device->full_discovery) {
+    log_warn("Sensors 0x%03X of %s not found by UUID, discovering all",
+             missing, device->name);
+    device->full_discovery = true;
+    forget_gatt_handles(device);
+    handle_state_transition(device, STATE_DISCOVER_SERVICES);
+    return;
+  }
+
+  gatt_cache_store(&device->address, &device->services,
+                   &device->characteristics);
+  handle_state_transition(device, STATE_SUBSCRIBE_CHARACTERISTICS);
+}
+
+static void state_handler_characteristic_discovery(
+    ThunderBoardDevice *device, uint32_t message_id,
+    struct gecko_cmd_packet *event, bool entry) {
+  if (entry) {
+    device->service_index = 0;
+    if (!discover_next_characteristics(device)) {
+      finish_characteristic_discovery(device);
+    }
     return;
   }
 
   switch (message_id) {
   case gecko_evt_gatt_characteristic_id: {
     print_characteristic(&event->data.evt_gatt_characteristic,
-                         _thunderboard.services.list[service_index]);
+                         device->services.list[device->service_index]);
 
+    if (device->characteristics.length == MAX_NUM_CHARACTERISTICS) {
+      log_fatal("Max Characteristics Exceeded");
+      flash_led();
+    }
     Characteristic *new_characteristic =
-        &_thunderboard.characteristics
-             .list[_thunderboard.characteristics.length++];
+        &device->characteristics
+             .list[device->characteristics.length++];
     new_characteristic->characteristic =
         event->data.evt_gatt_characteristic.characteristic;
     new_characteristic->properties.all =
@@ -549,145 +1359,18 @@ static void state_handler_characteristic_discovery(
     new_characteristic->uuid.length =
         event->data.evt_gatt_characteristic.uuid.len;
 
-    do {
-      if (_thunderboard.temperature_sensor == NULL) {
-        uint8_t temperature_uuid[] = {0x6E, 0x2A};
-        if (new_characteristic->uuid.length == sizeof(temperature_uuid) &&
-            memcmp(temperature_uuid, new_characteristic->uuid.bytes,
-                   sizeof(temperature_uuid)) == 0) {
-          _thunderboard.temperature_sensor = new_characteristic;
-          log_debug("Registered Temperature Characteristic: %d",
-                    _thunderboard.temperature_sensor->characteristic);
-          break;
-        }
-      }
-      if (_thunderboard.pressure_sensor == NULL) {
-        uint8_t pressure_uuid[] = {0x6D, 0x2A};
-        if (new_characteristic->uuid.length == sizeof(pressure_uuid) &&
-            memcmp(pressure_uuid, new_characteristic->uuid.bytes,
-                   sizeof(pressure_uuid)) == 0) {
-          _thunderboard.pressure_sensor = new_characteristic;
-          break;
-        }
-      }
-      if (_thunderboard.humidity_sensor == NULL) {
-        uint8_t humidity_uuid[] = {0x6F, 0x2A};
-        if (new_characteristic->uuid.length == sizeof(humidity_uuid) &&
-            memcmp(humidity_uuid, new_characteristic->uuid.bytes,
-                   sizeof(humidity_uuid)) == 0) {
-          _thunderboard.humidity_sensor = new_characteristic;
-          log_debug("Registered Humidity Characteristic: %d",
-                    _thunderboard.humidity_sensor->characteristic);
-          break;
-        }
-      }
-      if (_thunderboard.uv_sensor == NULL) {
-        uint8_t uv_uuid[] = {0x76, 0x2A};
-        if (new_characteristic->uuid.length == sizeof(uv_uuid) &&
-            memcmp(uv_uuid, new_characteristic->uuid.bytes, sizeof(uv_uuid)) ==
-                0) {
-          _thunderboard.uv_sensor = new_characteristic;
-          log_debug("Registered UV Characteristic: %d",
-                    _thunderboard.uv_sensor->characteristic);
-          break;
-        }
-      }
-      if (_thunderboard.co2_sensor == NULL) {
-        uint8_t co2_uuid[] = {0x3B, 0x10, 0x19, 0x00, 0xB0, 0x91, 0xE7, 0x76,
-                              0x33, 0xEF, 0x01, 0xC4, 0xAE, 0x58, 0xD6, 0xEF};
-        if (new_characteristic->uuid.length == sizeof(co2_uuid) &&
-            memcmp(co2_uuid, new_characteristic->uuid.bytes,
-                   sizeof(co2_uuid)) == 0) {
-          _thunderboard.co2_sensor = new_characteristic;
-          log_debug("Registered CO2 Characteristic: %d",
-                    _thunderboard.co2_sensor->characteristic);
-          break;
-        }
-      }
-      if (_thunderboard.voc_sensor == NULL) {
-        uint8_t voc_uuid[] = {0x3B, 0x10, 0x19, 0x0,  0xB0, 0x91, 0xE7, 0x76,
-                              0x33, 0xEF, 0x2,  0xC4, 0xAE, 0x58, 0xD6, 0xEF};
-        if (new_characteristic->uuid.length == sizeof(voc_uuid) &&
-            memcmp(voc_uuid, new_characteristic->uuid.bytes,
-                   sizeof(voc_uuid)) == 0) {
-          _thunderboard.voc_sensor = new_characteristic;
-          log_debug("Registered VOC Characteristic: %d",
-                    _thunderboard.voc_sensor->characteristic);
-          break;
-        }
-      }
-      if (_thunderboard.light_sensor == NULL) {
-        uint8_t light_uuid[] = {0x2E, 0xA3, 0xF4, 0x54, 0x87, 0x9F, 0xDE, 0x8D,
-                                0xEB, 0x45, 0xD9, 0xBF, 0x13, 0x69, 0x54, 0xC8};
-        if (new_characteristic->uuid.length == sizeof(light_uuid) &&
-            memcmp(light_uuid, new_characteristic->uuid.bytes,
-                   sizeof(light_uuid)) == 0) {
-          _thunderboard.light_sensor = new_characteristic;
-          log_debug("Registered Light Characteristic: %d",
-                    _thunderboard.light_sensor->characteristic);
-          break;
-        }
-      }
-      if (_thunderboard.sound_sensor == NULL) {
-        uint8_t sound_uuid[] = {0x2E, 0xA3, 0xF4, 0x54, 0x87, 0x9F, 0xDE, 0x8D,
-                                0xEB, 0x45, 0x2,  0xBF, 0x13, 0x69, 0x54, 0xC8};
-        if (new_characteristic->uuid.length == sizeof(sound_uuid) &&
-            memcmp(sound_uuid, new_characteristic->uuid.bytes,
-                   sizeof(sound_uuid)) == 0) {
-          _thunderboard.sound_sensor = new_characteristic;
-          log_debug("Registered Sound Characteristic: %d",
-                    _thunderboard.sound_sensor->characteristic);
-          break;
-        }
-      }
-      if (_thunderboard.acceleration_sensor == NULL) {
-        uint8_t acceleration_uuid[] = {0x9F, 0xDC, 0x9C, 0x81, 0xFF, 0xFE,
-                                       0x5D, 0x88, 0xE5, 0x11, 0xE5, 0x4B,
-                                       0xE2, 0xF6, 0xC1, 0xC4};
-        if (new_characteristic->uuid.length == sizeof(acceleration_uuid) &&
-            memcmp(acceleration_uuid, new_characteristic->uuid.bytes,
-                   sizeof(acceleration_uuid)) == 0) {
-          _thunderboard.acceleration_sensor = new_characteristic;
-          log_debug("Registered Acceleration Characteristic: %d",
-                    _thunderboard.acceleration_sensor->characteristic);
-          break;
-        }
-      }
-      if (_thunderboard.orientation_sensor == NULL) {
-        uint8_t orientation_uuid[] = {0x9A, 0xF4, 0x94, 0xE9, 0xB5, 0xF3,
-                                      0x9F, 0xBA, 0xDD, 0x45, 0xE3, 0xBE,
-                                      0x94, 0xB6, 0xC4, 0xB7};
-        if (new_characteristic->uuid.length == sizeof(orientation_uuid) &&
-            memcmp(orientation_uuid, new_characteristic->uuid.bytes,
-                   sizeof(orientation_uuid)) == 0) {
-          _thunderboard.orientation_sensor = new_characteristic;
-          log_debug("Registered Orientation Characteristic: %d",
-                    _thunderboard.orientation_sensor->characteristic);
-          break;
-        }
-      }
-    } while (0);
+    register_sensor(device, new_characteristic);
   } break;
 
-  case gecko_evt_gatt_procedure_completed_id: {
-    service_index++;
-    if (service_index < _thunderboard.services.length) {
-      struct gecko_msg_gatt_discover_characteristics_rsp_t *response =
-          gecko_cmd_gatt_discover_characteristics(
-              _thunderboard.connection,
-              _thunderboard.services.list[service_index]);
-      if (response->result != 0) {
-        log_fatal("gecko_cmd_gatt_discover_characteristics failed - 0x%X",
-                  response->result);
-        flash_led();
-      }
-    } else {
-      handle_state_transition(STATE_SUBSCRIBE_CHARACTERISTICS);
+  case gecko_evt_gatt_procedure_completed_id:
+    device->service_index++;
+    if (!discover_next_characteristics(device)) {
+      finish_characteristic_discovery(device);
     }
-  } break;
+    break;
 
   case gecko_evt_le_connection_closed_id:
-    handle_state_transition(STATE_INIT);
+    connection_lost(device, event);
     break;
 
   default:
@@ -698,36 +1381,33 @@ static void state_handler_characteristic_discovery(
   return;
 }
 
-static bool subscribe_to_next_characteristic(bool from_beginning) {
-  static uint32_t sensor_index = 0;
+static bool subscribe_to_next_characteristic(ThunderBoardDevice *device,
+                                             bool from_beginning) {
   bool subscription_made = false;
-  struct gecko_msg_gatt_set_characteristic_notification_rsp_t *response;
 
   log_trace("from_beginning: %s", from_beginning ? "true" : "false");
 
   if (from_beginning) {
-    sensor_index = 0;
+    device->sensor_index = 0;
   }
 
-  for (; sensor_index < NUM_THUNDERBOARD_SENSORS; sensor_index++) {
-    Characteristic *current_sensor = _thunderboard.all_sensors[sensor_index];
-    log_trace("current_sensor [%d] = %p", sensor_index, current_sensor);
+  for (; device->sensor_index < sensor_count(); device->sensor_index++) {
+    Characteristic *current_sensor =
+        device->all_sensors[device->sensor_index];
+    log_trace("current_sensor [%d] = %p", device->sensor_index,
+              current_sensor);
     if (current_sensor && (current_sensor->subscribed == false) &&
         (current_sensor->properties.notify ||
          current_sensor->properties.indicate)) {
-      response = gecko_cmd_gatt_set_characteristic_notification(
-          _thunderboard.connection, current_sensor->characteristic, 3);
-      if (response->result) {
-        log_fatal("gecko_cmd_gatt_set_characteristic_notification failed - %d",
-                  response->result);
-        flash_led();
-      } else {
-        log_debug("Subscribed to characteristic: %d",
-                  current_sensor->characteristic);
-        subscription_made = true;
-        sensor_index++;
-        break;
-      }
+      GATT_ASYNC(device, gecko_cmd_gatt_set_characteristic_notification(
+                             device->connection,
+                             current_sensor->characteristic, 3));
+      log_debug("Subscribing to characteristic: %d",
+                current_sensor->characteristic);
+      current_sensor->subscribed = true;
+      subscription_made = true;
+      device->sensor_index++;
+      break;
     }
   }
 
@@ -735,27 +1415,29 @@ static bool subscribe_to_next_characteristic(bool from_beginning) {
 }
 
 static void state_handler_subscribe_characteristics(
-    uint32_t message_id, struct gecko_cmd_packet *event, bool entry) {
+    ThunderBoardDevice *device, uint32_t message_id,
+    struct gecko_cmd_packet *event, bool entry) {
 
   log_trace("Subscribe Characteristics. Entry: %s", entry ? "true" : "false");
   
   if (entry) {
-    if (!subscribe_to_next_characteristic(true)) {
+    build_handle_map(device);
+    if (!subscribe_to_next_characteristic(device, true)) {
       log_debug("Subscriptions already fulfilled");
-      handle_state_transition(STATE_READ_CHARACTERISTIC_VALUES);
+      handle_state_transition(device, STATE_READ_CHARACTERISTIC_VALUES);
     }
     return;
   }
 
   switch (message_id) {
   case gecko_evt_gatt_procedure_completed_id:
-    if (!subscribe_to_next_characteristic(false)) {
-      handle_state_transition(STATE_READ_CHARACTERISTIC_VALUES);
+    if (!subscribe_to_next_characteristic(device, false)) {
+      handle_state_transition(device, STATE_READ_CHARACTERISTIC_VALUES);
     }
     break;
 
   case gecko_evt_le_connection_closed_id:
-    handle_state_transition(STATE_INIT);
+    connection_lost(device, event);
     break;
 
   default:
@@ -764,111 +1446,191 @@ static void state_handler_subscribe_characteristics(
   }
 }
 
-static void state_handler_read_characteristics(uint32_t message_id,
+// Hand the value just stored for the sensor to the history and count it
+// as its sample. A read moves the deadline on by a period, or a period
+// from now if the sensor fell that far behind. A notification sets it a
+// period from now when sampling from notifications.
+static void sample_taken(ThunderBoardDevice *device, uint32_t sensor_index,
+                         bool notified) {
+  Characteristic *sensor = device->all_sensors[sensor_index];
+  uint64_t period_us = sensor_profile(sensor_index)->period_ms * 1000ull;
+  uint64_t now = event_loop_now_us();
+
+  log_trace("%s: %u bytes", sensor_profile(sensor_index)->name,
+            sensor->value_length);
+  sensor_history_add(device - _devices, sensor_index, now, sensor->value,
+                     sensor->value_length);
+  device->samples[sensor_index]++;
+
+  if (!notified) {
+    device->due_us[sensor_index] += period_us;
+    if (device->due_us[sensor_index] <= now) {
+      device->due_us[sensor_index] = now + period_us;
+    }
+  } else if (_sampling_mode == SAMPLING_NOTIFY) {
+    device->due_us[sensor_index] = now + period_us;
+  }
+}
+
+static void sample_timer_expired(void *context) {
+  ThunderBoardDevice *device = context;
+
+  device->timer = 0;
+  if (device->state == STATE_READ_CHARACTERISTIC_VALUES &&
+      !device->read_pending) {
+    read_due_sensors(device);
+  }
+}
+
+// Read the sensor with the earliest deadline once it is due, grouped with
+// the others due by SAMPLE_BATCH_MS from now as far as the MTU allows.
+// Until one is due, wait for it on the board timer. Sensors that cannot be
+// read are only sampled by their notifications.
+static void read_due_sensors(ThunderBoardDevice *device) {
+  uint64_t now = event_loop_now_us();
+  uint64_t batch_us = now + SAMPLE_BATCH_MS * 1000ull;
+  uint32_t response_length = 0;
+  uint8_t order[MAX_SENSORS];
+  uint32_t count = 0;
+  uint32_t i;
+  uint32_t j;
+
+  for (i = 0; i < sensor_count(); i++) {
+    Characteristic *sensor = device->all_sensors[i];
+    if (sensor == NULL || !sensor->properties.read) {
+      continue;
+    }
+    for (j = count; j > 0 && device->due_us[order[j - 1]] > device->due_us[i];
+         j--) {
+      order[j] = order[j - 1];
+    }
+    order[j] = i;
+    count++;
+  }
+  if (count == 0) {
+    return;
+  }
+
+  if (device->due_us[order[0]] > now) {
+    // Every sensor was read once, the link can slow down
+    if (!device->slow_link) {
+      device->slow_link = true;
+      set_connection_interval(device, SLOW_CONNECTION_INTERVAL);
+    }
+    set_device_timer(device, (device->due_us[order[0]] - now + 999) / 1000,
+                     sample_timer_expired);
+    return;
+  }
+
+  // A read multiple response carries no lengths, so a sensor of varying
+  // length is read on its own
+  device->group_length = 0;
+  for (i = 0; device->read_multiple && sensor_profile(order[0])->length &&
+              i < count && device->due_us[order[i]] <= batch_us;
+       i++) {
+    uint8_t length = sensor_profile(order[i])->length;
+
+    if (length == 0 || response_length + length > device->mtu - 1u) {
+      continue;
+    }
+    response_length += length;
+    device->group[device->group_length++] = order[i];
+  }
+
+  device->read_start_us = now;
+  // Read multiple needs at least two handles
+  if (device->group_length > 1) {
+    read_characteristics(device);
+  } else {
+    device->group_length = 0;
+    device->sensor_index = order[0];
+    read_characteristic(device, device->all_sensors[order[0]]);
+  }
+}
+
+static void state_handler_read_characteristics(ThunderBoardDevice *device,
+                                               uint32_t message_id,
                                                struct gecko_cmd_packet *event,
                                                bool entry) {
-  static uint32_t sensor_index = 0;
-  static uint32_t last_requested_characteristic = 0;
-
   if (entry) {
     LedJob flash_green_red_job = {
         LED_JOB_ALTERNATE, 500, {LED_GREEN, LED_RED, 0}, 2};
     push_led_job(flash_green_red_job);
 
     uint32_t i;
-    for (i = 0; i < NUM_THUNDERBOARD_SENSORS; i++) {
-      log_trace("all_sensors[%u]: %p", i, _thunderboard.all_sensors[i]);
-    }
-
-    for (sensor_index = 0; sensor_index < NUM_THUNDERBOARD_SENSORS;
-         sensor_index++) {
-      if (_thunderboard.all_sensors[sensor_index] != NULL && _thunderboard.all_sensors[sensor_index]->properties.read) {
-        log_trace("Requesting characteristic: %d", _thunderboard.all_sensors[sensor_index]->characteristic);
-        struct gecko_msg_gatt_read_characteristic_value_rsp_t *response =
-            gecko_cmd_gatt_read_characteristic_value(
-                _thunderboard.connection,
-                _thunderboard.all_sensors[sensor_index]->characteristic);
-        if (response->result != 0) {
-          log_error("gecko_cmd_gatt_read_characteristic_value failed - 0x%X",
-                    response->result);
-          handle_state_transition(STATE_INIT);
-        }
-        last_requested_characteristic = _thunderboard.all_sensors[sensor_index]->characteristic;
-        break;
-      } else {
-        log_warn("NULL Sensor at index %d", sensor_index);
-      }
+    for (i = 0; i < sensor_count(); i++) {
+      log_trace("all_sensors[%u]: %p", i, device->all_sensors[i]);
     }
+    log_info("%s reading %.1f ms after connecting", device->name,
+             (event_loop_now_us() - device->connected_us) / 1000.0);
+
+    // Every sensor is due right away, then on its own period
+    for (i = 0; i < sensor_count(); i++) {
+      device->due_us[i] = event_loop_now_us();
+    }
+    read_due_sensors(device);
     return;
   }
 
   switch (message_id) {
   case gecko_evt_gatt_characteristic_value_id: {
-    log_trace("Got value for characteristic: %d", event->data.evt_gatt_characteristic_value.characteristic);
-    Characteristic *current_characteristic = get_characteristic_by_handle(
-        event->data.evt_gatt_characteristic_value.characteristic);
-    if (current_characteristic == NULL) {
-      log_error("get_characteristic_by_handle for %d returned NULL",
-                event->data.evt_gatt_characteristic_value.characteristic);
-    } else {
-
-      memcpy(current_characteristic->value,
-             event->data.evt_gatt_characteristic_value.value.data,
-             event->data.evt_gatt_characteristic_value.value.len);
-      current_characteristic->value_length =
-          event->data.evt_gatt_characteristic_value.value.len;
-      if (event->data.evt_gatt_characteristic_value.characteristic == last_requested_characteristic) {
-        sensor_index++;
-        log_trace("incrementing sensor index (%d)", sensor_index);
+    struct gecko_msg_gatt_characteristic_value_evt_t *value =
+        &event->data.evt_gatt_characteristic_value;
+    device->value_events++;
+    device->value_bytes += value->value.len;
+    if (value->att_opcode == gatt_read_multiple_response) {
+      // Carries no handle, the values are those of the outstanding group
+      log_trace("Got values for %u characteristics", device->group_length);
+      if (device->group_length) {
+        store_characteristics(device, &value->value);
+        device->readings++;
       }
+      break;
     }
-  } break;
 
-  case gecko_evt_gatt_procedure_completed_id:
-    for (; sensor_index < NUM_THUNDERBOARD_SENSORS; sensor_index++) {
-      if (_thunderboard.all_sensors[sensor_index] == NULL) {
-        log_warn("WARNING: NULL Sensor at index %d", sensor_index);
-      } else if (_thunderboard.all_sensors[sensor_index]->properties.read) {
-        log_trace("Requesting characteristic: %d", _thunderboard.all_sensors[sensor_index]->characteristic);
-        struct gecko_msg_gatt_read_characteristic_value_rsp_t *response =
-            gecko_cmd_gatt_read_characteristic_value(
-                _thunderboard.connection,
-                _thunderboard.all_sensors[sensor_index]->characteristic);
-        if (response->result != 0) {
-          log_error("gecko_cmd_gatt_read_characteristic_value failed - 0x%X",
-                    response->result);
-          if (response->result == bg_err_invalid_conn_handle) {
-            log_debug("Invalid connection handle. Revert to STATE_INIT");
-            handle_state_transition(STATE_INIT);
-          } else {
-            log_fatal("Unhandled exception");
-            flash_led();
-          }
-        }
-        last_requested_characteristic = _thunderboard.all_sensors[sensor_index]->characteristic;
-        break;
-      }
+    log_trace("Got value for characteristic: %d", value->characteristic);
+    int sensor_index = get_sensor_by_handle(device, value->characteristic);
+    if (sensor_index < 0) {
+      log_debug("Ignoring value of handle %d, not a sensor",
+                value->characteristic);
+      break;
     }
+    Characteristic *sensor = device->all_sensors[sensor_index];
+    uint8_t length = value->value.len < VALUE_PAYLOAD_LENGTH
+                         ? value->value.len
+                         : VALUE_PAYLOAD_LENGTH;
+    memcpy(sensor->value, value->value.data, length);
+    sensor->value_length = length;
+    sample_taken(device, sensor_index,
+                 value->att_opcode != gatt_read_response);
+    device->readings++;
+  } break;
 
-    if (sensor_index >= NUM_THUNDERBOARD_SENSORS) {
-      sensor_index = 0;
-      refresh_sensor_values();
-      log_trace("Requesting characteristic: %d", _thunderboard.all_sensors[sensor_index]->characteristic);
-      struct gecko_msg_gatt_read_characteristic_value_rsp_t *response =
-          gecko_cmd_gatt_read_characteristic_value(
-              _thunderboard.connection,
-              _thunderboard.all_sensors[sensor_index]->characteristic);
-      if (response->result != 0) {
-        log_fatal("gecko_cmd_gatt_read_characteristic_value failed - 0x%X",
-                  response->result);
-        handle_state_transition(STATE_INIT);
-      }
-      last_requested_characteristic = _thunderboard.all_sensors[sensor_index]->characteristic;
+  case gecko_evt_gatt_procedure_completed_id: {
+    uint16_t result = event->data.evt_gatt_procedure_completed.result;
+
+    device->read_pending = false;
+    device->read_total_us += event_loop_now_us() - device->read_start_us;
+    if (device->group_length) {
+      // No values came back, read the sensors one at a time from now on
+      log_warn("Read multiple failed on %s - 0x%X, falling back to reads",
+               device->name, result);
+      device->read_multiple = false;
+      device->group_length = 0;
+    } else if (result) {
+      // Try the sensor again a period later
+      log_warn("Reading %s of %s failed - 0x%X",
+               sensor_profile(device->sensor_index)->name, device->name,
+               result);
+      device->due_us[device->sensor_index] =
+          event_loop_now_us() +
+          sensor_profile(device->sensor_index)->period_ms * 1000ull;
     }
-    break;
+    read_due_sensors(device);
+  } break;
 
   case gecko_evt_le_connection_closed_id:
-    handle_state_transition(STATE_INIT);
+    connection_lost(device, event);
     break;
 
   default:
@@ -877,4 +1639,4 @@ static void state_handler_read_characteristics(uint32_t message_id,
   }
 
   return;
-}
\ No newline at end of file
+}
@@ -0,0 +1,404 @@
+/*******************************************************************************
+ * Copyright Arrow Electronics, Inc., 2019
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ ******************************************************************************/
+
+#include "bgapi_trace.h"
+#include "event_loop.h"
+#include "log.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Same as a uart read timing out with VTIME=1
+#define REPLAY_IDLE_WAIT_US 100000
+
+static void (*_output)(uint32_t, uint8_t *) = NULL;
+static int32_t (*_input)(uint32_t, uint8_t *) = NULL;
+static int32_t (*_read)(uint32_t, uint8_t *) = NULL;
+static int32_t (*_peek)(void) = NULL;
+
+static FILE *_record_file = NULL;
+static uint64_t _record_last_us = 0;
+static pthread_mutex_t _record_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct TraceReplay {
+  uint8_t *trace;
+  uint32_t length;
+  uint32_t position;       // next record header
+  uint32_t data_offset;    // bytes of the current record already delivered
+  uint64_t record_time_us; // recorded time of the current record
+  uint64_t base_us;        // wall time matching recorded time 0
+  uint32_t early_outputs;  // commands sent before the recording had them
+  bool realtime;
+  TraceReplayStats stats;
+  pthread_mutex_t mutex;
+  pthread_cond_t progress;
+} TraceReplay;
+
+static TraceReplay _replay = {.mutex = PTHREAD_MUTEX_INITIALIZER,
+                              .progress = PTHREAD_COND_INITIALIZER};
+
+static void put_le16(uint8_t *buffer, uint16_t value) {
+  buffer[0] = value & 0xFF;
+  buffer[1] = value >> 8;
+}
+
+static void put_le32(uint8_t *buffer, uint32_t value) {
+  put_le16(buffer, value & 0xFFFF);
+  put_le16(buffer + 2, value >> 16);
+}
+
+static uint16_t get_le16(const uint8_t *buffer) {
+  return buffer[0] | (buffer[1] << 8);
+}
+
+static uint32_t get_le32(const uint8_t *buffer) {
+  return get_le16(buffer) | ((uint32_t)get_le16(buffer + 2) << 16);
+}
+
+static void record(TraceDirection direction, uint32_t length, uint8_t *data) {
+  uint8_t header[TRACE_RECORD_HEADER_LENGTH];
+  uint64_t now;
+  uint64_t delta;
+
+  pthread_mutex_lock(&_record_mutex);
+  if (!_record_file) {
+    pthread_mutex_unlock(&_record_mutex);
+    return;
+  }
+
+  now = event_loop_now_us();
+  delta = now - _record_last_us;
+  _record_last_us = now;
+
+  // Records are at most 64k, bulk reads never come close
+  while (length) {
+    uint16_t chunk = length > 0xFFFF ? 0xFFFF : length;
+
+    put_le32(header, delta > UINT32_MAX ? UINT32_MAX : delta);
+    put_le16(header + 4, chunk);
+    header[6] = direction;
+    header[7] = 0;
+    if (fwrite(header, sizeof(header), 1, _record_file) != 1 ||
+        fwrite(data, chunk, 1, _record_file) != 1) {
+      log_error("Trace write failed, recording stopped: %s", strerror(errno));
+      fclose(_record_file);
+      _record_file = NULL;
+      break;
+    }
+    length -= chunk;
+    data += chunk;
+    delta = 0;
+  }
+
+  // Commands are rare, keep the file usable if the process dies
+  if (_record_file && direction == TRACE_TO_NCP) {
+    fflush(_record_file);
+  }
+  pthread_mutex_unlock(&_record_mutex);
+}
+
+void trace_wrap(void (*output)(uint32_t, uint8_t *),
+                int32_t (*input)(uint32_t, uint8_t *),
+                int32_t (*read)(uint32_t, uint8_t *), int32_t (*peek)(void)) {
+  _output = output;
+  _input = input;
+  _read = read;
+  _peek = peek;
+}
+
+void trace_output(uint32_t length, uint8_t *data) {
+  record(TRACE_TO_NCP, length, data);
+  _output(length, data);
+}
+
+int32_t trace_input(uint32_t length, uint8_t *data) {
+  int32_t result = _input(length, data);
+  if (result > 0) {
+    record(TRACE_FROM_NCP, result, data);
+  }
+  return result;
+}
+
+int32_t trace_read(uint32_t length, uint8_t *data) {
+  int32_t result = _read(length, data);
+  if (result > 0) {
+    record(TRACE_FROM_NCP, result, data);
+  }
+  return result;
+}
+
+int32_t trace_peek(void) { return _peek ? _peek() : -1; }
+
+int trace_record_start(const char *path) {
+  uint8_t header[TRACE_FILE_HEADER_LENGTH] = {0};
+  FILE *file = fopen(path, "wb");
+
+  if (!file) {
+    log_error("Cannot create trace %s: %s", path, strerror(errno));
+    return -1;
+  }
+
+  memcpy(header, TRACE_MAGIC, 4);
+  header[4] = TRACE_VERSION;
+  if (fwrite(header, sizeof(header), 1, file) != 1) {
+    log_error("Cannot write trace %s: %s", path, strerror(errno));
+    fclose(file);
+    return -1;
+  }
+
+  pthread_mutex_lock(&_record_mutex);
+  _record_file = file;
+  _record_last_us = event_loop_now_us();
+  pthread_mutex_unlock(&_record_mutex);
+
+  log_info("Recording BGAPI trace to %s", path);
+  return 0;
+}
+
+void trace_record_stop() {
+  pthread_mutex_lock(&_record_mutex);
+  if (_record_file) {
+    fclose(_record_file);
+    _record_file = NULL;
+  }
+  pthread_mutex_unlock(&_record_mutex);
+}
+
+int trace_replay_open(const char *path, bool realtime) {
+  FILE *file = fopen(path, "rb");
+  long length;
+
+  if (!file) {
+    log_error("Cannot open trace %s: %s", path, strerror(errno));
+    return -1;
+  }
+
+  fseek(file, 0, SEEK_END);
+  length = ftell(file);
+  fseek(file, 0, SEEK_SET);
+
+  _replay.trace = malloc(length > 0 ? length : 1);
+  if (!_replay.trace || fread(_replay.trace, 1, length, file) != length ||
+      length < TRACE_FILE_HEADER_LENGTH ||
+      memcmp(_replay.trace, TRACE_MAGIC, 4) ||
+      _replay.trace[4] != TRACE_VERSION) {
+    log_error("%s is not a version %d BGAPI trace", path, TRACE_VERSION);
+    fclose(file);
+    free(_replay.trace);
+    _replay.trace = NULL;
+    return -1;
+  }
+  fclose(file);
+
+  _replay.length = length;
+  _replay.position = TRACE_FILE_HEADER_LENGTH;
+  _replay.data_offset = 0;
+  _replay.record_time_us = 0;
+  _replay.early_outputs = 0;
+  _replay.realtime = realtime;
+  _replay.base_us = event_loop_now_us();
+  memset(&_replay.stats, 0, sizeof(_replay.stats));
+
+  if (_replay.position + TRACE_RECORD_HEADER_LENGTH <= _replay.length) {
+    _replay.record_time_us = get_le32(&_replay.trace[_replay.position]);
+  }
+
+  log_info("Replaying BGAPI trace %s (%ld bytes, %s)", path, length,
+           realtime ? "recorded speed" : "as fast as possible");
+  return 0;
+}
+
+void trace_replay_close() {
+  pthread_mutex_lock(&_replay.mutex);
+  free(_replay.trace);
+  _replay.trace = NULL;
+  _replay.length = 0;
+  _replay.position = 0;
+  pthread_cond_broadcast(&_replay.progress);
+  pthread_mutex_unlock(&_replay.mutex);
+}
+
+// Header of the current record, false at the end of the trace. Called with
+// the lock held.
+static bool current_record(TraceRecordHeader *header) {
+  uint8_t *raw;
+
+  if (!_replay.trace ||
+      _replay.position + TRACE_RECORD_HEADER_LENGTH > _replay.length) {
+    return false;
+  }
+
+  raw = &_replay.trace[_replay.position];
+  header->delta_us = get_le32(raw);
+  header->length = get_le16(raw + 4);
+  header->direction = raw[6];
+
+  // A truncated last record ends the trace
+  return _replay.position + TRACE_RECORD_HEADER_LENGTH + header->length <=
+         _replay.length;
+}
+
+static void next_record() {
+  TraceRecordHeader header;
+
+  current_record(&header);
+  _replay.position += TRACE_RECORD_HEADER_LENGTH + header.length;
+  _replay.data_offset = 0;
+  _replay.stats.records++;
+  if (current_record(&header)) {
+    _replay.record_time_us += header.delta_us;
+  }
+  pthread_cond_broadcast(&_replay.progress);
+}
+
+// Commands the application already sent cover recorded ones
+static void skip_early_outputs() {
+  TraceRecordHeader header;
+
+  while (_replay.early_outputs && current_record(&header) &&
+         header.direction == TRACE_TO_NCP) {
+    _replay.early_outputs--;
+    next_record();
+  }
+}
+
+static uint64_t due_us() { return _replay.base_us + _replay.record_time_us; }
+
+static void wait_progress(uint64_t until_us) {
+  struct timespec deadline;
+  uint64_t now = event_loop_now_us();
+  uint64_t wait = until_us > now ? until_us - now : 0;
+
+  if (wait > REPLAY_IDLE_WAIT_US) {
+    wait = REPLAY_IDLE_WAIT_US;
+  }
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += (deadline.tv_nsec + wait * 1000) / 1000000000;
+  deadline.tv_nsec = (deadline.tv_nsec + wait * 1000) % 1000000000;
+  pthread_cond_timedwait(&_replay.progress, &_replay.mutex, &deadline);
+}
+
+void replay_output(uint32_t length, uint8_t *data) {
+  TraceRecordHeader header;
+
+  pthread_mutex_lock(&_replay.mutex);
+  _replay.stats.outputs++;
+  skip_early_outputs();
+
+  if (current_record(&header) && header.direction == TRACE_TO_NCP) {
+    uint8_t *recorded =
+        &_replay.trace[_replay.position + TRACE_RECORD_HEADER_LENGTH];
+    uint64_t now = event_loop_now_us();
+
+    if (header.length != length || memcmp(recorded, data, length)) {
+      _replay.stats.output_mismatches++;
+    }
+    // The application was slower than the recording, shift what follows
+    if (_replay.realtime && now > due_us()) {
+      _replay.base_us += now - due_us();
+    }
+    next_record();
+  } else {
+    _replay.early_outputs++;
+  }
+  pthread_mutex_unlock(&_replay.mutex);
+}
+
+int32_t replay_read(uint32_t length, uint8_t *data) {
+  TraceRecordHeader header;
+  uint32_t delivered = 0;
+
+  pthread_mutex_lock(&_replay.mutex);
+  skip_early_outputs();
+
+  while (delivered < length && current_record(&header) &&
+         header.direction == TRACE_FROM_NCP) {
+    uint32_t available = header.length - _replay.data_offset;
+    uint32_t chunk = length - delivered;
+
+    if (_replay.realtime && event_loop_now_us() < due_us()) {
+      break;
+    }
+    if (chunk > available) {
+      chunk = available;
+    }
+    memcpy(data + delivered,
+           &_replay.trace[_replay.position + TRACE_RECORD_HEADER_LENGTH +
+                          _replay.data_offset],
+           chunk);
+    delivered += chunk;
+    _replay.data_offset += chunk;
+    _replay.stats.bytes_in += chunk;
+    if (_replay.data_offset == header.length) {
+      next_record();
+    }
+  }
+
+  // Nothing due: the NCP is waiting for a command, for its recorded time or
+  // the trace is over. Block like an idle uart would.
+  if (!delivered) {
+    wait_progress(current_record(&header) && header.direction == TRACE_FROM_NCP
+                      ? due_us()
+                      : UINT64_MAX);
+  }
+  pthread_mutex_unlock(&_replay.mutex);
+
+  return delivered;
+}
+
+int32_t replay_input(uint32_t length, uint8_t *data) {
+  uint32_t received = 0;
+
+  while (received < length) {
+    if (trace_replay_finished()) {
+      return -1;
+    }
+    received += replay_read(length - received, data + received);
+  }
+
+  return length;
+}
+
+int32_t replay_peek(void) {
+  TraceRecordHeader header;
+  int32_t available = 0;
+
+  pthread_mutex_lock(&_replay.mutex);
+  skip_early_outputs();
+  if (current_record(&header) && header.direction == TRACE_FROM_NCP &&
+      (!_replay.realtime || event_loop_now_us() >= due_us())) {
+    available = header.length - _replay.data_offset;
+  }
+  pthread_mutex_unlock(&_replay.mutex);
+
+  return available;
+}
+
+bool trace_replay_finished() {
+  TraceRecordHeader header;
+  bool finished;
+
+  pthread_mutex_lock(&_replay.mutex);
+  finished = !current_record(&header);
+  pthread_mutex_unlock(&_replay.mutex);
+
+  return finished;
+}
+
+void trace_replay_get_stats(TraceReplayStats *stats) {
+  pthread_mutex_lock(&_replay.mutex);
+  *stats = _replay.stats;
+  pthread_mutex_unlock(&_replay.mutex);
+}
@@ -0,0 +1,197 @@
+/*******************************************************************************
+ * Copyright Arrow Electronics, Inc., 2019
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ ******************************************************************************/
+
+#include "event_loop.h"
+#include "log.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct EventSource {
+  int fd;
+  event_loop_callback callback;
+  event_loop_pending pending;
+  void *context;
+  // Tells this registration from a later one of the same fd
+  uint32_t id;
+} EventSource;
+
+typedef struct EventTimer {
+  bool active;
+  uint64_t due_us;
+  uint32_t period_ms;
+  event_loop_callback callback;
+  void *context;
+} EventTimer;
+
+static EventSource _sources[EVENT_LOOP_MAX_FDS];
+static uint32_t _num_sources = 0;
+static uint32_t _next_source_id = 0;
+static EventTimer _timers[EVENT_LOOP_MAX_TIMERS];
+static volatile bool _running = false;
+
+uint64_t event_loop_now_us() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return ((uint64_t)now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+}
+
+int event_loop_add_fd(int fd, event_loop_callback callback,
+                      event_loop_pending pending, void *context) {
+  if (_num_sources == EVENT_LOOP_MAX_FDS) {
+    log_error("Event loop fd table full");
+    return -1;
+  }
+
+  _sources[_num_sources].fd = fd;
+  _sources[_num_sources].callback = callback;
+  _sources[_num_sources].pending = pending;
+  _sources[_num_sources].context = context;
+  _sources[_num_sources].id = ++_next_source_id;
+  _num_sources++;
+
+  return 0;
+}
+
+void event_loop_remove_fd(int fd) {
+  for (uint32_t index = 0; index < _num_sources; index++) {
+    if (_sources[index].fd == fd) {
+      _sources[index] = _sources[--_num_sources];
+      return;
+    }
+  }
+}
+
+int event_loop_add_timer(uint32_t delay_ms, uint32_t period_ms,
+                         event_loop_callback callback, void *context) {
+  for (int timer_id = 0; timer_id < EVENT_LOOP_MAX_TIMERS; timer_id++) {
+    EventTimer *timer = &_timers[timer_id];
+    if (!timer->active) {
+      timer->active = true;
+      timer->due_us = event_loop_now_us() + ((uint64_t)delay_ms * 1000);
+      timer->period_ms = period_ms;
+      timer->callback = callback;
+      timer->context = context;
+      return timer_id;
+    }
+  }
+
+  log_error("Event loop timer table full");
+  return -1;
+}
+
+void event_loop_cancel_timer(int timer_id) {
+  if (timer_id >= 0 && timer_id < EVENT_LOOP_MAX_TIMERS) {
+    _timers[timer_id].active = false;
+  }
+}
+
+// The source polled is still registered, an earlier callback of the same
+// round may have removed it and maybe added its fd again
+static bool source_registered(const EventSource *source) {
+  for (uint32_t index = 0; index < _num_sources; index++) {
+    if (_sources[index].fd == source->fd) {
+      return _sources[index].id == source->id;
+    }
+  }
+  return false;
+}
+
+// Milliseconds until the next timer is due, -1 to wait forever
+static int next_timeout_ms(uint64_t now) {
+  int timeout = -1;
+
+  for (int timer_id = 0; timer_id < EVENT_LOOP_MAX_TIMERS; timer_id++) {
+    EventTimer *timer = &_timers[timer_id];
+    if (timer->active) {
+      int remaining = 0;
+      if (timer->due_us > now) {
+        remaining = (timer->due_us - now + 999) / 1000;
+      }
+      if (timeout < 0 || remaining < timeout) {
+        timeout = remaining;
+      }
+    }
+  }
+
+  return timeout;
+}
+
+static void run_due_timers() {
+  uint64_t now = event_loop_now_us();
+
+  for (int timer_id = 0; timer_id < EVENT_LOOP_MAX_TIMERS; timer_id++) {
+    EventTimer *timer = &_timers[timer_id];
+    if (timer->active && timer->due_us <= now) {
+      if (timer->period_ms) {
+        timer->due_us += (uint64_t)timer->period_ms * 1000;
+        if (timer->due_us <= now) {
+          timer->due_us = now + ((uint64_t)timer->period_ms * 1000);
+        }
+      } else {
+        timer->active = false;
+      }
+      timer->callback(timer->context);
+    }
+  }
+}
+
+void event_loop_run() {
+  struct pollfd poll_fds[EVENT_LOOP_MAX_FDS];
+  EventSource ready[EVENT_LOOP_MAX_FDS];
+
+  _running = true;
+  while (_running) {
+    int timeout = next_timeout_ms(event_loop_now_us());
+    uint32_t num_fds = _num_sources;
+
+    for (uint32_t index = 0; index < num_fds; index++) {
+      poll_fds[index].fd = _sources[index].fd;
+      poll_fds[index].events = POLLIN;
+      poll_fds[index].revents = 0;
+      if (_sources[index].pending &&
+          _sources[index].pending(_sources[index].context)) {
+        timeout = 0;
+      }
+    }
+
+    int result = poll(poll_fds, num_fds, timeout);
+    if (result < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      log_error("poll failed - %s", strerror(errno));
+      break;
+    }
+
+    // Callbacks may add or remove sources, so work from a snapshot
+    uint32_t num_ready = 0;
+    for (uint32_t index = 0; index < num_fds; index++) {
+      if (poll_fds[index].revents ||
+          (_sources[index].pending &&
+           _sources[index].pending(_sources[index].context))) {
+        ready[num_ready++] = _sources[index];
+      }
+    }
+    for (uint32_t index = 0; index < num_ready; index++) {
+      if (source_registered(&ready[index])) {
+        ready[index].callback(ready[index].context);
+      }
+    }
+
+    run_due_timers();
+  }
+}
+
+void event_loop_stop() { _running = false; }
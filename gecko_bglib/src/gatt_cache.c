@@ -0,0 +1,169 @@
+/*******************************************************************************
+ * Copyright Arrow Electronics, Inc., 2019
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ ******************************************************************************/
+
+#include "gatt_cache.h"
+#include "log.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define GATT_CACHE_MAX_LENGTH                                                  \
+  (GATT_CACHE_HEADER_LENGTH + MAX_NUM_SERVICES * 4 +                           \
+   MAX_NUM_CHARACTERISTICS * (4 + MAX_UUID_LENGTH))
+
+static void put_le16(uint8_t *buffer, uint16_t value) {
+  buffer[0] = value & 0xFF;
+  buffer[1] = value >> 8;
+}
+
+static void put_le32(uint8_t *buffer, uint32_t value) {
+  put_le16(buffer, value & 0xFFFF);
+  put_le16(buffer + 2, value >> 16);
+}
+
+static uint16_t get_le16(const uint8_t *buffer) {
+  return buffer[0] | (buffer[1] << 8);
+}
+
+static uint32_t get_le32(const uint8_t *buffer) {
+  return get_le16(buffer) | ((uint32_t)get_le16(buffer + 2) << 16);
+}
+
+static void cache_path(const bd_addr *address, char *path, size_t size) {
+  snprintf(path, size, "%s/%02X%02X%02X%02X%02X%02X.gatt", GATT_CACHE_DIR,
+           address->addr[5], address->addr[4], address->addr[3],
+           address->addr[2], address->addr[1], address->addr[0]);
+}
+
+int gatt_cache_load(const bd_addr *address, GattServiceList *services,
+                    CharacteristicList *characteristics) {
+  uint8_t buffer[GATT_CACHE_MAX_LENGTH];
+  char path[64];
+  uint32_t length;
+  uint32_t position = GATT_CACHE_HEADER_LENGTH;
+  uint32_t i;
+
+  cache_path(address, path, sizeof(path));
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    return -1;
+  }
+  length = fread(buffer, 1, sizeof(buffer), file);
+  fclose(file);
+
+  if (length < GATT_CACHE_HEADER_LENGTH ||
+      memcmp(buffer, GATT_CACHE_MAGIC, 4) != 0 ||
+      buffer[4] != GATT_CACHE_VERSION || buffer[5] > MAX_NUM_SERVICES ||
+      buffer[6] > MAX_NUM_CHARACTERISTICS) {
+    log_warn("%s is not a version %d GATT cache", path, GATT_CACHE_VERSION);
+    return -1;
+  }
+  services->length = buffer[5];
+  characteristics->length = buffer[6];
+
+  if (position + services->length * 4 > length) {
+    goto truncated;
+  }
+  for (i = 0; i < services->length; i++, position += 4) {
+    services->list[i] = get_le32(&buffer[position]);
+  }
+
+  for (i = 0; i < characteristics->length; i++) {
+    Characteristic *characteristic = &characteristics->list[i];
+    if (position + 4 > length || buffer[position + 3] > MAX_UUID_LENGTH ||
+        position + 4 + buffer[position + 3] > length) {
+      goto truncated;
+    }
+    memset(characteristic, 0, sizeof(*characteristic));
+    characteristic->characteristic = get_le16(&buffer[position]);
+    characteristic->properties.all = buffer[position + 2];
+    characteristic->uuid.length = buffer[position + 3];
+    memcpy(characteristic->uuid.bytes, &buffer[position + 4],
+           characteristic->uuid.length);
+    position += 4 + characteristic->uuid.length;
+  }
+
+  log_debug("Loaded %u services and %u characteristics from %s",
+            services->length, characteristics->length, path);
+  return 0;
+
+truncated:
+  log_warn("%s is truncated", path);
+  services->length = 0;
+  characteristics->length = 0;
+  return -1;
+}
+
+int gatt_cache_store(const bd_addr *address, const GattServiceList *services,
+                     const CharacteristicList *characteristics) {
+  uint8_t buffer[GATT_CACHE_MAX_LENGTH] = {0};
+  char path[64];
+  char temporary_path[72];
+  uint32_t position = GATT_CACHE_HEADER_LENGTH;
+  uint32_t i;
+
+  if (mkdir(GATT_CACHE_DIR, 0755) && errno != EEXIST) {
+    log_warn("Cannot create %s: %s", GATT_CACHE_DIR, strerror(errno));
+    return -1;
+  }
+
+  memcpy(buffer, GATT_CACHE_MAGIC, 4);
+  buffer[4] = GATT_CACHE_VERSION;
+  buffer[5] = services->length;
+  buffer[6] = characteristics->length;
+  for (i = 0; i < services->length; i++, position += 4) {
+    put_le32(&buffer[position], services->list[i]);
+  }
+  for (i = 0; i < characteristics->length; i++) {
+    const Characteristic *characteristic = &characteristics->list[i];
+    put_le16(&buffer[position], characteristic->characteristic);
+    buffer[position + 2] = characteristic->properties.all;
+    buffer[position + 3] = characteristic->uuid.length;
+    memcpy(&buffer[position + 4], characteristic->uuid.bytes,
+           characteristic->uuid.length);
+    position += 4 + characteristic->uuid.length;
+  }
+
+  // Written aside and renamed so a power cut never leaves half a cache
+  cache_path(address, path, sizeof(path));
+  snprintf(temporary_path, sizeof(temporary_path), "%s.tmp", path);
+  FILE *file = fopen(temporary_path, "wb");
+  if (!file) {
+    log_warn("Cannot create %s: %s", temporary_path, strerror(errno));
+    return -1;
+  }
+  bool written = fwrite(buffer, position, 1, file) == 1;
+  if (fclose(file) != 0 || !written) {
+    log_warn("Cannot write %s: %s", temporary_path, strerror(errno));
+    remove(temporary_path);
+    return -1;
+  }
+  if (rename(temporary_path, path)) {
+    log_warn("Cannot rename %s: %s", temporary_path, strerror(errno));
+    remove(temporary_path);
+    return -1;
+  }
+
+  log_debug("Stored %u services and %u characteristics in %s",
+            services->length, characteristics->length, path);
+  return 0;
+}
+
+void gatt_cache_remove(const bd_addr *address) {
+  char path[64];
+
+  cache_path(address, path, sizeof(path));
+  if (remove(path) && errno != ENOENT) {
+    log_warn("Cannot remove %s: %s", path, strerror(errno));
+  }
+}
@@ -1,14 +1,922 @@
 #include "gecko_bglib.h"
 
+#include <fcntl.h>
+#include <stddef.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
 uint8_t last_message_byte = 0xFF;
 
-struct gecko_cmd_packet* gecko_wait_message(void)  // wait for event from system
+#define RX_MASK (BGLIB_RX_BUFFER_LEN - 1)
+#define READER_MASK (BGLIB_READER_QUEUE_LEN - 1)
+#define ASYNC_INDEX(I) ((I) % BGLIB_ASYNC_MAX_PENDING)
+
+#define QUEUE_MASK (BGLIB_QUEUE_BYTES - 1)
+// Header of the filler from the last record to the end of the ring, events
+// always have the event bit set so it can't be mistaken for one
+#define QUEUE_PAD 0
+// Records are header + payload, padded to keep headers aligned
+#define QUEUE_RECORD_LEN(LEN) ((BGLIB_MSG_HEADER_LEN + (LEN) + 3) & ~3u)
+
+// Header left in place of a coalesced record, keeps only its length
+#define QUEUE_SKIP(HDR) ((HDR) & 0x0000ff07)
+
+// Commands sent with GECKO_ASYNC. The NCP answers in order, so entries
+// [async_r, async_c) hold responses waiting for their callback and
+// [async_c, async_w) are still in flight.
+struct async_command {
+    uint32_t msg_id;
+    uint64_t sent_us;
+    gecko_command_callback callback;
+    void* context;
+    uint32_t events_before;  // events queued before the response arrived
+    struct gecko_cmd_packet response;
+};
+
+// Everything belonging to one NCP
+struct bglib_context {
+    struct gecko_cmd_packet cmd_msg;
+    struct gecko_cmd_packet rsp_msg;
+
+    void (*output)(uint32_t len1, uint8_t* data1);
+    int32_t (*input)(uint32_t len1, uint8_t* data1);
+    int32_t (*read)(uint32_t len1, uint8_t* data1);
+    int32_t (*peek)(void);
+
+    // set instead of the functions above by bglib_initialize_serial()
+    int32_t serial_handle;
+    int32_t (*serial_tx)(int32_t handle, uint32_t len1, uint8_t* data1);
+    int32_t (*serial_read)(int32_t handle, uint32_t len1, uint8_t* data1);
+    int32_t (*serial_peek)(int32_t handle);
+
+    // Byte packed event queue, holds byte offsets [queue_released, queue_w).
+    // The event last returned by gecko_get_event stays there until the next
+    // call.
+    uint32_t queue[BGLIB_QUEUE_BYTES / 4];
+    uint32_t queue_w;
+    uint32_t queue_r;
+    uint32_t queue_released;
+    // Events put into / taken out of the queue, orders async callbacks
+    uint32_t queue_in;
+    uint32_t queue_out;
+
+    // Receive ring used in buffered mode. Indexes are free running, the
+    // amount of buffered data is always rx_head - rx_tail.
+    uint8_t rx_buffer[BGLIB_RX_BUFFER_LEN];
+    uint32_t rx_head;
+    uint32_t rx_tail;
+    struct gecko_rx_stats rx_stats;
+    volatile int rx_abort;
+
+    // Single producer / single consumer handoff from the reader thread. The
+    // reader thread only writes reader_head, the application only
+    // reader_tail.
+    struct gecko_cmd_packet reader_queue[BGLIB_READER_QUEUE_LEN];
+    uint32_t reader_head;
+    uint32_t reader_tail;
+    int reader_pipe[2];
+    pthread_t reader_thread;
+    volatile int reader_running;
+    struct gecko_reader_stats reader_stats;
+
+    struct async_command async_fifo[BGLIB_ASYNC_MAX_PENDING];
+    uint32_t async_r;
+    uint32_t async_c;
+    uint32_t async_w;
+    int async_armed;
+    gecko_command_callback async_armed_callback;
+    void* async_armed_context;
+
+    // Filters are set by the application and applied by the reader thread
+    struct {
+        uint32_t drop_ids[BGLIB_FILTER_MAX_IDS];
+        int drop_id_count;
+        bd_addr addresses[BGLIB_FILTER_MAX_ADDRESSES];
+        int address_count;
+        char name_prefix[BGLIB_FILTER_NAME_LEN];
+        size_t name_prefix_len;
+    } filter;
+    pthread_mutex_t filter_lock;
+
+    // Queue offset of the newest scan response per address hash
+    int coalesce_scans;
+    uint32_t coalesce_index[BGLIB_COALESCE_SLOTS];
+
+    uint64_t sync_sent_us;
+    struct gecko_latency_histogram latency[BGLIB_LATENCY_IDS];
+};
+
+// Used until the application selects another one
+static struct bglib_context default_context = {
+    .filter_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+static struct bglib_context* current = &default_context;
+
+struct gecko_cmd_packet* gecko_cmd_msg = &default_context.cmd_msg;
+struct gecko_cmd_packet* gecko_rsp_msg = &default_context.rsp_msg;
+
+struct bglib_context* bglib_context_create(void) {
+    struct bglib_context* ctx = calloc(1, sizeof(*ctx));
+
+    if (!ctx) {
+        return NULL;
+    }
+    pthread_mutex_init(&ctx->filter_lock, NULL);
+    return ctx;
+}
+
+void bglib_context_destroy(struct bglib_context* ctx) {
+    if (!ctx || ctx == &default_context) {
+        return;
+    }
+    bglib_reader_stop(ctx);
+    if (current == ctx) {
+        bglib_select(&default_context);
+    }
+
+    pthread_mutex_destroy(&ctx->filter_lock);
+    free(ctx);
+}
+
+struct bglib_context* bglib_default_context(void) {
+    return &default_context;
+}
+
+void bglib_select(struct bglib_context* ctx) {
+    current = ctx;
+    gecko_cmd_msg = &ctx->cmd_msg;
+    gecko_rsp_msg = &ctx->rsp_msg;
+}
+
+struct bglib_context* bglib_selected(void) {
+    return current;
+}
+
+void bglib_initialize(struct bglib_context* ctx,
+                      void (*output)(uint32_t len1, uint8_t* data1),
+                      int32_t (*input)(uint32_t len1, uint8_t* data1),
+                      int32_t (*read)(uint32_t len1, uint8_t* data1),
+                      int32_t (*peek)(void)) {
+    ctx->output = output;
+    ctx->input = input;
+    ctx->read = read;
+    ctx->peek = peek;
+    ctx->serial_tx = NULL;
+    ctx->serial_read = NULL;
+    ctx->serial_peek = NULL;
+}
+
+void bglib_initialize_serial(struct bglib_context* ctx, int32_t handle,
+                             int32_t (*tx)(int32_t handle, uint32_t len1, uint8_t* data1),
+                             int32_t (*read)(int32_t handle, uint32_t len1, uint8_t* data1),
+                             int32_t (*peek)(int32_t handle)) {
+    bglib_initialize(ctx, NULL, NULL, NULL, NULL);
+    ctx->serial_handle = handle;
+    ctx->serial_tx = tx;
+    ctx->serial_read = read;
+    ctx->serial_peek = peek;
+}
+
+static void io_output(struct bglib_context* ctx, uint32_t len, uint8_t* data) {
+    if (ctx->serial_tx) {
+        ctx->serial_tx(ctx->serial_handle, len, data);
+    } else {
+        ctx->output(len, data);
+    }
+}
+
+static int32_t io_read(struct bglib_context* ctx, uint32_t len, uint8_t* data) {
+    if (ctx->serial_read) {
+        return ctx->serial_read(ctx->serial_handle, len, data);
+    }
+    return ctx->read(len, data);
+}
+
+// Buffered mode, the device is drained through the receive ring
+static int io_buffered(struct bglib_context* ctx) {
+    return ctx->read || ctx->serial_read;
+}
+
+// Bytes waiting in the device, 1 if it can't tell
+static int32_t io_peek(struct bglib_context* ctx) {
+    if (ctx->serial_peek) {
+        return ctx->serial_peek(ctx->serial_handle);
+    }
+    return ctx->peek ? ctx->peek() : 1;
+}
+
+static uint32_t rx_level(struct bglib_context* ctx) {
+    return ctx->rx_head - ctx->rx_tail;
+}
+
+// Pull whatever the device has into the free space of the ring
+static int32_t rx_fill(struct bglib_context* ctx) {
+    uint32_t space = BGLIB_RX_BUFFER_LEN - rx_level(ctx);
+    uint32_t offset = ctx->rx_head & RX_MASK;
+    uint32_t len = BGLIB_RX_BUFFER_LEN - offset;
+    int32_t ret;
+
+    if (len > space) {
+        len = space;
+    }
+    if (len == 0) {
+        return 0;
+    }
+
+    ctx->rx_stats.input_calls++;
+    ret = io_read(ctx, len, &ctx->rx_buffer[offset]);
+    if (ret > 0) {
+        ctx->rx_head += ret;
+        ctx->rx_stats.bytes += ret;
+    }
+    return ret;
+}
+
+static void rx_copy(struct bglib_context* ctx, uint32_t len, uint8_t* data) {
+    uint32_t offset = ctx->rx_tail & RX_MASK;
+    uint32_t first = BGLIB_RX_BUFFER_LEN - offset;
+
+    if (first > len) {
+        first = len;
+    }
+    memcpy(data, &ctx->rx_buffer[offset], first);
+    memcpy(data + first, ctx->rx_buffer, len - first);
+}
+
+// Complete message (or garbage to skip) waiting in the ring
+static int rx_frame_ready(struct bglib_context* ctx) {
+    uint32_t header;
+    uint32_t level = rx_level(ctx);
+
+    if (level == 0) {
+        return 0;
+    }
+    if ((ctx->rx_buffer[ctx->rx_tail & RX_MASK] & 0x78) != gecko_dev_type_gecko) {
+        return 1;
+    }
+    if (level < BGLIB_MSG_HEADER_LEN) {
+        return 0;
+    }
+    rx_copy(ctx, BGLIB_MSG_HEADER_LEN, (uint8_t*)&header);
+    return BGLIB_MSG_LEN(header) > BGLIB_MSG_MAX_PAYLOAD ||
+           level >= BGLIB_MSG_HEADER_LEN + BGLIB_MSG_LEN(header);
+}
+
+// Blocking read of exactly len bytes, from the ring in buffered mode
+static int32_t rx_input(struct bglib_context* ctx, uint32_t len, uint8_t* data) {
+    if (!io_buffered(ctx)) {
+        ctx->rx_stats.input_calls++;
+        ctx->rx_stats.bytes += len;
+        return ctx->input(len, data);
+    }
+
+    while (rx_level(ctx) < len) {
+        int32_t ret = rx_fill(ctx);
+        if (ret < 0 || (ret == 0 && ctx->rx_abort)) {
+            return -1;
+        }
+    }
+    rx_copy(ctx, len, data);
+    ctx->rx_tail += len;
+    return len;
+}
+
+void bglib_get_rx_stats(struct bglib_context* ctx, struct gecko_rx_stats *stats) {
+    *stats = ctx->rx_stats;
+}
+
+void gecko_get_rx_stats(struct gecko_rx_stats *stats) {
+    bglib_get_rx_stats(current, stats);
+}
+
+static uint64_t now_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+}
+
+static void record_latency(struct bglib_context* ctx, uint32_t msg_id,
+                           uint64_t sent_us) {
+    struct gecko_latency_histogram* latency = ctx->latency;
+    uint32_t elapsed = (uint32_t)(now_us() - sent_us);
+    uint32_t bucket = 0;
+    int i;
+
+    for (i = 0; i < BGLIB_LATENCY_IDS; i++) {
+        if (latency[i].count == 0 || latency[i].msg_id == msg_id) {
+            break;
+        }
+    }
+    if (i == BGLIB_LATENCY_IDS) {
+        return;  // table full, command not tracked
+    }
+
+    while ((elapsed >> (bucket + 1)) && bucket < BGLIB_LATENCY_BUCKETS - 1) {
+        bucket++;
+    }
+    latency[i].msg_id = msg_id;
+    latency[i].count++;
+    latency[i].buckets[bucket]++;
+    if (elapsed > latency[i].max_us) {
+        latency[i].max_us = elapsed;
+    }
+}
+
+int bglib_get_latency_histograms(struct bglib_context* ctx,
+                                 struct gecko_latency_histogram* histograms,
+                                 int max) {
+    struct gecko_latency_histogram* latency = ctx->latency;
+    int i;
+
+    for (i = 0; i < BGLIB_LATENCY_IDS && i < max && latency[i].count; i++) {
+        histograms[i] = latency[i];
+    }
+    return i;
+}
+
+int gecko_get_latency_histograms(struct gecko_latency_histogram* histograms,
+                                 int max) {
+    return bglib_get_latency_histograms(current, histograms, max);
+}
+
+// Where an incoming response goes: the oldest async command if any is in
+// flight, otherwise rsp_msg for the synchronous caller
+static struct gecko_cmd_packet* response_slot(struct bglib_context* ctx,
+                                              uint32_t header) {
+    struct async_command* cmd;
+
+    if (ctx->async_c == ctx->async_w) {
+        record_latency(ctx, BGLIB_MSG_ID(header), ctx->sync_sent_us);
+        return &ctx->rsp_msg;
+    }
+
+    cmd = &ctx->async_fifo[ASYNC_INDEX(ctx->async_c)];
+    record_latency(ctx, cmd->msg_id, cmd->sent_us);
+    cmd->events_before = ctx->queue_in;
+    ctx->async_c++;
+    return &cmd->response;
+}
+
+static void async_dispatch(struct bglib_context* ctx) {
+    struct async_command cmd = ctx->async_fifo[ASYNC_INDEX(ctx->async_r)];
+
+    // free the slot first, the callback may send further commands
+    ctx->async_r++;
+    cmd.callback(&cmd.response, cmd.context);
+}
+
+// Oldest completed async command is due, events before it have been taken
+static int async_due(struct bglib_context* ctx) {
+    return ctx->async_r != ctx->async_c &&
+           (int32_t)(ctx->async_fifo[ASYNC_INDEX(ctx->async_r)].events_before -
+                     ctx->queue_out) <= 0;
+}
+
+void gecko_async_begin(gecko_command_callback callback, void* context) {
+    current->async_armed = 1;
+    current->async_armed_callback = callback;
+    current->async_armed_context = context;
+}
+
+void gecko_async_end(void) {
+    current->async_armed = 0;
+}
+
+int bglib_async_pending(struct bglib_context* ctx) {
+    return ctx->async_w - ctx->async_r;
+}
+
+int gecko_async_pending(void) {
+    return bglib_async_pending(current);
+}
+
+static struct gecko_cmd_packet* queue_at(struct bglib_context* ctx,
+                                         uint32_t offset) {
+    return (struct gecko_cmd_packet*)((uint8_t*)ctx->queue + (offset & QUEUE_MASK));
+}
+
+// Contiguous room for an event with msg_length bytes of payload, NULL if full
+static struct gecko_cmd_packet* queue_reserve(struct bglib_context* ctx,
+                                              uint32_t msg_length) {
+    uint32_t need = QUEUE_RECORD_LEN(msg_length);
+    uint32_t room = BGLIB_QUEUE_BYTES - (ctx->queue_w - ctx->queue_released);
+    uint32_t to_end = BGLIB_QUEUE_BYTES - (ctx->queue_w & QUEUE_MASK);
+
+    if (to_end < need) {
+        // wrap, the tail of the ring becomes filler
+        if (room < to_end + need) {
+            return NULL;
+        }
+        queue_at(ctx, ctx->queue_w)->header = QUEUE_PAD;
+        ctx->queue_w += to_end;
+    } else if (room < need) {
+        return NULL;
+    }
+
+    return queue_at(ctx, ctx->queue_w);
+}
+
+static uint32_t address_hash(const bd_addr* address) {
+    uint32_t hash = 0;
+    int i;
+
+    for (i = 0; i < 6; i++) {
+        hash = hash * 31 + address->addr[i];
+    }
+    return hash % BGLIB_COALESCE_SLOTS;
+}
+
+// Fold the scan response in pck into a queued one from the same address,
+// returns nonzero if pck needs no record of its own
+static int queue_coalesce(struct bglib_context* ctx, struct gecko_cmd_packet* pck) {
+    const bd_addr* address = &pck->data.evt_le_gap_scan_response.address;
+    uint32_t* slot = &ctx->coalesce_index[address_hash(address)];
+    struct gecko_cmd_packet* queued = queue_at(ctx, *slot);
+    uint32_t offset = ctx->queue_w;
+
+    // not yet taken by the application and still the same device
+    if (*slot - ctx->queue_r < ctx->queue_w - ctx->queue_r &&
+        BGLIB_MSG_ID(queued->header) == gecko_evt_le_gap_scan_response_id &&
+        !memcmp(&queued->data.evt_le_gap_scan_response.address, address,
+                sizeof(bd_addr))) {
+        ctx->rx_stats.coalesced++;
+        if (queued->header == pck->header) {
+            memcpy(queued, pck, BGLIB_MSG_HEADER_LEN + BGLIB_MSG_LEN(pck->header));
+            return 1;
+        }
+        queued->header = QUEUE_SKIP(queued->header);
+    }
+
+    *slot = offset;
+    return 0;
+}
+
+// Publish the event written into the last reservation
+static void queue_commit(struct bglib_context* ctx, struct gecko_cmd_packet* pck) {
+    if (ctx->coalesce_scans &&
+        BGLIB_MSG_ID(pck->header) == gecko_evt_le_gap_scan_response_id &&
+        queue_coalesce(ctx, pck)) {
+        return;
+    }
+    ctx->queue_w += QUEUE_RECORD_LEN(BGLIB_MSG_LEN(pck->header));
+    ctx->queue_in++;
+}
+
+static int queue_empty(struct bglib_context* ctx) {
+    while (ctx->queue_r != ctx->queue_w) {
+        uint32_t header = queue_at(ctx, ctx->queue_r)->header;
+
+        if (header == QUEUE_PAD) {
+            ctx->queue_r += BGLIB_QUEUE_BYTES - (ctx->queue_r & QUEUE_MASK);
+        } else if ((header & 0x78) != gecko_dev_type_gecko) {
+            // coalesced away, counts as taken for async ordering
+            ctx->queue_r += QUEUE_RECORD_LEN(BGLIB_MSG_LEN(header));
+            ctx->queue_out++;
+        } else {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Local name in the advertising data starts with the filter prefix
+static int name_matches(struct bglib_context* ctx,
+                        const struct gecko_msg_le_gap_scan_response_evt_t* scan,
+                        uint32_t msg_length) {
+    uint32_t available = msg_length -
+        offsetof(struct gecko_msg_le_gap_scan_response_evt_t, data.data);
+    uint32_t length = scan->data.len;
+    uint32_t offset = 0;
+
+    if (msg_length < offsetof(struct gecko_msg_le_gap_scan_response_evt_t, data.data)) {
+        return 0;
+    }
+    if (length > available) {
+        length = available;
+    }
+
+    while (offset + 2 <= length) {
+        uint32_t field_length = scan->data.data[offset];
+        uint8_t type = scan->data.data[offset + 1];
+
+        if (field_length == 0 || offset + 1 + field_length > length) {
+            return 0;
+        }
+        // 0x08 shortened, 0x09 complete local name
+        if ((type == 0x08 || type == 0x09) &&
+            field_length - 1 >= ctx->filter.name_prefix_len &&
+            !memcmp(&scan->data.data[offset + 2], ctx->filter.name_prefix,
+                    ctx->filter.name_prefix_len)) {
+            return 1;
+        }
+        offset += field_length + 1;
+    }
+    return 0;
+}
+
+static int scan_allowed(struct bglib_context* ctx,
+                        const struct gecko_cmd_packet* pck) {
+    const struct gecko_msg_le_gap_scan_response_evt_t* scan =
+        &pck->data.evt_le_gap_scan_response;
+    int i;
+
+    if (!ctx->filter.address_count && !ctx->filter.name_prefix_len) {
+        return 1;
+    }
+    for (i = 0; i < ctx->filter.address_count; i++) {
+        if (!memcmp(&ctx->filter.addresses[i], &scan->address, sizeof(bd_addr))) {
+            return 1;
+        }
+    }
+    return ctx->filter.name_prefix_len &&
+           name_matches(ctx, scan, BGLIB_MSG_LEN(pck->header));
+}
+
+// Event the application asked not to see, counted as filtered
+static int filter_reject(struct bglib_context* ctx,
+                         const struct gecko_cmd_packet* pck) {
+    uint32_t msg_id = BGLIB_MSG_ID(pck->header);
+    int reject = 0;
+    int i;
+
+    if (!(pck->header & gecko_msg_type_evt)) {
+        return 0;  // responses always go through
+    }
+
+    pthread_mutex_lock(&ctx->filter_lock);
+    for (i = 0; i < ctx->filter.drop_id_count; i++) {
+        if (ctx->filter.drop_ids[i] == msg_id) {
+            reject = 1;
+        }
+    }
+    if (!reject && msg_id == gecko_evt_le_gap_scan_response_id) {
+        reject = !scan_allowed(ctx, pck);
+    }
+    pthread_mutex_unlock(&ctx->filter_lock);
+
+    if (reject) {
+        ctx->rx_stats.filtered++;
+    }
+    return reject;
+}
+
+int bglib_filter_drop_event(struct bglib_context* ctx, uint32_t msg_id) {
+    int ret = -1;
+
+    pthread_mutex_lock(&ctx->filter_lock);
+    if (ctx->filter.drop_id_count < BGLIB_FILTER_MAX_IDS) {
+        ctx->filter.drop_ids[ctx->filter.drop_id_count++] = msg_id;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&ctx->filter_lock);
+    return ret;
+}
+
+int bglib_filter_allow_address(struct bglib_context* ctx, const bd_addr* address) {
+    int ret = -1;
+
+    pthread_mutex_lock(&ctx->filter_lock);
+    if (ctx->filter.address_count < BGLIB_FILTER_MAX_ADDRESSES) {
+        ctx->filter.addresses[ctx->filter.address_count++] = *address;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&ctx->filter_lock);
+    return ret;
+}
+
+int bglib_filter_name_prefix(struct bglib_context* ctx, const char* prefix) {
+    size_t length = prefix ? strlen(prefix) : 0;
+
+    if (length >= BGLIB_FILTER_NAME_LEN) {
+        return -1;
+    }
+    pthread_mutex_lock(&ctx->filter_lock);
+    if (length) {
+        memcpy(ctx->filter.name_prefix, prefix, length);
+    }
+    ctx->filter.name_prefix_len = length;
+    pthread_mutex_unlock(&ctx->filter_lock);
+    return 0;
+}
+
+void bglib_filter_coalesce_scans(struct bglib_context* ctx, int enable) {
+    ctx->coalesce_scans = enable;
+}
+
+void bglib_filter_clear(struct bglib_context* ctx) {
+    pthread_mutex_lock(&ctx->filter_lock);
+    memset(&ctx->filter, 0, sizeof(ctx->filter));
+    pthread_mutex_unlock(&ctx->filter_lock);
+    ctx->coalesce_scans = 0;
+}
+
+int gecko_filter_drop_event(uint32_t msg_id) {
+    return bglib_filter_drop_event(current, msg_id);
+}
+
+int gecko_filter_allow_address(const bd_addr* address) {
+    return bglib_filter_allow_address(current, address);
+}
+
+int gecko_filter_name_prefix(const char* prefix) {
+    return bglib_filter_name_prefix(current, prefix);
+}
+
+void gecko_filter_coalesce_scans(int enable) {
+    bglib_filter_coalesce_scans(current, enable);
+}
+
+void gecko_filter_clear(void) {
+    bglib_filter_clear(current);
+}
+
+static uint32_t reader_level(struct bglib_context* ctx) {
+    return __atomic_load_n(&ctx->reader_head, __ATOMIC_SEQ_CST) -
+           __atomic_load_n(&ctx->reader_tail, __ATOMIC_SEQ_CST);
+}
+
+// Read one complete message into pck, 0 on success
+static int read_frame(struct bglib_context* ctx, struct gecko_cmd_packet* pck) {
+    uint32_t header = 0;
+    uint32_t msg_length;
+
+    // sync to header byte
+    if (rx_input(ctx, 1, (uint8_t*)&header) < 0 ||
+        (header & 0x78) != gecko_dev_type_gecko) {
+        return -1;
+    }
+    if (rx_input(ctx, BGLIB_MSG_HEADER_LEN - 1, &((uint8_t*)&header)[1]) < 0) {
+        return -1;
+    }
+    msg_length = BGLIB_MSG_LEN(header);
+    if (msg_length > BGLIB_MSG_MAX_PAYLOAD) {
+        return -1;
+    }
+
+    pck->header = header;
+    if (msg_length && rx_input(ctx, msg_length, (uint8_t*)&pck->data.payload) < 0) {
+        return -1;
+    }
+
+    ctx->rx_stats.frames++;
+    return 0;
+}
+
+// Wait until the application takes a message, nonzero if the thread stops
+static int reader_wait_room(struct bglib_context* ctx, uint32_t head) {
+    while (head - __atomic_load_n(&ctx->reader_tail, __ATOMIC_ACQUIRE) ==
+           BGLIB_READER_QUEUE_LEN) {
+        if (!ctx->reader_running) {
+            return -1;
+        }
+        usleep(1000);
+    }
+    return 0;
+}
+
+static void* reader_main(void* arg) {
+    struct bglib_context* ctx = arg;
+    struct gecko_cmd_packet scratch;
+
+    while (ctx->reader_running) {
+        uint32_t head = ctx->reader_head;
+        uint32_t tail = __atomic_load_n(&ctx->reader_tail, __ATOMIC_ACQUIRE);
+        struct gecko_cmd_packet* pck = &scratch;
+        uint32_t level;
+
+        if (head - tail == BGLIB_READER_QUEUE_LEN) {
+            // on a single core the application may just need the cpu
+            sched_yield();
+            tail = __atomic_load_n(&ctx->reader_tail, __ATOMIC_ACQUIRE);
+        }
+        if (head - tail < BGLIB_READER_QUEUE_LEN) {
+            pck = &ctx->reader_queue[head & READER_MASK];
+        }
+        if (read_frame(ctx, pck) || filter_reject(ctx, pck)) {
+            continue;
+        }
+        if (pck == &scratch && (pck->header & gecko_msg_type_evt)) {
+            // application is not keeping up, drop the event
+            ctx->reader_stats.dropped++;
+            continue;
+        }
+        if (pck == &scratch) {
+            // a command is waiting for this response, never drop it
+            if (reader_wait_room(ctx, head)) {
+                break;
+            }
+            pck = &ctx->reader_queue[head & READER_MASK];
+            memcpy(pck, &scratch, BGLIB_MSG_HEADER_LEN + BGLIB_MSG_LEN(scratch.header));
+        }
+
+        __atomic_store_n(&ctx->reader_head, head + 1, __ATOMIC_SEQ_CST);
+        level = head + 1 - __atomic_load_n(&ctx->reader_tail, __ATOMIC_SEQ_CST);
+        ctx->reader_stats.frames++;
+        if (level > ctx->reader_stats.high_water) {
+            ctx->reader_stats.high_water = level;
+        }
+        // the application drained everything, it may be asleep
+        if (level == 1 && write(ctx->reader_pipe[1], "", 1) < 0) {
+            ctx->reader_stats.wakeup_errors++;
+        }
+    }
+
+    return NULL;
+}
+
+// Oldest frame from the reader thread, NULL if none and not blocking
+static struct gecko_cmd_packet* reader_peek(struct bglib_context* ctx, int block) {
+    uint8_t wakeups[64];
+    struct pollfd pfd;
+
+    while (1) {
+        if (reader_level(ctx)) {
+            return &ctx->reader_queue[ctx->reader_tail & READER_MASK];
+        }
+        // consume wakeups, then look again before sleeping
+        while (read(ctx->reader_pipe[0], wakeups, sizeof(wakeups)) > 0) {
+        }
+        if (reader_level(ctx)) {
+            return &ctx->reader_queue[ctx->reader_tail & READER_MASK];
+        }
+        if (!block) {
+            return NULL;
+        }
+        pfd.fd = ctx->reader_pipe[0];
+        pfd.events = POLLIN;
+        poll(&pfd, 1, -1);
+    }
+}
+
+static void reader_release(struct bglib_context* ctx) {
+    __atomic_store_n(&ctx->reader_tail, ctx->reader_tail + 1, __ATOMIC_SEQ_CST);
+}
+
+static struct gecko_cmd_packet* reader_wait_message(struct bglib_context* ctx) {
+    struct gecko_cmd_packet *src = reader_peek(ctx, 1), *pck, *retVal = NULL;
+    uint32_t header = src->header;
+
+    if ((header & 0xf8) == (gecko_dev_type_gecko | gecko_msg_type_evt)) {
+        pck = queue_reserve(ctx, BGLIB_MSG_LEN(header));
+        if (!pck) {
+            ctx->rx_stats.dropped++;
+            reader_release(ctx);
+            return 0;  // NO ROOM IN QUEUE
+        }
+        memcpy(pck, src, BGLIB_MSG_HEADER_LEN + BGLIB_MSG_LEN(header));
+        queue_commit(ctx, pck);
+    } else {
+        pck = response_slot(ctx, header);
+        if (pck == &ctx->rsp_msg) {
+            retVal = pck;
+        }
+        memcpy(pck, src, BGLIB_MSG_HEADER_LEN + BGLIB_MSG_LEN(header));
+    }
+    reader_release(ctx);
+
+    return retVal;
+}
+
+int bglib_reader_start(struct bglib_context* ctx) {
+    if (ctx->reader_running) {
+        return 0;
+    }
+    if (!io_buffered(ctx)) {
+        return -1;  // reader thread needs buffered mode
+    }
+    if (pipe(ctx->reader_pipe)) {
+        return -1;
+    }
+    fcntl(ctx->reader_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(ctx->reader_pipe[1], F_SETFL, O_NONBLOCK);
+
+    ctx->reader_running = 1;
+    if (pthread_create(&ctx->reader_thread, NULL, reader_main, ctx)) {
+        ctx->reader_running = 0;
+        close(ctx->reader_pipe[0]);
+        close(ctx->reader_pipe[1]);
+        return -1;
+    }
+
+    return 0;
+}
+
+void bglib_reader_stop(struct bglib_context* ctx) {
+    if (!ctx->reader_running) {
+        return;
+    }
+
+    ctx->reader_running = 0;
+    ctx->rx_abort = 1;
+    pthread_join(ctx->reader_thread, NULL);
+    ctx->rx_abort = 0;
+
+    close(ctx->reader_pipe[0]);
+    close(ctx->reader_pipe[1]);
+    ctx->reader_head = ctx->reader_tail = 0;
+    ctx->rx_tail = ctx->rx_head;
+}
+
+int bglib_reader_fd(struct bglib_context* ctx) {
+    return ctx->reader_running ? ctx->reader_pipe[0] : -1;
+}
+
+void bglib_get_reader_stats(struct bglib_context* ctx,
+                            struct gecko_reader_stats *stats) {
+    *stats = ctx->reader_stats;
+    stats->level = reader_level(ctx);
+}
+
+int gecko_reader_start(void) {
+    return bglib_reader_start(current);
+}
+
+void gecko_reader_stop(void) {
+    bglib_reader_stop(current);
+}
+
+int gecko_reader_fd(void) {
+    return bglib_reader_fd(current);
+}
+
+void gecko_get_reader_stats(struct gecko_reader_stats *stats) {
+    bglib_get_reader_stats(current, stats);
+}
+
+static void handle_command(struct bglib_context* ctx, uint32_t hdr);
+
+static void hello_completed(struct gecko_cmd_packet* response, void* context) {
+}
+
+int bglib_hello(struct bglib_context* ctx, int timeout_ms) {
+    uint64_t deadline = now_us() + (uint64_t)timeout_ms * 1000;
+    uint32_t hello;
+    struct pollfd pfd;
+
+    if (!ctx->reader_running) {
+        return -1;
+    }
+
+    // sent on ctx itself, the selected context may be another one
+    ctx->async_armed = 1;
+    ctx->async_armed_callback = hello_completed;
+    ctx->async_armed_context = NULL;
+    ctx->cmd_msg.header = gecko_cmd_system_hello_id;
+    handle_command(ctx, ctx->cmd_msg.header);
+    hello = ctx->async_w - 1;
+
+    while ((int32_t)(ctx->async_c - hello) <= 0) {
+        int64_t left = (int64_t)(deadline - now_us());
+
+        if (reader_peek(ctx, 0)) {
+            reader_wait_message(ctx);
+            continue;
+        }
+        if (left <= 0) {
+            // nothing came back, the response will never be matched
+            ctx->async_w = hello;
+            return -1;
+        }
+        pfd.fd = ctx->reader_pipe[0];
+        pfd.events = POLLIN;
+        poll(&pfd, 1, (int)((left + 999) / 1000));
+    }
+
+    // line noise at a wrong baud rate can look like a response
+    if (BGLIB_MSG_ID(ctx->async_fifo[ASYNC_INDEX(hello)].response.header) !=
+        ctx->async_fifo[ASYNC_INDEX(hello)].msg_id) {
+        return -1;
+    }
+    return 0;
+}
+
+int gecko_hello(int timeout_ms) {
+    return bglib_hello(current, timeout_ms);
+}
+
+// Input waiting that can be read without blocking for long
+static int input_ready(struct bglib_context* ctx) {
+    if (ctx->reader_running) {
+        return reader_peek(ctx, 0) != NULL;
+    }
+    return rx_frame_ready(ctx) || io_peek(ctx) != 0;
+}
+
+static struct gecko_cmd_packet* wait_message(struct bglib_context* ctx)
 {
     uint32_t msg_length;
     uint32_t header;
     uint8_t* payload;
     struct gecko_cmd_packet *pck, *retVal = NULL;
     int ret;
+
+    if (ctx->reader_running) {
+        return reader_wait_message(ctx);
+    }
 #if 0
     if (0 && last_message_byte == 0xA0) {
         *((uint8_t*)&header) = 0xA0;
@@ -17,14 +925,14 @@ struct gecko_cmd_packet* gecko_wait_message(void)  // wait for event from system
 #endif
     {
         // sync to header byte
-        ret = bglib_input(1, (uint8_t*)&header);
+        ret = rx_input(ctx, 1, (uint8_t*)&header);
         if (ret < 0 || (header & 0x78) != gecko_dev_type_gecko) {
             last_message_byte = 0xFF;
             return 0;
         }
     }
 
-    ret = bglib_input(BGLIB_MSG_HEADER_LEN - 1, &((uint8_t*)&header)[1]);
+    ret = rx_input(ctx, BGLIB_MSG_HEADER_LEN - 1, &((uint8_t*)&header)[1]);
     if (ret < 0) {
         last_message_byte = 0xFF;
         return 0;
@@ -38,20 +946,23 @@ struct gecko_cmd_packet* gecko_wait_message(void)  // wait for event from system
     }
 
     if ((header & 0xf8) == (gecko_dev_type_gecko | gecko_msg_type_evt)) {
-        // received event
-        if ((gecko_queue_w + 1) % BGLIB_QUEUE_LEN == gecko_queue_r) {
+        // received event, read straight into the queue
+        pck = queue_reserve(ctx, msg_length);
+        if (!pck) {
             // drop packet
             if (msg_length) {
                 uint8 tmp_payload[BGLIB_MSG_MAX_PAYLOAD];
-                bglib_input(msg_length, tmp_payload);
+                rx_input(ctx, msg_length, tmp_payload);
             }
+            ctx->rx_stats.dropped++;
             last_message_byte = 0xFF;
             return 0;  // NO ROOM IN QUEUE
         }
-        pck = &gecko_queue[gecko_queue_w];
-        gecko_queue_w = (gecko_queue_w + 1) % BGLIB_QUEUE_LEN;
     } else if ((header & 0xf8) == gecko_dev_type_gecko) {  // response
-        retVal = pck = gecko_rsp_msg;
+        pck = response_slot(ctx, header);
+        if (pck == &ctx->rsp_msg) {
+            retVal = pck;
+        }
     } else {
         // fail
         last_message_byte = 0xFF;
@@ -63,53 +974,103 @@ struct gecko_cmd_packet* gecko_wait_message(void)  // wait for event from system
      * Read the payload data if required and store it after the header.
      */
     if (msg_length) {
-        ret = bglib_input(msg_length, payload);
+        ret = rx_input(ctx, msg_length, payload);
         if (ret < 0) {
             last_message_byte = 0xFF;
             return 0;
         }
     }
 
+    ctx->rx_stats.frames++;
+    if ((header & gecko_msg_type_evt) && !filter_reject(ctx, pck)) {
+        queue_commit(ctx, pck);
+    }
+
     // last_message_byte = payload[msg_length - 1];
 
     // Using retVal avoid double handling of event msg types in outer function
     return retVal;
 }
 
-int gecko_event_pending(void) {
-    if (gecko_queue_w != gecko_queue_r) {  // event is waiting in queue
+struct gecko_cmd_packet* gecko_wait_message(void)  // wait for event from system
+{
+    return wait_message(current);
+}
+
+int bglib_event_buffered(struct bglib_context* ctx) {
+    if (!queue_empty(ctx) || ctx->async_r != ctx->async_c) {
+        return 1;
+    }
+    return ctx->reader_running ? reader_level(ctx) != 0 : rx_frame_ready(ctx);
+}
+
+int gecko_event_buffered(void) {
+    return bglib_event_buffered(current);
+}
+
+int bglib_event_pending(struct bglib_context* ctx) {
+    if (!queue_empty(ctx)) {  // event is waiting in queue
+        return 1;
+    }
+
+    if (ctx->async_r != ctx->async_c) {  // async response waiting for its callback
         return 1;
     }
 
+    // complete message already buffered
+    if (bglib_event_buffered(ctx)) {
+        return 1;
+    }
+    if (ctx->reader_running) {
+        return 0;
+    }
+
     // something in uart waiting to be read
-    if (bglib_peek && bglib_peek()) {
+    if ((ctx->peek || ctx->serial_peek) && io_peek(ctx)) {
         return 1;
     }
 
     return 0;
 }
 
-struct gecko_cmd_packet* gecko_get_event(int block) {
+int gecko_event_pending(void) {
+    return bglib_event_pending(current);
+}
+
+struct gecko_cmd_packet* bglib_get_event(struct bglib_context* ctx, int block) {
     struct gecko_cmd_packet* p;
 
+    // the caller is done with the event returned last time
+    ctx->queue_released = ctx->queue_r;
+
     while (1) {
-        if (gecko_queue_w != gecko_queue_r) {
-            p = &gecko_queue[gecko_queue_r];
-            gecko_queue_r = (gecko_queue_r + 1) % BGLIB_QUEUE_LEN;
+        // async callbacks run in arrival order relative to events
+        if (async_due(ctx)) {
+            async_dispatch(ctx);
+            continue;
+        }
+        if (!queue_empty(ctx)) {
+            p = queue_at(ctx, ctx->queue_r);
+            ctx->queue_r += QUEUE_RECORD_LEN(BGLIB_MSG_LEN(p->header));
+            ctx->queue_out++;
             return p;
         }
-        // if not blocking and nothing in uart -> out
-        if (!block && bglib_peek && bglib_peek() == 0) {
+        // if not blocking and nothing buffered or in uart -> out
+        if (!block && !input_ready(ctx)) {
             return NULL;
         }
 
         // read more messages from device
-        if ((p = gecko_wait_message())) {
+        if ((p = wait_message(ctx))) {
             return p;
         }
     }
 }
 
+struct gecko_cmd_packet* gecko_get_event(int block) {
+    return bglib_get_event(current, block);
+}
+
 struct gecko_cmd_packet* gecko_wait_event(void) {
     return gecko_get_event(1);
 }
@@ -118,25 +1079,61 @@ struct gecko_cmd_packet* gecko_peek_event(void) {
     return gecko_get_event(0);
 }
 
-struct gecko_cmd_packet* gecko_wait_response(void) {
+static struct gecko_cmd_packet* wait_response(struct bglib_context* ctx) {
     struct gecko_cmd_packet* p;
     while (1) {
-        p = gecko_wait_message();
+        p = wait_message(ctx);
         if (p && !(p->header & gecko_msg_type_evt)) {
             return p;
         }
     }
 }
 
+struct gecko_cmd_packet* gecko_wait_response(void) {
+    return wait_response(current);
+}
+
+static void handle_command(struct bglib_context* ctx, uint32_t hdr) {
+    struct async_command* cmd;
+
+    if (!ctx->async_armed) {
+        // packet in cmd_msg is waiting for output
+        ctx->sync_sent_us = now_us();
+        io_output(ctx, BGLIB_MSG_HEADER_LEN + BGLIB_MSG_LEN(ctx->cmd_msg.header),
+                  (uint8_t*)&ctx->cmd_msg);
+        wait_response(ctx);
+        return;
+    }
+
+    ctx->async_armed = 0;
+    // pipeline full, complete the oldest command first
+    while (ctx->async_w - ctx->async_r == BGLIB_ASYNC_MAX_PENDING) {
+        if (ctx->async_r != ctx->async_c) {
+            async_dispatch(ctx);
+        } else {
+            wait_message(ctx);
+        }
+    }
+
+    cmd = &ctx->async_fifo[ASYNC_INDEX(ctx->async_w)];
+    cmd->msg_id = BGLIB_MSG_ID(hdr);
+    cmd->callback = ctx->async_armed_callback;
+    cmd->context = ctx->async_armed_context;
+    cmd->sent_us = now_us();
+    ctx->async_w++;
+
+    io_output(ctx, BGLIB_MSG_HEADER_LEN + BGLIB_MSG_LEN(ctx->cmd_msg.header),
+              (uint8_t*)&ctx->cmd_msg);
+}
+
 void gecko_handle_command(uint32_t hdr, void* data) {
-    // packet in gecko_cmd_msg is waiting for output
-    bglib_output(BGLIB_MSG_HEADER_LEN + BGLIB_MSG_LEN(gecko_cmd_msg->header),
-                 (uint8_t*)gecko_cmd_msg);
-    gecko_wait_response();
+    handle_command(current, hdr);
 }
 
 void gecko_handle_command_noresponse(uint32_t hdr, void* data) {
-    // packet in gecko_cmd_msg is waiting for output
-    bglib_output(BGLIB_MSG_HEADER_LEN + BGLIB_MSG_LEN(gecko_cmd_msg->header),
-                 (uint8_t*)gecko_cmd_msg);
+    struct bglib_context* ctx = current;
+
+    // packet in cmd_msg is waiting for output
+    io_output(ctx, BGLIB_MSG_HEADER_LEN + BGLIB_MSG_LEN(ctx->cmd_msg.header),
+              (uint8_t*)&ctx->cmd_msg);
 }
@@ -15,12 +15,18 @@
  *******************************************************************************/
 
 #include "main.h"
+#include "advert_ingest.h"
+#include "aggregate.h"
 #include "app.h"
 #include "azure_functions.h"
 #include "bg_types.h"
+#include "bgapi_trace.h"
+#include "event_loop.h"
 #include "gecko_bglib.h"
 #include "led_worker.h"
 #include "log.h"
+#include "sensor_history.h"
+#include "sensor_registry.h"
 #include "uart.h"
 
 #include <curl/curl.h>
@@ -30,32 +36,70 @@
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 // TODO Before Release - Set advertisement timeout time much higher
 // orientation 0-180
 // sound
 // air pressure
-extern SensorValues _sensor_values;
 pthread_t _led_worker_thread;
+static pthread_t _upload_thread;
+// The event loop, the upload thread and the LED worker all log
+static pthread_mutex_t _log_mutex = PTHREAD_MUTEX_INITIALIZER;
 static FILE *_log_file = NULL;
+static bool _replaying = false;
+static uint32_t _events_handled = 0;
+static uint64_t _replay_start_us = 0;
+static uint64_t _stats_us = 0;
+static bool _aggregating = false;
+static bool _upload_samples = false;
+
+// Tried after the requested baud rate, fastest first
+static const uint32_t _fallback_baudrates[] = {
+    3000000, 2000000, 1000000, 921600, 460800, 230400, 115200, 0};
+#define HELLO_TIMEOUT_MS 500
+#define STATS_INTERVAL_US 10000000
+#define UPLOAD_INTERVAL_MS 2000
+// Holds every sample of every sensor a board history can keep
+#define UPLOAD_BUFFER_SIZE (128 * 1024)
 
 static int get_parameters(int argc, char **argv, G300Args *args);
-static void upload_sensor_values();
+static int parse_seconds(const char *text, uint32_t *ms);
+static int parse_boards(const char *text, uint32_t *count);
+static int open_ncp_link(G300Args *args);
+static void upload_sensor_values(const char *name, const SensorValues *values,
+                                 uint32_t sensors, const AdvertReading *beacon);
+static void upload_beacon(const AdvertReading *beacon);
+static void history_values(const SensorHistory *history,
+                           double (*values)[SENSOR_HISTORY_LENGTH]);
+static void upload_history(const SensorHistory *history);
+static void upload_window(const char *name, uint64_t start_us,
+                          const FieldStats *stats);
+static void *upload_worker(void *context);
+static void log_stats(void);
+static void log_lock(void *udata, int lock);
+static void log_command_latency(void);
+static int start_replay(G300Args *args);
+static void check_replay_finished(void *context);
+static void serial_ready(void *context);
+static int serial_pending(void *context);
 
 BGLIB_DEFINE();
 
 int main(int argc, char **argv) {
-  uint32_t last_reading_id = 0;
   G300Args arguments = {0};
-  struct gecko_cmd_packet *event = NULL;
 
   CURLcode res;
 
   if (get_parameters(argc, argv, &arguments)) {
     exit(-1);
   }
+  log_set_lock(log_lock);
+  _aggregating = arguments.window_ms != 0;
+  _upload_samples = arguments.upload_samples;
 
   int pthread_result =
       pthread_create(&_led_worker_thread, NULL, &led_worker, NULL);
@@ -77,68 +121,89 @@ int main(int argc, char **argv) {
     }
   }
 
-  res = curl_global_init(CURL_GLOBAL_ALL);
-  if (res) {
-    log_fatal("curl_global_init failed: %s", curl_easy_strerror(res));
-    flash_led();
-  }
+  sensor_registry_load(SENSOR_REGISTRY_PATH);
 
-  LedJob flash_yellow_job = {LED_JOB_ON_OFF, 400, {LED_YELLOW, 0, 0}, 1};
-  push_led_job(flash_yellow_job);
-  if (wait_for_network_connection(30)) {
-    log_fatal("no network available");
-    flash_led();
-  }
-
-  if (azure_init()) {
-    log_fatal("Azure Init Failed.");
-    flash_led();
+  if (arguments.replay_path[0]) {
+    // Offline: the trace stands in for the NCP, no network needed
+    if (start_replay(&arguments)) {
+      log_fatal("Trace Replay Failed");
+      flash_led();
+    }
   } else {
-    log_trace("Azure Initialized.");
-  }
+    res = curl_global_init(CURL_GLOBAL_ALL);
+    if (res) {
+      log_fatal("curl_global_init failed: %s", curl_easy_strerror(res));
+      flash_led();
+    }
 
-  BGLIB_INITIALIZE_NONBLOCK(serial_write, uartRx, uartRxPeek);
+    LedJob flash_yellow_job = {LED_JOB_ON_OFF, 400, {LED_YELLOW, 0, 0}, 1};
+    push_led_job(flash_yellow_job);
+    if (wait_for_network_connection(30)) {
+      log_fatal("no network available");
+      flash_led();
+    }
 
-  if (uartOpen((int8_t *)arguments.serial_port, arguments.baudrate, 0, 100) <
-      0) {
-    log_fatal("Serial Port Initialization Failed");
-    flash_led();
-  } else {
-    log_trace("Serial Port Initialized.");
-  }
+    if (azure_init()) {
+      log_fatal("Azure Init Failed.");
+      flash_led();
+    } else {
+      log_trace("Azure Initialized.");
+    }
 
-  LedJob bluetooth_scan_job = {
-      LED_JOB_ALTERNATE, 500, {LED_YELLOW, LED_GREEN, 0}, 2};
-  push_led_job(bluetooth_scan_job);
+    pthread_result = pthread_create(&_upload_thread, NULL, &upload_worker,
+                                    NULL);
+    if (pthread_result) {
+      log_fatal("Upload thread creation failed: %d", pthread_result);
+      flash_led();
+    }
 
-  gecko_cmd_system_reset(0);
+    if (arguments.record_path[0]) {
+      trace_wrap(serial_write, NULL, uartRxNonBlocking, uartRxPeek);
+      BGLIB_INITIALIZE_BUFFERED(trace_output, trace_read, trace_peek);
+    } else {
+      BGLIB_INITIALIZE_BUFFERED(serial_write, uartRxNonBlocking, uartRxPeek);
+    }
 
-  while (1) {
-    event = gecko_peek_event();
+    if (open_ncp_link(&arguments)) {
+      log_fatal("Serial Port Initialization Failed");
+      flash_led();
+    } else {
+      log_trace("Serial Port Initialized.");
+    }
 
-    if (event) {
-      handle_event(event);
+    // The trace starts at the verified link, like a replay does
+    if (arguments.record_path[0] && trace_record_start(arguments.record_path)) {
+      log_fatal("Trace Recording Failed");
+      flash_led();
     }
+  }
 
-    if (_sensor_values.id > last_reading_id) {
-      last_reading_id = _sensor_values.id;
-      LedJob one_sec_yellow_job = {
-          LED_JOB_ALTERNATE, 500, {LED_YELLOW, LED_YELLOW, 0}, 2};
-      push_led_job(one_sec_yellow_job);
-      upload_sensor_values();
+  // Only Thunderboard adverts are of interest, and only the newest of each.
+  // Beacons need not advertise a name at all.
+  if (!arguments.advert_ingest) {
+    gecko_filter_name_prefix(THUNDERBOARD_NAME_PREFIX);
+  }
+  gecko_filter_coalesce_scans(1);
+  app_set_advert_ingest(arguments.advert_ingest);
+  app_set_active_scan(arguments.active_scan);
+  app_set_max_devices(arguments.max_devices);
+  app_set_sampling_mode(arguments.notify_sampling ? SAMPLING_NOTIFY
+                                                  : SAMPLING_POLL);
 
-      if (!last_reading_id || (last_reading_id % 10) == 0) {
-        log_info("Azure Upload (%d)", last_reading_id);
-      }
+  LedJob bluetooth_scan_job = {
+      LED_JOB_ALTERNATE, 500, {LED_YELLOW, LED_GREEN, 0}, 2};
+  push_led_job(bluetooth_scan_job);
 
-      LedJob flash_green_red_job = {
-          LED_JOB_ALTERNATE, 500, {LED_GREEN, LED_RED, 0}, 2};
-      push_led_job(flash_green_red_job);
+  gecko_cmd_system_reset(0);
 
-      sleep(2);
-    }
+  if (event_loop_add_fd(gecko_reader_fd(), serial_ready, serial_pending,
+                        NULL)) {
+    log_fatal("Event loop registration failed");
+    flash_led();
   }
 
+  event_loop_run();
+
   return 0;
 }
 
@@ -149,7 +214,11 @@ void flash_led() {
     fclose(_log_file);
   }
 
-  uartClose();
+  gecko_reader_stop();
+  trace_record_stop();
+  if (!_replaying) {
+    uartClose();
+  }
 
   LedJob flash_red_job = {LED_JOB_ON_OFF, 1000, {LED_RED, 0, 0}, 1};
   push_led_job(flash_red_job);
@@ -171,15 +240,120 @@ void flash_led() {
   exit(-1);
 }
 
+// Open the uart at the requested rate and verify it with system_hello, then
+// step down through the slower rates until the NCP answers
+static int open_ncp_link(G300Args *args) {
+  uint32_t baudrate = args->baudrate;
+  int index = 0;
+
+  while (baudrate) {
+    log_debug("Trying %u baud%s", baudrate,
+              args->flow_control ? " with RTS/CTS" : "");
+    if (uartOpen((int8_t *)args->serial_port, baudrate, args->flow_control,
+                 100) < 0) {
+      log_error("Opening %s at %u baud failed", args->serial_port, baudrate);
+    } else if (gecko_reader_start()) {
+      log_fatal("Serial Reader Thread Creation Failed");
+      uartClose();
+      return -1;
+    } else if (gecko_hello(HELLO_TIMEOUT_MS) == 0) {
+      log_info("NCP answered at %u baud", baudrate);
+      args->baudrate = baudrate;
+      return 0;
+    } else {
+      log_warn("No answer from NCP at %u baud", baudrate);
+      gecko_reader_stop();
+      uartClose();
+    }
+
+    while (_fallback_baudrates[index] >= baudrate) {
+      index++;
+    }
+    baudrate = _fallback_baudrates[index];
+  }
+
+  return -1;
+}
+
+static int start_replay(G300Args *args) {
+  if (trace_replay_open(args->replay_path, !args->replay_fast)) {
+    return -1;
+  }
+  BGLIB_INITIALIZE_BUFFERED(replay_output, replay_read, replay_peek);
+  if (gecko_reader_start()) {
+    log_fatal("Serial Reader Thread Creation Failed");
+    return -1;
+  }
+
+  _replaying = true;
+  _replay_start_us = event_loop_now_us();
+  event_loop_add_timer(100, 100, check_replay_finished, NULL);
+  return 0;
+}
+
+// Trace delivered and every event handled: report and leave the loop
+static void check_replay_finished(void *context) {
+  TraceReplayStats stats;
+
+  if (!trace_replay_finished() || gecko_event_pending()) {
+    return;
+  }
+
+  uint64_t elapsed_us = event_loop_now_us() - _replay_start_us;
+  SensorHistoryStats history_stats;
+  AdvertStats advert_stats;
+  sensor_history_get_stats(&history_stats);
+  advert_get_stats(&advert_stats);
+  trace_replay_get_stats(&stats);
+  log_info("Replay finished: %u records, %u bytes in, %u commands "
+           "(%u differ from the recording)",
+           stats.records, stats.bytes_in, stats.outputs,
+           stats.output_mismatches);
+  log_info("Replay handled %u events, %u samples and %u beacon readings in "
+           "%.3f s",
+           _events_handled, history_stats.written, advert_stats.decoded,
+           elapsed_us / 1000000.0);
+  log_command_latency();
+  event_loop_stop();
+}
+
+// A positive number of seconds, in whole ms that fit a uint32_t. Returns 0
+// on success.
+static int parse_seconds(const char *text, uint32_t *ms) {
+  char *end;
+  double seconds = strtod(text, &end);
+
+  if (end == text || *end != '\0' || !(seconds * 1000 >= 1) ||
+      seconds * 1000 > UINT32_MAX) {
+    return -1;
+  }
+  *ms = seconds * 1000;
+  return 0;
+}
+
+// A board count from 1 to MAX_THUNDERBOARDS. Returns 0 on success.
+static int parse_boards(const char *text, uint32_t *count) {
+  char *end;
+  unsigned long value;
+
+  errno = 0;
+  value = strtoul(text, &end, 10);
+  if (end == text || *end != '\0' || errno || text[0] == '-' || value == 0 ||
+      value > MAX_THUNDERBOARDS) {
+    return -1;
+  }
+  *count = value;
+  return 0;
+}
+
 static int get_parameters(int argc, char **argv, G300Args *args) {
   args->baudrate = 115200;
+  args->flow_control = FALSE;
   snprintf(args->serial_port, sizeof(args->serial_port), "/dev/ttyS1");
   args->log_level = LOG_DEBUG;
   args->disable_log_file = FALSE;
-
-  if (argc == 1) {
-    return 0;
-  }
+  args->window_ms = AGGREGATE_WINDOW_MS;
+  args->step_ms = AGGREGATE_STEP_MS;
 
   bool expect_baud = FALSE;
   bool got_baud = FALSE;
@@ -187,6 +361,13 @@ static int get_parameters(int argc, char **argv, G300Args *args) {
   bool got_serial = FALSE;
   bool expect_log = FALSE;
   bool got_log = FALSE;
+  bool expect_record = FALSE;
+  bool expect_replay = FALSE;
+  bool expect_devices = FALSE;
+  bool expect_mode = FALSE;
+  bool expect_window = FALSE;
+  bool expect_step = FALSE;
+  bool got_step = FALSE;
 
   for (uint32_t arg_index = 1; arg_index < argc; arg_index++) {
     if (expect_baud) {
@@ -202,6 +383,41 @@ static int get_parameters(int argc, char **argv, G300Args *args) {
       args->log_level = atoi(argv[arg_index]);
       expect_log = FALSE;
       got_log = TRUE;
+    } else if (expect_record) {
+      snprintf(args->record_path, sizeof(args->record_path), "%s",
+               argv[arg_index]);
+      expect_record = FALSE;
+    } else if (expect_devices) {
+      if (parse_boards(argv[arg_index], &args->max_devices)) {
+        printf(USAGE, argv[0]);
+        return -1;
+      }
+      expect_devices = FALSE;
+    } else if (expect_mode) {
+      if (strcmp(argv[arg_index], "notify") == 0) {
+        args->notify_sampling = TRUE;
+      } else if (strcmp(argv[arg_index], "poll") != 0) {
+        printf(USAGE, argv[0]);
+        return -1;
+      }
+      expect_mode = FALSE;
+    } else if (expect_window) {
+      if (parse_seconds(argv[arg_index], &args->window_ms)) {
+        printf(USAGE, argv[0]);
+        return -1;
+      }
+      expect_window = FALSE;
+    } else if (expect_step) {
+      if (parse_seconds(argv[arg_index], &args->step_ms)) {
+        printf(USAGE, argv[0]);
+        return -1;
+      }
+      expect_step = FALSE;
+      got_step = TRUE;
+    } else if (expect_replay) {
+      snprintf(args->replay_path, sizeof(args->replay_path), "%s",
+               argv[arg_index]);
+      expect_replay = FALSE;
     } else {
       if (strcmp(argv[arg_index], "-b") == 0) {
         if (got_baud) {
@@ -226,6 +442,38 @@ static int get_parameters(int argc, char **argv, G300Args *args) {
         }
       } else if (strcmp(argv[arg_index], "-n") == 0) {
         args->disable_log_file = TRUE;
+      } else if (strcmp(argv[arg_index], "-c") == 0) {
+        expect_devices = TRUE;
+      } else if (strcmp(argv[arg_index], "-a") == 0) {
+        args->advert_ingest = TRUE;
+      } else if (strcmp(argv[arg_index], "-A") == 0) {
+        args->active_scan = TRUE;
+      } else if (strcmp(argv[arg_index], "-m") == 0) {
+        expect_mode = TRUE;
+      } else if (strcmp(argv[arg_index], "-w") == 0) {
+        expect_window = TRUE;
+      } else if (strcmp(argv[arg_index], "-W") == 0) {
+        expect_step = TRUE;
+      } else if (strcmp(argv[arg_index], "-S") == 0) {
+        args->upload_samples = TRUE;
+      } else if (strcmp(argv[arg_index], "-f") == 0) {
+        args->flow_control = TRUE;
+      } else if (strcmp(argv[arg_index], "-r") == 0) {
+        if (args->record_path[0] || args->replay_path[0]) {
+          printf(USAGE, argv[0]);
+          return -1;
+        } else {
+          expect_record = TRUE;
+        }
+      } else if (strcmp(argv[arg_index], "-p") == 0) {
+        if (args->record_path[0] || args->replay_path[0]) {
+          printf(USAGE, argv[0]);
+          return -1;
+        } else {
+          expect_replay = TRUE;
+        }
+      } else if (strcmp(argv[arg_index], "-x") == 0) {
+        args->replay_fast = TRUE;
       } else if (strcmp(argv[arg_index], "-h") == 0 ||
                  (strcmp(argv[arg_index], "--help") == 0)) {
         printf(USAGE, argv[0]);
@@ -238,18 +486,188 @@ static int get_parameters(int argc, char **argv, G300Args *args) {
     }
   }
 
-  if (expect_baud || expect_serial || expect_log) {
+  if (expect_baud || expect_serial || expect_log || expect_record ||
+      expect_replay || expect_devices || expect_mode || expect_window ||
+      expect_step) {
+    printf(USAGE, argv[0]);
+    return -1;
+  }
+  // Tumbling windows unless a step is given, and a step only for windows
+  if (got_step && !args->window_ms) {
     printf(USAGE, argv[0]);
     return -1;
   }
+  if (!got_step) {
+    args->step_ms = args->window_ms;
+  }
+  if (args->window_ms) {
+    if (aggregate_set_window(args->window_ms, args->step_ms)) {
+      printf(USAGE, argv[0]);
+      return -1;
+    }
+  }
 
   log_info("Baud Rate: %d", args->baudrate);
+  log_info("Flow Control: %s", args->flow_control ? "RTS/CTS" : "none");
+  if (args->record_path[0]) {
+    log_info("Record Trace: %s", args->record_path);
+  }
+  if (args->replay_path[0]) {
+    log_info("Replay Trace: %s", args->replay_path);
+  }
   log_info("Serial Port: %s", args->serial_port);
   log_info("Log Level: %d", args->log_level);
+  if (args->max_devices) {
+    log_info("Max Thunderboards: %u", args->max_devices);
+  }
+  log_info("Scanning: %s", args->active_scan ? "active" : "passive");
+  if (args->advert_ingest) {
+    log_info("Sampling: advertisements");
+  } else {
+    log_info("Sampling: %s", args->notify_sampling ? "notify" : "poll");
+  }
+  if (args->window_ms) {
+    log_info("Upload: statistics over %.1f s windows every %.1f s",
+             args->window_ms / 1000.0, args->step_ms / 1000.0);
+  } else if (args->upload_samples) {
+    log_info("Upload: every sample");
+  } else {
+    log_info("Upload: latest values");
+  }
 
   return 0;
 }
 
+// Round trip per command ID, the median is the first bucket past half
+static void log_command_latency(void) {
+  struct gecko_latency_histogram hist[BGLIB_LATENCY_IDS];
+  int count = gecko_get_latency_histograms(hist, BGLIB_LATENCY_IDS);
+
+  for (int i = 0; i < count; i++) {
+    uint32_t seen = 0;
+    int bucket = 0;
+    while (bucket < BGLIB_LATENCY_BUCKETS - 1 &&
+           (seen += hist[i].buckets[bucket]) * 2 < hist[i].count) {
+      bucket++;
+    }
+    log_info("Command 0x%08X: %u sent, median < %u us, max %u us",
+             hist[i].msg_id, hist[i].count, 2u << bucket, hist[i].max_us);
+  }
+}
+
+static int serial_pending(void *context) { return gecko_event_buffered(); }
+
+static void log_lock(void *udata, int lock) {
+  if (lock) {
+    pthread_mutex_lock(&_log_mutex);
+  } else {
+    pthread_mutex_unlock(&_log_mutex);
+  }
+}
+
+static void log_stats(void) {
+  struct gecko_reader_stats reader_stats;
+  struct gecko_rx_stats rx_stats;
+
+  gecko_get_reader_stats(&reader_stats);
+  gecko_get_rx_stats(&rx_stats);
+  log_info("Serial Reader: %u frames, %u dropped, high water %u/%u",
+           reader_stats.frames, reader_stats.dropped, reader_stats.high_water,
+           BGLIB_READER_QUEUE_LEN);
+  log_info("Event Filter: %u filtered, %u coalesced", rx_stats.filtered,
+           rx_stats.coalesced);
+  log_command_latency();
+  app_log_device_stats();
+  advert_log_stats();
+}
+
+static void serial_ready(void *context) {
+  struct gecko_cmd_packet *event = NULL;
+
+  while ((event = gecko_peek_event())) {
+    handle_event(event);
+    _events_handled++;
+  }
+
+  if (event_loop_now_us() >= _stats_us) {
+    if (_stats_us) {
+      log_stats();
+    }
+    _stats_us = event_loop_now_us() + STATS_INTERVAL_US;
+  }
+  // Board samples and beacon readings wait for the upload thread
+}
+
+// Every UPLOAD_INTERVAL_MS, take the samples each board took since the
+// last round and upload them, or their statistics over every window that
+// ended, and upload the latest reading of every beacon heard from since.
+// A slow upload holds up only this thread, the samples wait in the history
+// and the beacon readings in the advert table meanwhile.
+static void *upload_worker(void *context) {
+  static SensorHistory history;
+  static double values[MAX_SENSOR_FIELDS][SENSOR_HISTORY_LENGTH];
+  static Aggregate aggregates[MAX_THUNDERBOARDS];
+  static AdvertReading beacons[ADVERT_MAX_BEACONS];
+  uint32_t uploads = 0;
+  uint32_t beacon_uploads = 0;
+  uint32_t lost[MAX_THUNDERBOARDS] = {0};
+
+  while (1) {
+    usleep(UPLOAD_INTERVAL_MS * 1000);
+
+    uint32_t beacon_count = advert_take(beacons);
+    for (uint32_t i = 0; i < beacon_count; i++) {
+      upload_beacon(&beacons[i]);
+    }
+    if (beacon_count) {
+      beacon_uploads += beacon_count;
+      log_debug("Azure Upload (%d), %u beacons this round", beacon_uploads,
+                beacon_count);
+      LedJob flash_green_red_job = {
+          LED_JOB_ALTERNATE, 500, {LED_GREEN, LED_RED, 0}, 2};
+      push_led_job(flash_green_red_job);
+    }
+
+    for (uint32_t i = 0; i < MAX_THUNDERBOARDS; i++) {
+      uint32_t count = sensor_history_take(i, &history);
+      // Every sample taken is older than this
+      uint64_t now_us = event_loop_now_us();
+      if (_aggregating) {
+        if (count) {
+          history_values(&history, values);
+        }
+        aggregate_history(&aggregates[i], count ? &history : NULL, values,
+                          now_us, upload_window);
+      }
+      if (count == 0) {
+        continue;
+      }
+      if (history.lost < lost[i]) {
+        lost[i] = 0;
+      }
+      if (history.lost > lost[i]) {
+        log_warn("%s: %u samples overwritten before they were uploaded",
+                 history.name, history.lost - lost[i]);
+        lost[i] = history.lost;
+      }
+
+      if (_aggregating) {
+        continue;
+      }
+
+      LedJob one_sec_yellow_job = {
+          LED_JOB_ALTERNATE, 500, {LED_YELLOW, LED_YELLOW, 0}, 2};
+      push_led_job(one_sec_yellow_job);
+      upload_history(&history);
+      if ((++uploads % 10) == 0) {
+        log_info("Azure Upload (%d), %u samples", uploads, count);
+      }
+    }
+  }
+
+  return NULL;
+}
+
 void serial_write(uint32_t length, uint8_t *data) {
   int32_t result = uartTx(length, data);
   if (result < 0) {
@@ -258,41 +676,243 @@ void serial_write(uint32_t length, uint8_t *data) {
   }
 }
 
-static void upload_sensor_values() {
-  log_trace("Sending Sensor Values:");
-  log_trace("  Temperature: %f", _sensor_values.temperature);
-  log_trace("  Pressure: %f", _sensor_values.pressure);
-  log_trace("  Humidity: %f", _sensor_values.humidity);
-  log_trace("  CO2: %f", _sensor_values.co2);
-  log_trace("  VOC: %f", _sensor_values.voc);
-  log_trace("  Light: %f", _sensor_values.light);
-  log_trace("  Sound: %f", _sensor_values.sound);
-  log_trace("  Acceleration: (%f, %f, %f)", _sensor_values.acceleration[0],
-            _sensor_values.acceleration[1], _sensor_values.acceleration[2]);
-  log_trace("  Orientation: (%f, %f, %f)", _sensor_values.orientation[0],
-            _sensor_values.orientation[1], _sensor_values.orientation[2]);
-
-  char json_buffer[1024];
-  snprintf(json_buffer, 1024,
-           "{\"temp\":%f,"
-           "\"press\":%f,"
-           "\"hum\":%f,"
-           "\"co2\":%f,"
-           "\"voc\":%f,"
-           "\"ambientlight\":%f,"
-           "\"sound\":%f,"
-           "\"accx\":%f,"
-           "\"accy\":%f,"
-           "\"accz\":%f,"
-           "\"orientationx\":%f,"
-           "\"orientationy\":%f,"
-           "\"orientationz\":%f}",
-           _sensor_values.temperature, _sensor_values.pressure,
-           _sensor_values.humidity, _sensor_values.co2, _sensor_values.voc,
-           _sensor_values.light, _sensor_values.sound,
-           _sensor_values.acceleration[0], _sensor_values.acceleration[1],
-           _sensor_values.acceleration[2], _sensor_values.orientation[0],
-           _sensor_values.orientation[1], _sensor_values.orientation[2]);
+static void upload_sensor_values(const char *name, const SensorValues *values,
+                                 uint32_t sensors, const AdvertReading *beacon) {
+  log_trace("Sending Sensor Values of %s:", name);
+
+  // One member per registry field of the sensors given, named as in the
+  // registry
+  char json_buffer[2048];
+  uint32_t length =
+      snprintf(json_buffer, sizeof(json_buffer), "{\"device\":\"%s\"", name);
+  uint32_t i;
+  for (i = 0; i < sensor_count() && length < sizeof(json_buffer); i++) {
+    const SensorProfile *profile = sensor_profile(i);
+    uint32_t index;
+    if (!(sensors & (1u << i))) {
+      continue;
+    }
+    for (index = profile->first_field;
+         index < profile->first_field + profile->field_count &&
+         length < sizeof(json_buffer);
+         index++) {
+      const SensorField *field = sensor_field(index);
+      log_trace("  %s: %f", field->name, values->fields[index]);
+      length += snprintf(json_buffer + length, sizeof(json_buffer) - length,
+                         ",\"%s\":%f", field->name, values->fields[index]);
+    }
+  }
+  if (beacon && length < sizeof(json_buffer)) {
+    length += snprintf(json_buffer + length, sizeof(json_buffer) - length,
+                       ",\"rssi\":%d", beacon->rssi);
+  }
+  if (beacon && beacon->has_tlm && length < sizeof(json_buffer)) {
+    length += snprintf(json_buffer + length, sizeof(json_buffer) - length,
+                       ",\"battery\":%.3f,\"beacontemp\":%.2f",
+                       beacon->battery_mv / 1000.0, beacon->temperature);
+  }
+  if (length + 1 >= sizeof(json_buffer)) {
+    log_error("Sensor values of %s do not fit in %zu bytes", name,
+              sizeof(json_buffer));
+    return;
+  }
+  strcat(json_buffer, "}");
+
+  if (_replaying) {
+    log_trace("Replay, not uploaded: %s", json_buffer);
+    return;
+  }
+  azure_post_telemetry(json_buffer);
+}
+
+// Beacons that advertise no name go by their address
+static void upload_beacon(const AdvertReading *beacon) {
+  char address[18];
+
+  if (beacon->name[0]) {
+    upload_sensor_values(beacon->name, &beacon->values, beacon->sensors,
+                         beacon);
+    return;
+  }
+  snprintf(address, sizeof(address), "%02X:%02X:%02X:%02X:%02X:%02X",
+           beacon->address.addr[5], beacon->address.addr[4],
+           beacon->address.addr[3], beacon->address.addr[2],
+           beacon->address.addr[1], beacon->address.addr[0]);
+  upload_sensor_values(address, &beacon->values, beacon->sensors, beacon);
+}
+
+// Scaled a field at a time
+static void history_values(const SensorHistory *history,
+                           double (*values)[SENSOR_HISTORY_LENGTH]) {
+  uint32_t i;
+  uint32_t field;
+
+  for (i = 0; i < sensor_count(); i++) {
+    const SensorProfile *profile = sensor_profile(i);
+    for (field = profile->first_field;
+         field < profile->first_field + profile->field_count; field++) {
+      sensor_history_values(history, i, field, values[field]);
+    }
+  }
+}
+
+// The latest value of every field sampled since the last round, as a
+// reading would upload it. With -S the message is version 2 and also has
+// all the samples taken under "samples": per sensor its sample times in ms
+// since the epoch and per field the values.
+static void upload_history(const SensorHistory *history) {
+  static char json_buffer[UPLOAD_BUFFER_SIZE];
+  static double values[MAX_SENSOR_FIELDS][SENSOR_HISTORY_LENGTH];
+  uint32_t counts[MAX_SENSORS] = {0};
+  struct timespec realtime;
+  uint64_t epoch_ms;
+  uint64_t now_us = event_loop_now_us();
+  uint32_t length;
+  uint32_t i;
+  uint32_t field;
+  uint32_t n;
+  bool first = true;
+
+  // Sample times are event loop times, the wall clock may have been set
+  // since they were taken
+  clock_gettime(CLOCK_REALTIME, &realtime);
+  epoch_ms = realtime.tv_sec * 1000ull + realtime.tv_nsec / 1000000;
+
+  history_values(history, values);
+  for (i = 0; i < sensor_count(); i++) {
+    counts[i] = history->written[i] - history->read[i];
+  }
 
+  length = snprintf(json_buffer, sizeof(json_buffer), "{\"device\":\"%s\"",
+                    history->name);
+  if (_upload_samples && length < sizeof(json_buffer)) {
+    length += snprintf(json_buffer + length, sizeof(json_buffer) - length,
+                       ",\"version\":2");
+  }
+  for (i = 0; i < sensor_count() && length < sizeof(json_buffer); i++) {
+    const SensorProfile *profile = sensor_profile(i);
+    if (counts[i] == 0) {
+      continue;
+    }
+    for (field = profile->first_field;
+         field < profile->first_field + profile->field_count &&
+         length < sizeof(json_buffer);
+         field++) {
+      length += snprintf(json_buffer + length, sizeof(json_buffer) - length,
+                         ",\"%s\":%f", sensor_field(field)->name,
+                         values[field][counts[i] - 1]);
+    }
+  }
+
+  if (_upload_samples && length < sizeof(json_buffer)) {
+    length += snprintf(json_buffer + length, sizeof(json_buffer) - length,
+                       ",\"samples\":{");
+  }
+  for (i = 0; _upload_samples && i < sensor_count() &&
+              length < sizeof(json_buffer);
+       i++) {
+    const SensorProfile *profile = sensor_profile(i);
+    if (counts[i] == 0) {
+      continue;
+    }
+    length += snprintf(json_buffer + length, sizeof(json_buffer) - length,
+                       "%s\"%s\":{\"time\":[", first ? "" : ",",
+                       profile->name);
+    first = false;
+    for (n = 0; n < counts[i] && length < sizeof(json_buffer); n++) {
+      uint64_t time_us =
+          history->time_us[i][(history->read[i] + n) &
+                              (SENSOR_HISTORY_LENGTH - 1)];
+      length += snprintf(json_buffer + length, sizeof(json_buffer) - length,
+                         "%s%llu", n ? "," : "",
+                         (unsigned long long)(epoch_ms -
+                                              (now_us - time_us) / 1000));
+    }
+    for (field = profile->first_field;
+         field < profile->first_field + profile->field_count &&
+         length < sizeof(json_buffer);
+         field++) {
+      length += snprintf(json_buffer + length, sizeof(json_buffer) - length,
+                         "],\"%s\":[", sensor_field(field)->name);
+      for (n = 0; n < counts[i] && length < sizeof(json_buffer); n++) {
+        length += snprintf(json_buffer + length, sizeof(json_buffer) - length,
+                           "%s%g", n ? "," : "", values[field][n]);
+      }
+    }
+    if (length < sizeof(json_buffer)) {
+      length += snprintf(json_buffer + length, sizeof(json_buffer) - length,
+                         "]}");
+    }
+  }
+  if (_upload_samples && length < sizeof(json_buffer)) {
+    length += snprintf(json_buffer + length, sizeof(json_buffer) - length,
+                       "}");
+  }
+  if (length + 1 >= sizeof(json_buffer)) {
+    log_error("Samples of %s do not fit in %zu bytes", history->name,
+              sizeof(json_buffer));
+    return;
+  }
+  strcat(json_buffer, "}");
+
+  if (_replaying) {
+    log_trace("Replay, not uploaded: %s", json_buffer);
+    return;
+  }
+  azure_post_telemetry(json_buffer);
+}
+
+// One message per board and window: its start in ms since the epoch, its
+// length in s, and per field sampled in it the mean under the field name,
+// as a reading would upload the value, and the minimum, maximum, standard
+// deviation and sample count under the name with _min, _max, _stddev and
+// _count appended
+static void upload_window(const char *name, uint64_t start_us,
+                          const FieldStats *stats) {
+  static uint32_t windows = 0;
+  char json_buffer[8192];
+  struct timespec realtime;
+  uint64_t epoch_ms;
+  uint64_t now_us = event_loop_now_us();
+  uint32_t length;
+  uint32_t samples = 0;
+  uint32_t field;
+
+  clock_gettime(CLOCK_REALTIME, &realtime);
+  epoch_ms = realtime.tv_sec * 1000ull + realtime.tv_nsec / 1000000;
+
+  length = snprintf(json_buffer, sizeof(json_buffer),
+                    "{\"device\":\"%s\",\"start\":%llu,\"window\":%g", name,
+                    (unsigned long long)(epoch_ms - (now_us - start_us) / 1000),
+                    aggregate_window_ms() / 1000.0);
+  for (field = 0; field < sensor_field_count() && length < sizeof(json_buffer);
+       field++) {
+    const char *field_name = sensor_field(field)->name;
+    if (stats[field].count == 0) {
+      continue;
+    }
+    samples += stats[field].count;
+    length += snprintf(json_buffer + length, sizeof(json_buffer) - length,
+                       ",\"%s\":%f,\"%s_min\":%g,\"%s_max\":%g,"
+                       "\"%s_stddev\":%g,\"%s_count\":%u",
+                       field_name, stats[field].mean, field_name,
+                       stats[field].min, field_name, stats[field].max,
+                       field_name, field_stats_stddev(&stats[field]),
+                       field_name, stats[field].count);
+  }
+  if (length + 1 >= sizeof(json_buffer)) {
+    log_error("Window statistics of %s do not fit in %zu bytes", name,
+              sizeof(json_buffer));
+    return;
+  }
+  strcat(json_buffer, "}");
+
+  LedJob one_sec_yellow_job = {
+      LED_JOB_ALTERNATE, 500, {LED_YELLOW, LED_YELLOW, 0}, 2};
+  push_led_job(one_sec_yellow_job);
   azure_post_telemetry(json_buffer);
+  if ((++windows % 10) == 0) {
+    log_info("Azure Upload (%d), window of %u field values", windows,
+             samples);
+  }
 }
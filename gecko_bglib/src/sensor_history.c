@@ -0,0 +1,150 @@
+/*******************************************************************************
+ * Copyright Arrow Electronics, Inc., 2019
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ ******************************************************************************/
+
+#include "sensor_history.h"
+#include "log.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#if SENSOR_HISTORY_LENGTH & (SENSOR_HISTORY_LENGTH - 1)
+#error SENSOR_HISTORY_LENGTH must be a power of two
+#endif
+#define SLOT(n) ((n) & (SENSOR_HISTORY_LENGTH - 1))
+
+// Written from the event loop, taken from by the uploader
+static pthread_mutex_t _history_mutex = PTHREAD_MUTEX_INITIALIZER;
+static SensorHistory _histories[MAX_THUNDERBOARDS];
+static SensorHistoryStats _stats = {0};
+
+static uint32_t unread(const SensorHistory *history) {
+  uint32_t count = 0;
+  uint32_t i;
+
+  for (i = 0; i < sensor_count(); i++) {
+    count += history->written[i] - history->read[i];
+  }
+  return count;
+}
+
+void sensor_history_open(uint32_t board, const char *name) {
+  SensorHistory *history = &_histories[board];
+  uint32_t dropped;
+
+  pthread_mutex_lock(&_history_mutex);
+  dropped = unread(history);
+  if (dropped) {
+    log_warn("%s: %u samples not uploaded before %s took the slot",
+             history->name, dropped, name);
+    _stats.lost += dropped;
+  }
+  memcpy(history->read, history->written, sizeof(history->read));
+  history->lost = 0;
+  snprintf(history->name, sizeof(history->name), "%s", name);
+  pthread_mutex_unlock(&_history_mutex);
+}
+
+void sensor_history_add(uint32_t board, uint32_t sensor, uint64_t time_us,
+                        const uint8_t *value, uint32_t length) {
+  const SensorProfile *profile = sensor_profile(sensor);
+  SensorHistory *history = &_histories[board];
+  uint32_t slot;
+  uint32_t i;
+
+  pthread_mutex_lock(&_history_mutex);
+  // Overwrite the oldest sample
+  if (history->written[sensor] - history->read[sensor] ==
+      SENSOR_HISTORY_LENGTH) {
+    history->read[sensor]++;
+    history->lost++;
+    _stats.lost++;
+  }
+  slot = SLOT(history->written[sensor]);
+  history->time_us[sensor][slot] = time_us;
+  for (i = profile->first_field;
+       i < profile->first_field + profile->field_count; i++) {
+    history->raw[i][slot] = sensor_field_raw(sensor_field(i), value, length);
+  }
+  history->written[sensor]++;
+  _stats.written++;
+  pthread_mutex_unlock(&_history_mutex);
+}
+
+// Samples start up to start + count of a ring of size byte elements, in
+// one or two runs
+static void copy_ring(void *to, const void *from, uint32_t start,
+                      uint32_t count, size_t size) {
+  uint32_t slot = SLOT(start);
+  uint32_t first_run = SENSOR_HISTORY_LENGTH - slot;
+
+  if (first_run > count) {
+    first_run = count;
+  }
+  memcpy((uint8_t *)to + slot * size, (const uint8_t *)from + slot * size,
+         first_run * size);
+  memcpy(to, from, (count - first_run) * size);
+}
+
+// Only the samples not taken are copied, the lock is held for a fraction
+// of the whole history when uploads keep up
+uint32_t sensor_history_take(uint32_t board, SensorHistory *samples) {
+  SensorHistory *history = &_histories[board];
+  uint32_t count;
+  uint32_t i;
+  uint32_t field;
+
+  pthread_mutex_lock(&_history_mutex);
+  count = unread(history);
+  if (count) {
+    memcpy(samples->name, history->name, sizeof(samples->name));
+    memcpy(samples->written, history->written, sizeof(samples->written));
+    memcpy(samples->read, history->read, sizeof(samples->read));
+    samples->lost = history->lost;
+    for (i = 0; i < sensor_count(); i++) {
+      const SensorProfile *profile = sensor_profile(i);
+      uint32_t pending = history->written[i] - history->read[i];
+      copy_ring(samples->time_us[i], history->time_us[i], history->read[i],
+                pending, sizeof(history->time_us[i][0]));
+      for (field = profile->first_field;
+           field < profile->first_field + profile->field_count; field++) {
+        copy_ring(samples->raw[field], history->raw[field], history->read[i],
+                  pending, sizeof(history->raw[field][0]));
+      }
+    }
+    memcpy(history->read, history->written, sizeof(history->read));
+  }
+  pthread_mutex_unlock(&_history_mutex);
+  return count;
+}
+
+// The ring wraps at most once, so the samples are in one or two runs
+uint32_t sensor_history_values(const SensorHistory *history, uint32_t sensor,
+                               uint32_t field, double *values) {
+  uint32_t count = history->written[sensor] - history->read[sensor];
+  uint32_t start = SLOT(history->read[sensor]);
+  uint32_t first_run = SENSOR_HISTORY_LENGTH - start;
+
+  if (first_run > count) {
+    first_run = count;
+  }
+  sensor_field_convert(sensor_field(field), &history->raw[field][start],
+                       first_run, values);
+  sensor_field_convert(sensor_field(field), history->raw[field],
+                       count - first_run, &values[first_run]);
+  return count;
+}
+
+void sensor_history_get_stats(SensorHistoryStats *stats) {
+  pthread_mutex_lock(&_history_mutex);
+  *stats = _stats;
+  pthread_mutex_unlock(&_history_mutex);
+}
@@ -0,0 +1,499 @@
+/*******************************************************************************
+ * Copyright Arrow Electronics, Inc., 2019
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ ******************************************************************************/
+
+#include "sensor_registry.h"
+#include "app.h"
+#include "log.h"
+
+#include <azureiot/parson.h>
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+// Open addressing with linear probing, kept at most a quarter full
+#define SENSOR_HASH_SIZE 64
+#define MAX_BUILTIN_FIELDS 3
+
+typedef struct BuiltinField {
+  const char *name;
+  uint8_t position;
+  SensorFieldType type;
+  double scale;
+  double offset;
+} BuiltinField;
+
+typedef struct BuiltinSensor {
+  const char *name;
+  const char *service;
+  const char *uuid;
+  uint8_t length;
+  uint32_t period_ms;
+  uint8_t field_count;
+  BuiltinField fields[MAX_BUILTIN_FIELDS];
+} BuiltinSensor;
+
+// Thunderboard Sense, the same as upload/sensors.json. UV is read but not
+// uploaded.
+static const BuiltinSensor _thunderboard_sense[] = {
+    {"Temperature",
+     "181a",
+     "2a6e",
+     2,
+     5000,
+     1,
+     {{"temp", 0, FIELD_INT16, 0.01, 0}}},
+    {"Pressure",
+     "181a",
+     "2a6d",
+     4,
+     10000,
+     1,
+     {{"press", 0, FIELD_UINT32, 0.1, 0}}},
+    {"Humidity",
+     "181a",
+     "2a6f",
+     2,
+     10000,
+     1,
+     {{"hum", 0, FIELD_UINT16, 0.01, 0}}},
+    {"CO2",
+     "efd658ae-c400-ef33-76e7-91b00019103b",
+     "efd658ae-c401-ef33-76e7-91b00019103b",
+     2,
+     2000,
+     1,
+     {{"co2", 0, FIELD_UINT16, 1, 0}}},
+    {"VOC",
+     "efd658ae-c400-ef33-76e7-91b00019103b",
+     "efd658ae-c402-ef33-76e7-91b00019103b",
+     2,
+     2000,
+     1,
+     {{"voc", 0, FIELD_UINT16, 0.01, 0}}},
+    {"Light",
+     "d24c4f4e-17a7-4548-852c-abf51127368b",
+     "c8546913-bfd9-45eb-8dde-9f8754f4a32e",
+     4,
+     1000,
+     1,
+     {{"ambientlight", 0, FIELD_UINT32, 0.001, 0}}},
+    {"UV", "181a", "2a76", 1, 10000, 0, {{0}}},
+    {"Sound",
+     "181a",
+     "c8546913-bf02-45eb-8dde-9f8754f4a32e",
+     2,
+     500,
+     1,
+     {{"sound", 0, FIELD_UINT16, 0.01, 0}}},
+    {"Acceleration",
+     "a4e649f4-4be5-11e5-885d-feff819cdc9f",
+     "c4c1f6e2-4be5-11e5-885d-feff819cdc9f",
+     6,
+     100,
+     3,
+     {{"accx", 0, FIELD_UINT16, 0.001, 0},
+      {"accy", 2, FIELD_UINT16, 0.001, 0},
+      {"accz", 4, FIELD_UINT16, 0.001, 0}}},
+    {"Orientation",
+     "a4e649f4-4be5-11e5-885d-feff819cdc9f",
+     "b7c4b694-bee3-45dd-ba9f-f3b5e994f49a",
+     6,
+     100,
+     3,
+     {{"orientationx", 0, FIELD_UINT16, 360.0 / UINT16_MAX, -180},
+      {"orientationy", 2, FIELD_UINT16, 180.0 / UINT16_MAX, -90},
+      {"orientationz", 4, FIELD_UINT16, 360.0 / UINT16_MAX, -180}}}};
+
+static const char *_field_type_names[NUM_FIELD_TYPES] = {
+    "uint8", "int8", "uint16", "int16", "uint32", "int32"};
+static const uint8_t _field_type_sizes[NUM_FIELD_TYPES] = {1, 1, 2, 2, 4, 4};
+
+static SensorProfile _sensors[MAX_SENSORS];
+static uint32_t _sensor_count = 0;
+static SensorField _fields[MAX_SENSOR_FIELDS];
+static uint32_t _field_count = 0;
+static UUID _services[MAX_SENSOR_SERVICES];
+static uint32_t _service_members[MAX_SENSOR_SERVICES];
+static uint32_t _service_count = 0;
+// Sensor index + 1, 0 for a free slot
+static uint8_t _sensor_hash[SENSOR_HASH_SIZE];
+
+// FNV-1a
+static uint32_t uuid_hash(const UUID *uuid) {
+  uint32_t hash = 2166136261u;
+  uint32_t i;
+
+  for (i = 0; i < uuid->length; i++) {
+    hash = (hash ^ uuid->bytes[i]) * 16777619u;
+  }
+  return hash;
+}
+
+static bool uuid_equal(const UUID *a, const UUID *b) {
+  return a->length == b->length && memcmp(a->bytes, b->bytes, a->length) == 0;
+}
+
+// Printed UUIDs start with the most significant byte, over the air the
+// least significant comes first
+static int parse_uuid(const char *text, UUID *uuid) {
+  uint8_t bytes[MAX_UUID_LENGTH];
+  uint32_t digits = 0;
+  uint32_t i;
+
+  for (; *text; text++) {
+    if (*text == '-') {
+      continue;
+    }
+    if (!isxdigit((unsigned char)*text) || digits == 2 * MAX_UUID_LENGTH) {
+      return -1;
+    }
+    uint8_t nibble = isdigit((unsigned char)*text)
+                         ? *text - '0'
+                         : tolower((unsigned char)*text) - 'a' + 10;
+    if (digits % 2 == 0) {
+      bytes[digits / 2] = nibble << 4;
+    } else {
+      bytes[digits / 2] |= nibble;
+    }
+    digits++;
+  }
+  if (digits != 4 && digits != 2 * MAX_UUID_LENGTH) {
+    return -1;
+  }
+
+  uuid->length = digits / 2;
+  for (i = 0; i < uuid->length; i++) {
+    uuid->bytes[i] = bytes[uuid->length - 1 - i];
+  }
+  return 0;
+}
+
+static void registry_clear() {
+  memset(_sensors, 0, sizeof(_sensors));
+  memset(_fields, 0, sizeof(_fields));
+  memset(_services, 0, sizeof(_services));
+  memset(_service_members, 0, sizeof(_service_members));
+  memset(_sensor_hash, 0, sizeof(_sensor_hash));
+  _sensor_count = 0;
+  _field_count = 0;
+  _service_count = 0;
+}
+
+static int add_service(const UUID *service, uint32_t sensor_index) {
+  uint32_t i;
+
+  for (i = 0; i < _service_count; i++) {
+    if (uuid_equal(&_services[i], service)) {
+      break;
+    }
+  }
+  if (i == MAX_SENSOR_SERVICES) {
+    log_error("More than %d sensor services", MAX_SENSOR_SERVICES);
+    return -1;
+  }
+  if (i == _service_count) {
+    _services[_service_count++] = *service;
+  }
+  _service_members[i] |= 1u << sensor_index;
+  return 0;
+}
+
+static int add_sensor(const char *name, const char *service, const char *uuid,
+                      uint32_t length, uint32_t period_ms) {
+  SensorProfile *sensor = &_sensors[_sensor_count];
+  uint32_t slot;
+
+  if (_sensor_count == MAX_SENSORS) {
+    log_error("More than %d sensors", MAX_SENSORS);
+    return -1;
+  }
+  if (!name || !service || !uuid) {
+    log_error("Sensor %u needs a name, service and uuid", _sensor_count);
+    return -1;
+  }
+  if (parse_uuid(service, &sensor->service) ||
+      parse_uuid(uuid, &sensor->uuid)) {
+    log_error("Sensor %s has an invalid UUID", name);
+    return -1;
+  }
+  if (length > VALUE_PAYLOAD_LENGTH) {
+    log_error("Sensor %s is longer than the %u bytes kept of a value", name,
+              VALUE_PAYLOAD_LENGTH);
+    return -1;
+  }
+  snprintf(sensor->name, sizeof(sensor->name), "%s", name);
+  sensor->length = length;
+  sensor->period_ms = period_ms;
+  sensor->first_field = _field_count;
+
+  for (slot = uuid_hash(&sensor->uuid) % SENSOR_HASH_SIZE; _sensor_hash[slot];
+       slot = (slot + 1) % SENSOR_HASH_SIZE) {
+    if (uuid_equal(&_sensors[_sensor_hash[slot] - 1].uuid, &sensor->uuid)) {
+      log_error("Sensors %s and %s have the same UUID",
+                _sensors[_sensor_hash[slot] - 1].name, name);
+      return -1;
+    }
+  }
+  if (add_service(&sensor->service, _sensor_count)) {
+    return -1;
+  }
+  _sensor_hash[slot] = ++_sensor_count;
+  return 0;
+}
+
+// Adds a field to the sensor added last
+static int add_field(const char *name, uint32_t position, const char *type,
+                     double scale, double offset) {
+  SensorProfile *sensor = &_sensors[_sensor_count - 1];
+  SensorField *field = &_fields[_field_count];
+  uint32_t i;
+
+  if (_field_count == MAX_SENSOR_FIELDS) {
+    log_error("More than %d sensor fields", MAX_SENSOR_FIELDS);
+    return -1;
+  }
+  if (!name || !type) {
+    log_error("A field of %s needs a name and type", sensor->name);
+    return -1;
+  }
+  for (i = 0; i < NUM_FIELD_TYPES; i++) {
+    if (strcmp(type, _field_type_names[i]) == 0) {
+      break;
+    }
+  }
+  if (i == NUM_FIELD_TYPES) {
+    log_error("Field %s of %s has unknown type %s", name, sensor->name, type);
+    return -1;
+  }
+  if (sensor->length && position + _field_type_sizes[i] > sensor->length) {
+    log_error("Field %s is past the end of %s", name, sensor->name);
+    return -1;
+  }
+
+  snprintf(field->name, sizeof(field->name), "%s", name);
+  field->position = position;
+  field->type = i;
+  field->scale = scale;
+  field->offset = offset;
+  sensor->field_count++;
+  _field_count++;
+  return 0;
+}
+
+static void load_builtin() {
+  uint32_t i;
+  uint32_t j;
+
+  registry_clear();
+  for (i = 0; i < sizeof(_thunderboard_sense) / sizeof(_thunderboard_sense[0]);
+       i++) {
+    const BuiltinSensor *sensor = &_thunderboard_sense[i];
+    add_sensor(sensor->name, sensor->service, sensor->uuid, sensor->length,
+               sensor->period_ms);
+    for (j = 0; j < sensor->field_count; j++) {
+      const BuiltinField *field = &sensor->fields[j];
+      add_field(field->name, field->position, _field_type_names[field->type],
+                field->scale, field->offset);
+    }
+  }
+}
+
+static double optional_number(const JSON_Object *object, const char *name,
+                              double fallback) {
+  return json_object_has_value_of_type(object, name, JSONNumber)
+             ? json_object_get_number(object, name)
+             : fallback;
+}
+
+// A whole number from 0 to max, fallback if the member is missing. Returns
+// -1 if it is out of range.
+static int optional_uint(const JSON_Object *object, const char *name,
+                         uint32_t fallback, uint32_t max, uint32_t *value) {
+  double number;
+
+  if (!json_object_has_value_of_type(object, name, JSONNumber)) {
+    *value = fallback;
+    return 0;
+  }
+  number = json_object_get_number(object, name);
+  // Only cast once it is known to fit
+  if (!(number >= 0 && number <= max) || (uint32_t)number != number) {
+    log_error("\"%s\" is %g, not a whole number from 0 to %u", name, number,
+              max);
+    return -1;
+  }
+  *value = number;
+  return 0;
+}
+
+static int load_file(const char *path) {
+  JSON_Value *root_value = json_parse_file(path);
+  JSON_Array *sensors;
+  int result = -1;
+  size_t i;
+  size_t j;
+
+  if (root_value == NULL) {
+    log_error("Could not parse %s", path);
+    return -1;
+  }
+  sensors = json_object_get_array(json_value_get_object(root_value), "sensors");
+  if (sensors == NULL) {
+    log_error("%s has no sensors array", path);
+    goto done;
+  }
+  if (json_array_get_count(sensors) == 0) {
+    log_error("%s has no sensors", path);
+    goto done;
+  }
+
+  registry_clear();
+  for (i = 0; i < json_array_get_count(sensors); i++) {
+    JSON_Object *sensor = json_array_get_object(sensors, i);
+    JSON_Array *fields = json_object_get_array(sensor, "fields");
+    uint32_t length;
+    uint32_t period_ms;
+
+    if (optional_uint(sensor, "length", 0, VALUE_PAYLOAD_LENGTH, &length) ||
+        optional_uint(sensor, "period", SENSOR_PERIOD_MS, UINT32_MAX,
+                      &period_ms) ||
+        add_sensor(json_object_get_string(sensor, "name"),
+                   json_object_get_string(sensor, "service"),
+                   json_object_get_string(sensor, "uuid"), length,
+                   period_ms)) {
+      goto done;
+    }
+    for (j = 0; j < json_array_get_count(fields); j++) {
+      JSON_Object *field = json_array_get_object(fields, j);
+      uint32_t position;
+      if (optional_uint(field, "position", 0, UINT8_MAX, &position) ||
+          add_field(json_object_get_string(field, "name"), position,
+                    json_object_get_string(field, "type"),
+                    optional_number(field, "scale", 1),
+                    optional_number(field, "offset", 0))) {
+        goto done;
+      }
+    }
+  }
+  result = 0;
+
+done:
+  json_value_free(root_value);
+  return result;
+}
+
+void sensor_registry_load(const char *path) {
+  if (access(path, F_OK) == 0) {
+    if (load_file(path) == 0) {
+      log_info("Loaded %u sensors with %u fields from %s", _sensor_count,
+               _field_count, path);
+      return;
+    }
+    log_error("Invalid sensor registry %s, using Thunderboard Sense", path);
+  }
+  load_builtin();
+}
+
+uint32_t sensor_count() { return _sensor_count; }
+
+const SensorProfile *sensor_profile(uint32_t index) {
+  return &_sensors[index];
+}
+
+int sensor_find(const UUID *uuid) {
+  uint32_t slot;
+
+  for (slot = uuid_hash(uuid) % SENSOR_HASH_SIZE; _sensor_hash[slot];
+       slot = (slot + 1) % SENSOR_HASH_SIZE) {
+    if (uuid_equal(&_sensors[_sensor_hash[slot] - 1].uuid, uuid)) {
+      return _sensor_hash[slot] - 1;
+    }
+  }
+  return -1;
+}
+
+uint32_t sensor_field_count() { return _field_count; }
+
+const SensorField *sensor_field(uint32_t index) { return &_fields[index]; }
+
+uint32_t sensor_field_raw(const SensorField *field, const uint8_t *value,
+                          uint32_t length) {
+  const uint8_t *data = value + field->position;
+
+  if (field->position + _field_type_sizes[field->type] > length) {
+    return 0;
+  }
+
+  switch (field->type) {
+  case FIELD_UINT8:
+    return data[0];
+  case FIELD_INT8:
+    return (int8_t)data[0];
+  case FIELD_UINT16:
+    return data[0] | (data[1] << 8);
+  case FIELD_INT16:
+    return (int16_t)(data[0] | (data[1] << 8));
+  default:
+    return data[0] | (data[1] << 8) | (data[2] << 16) |
+           ((uint32_t)data[3] << 24);
+  }
+}
+
+double sensor_field_decode(const SensorField *field, const uint8_t *value,
+                           uint32_t length) {
+  uint32_t raw;
+
+  if (field->position + _field_type_sizes[field->type] > length) {
+    return 0;
+  }
+  raw = sensor_field_raw(field, value, length);
+
+  switch (field->type) {
+  case FIELD_INT8:
+  case FIELD_INT16:
+  case FIELD_INT32:
+    return (int32_t)raw * field->scale + field->offset;
+  default:
+    return raw * field->scale + field->offset;
+  }
+}
+
+// One loop without branches per conversion, which the compiler can
+// vectorize. 8 and 16-bit values convert as signed, which has a vector
+// instruction where unsigned has none. Doubles, as sensor_field_decode
+// gives, keep every 32-bit integer exact.
+void sensor_field_convert(const SensorField *field,
+                          const uint32_t *restrict raw, uint32_t count,
+                          double *restrict values) {
+  double scale = field->scale;
+  double offset = field->offset;
+  uint32_t i;
+
+  if (field->type == FIELD_UINT32) {
+    for (i = 0; i < count; i++) {
+      values[i] = raw[i] * scale + offset;
+    }
+  } else {
+    for (i = 0; i < count; i++) {
+      values[i] = (int32_t)raw[i] * scale + offset;
+    }
+  }
+}
+
+uint32_t sensor_service_count() { return _service_count; }
+
+const UUID *sensor_service(uint32_t index) { return &_services[index]; }
+
+uint32_t sensor_service_members(uint32_t index) {
+  return _service_members[index];
+}
@@ -47,6 +47,39 @@ static struct {
   { B38400, 38400  },
   { B57600, 57600  },
   { B115200, 115200 },
+#ifdef B230400
+  { B230400, 230400 },
+#endif
+#ifdef B460800
+  { B460800, 460800 },
+#endif
+#ifdef B500000
+  { B500000, 500000 },
+#endif
+#ifdef B576000
+  { B576000, 576000 },
+#endif
+#ifdef B921600
+  { B921600, 921600 },
+#endif
+#ifdef B1000000
+  { B1000000, 1000000 },
+#endif
+#ifdef B1152000
+  { B1152000, 1152000 },
+#endif
+#ifdef B1500000
+  { B1500000, 1500000 },
+#endif
+#ifdef B2000000
+  { B2000000, 2000000 },
+#endif
+#ifdef B2500000
+  { B2500000, 2500000 },
+#endif
+#ifdef B3000000
+  { B3000000, 3000000 },
+#endif
   { 0, 0 }
 };
 
@@ -60,31 +93,31 @@ static int32_t uartOpenSerial(int8_t* device, uint32_t bps, uint32_t dataBits, u
                               uint32_t stopBits, uint32_t rtsCts, uint32_t xOnXOff,
                               int32_t timeout);
 static int32_t uartCloseSerial(int32_t handle);
+#if __linux == 1
+/* uart_termios2.c */
+int32_t uartSetCustomBaudRate(int32_t handle, uint32_t bps);
+#endif /* __linux == 1 */
 
 /***************************************************************************************************
    Public Function Definitions
  **************************************************************************************************/
 int32_t uartOpen(int8_t* port, uint32_t baudRate, uint32_t rtsCts, int32_t timeout)
 {
-  uint8_t buf[4];
-
-  serialHandle = uartOpenSerial(port, baudRate, 8, 0, 1, rtsCts, 0, timeout);
+  serialHandle = uartOpenPort(port, baudRate, rtsCts, timeout);
 
   if (-1 == serialHandle) {
     return -1;
   }
 
-  // Flush all accumulated data in target
-  usleep(50000);
-  while (uartRxNonBlocking(4, buf) == 4) {
-  }
-
   return 0;
 }
 
 int32_t uartClose(void)
 {
-  return uartCloseSerial(serialHandle);
+  int32_t ret = uartClosePort(serialHandle);
+
+  serialHandle = -1;
+  return ret;
 }
 
 int32_t uartRx(uint32_t dataLength, uint8_t* data)
@@ -112,15 +145,59 @@ int32_t uartRx(uint32_t dataLength, uint8_t* data)
 }
 
 int32_t uartRxNonBlocking(uint32_t dataLength, uint8_t* data)
+{
+  return uartRxNonBlockingPort(serialHandle, dataLength, data);
+}
+
+int32_t uartRxPeek(void)
+{
+  return uartRxPeekPort(serialHandle);
+}
+
+int32_t uartGetHandle(void)
+{
+  return serialHandle;
+}
+
+int32_t uartTx(uint32_t dataLength, uint8_t* data)
+{
+  return uartTxPort(serialHandle, dataLength, data);
+}
+
+int32_t uartOpenPort(int8_t* port, uint32_t baudRate, uint32_t rtsCts, int32_t timeout)
+{
+  uint8_t buf[4];
+  int32_t handle;
+
+  handle = uartOpenSerial(port, baudRate, 8, 0, 1, rtsCts, 0, timeout);
+
+  if (-1 == handle) {
+    return -1;
+  }
+
+  // Flush all accumulated data in target
+  usleep(50000);
+  while (uartRxNonBlockingPort(handle, 4, buf) == 4) {
+  }
+
+  return handle;
+}
+
+int32_t uartClosePort(int32_t handle)
+{
+  return uartCloseSerial(handle);
+}
+
+int32_t uartRxNonBlockingPort(int32_t handle, uint32_t dataLength, uint8_t* data)
 {
   /** The amount of bytes read. */
   size_t dataRead;
 
-  if (serialHandle == -1) {
+  if (handle == -1) {
     return -1;
   }
 
-  dataRead = read(serialHandle, (void*)data, (size_t)dataLength);
+  dataRead = read(handle, (void*)data, (size_t)dataLength);
   if (-1 == dataRead) {
     return -1;
   }
@@ -128,34 +205,34 @@ int32_t uartRxNonBlocking(uint32_t dataLength, uint8_t* data)
   return (int32_t)dataRead;
 }
 
-int32_t uartRxPeek(void)
+int32_t uartRxPeekPort(int32_t handle)
 {
   int32_t bytesInBuf;
 
-  if (serialHandle == -1) {
+  if (handle == -1) {
     return -1;
   }
 
-  if (-1 == ioctl(serialHandle, FIONREAD, (int*)&bytesInBuf)) {
+  if (-1 == ioctl(handle, FIONREAD, (int*)&bytesInBuf)) {
     return -1;
   }
 
   return bytesInBuf;
 }
 
-int32_t uartTx(uint32_t dataLength, uint8_t* data)
+int32_t uartTxPort(int32_t handle, uint32_t dataLength, uint8_t* data)
 {
   /** The amount of bytes written. */
   size_t dataWritten;
   /** The amount of bytes still needed to be written. */
   size_t dataToWrite = dataLength;
 
-  if (serialHandle == -1) {
+  if (handle == -1) {
     return -1;
   }
 
   while (dataToWrite) {
-    dataWritten = write(serialHandle, (void*)data, dataToWrite);
+    dataWritten = write(handle, (void*)data, dataToWrite);
     if (-1 == dataWritten) {
       if (EAGAIN == errno) {
         continue;
@@ -194,18 +271,28 @@ static int32_t uartOpenSerial(int8_t* device, uint32_t bps, uint32_t dataBits, u
   uint32_t i;
   int32_t serial = -1;
   struct termios ttyAttrs = { 0 };
+  speed_t cbaud = B38400;
+#if __linux == 1
+  uint32_t customBaud = 0;
+#endif /* __linux == 1 */
 
-  /* Check if baud rate is supported. Return -1 if not. */
+  /* Check if baud rate is supported. Other rates need termios2 (Linux only),
+   * the port is configured at B38400 first and switched afterwards. */
   for (i = 0; speedTab[i].nspeed != 0; i++) {
     if (bps == speedTab[i].nspeed) {
+      cbaud = speedTab[i].cbaud;
       break;
     }
   }
   if (speedTab[i].nspeed == 0) {
+#if __linux == 1
+    customBaud = bps;
+#else
     fprintf(stderr, "Baud rate not supported %s - %s(%d).\n",
             (char*)device,
             strerror(errno), errno);
     goto error;
+#endif /* __linux == 1 */
   }
 
   /* Open the serial port read/write, with no controlling terminal, and don't wait for a
@@ -249,7 +336,7 @@ static int32_t uartOpenSerial(int8_t* device, uint32_t bps, uint32_t dataBits, u
   }
 
   /* Configure baud rate. */
-  if (cfsetspeed(&ttyAttrs, speedTab[i].cbaud) == -1) {
+  if (cfsetspeed(&ttyAttrs, cbaud) == -1) {
     fprintf(stderr, "Error setting baud rate %s - %s(%d).\n",
             (char*)device,
             strerror(errno), errno);
@@ -352,6 +439,15 @@ static int32_t uartOpenSerial(int8_t* device, uint32_t bps, uint32_t dataBits, u
     goto error;
   }
 
+#if __linux == 1
+  if (customBaud && uartSetCustomBaudRate(serial, customBaud) == -1) {
+    fprintf(stderr, "Error setting custom baud rate %u %s - %s(%d).\n",
+            customBaud, (char*)device,
+            strerror(errno), errno);
+    goto error;
+  }
+#endif /* __linux == 1 */
+
   /* Success */
   return serial;
 
@@ -0,0 +1,48 @@
+/*******************************************************************************
+ * Copyright Arrow Electronics, Inc., 2019
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ *******************************************************************************/
+
+/*******************************************************************************
+ * Arbitrary baud rates through the Linux termios2 interface. Kept apart from
+ * uart_posix.c because the kernel termios headers clash with <termios.h>.
+ *******************************************************************************/
+
+#if __linux == 1
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <asm/ioctls.h>
+#include <asm/termbits.h>
+
+/* Switch an already configured port to bps, keeping every other setting.
+ * Return 0 on success, -1 on failure. */
+int32_t uartSetCustomBaudRate(int32_t handle, uint32_t bps)
+{
+  struct termios2 tio;
+
+  if (ioctl(handle, TCGETS2, &tio) == -1) {
+    return -1;
+  }
+
+  tio.c_cflag &= ~CBAUD;
+  tio.c_cflag |= BOTHER;
+  tio.c_ospeed = bps;
+  tio.c_cflag &= ~(CBAUD << IBSHIFT);
+  tio.c_cflag |= BOTHER << IBSHIFT;
+  tio.c_ispeed = bps;
+
+  if (ioctl(handle, TCSETS2, &tio) == -1) {
+    return -1;
+  }
+
+  return 0;
+}
+
+#endif /* __linux == 1 */
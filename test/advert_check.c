@@ -0,0 +1,275 @@
+/*******************************************************************************
+ * Copyright Arrow Electronics, Inc., 2019
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ ******************************************************************************/
+
+/*******************************************************************************
+ *  Advert ingest checks
+ *
+ *  Feeds scan responses built in memory to advert_ingest() with the
+ *  built-in sensor table. Eddystone-TLM frames, manufacturer data and
+ *  service data must decode to their values, frames that are not version 0
+ *  TLM or too short to nothing. With the table full, a new address must be
+ *  untracked while every advertiser was heard lately, and take the slot of
+ *  the one quiet for longest once it was not heard for
+ *  ADVERTISER_TIMEOUT_MS, every other address staying where it was.
+ *******************************************************************************/
+
+#include "advert_ingest.h"
+#include "check.h"
+#include "log.h"
+#include "sensor_registry.h"
+
+#include <math.h>
+#include <string.h>
+
+#define SECOND_US 1000000ull
+#define TIMEOUT_US (ADVERTISER_TIMEOUT_MS * 1000ull)
+
+static struct gecko_cmd_packet _packet;
+
+static struct gecko_msg_le_gap_scan_response_evt_t *scan(uint32_t address) {
+  struct gecko_msg_le_gap_scan_response_evt_t *scan =
+      &_packet.data.evt_le_gap_scan_response;
+
+  memset(&_packet, 0, sizeof(_packet));
+  scan->rssi = -60;
+  scan->packet_type = 2;
+  scan->address.addr[0] = address & 0xFF;
+  scan->address.addr[1] = (address >> 8) & 0xFF;
+  scan->address.addr[5] = 0xC0;
+  return scan;
+}
+
+static void put_le(uint8_t *buffer, uint32_t value, uint32_t length) {
+  for (uint32_t i = 0; i < length; i++) {
+    buffer[i] = (value >> (8 * i)) & 0xFF;
+  }
+}
+
+static void put_be(uint8_t *buffer, uint32_t value, uint32_t length) {
+  for (uint32_t i = 0; i < length; i++) {
+    buffer[i] = (value >> (8 * (length - 1 - i))) & 0xFF;
+  }
+}
+
+// Append an AD structure of type holding length bytes of data
+static void put_field(struct gecko_msg_le_gap_scan_response_evt_t *scan,
+                      uint8_t type, const uint8_t *data, uint8_t length) {
+  uint8_t *field = &scan->data.data[scan->data.len];
+
+  field[0] = length + 1;
+  field[1] = type;
+  memcpy(&field[2], data, length);
+  scan->data.len += length + 2;
+}
+
+// Service data of an Eddystone-TLM frame of the given version, cut to
+// length bytes of frame
+static void put_tlm(struct gecko_msg_le_gap_scan_response_evt_t *scan,
+                    uint8_t version, uint8_t length) {
+  uint8_t data[2 + EDDYSTONE_TLM_LENGTH];
+
+  put_le(data, EDDYSTONE_UUID, 2);
+  data[2] = EDDYSTONE_TLM_FRAME;
+  data[3] = version;
+  put_be(&data[4], 2950, 2);
+  // -5.5 degrees in 8.8 fixed point
+  put_be(&data[6], 0xFA80, 2);
+  put_be(&data[8], 123456, 4);
+  put_be(&data[12], 987654, 4);
+  put_field(scan, AD_SERVICE_DATA_16, data, 2 + length);
+}
+
+static double field_of(const AdvertReading *reading, uint16_t uuid) {
+  UUID id = {2, {uuid & 0xFF, uuid >> 8}};
+  int index = sensor_find(&id);
+
+  return reading->values.fields[sensor_profile(index)->first_field];
+}
+
+static bool has_sensor(const AdvertReading *reading, uint16_t uuid) {
+  UUID id = {2, {uuid & 0xFF, uuid >> 8}};
+
+  return reading->sensors & (1u << sensor_find(&id));
+}
+
+// The reading of address, false if it is not tracked
+static bool find(uint32_t address, AdvertReading *reading) {
+  bd_addr wanted = scan(address)->address;
+
+  for (uint32_t i = 0; advert_reading(i, reading); i++) {
+    if (memcmp(reading->address.addr, wanted.addr, sizeof(wanted.addr)) ==
+        0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void check_tlm() {
+  AdvertReading reading;
+
+  put_tlm(scan(1), 0, EDDYSTONE_TLM_LENGTH);
+  CHECK(advert_ingest(&_packet.data.evt_le_gap_scan_response, SECOND_US),
+        "TLM frame not decoded");
+  CHECK(find(1, &reading), "TLM advertiser not tracked");
+  CHECK(reading.has_tlm, "has_tlm not set");
+  CHECK(reading.battery_mv == 2950, "battery %u mV, expected 2950",
+        reading.battery_mv);
+  CHECK(reading.temperature == -5.5, "temperature %.3f, expected -5.5",
+        reading.temperature);
+  CHECK(reading.advert_count == 123456, "advert count %u, expected 123456",
+        reading.advert_count);
+  CHECK(reading.uptime_s == 98765, "uptime %u s, expected 98765",
+        reading.uptime_s);
+  CHECK(reading.sensors == 0, "TLM frame gave sensors %x", reading.sensors);
+
+  put_tlm(scan(2), 1, EDDYSTONE_TLM_LENGTH);
+  CHECK(!advert_ingest(&_packet.data.evt_le_gap_scan_response, SECOND_US),
+        "version 1 TLM frame decoded");
+  put_tlm(scan(2), 0, EDDYSTONE_TLM_LENGTH - 1);
+  CHECK(!advert_ingest(&_packet.data.evt_le_gap_scan_response, SECOND_US),
+        "short TLM frame decoded");
+  CHECK(!find(2, &reading), "advertiser of undecoded frames tracked");
+}
+
+static void check_sensor_data() {
+  AdvertReading reading;
+  uint8_t data[16];
+
+  // Temperature and humidity records after the company ID
+  put_le(data, ADVERT_COMPANY_ID, 2);
+  put_le(&data[2], 0x2A6E, 2);
+  put_le(&data[4], (uint16_t)-1234, 2);
+  put_le(&data[6], 0x2A6F, 2);
+  put_le(&data[8], 4567, 2);
+  put_field(scan(3), AD_MANUFACTURER_DATA, data, 10);
+  CHECK(advert_ingest(&_packet.data.evt_le_gap_scan_response,
+                      SECOND_US + 1000),
+        "manufacturer data not decoded");
+  CHECK(find(3, &reading), "manufacturer data advertiser not tracked");
+  CHECK(has_sensor(&reading, 0x2A6E) && has_sensor(&reading, 0x2A6F) &&
+            !has_sensor(&reading, 0x2A6D),
+        "manufacturer data gave sensors %x", reading.sensors);
+  CHECK(fabs(field_of(&reading, 0x2A6E) + 12.34) < 1e-9,
+        "temperature %f, expected -12.34", field_of(&reading, 0x2A6E));
+  CHECK(fabs(field_of(&reading, 0x2A6F) - 45.67) < 1e-9,
+        "humidity %f, expected 45.67", field_of(&reading, 0x2A6F));
+
+  // Pressure as service data, with the name
+  put_le(data, 0x2A6D, 2);
+  put_le(&data[2], 1013250, 4);
+  put_field(scan(4), AD_SERVICE_DATA_16, data, 6);
+  put_field(&_packet.data.evt_le_gap_scan_response, AD_COMPLETE_LOCAL_NAME,
+            (const uint8_t *)"Beacon", 6);
+  CHECK(advert_ingest(&_packet.data.evt_le_gap_scan_response,
+                      SECOND_US + 2000),
+        "service data not decoded");
+  CHECK(find(4, &reading), "service data advertiser not tracked");
+  CHECK(strcmp(reading.name, "Beacon") == 0, "name '%s', expected Beacon",
+        reading.name);
+  CHECK(reading.sensors == (1u << sensor_find(&(UUID){2, {0x6D, 0x2A}})),
+        "service data gave sensors %x", reading.sensors);
+  CHECK(fabs(field_of(&reading, 0x2A6D) - 101325) < 1e-6,
+        "pressure %f, expected 101325", field_of(&reading, 0x2A6D));
+}
+
+static void check_take() {
+  static AdvertReading taken[ADVERT_MAX_BEACONS];
+  AdvertReading reading;
+  uint32_t count = advert_take(taken);
+
+  CHECK(count == 3, "%u readings taken, expected 3", count);
+  count = advert_take(taken);
+  CHECK(count == 0, "%u readings taken twice", count);
+
+  put_tlm(scan(1), 0, EDDYSTONE_TLM_LENGTH);
+  advert_ingest(&_packet.data.evt_le_gap_scan_response, 2 * SECOND_US);
+  count = advert_take(taken);
+  CHECK(count == 1 && taken[0].has_tlm && taken[0].updates == 2,
+        "%u readings taken after one update", count);
+
+  CHECK(advert_track(scan(1), 2 * SECOND_US, &reading) &&
+            reading.battery_mv == 2950 && reading.adverts == 3,
+        "advert_track did not copy out the reading");
+  advert_set_attempted(&reading.address, 2 * SECOND_US + 1);
+  CHECK(find(1, &reading) && reading.attempted_us == 2 * SECOND_US + 1,
+        "attempted_us not set");
+}
+
+static void check_eviction() {
+  static AdvertReading taken[ADVERT_MAX_BEACONS];
+  uint64_t full_us = 5 * SECOND_US;
+  AdvertReading reading;
+  AdvertStats stats;
+  uint32_t address;
+
+  // Addresses 1, 3 and 4 were heard around 1 s, 1 last at 2 s
+  for (address = 100; advert_reading_count() < ADVERT_MAX_BEACONS;
+       address++) {
+    advert_track(scan(address), full_us, &reading);
+  }
+  advert_take(taken);
+
+  put_tlm(scan(5000), 0, EDDYSTONE_TLM_LENGTH);
+  CHECK(!advert_ingest(&_packet.data.evt_le_gap_scan_response, full_us),
+        "advert of a new address decoded with the table full");
+  advert_get_stats(&stats);
+  CHECK(stats.untracked == 1 && stats.evicted == 0,
+        "%u untracked and %u evicted, expected 1 and 0", stats.untracked,
+        stats.evicted);
+
+  // 3 and 4 were quiet for longer than the timeout, 3 for longest
+  put_tlm(scan(5000), 0, EDDYSTONE_TLM_LENGTH);
+  CHECK(advert_ingest(&_packet.data.evt_le_gap_scan_response,
+                      SECOND_US + 2000 + TIMEOUT_US + 1),
+        "quiet advertiser not replaced");
+  advert_get_stats(&stats);
+  CHECK(stats.evicted == 1, "%u evicted, expected 1", stats.evicted);
+  CHECK(!find(3, &reading), "replaced advertiser still tracked");
+  CHECK(find(4, &reading) && reading.sensors, "advertiser 4 lost");
+  CHECK(find(5000, &reading) && reading.has_tlm && reading.updates == 1 &&
+            reading.attempted_us == 0,
+        "new advertiser not in the replaced slot");
+  CHECK(advert_reading_count() == ADVERT_MAX_BEACONS,
+        "%u advertisers tracked", advert_reading_count());
+  CHECK(advert_take(taken) == 1 && taken[0].has_tlm,
+        "reading of the new advertiser not taken");
+
+  // Every slot goes to a new address, which must then all be found again
+  uint64_t later_us = full_us + 2 * TIMEOUT_US;
+  for (address = 10000; address < 10000 + ADVERT_MAX_BEACONS; address++) {
+    CHECK(advert_track(scan(address), later_us, &reading),
+          "address %u not tracked", address);
+  }
+  for (address = 10000; address < 10000 + ADVERT_MAX_BEACONS; address++) {
+    CHECK(advert_track(scan(address), later_us, &reading) &&
+              reading.adverts == 2,
+          "address %u not found again", address);
+  }
+  advert_get_stats(&stats);
+  CHECK(stats.evicted == 1 + ADVERT_MAX_BEACONS && stats.untracked == 1,
+        "%u evicted and %u untracked, expected %u and 1", stats.evicted,
+        stats.untracked, 1 + ADVERT_MAX_BEACONS);
+  CHECK(!find(5000, &reading) && !find(100, &reading),
+        "replaced advertisers still tracked");
+}
+
+int main() {
+  log_set_quiet(1);
+  // No registry file, the built-in table
+  sensor_registry_load("");
+
+  check_tlm();
+  check_sensor_data();
+  check_take();
+  check_eviction();
+  return check_done("advert_check");
+}
@@ -0,0 +1,205 @@
+/*******************************************************************************
+ * Copyright Arrow Electronics, Inc., 2019
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ ******************************************************************************/
+
+/*******************************************************************************
+ *  Windowed statistics checks
+ *
+ *  Feeds rounds of temperature and humidity samples, far from 0 and at
+ *  uneven times, to aggregate_history() the way the upload thread does,
+ *  for tumbling and sliding windows. Every window with samples in it must
+ *  be reported once, oldest first, and the count, minimum, maximum, mean
+ *  and standard deviation its panes merge to must match a two-pass
+ *  computation over the same samples.
+ *******************************************************************************/
+
+#include "aggregate.h"
+#include "check.h"
+#include "log.h"
+#include "sensor_registry.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ROUNDS 300
+#define MAX_ROUND_SAMPLES 40
+#define MAX_SAMPLES (ROUNDS * MAX_ROUND_SAMPLES)
+#define TEMPERATURE 0
+#define HUMIDITY 2
+
+typedef struct WindowConfig {
+  uint32_t window_ms;
+  uint32_t step_ms;
+} WindowConfig;
+
+static const WindowConfig _configs[] = {
+    {10000, 10000}, {10000, 2500}, {60000, 5000}, {1000, 1000}, {3000, 200}};
+
+// Every sample fed, per sensor
+static uint64_t _time_us[MAX_SENSORS][MAX_SAMPLES];
+static double _value[MAX_SENSORS][MAX_SAMPLES];
+static uint32_t _count[MAX_SENSORS];
+
+static uint32_t _reported;
+static uint64_t _last_start_us;
+
+static bool close_to(double value, double expected) {
+  return fabs(value - expected) <= 1e-9 * fmax(1, fabs(expected));
+}
+
+// Two-pass statistics of the samples of sensor from start_us on, for as
+// long as the window
+static FieldStats reference(uint32_t sensor, uint64_t start_us) {
+  uint64_t end_us = start_us + aggregate_window_ms() * 1000ull;
+  FieldStats stats = {0};
+  double sum = 0;
+  uint32_t i;
+
+  for (i = 0; i < _count[sensor]; i++) {
+    double value = _value[sensor][i];
+    if (_time_us[sensor][i] < start_us || _time_us[sensor][i] >= end_us) {
+      continue;
+    }
+    if (stats.count == 0 || value < stats.min) {
+      stats.min = value;
+    }
+    if (stats.count == 0 || value > stats.max) {
+      stats.max = value;
+    }
+    stats.count++;
+    sum += value;
+  }
+  if (stats.count == 0) {
+    return stats;
+  }
+  stats.mean = sum / stats.count;
+  for (i = 0; i < _count[sensor]; i++) {
+    double delta = _value[sensor][i] - stats.mean;
+    if (_time_us[sensor][i] >= start_us && _time_us[sensor][i] < end_us) {
+      stats.m2 += delta * delta;
+    }
+  }
+  return stats;
+}
+
+static void check_window(const char *name, uint64_t start_us,
+                         const FieldStats *stats) {
+  uint32_t sensor;
+
+  CHECK(_reported == 0 || start_us > _last_start_us,
+        "window at %llu us reported after the one at %llu us",
+        (unsigned long long)start_us, (unsigned long long)_last_start_us);
+  _reported++;
+  _last_start_us = start_us;
+
+  for (sensor = 0; sensor < sensor_count(); sensor++) {
+    uint32_t field = sensor_profile(sensor)->first_field;
+    const FieldStats *got = &stats[field];
+    FieldStats want = reference(sensor, start_us);
+    CHECK(got->count == want.count, "%s at %llu us: %u samples, expected %u",
+          sensor_field(field)->name, (unsigned long long)start_us,
+          got->count, want.count);
+    if (want.count == 0 || got->count != want.count) {
+      continue;
+    }
+    CHECK(got->min == want.min && got->max == want.max,
+          "%s at %llu us: range %f to %f, expected %f to %f",
+          sensor_field(field)->name, (unsigned long long)start_us, got->min,
+          got->max, want.min, want.max);
+    CHECK(close_to(got->mean, want.mean), "%s at %llu us: mean %.12f, "
+          "expected %.12f", sensor_field(field)->name,
+          (unsigned long long)start_us, got->mean, want.mean);
+    CHECK(close_to(field_stats_stddev(got), field_stats_stddev(&want)),
+          "%s at %llu us: standard deviation %.12f, expected %.12f",
+          sensor_field(field)->name, (unsigned long long)start_us,
+          field_stats_stddev(got), field_stats_stddev(&want));
+  }
+}
+
+static void check_config(const WindowConfig *config) {
+  static SensorHistory history;
+  static double values[MAX_SENSOR_FIELDS][SENSOR_HISTORY_LENGTH];
+  static Aggregate aggregate;
+  uint32_t sensors[] = {TEMPERATURE, HUMIDITY};
+  uint64_t step_us = config->step_ms * 1000ull;
+  uint32_t panes = config->window_ms / config->step_ms;
+  uint64_t now_us = 1000 * 1000000ull;
+  uint32_t expected = 0;
+  uint32_t round;
+  uint32_t i;
+  uint64_t pane;
+
+  CHECK(aggregate_set_window(config->window_ms, config->step_ms) == 0,
+        "window of %u ms in steps of %u ms refused", config->window_ms,
+        config->step_ms);
+  memset(&aggregate, 0, sizeof(aggregate));
+  memset(&history, 0, sizeof(history));
+  memset(_count, 0, sizeof(_count));
+  snprintf(history.name, sizeof(history.name), "Board");
+  _reported = 0;
+
+  for (round = 0; round < ROUNDS; round++) {
+    uint32_t samples = rand() % MAX_ROUND_SAMPLES;
+    uint32_t n;
+
+    memset(history.read, 0, sizeof(history.read));
+    memset(history.written, 0, sizeof(history.written));
+    for (n = 0; n < samples; n++) {
+      uint32_t sensor = sensors[rand() % 2];
+      uint32_t field = sensor_profile(sensor)->first_field;
+      uint32_t slot = history.written[sensor]++;
+      // Large against its spread, where sums of squares lose the variance
+      double value = 1e6 + (rand() % 100000) / 7.0;
+
+      now_us += rand() % (config->step_ms * 250);
+      history.time_us[sensor][slot] = now_us;
+      values[field][slot] = value;
+      _time_us[sensor][_count[sensor]] = now_us;
+      _value[sensor][_count[sensor]++] = value;
+    }
+    now_us += rand() % (config->step_ms * 1000);
+    aggregate_history(&aggregate, samples ? &history : NULL, values, now_us,
+                      check_window);
+  }
+  CHECK(aggregate.late == 0, "%u samples late", aggregate.late);
+
+  // Every window ending by now_us with a sample in it
+  uint64_t first = UINT64_MAX;
+  for (i = 0; i < MAX_SENSORS; i++) {
+    if (_count[i] && _time_us[i][0] / step_us < first) {
+      first = _time_us[i][0] / step_us;
+    }
+  }
+  for (pane = first; pane < now_us / step_us; pane++) {
+    uint64_t start_us = (pane + 1 - panes) * step_us;
+    if (reference(TEMPERATURE, start_us).count ||
+        reference(HUMIDITY, start_us).count) {
+      expected++;
+    }
+  }
+  CHECK(_reported == expected,
+        "%u windows of %u ms in steps of %u ms reported, expected %u",
+        _reported, config->window_ms, config->step_ms, expected);
+}
+
+int main() {
+  uint32_t i;
+
+  log_set_quiet(1);
+  // No registry file, the built-in table
+  sensor_registry_load("");
+  srand(1);
+
+  for (i = 0; i < sizeof(_configs) / sizeof(_configs[0]); i++) {
+    check_config(&_configs[i]);
+  }
+  return check_done("aggregate_check");
+}
@@ -0,0 +1,730 @@
+/*******************************************************************************
+ * Copyright Arrow Electronics, Inc., 2019
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ ******************************************************************************/
+
+/*******************************************************************************
+ *  BGLIB checks
+ *
+ *  Feeds BGAPI messages from memory to the library in buffered mode and
+ *  checks what comes out of it:
+ *    - frames of every payload length, split over reads of different sizes
+ *      so headers and payloads wrap around the end of the receive ring,
+ *      with line noise between some of them
+ *    - bursts of events of different lengths held in the event queue while
+ *      a command waits, wrapping around its end, and bursts too large for
+ *      it starting at different offsets: exactly the events that fit must
+ *      come out, unchanged
+ *    - the same with scan responses coalesced: each address keeps only its
+ *      newest one, in place if of the same length, otherwise the old one
+ *      is skipped and the new one queued last
+ *    - async commands of different IDs, each answered after an event: every
+ *      callback gets the response of its own command, in the order sent,
+ *      and after the events received before that response
+ *    - the reader thread filling its queue while an async command waits
+ *      for its response, only events may be dropped
+ *    - two contexts on two NCPs, one with a reader thread: commands,
+ *      events and filters of one must not reach the other
+ *******************************************************************************/
+
+#include "check.h"
+#include "gecko_bglib.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+BGLIB_DEFINE();
+
+#define NUM_NCPS 2
+#define INPUT_LEN (1 << 20)
+#define WRAP_FRAMES 300
+#define NOISE_INTERVAL 50
+#define OVERFLOW_EVENTS (BGLIB_READER_QUEUE_LEN + 64)
+#define TIMEOUT_US 2000000
+#define ASYNC_COMMANDS 20
+#define BURST_ROUNDS 60
+#define OVERFLOW_BURST 400
+#define MAX_BURST 1000
+#define SCAN_BURST 205
+#define SCAN_ADDRESSES 5
+#define SCAN_HEADER_LEN 11
+#define LOG_EVENT 0x100
+#define CONTEXT_ROUNDS 4
+
+// A simulated NCP. Its input holds the bytes it sent that were not read
+// yet, [input_r, input_w), the reader thread reads them while the
+// application sends commands.
+typedef struct Ncp {
+  uint8_t input[INPUT_LEN];
+  uint32_t input_w;
+  uint32_t input_r;
+  pthread_mutex_t mutex;
+  // Most bytes one read returns, 0 for no limit
+  uint32_t chunk;
+  // Called with the header of each command sent, queues the answer
+  void (*on_command)(struct Ncp *ncp, uint32_t header);
+} Ncp;
+
+// Serial handles are indexes, the default context uses the first one
+static Ncp _ncps[NUM_NCPS] = {{.mutex = PTHREAD_MUTEX_INITIALIZER},
+                              {.mutex = PTHREAD_MUTEX_INITIALIZER}};
+
+static int32_t ncp_tx(int32_t handle, uint32_t len, uint8_t *data) {
+  Ncp *ncp = &_ncps[handle];
+  uint32_t header;
+
+  memcpy(&header, data, BGLIB_MSG_HEADER_LEN);
+  if (ncp->on_command) {
+    ncp->on_command(ncp, header);
+  }
+  return len;
+}
+
+static int32_t ncp_rx(int32_t handle, uint32_t len, uint8_t *data) {
+  Ncp *ncp = &_ncps[handle];
+  uint32_t available;
+
+  pthread_mutex_lock(&ncp->mutex);
+  available = ncp->input_w - ncp->input_r;
+  if (len > available) {
+    len = available;
+  }
+  if (ncp->chunk && len > ncp->chunk) {
+    len = ncp->chunk;
+  }
+  memcpy(data, &ncp->input[ncp->input_r], len);
+  ncp->input_r += len;
+  pthread_mutex_unlock(&ncp->mutex);
+
+  if (len == 0) {
+    usleep(100);  // a serial read timing out
+  }
+  return len;
+}
+
+static int32_t ncp_rx_peek(int32_t handle) {
+  Ncp *ncp = &_ncps[handle];
+  int32_t available;
+
+  pthread_mutex_lock(&ncp->mutex);
+  available = ncp->input_w - ncp->input_r;
+  pthread_mutex_unlock(&ncp->mutex);
+  return available;
+}
+
+// I/O functions of the first NCP for BGLIB_INITIALIZE_BUFFERED
+static void ncp_output(uint32_t len, uint8_t *data) { ncp_tx(0, len, data); }
+
+static int32_t ncp_read(uint32_t len, uint8_t *data) {
+  return ncp_rx(0, len, data);
+}
+
+static int32_t ncp_peek(void) { return ncp_rx_peek(0); }
+
+static Ncp *ncp_reset(uint32_t handle, uint32_t chunk,
+                      void (*on_command)(Ncp *ncp, uint32_t header)) {
+  Ncp *ncp = &_ncps[handle];
+
+  pthread_mutex_lock(&ncp->mutex);
+  ncp->input_w = ncp->input_r = 0;
+  ncp->chunk = chunk;
+  ncp->on_command = on_command;
+  pthread_mutex_unlock(&ncp->mutex);
+  return ncp;
+}
+
+static uint64_t now_us(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000ull + now.tv_nsec / 1000;
+}
+
+static uint32_t msg_header(uint32_t msg_id, uint32_t length) {
+  return msg_id | (length & 0xff) << 8 | (length >> 8 & 0x7);
+}
+
+static void ncp_send(Ncp *ncp, uint32_t header, const void *payload) {
+  uint32_t length = BGLIB_MSG_LEN(header);
+
+  pthread_mutex_lock(&ncp->mutex);
+  if (ncp->input_w + BGLIB_MSG_HEADER_LEN + length > INPUT_LEN) {
+    fprintf(stderr, "Input buffer too small\n");
+    exit(1);
+  }
+  memcpy(&ncp->input[ncp->input_w], &header, BGLIB_MSG_HEADER_LEN);
+  if (length) {
+    memcpy(&ncp->input[ncp->input_w + BGLIB_MSG_HEADER_LEN], payload, length);
+  }
+  ncp->input_w += BGLIB_MSG_HEADER_LEN + length;
+  pthread_mutex_unlock(&ncp->mutex);
+}
+
+static void ncp_send_noise(Ncp *ncp) {
+  pthread_mutex_lock(&ncp->mutex);
+  ncp->input[ncp->input_w++] = 0x00;
+  pthread_mutex_unlock(&ncp->mutex);
+}
+
+// Event number n of a stream, of every length from 0 to the largest payload
+static uint32_t wrap_event(uint32_t n, uint8_t *payload) {
+  uint32_t length = n * 37 % (BGLIB_MSG_MAX_PAYLOAD + 1);
+  uint32_t i;
+
+  for (i = 0; i < length; i++) {
+    payload[i] = n + i;
+  }
+  return msg_header(gecko_evt_system_awake_id, length);
+}
+
+static void check_ring_wraparound(void) {
+  static const uint32_t chunks[] = {1, 3, 7, 64, 1000, 0};
+  uint8_t payload[BGLIB_MSG_MAX_PAYLOAD];
+  struct gecko_rx_stats before, after;
+  struct gecko_cmd_packet *p;
+  uint32_t c, n;
+
+  for (c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++) {
+    Ncp *ncp = ncp_reset(0, chunks[c], NULL);
+    for (n = 0; n < WRAP_FRAMES; n++) {
+      uint32_t header = wrap_event(n, payload);
+      if (n % NOISE_INTERVAL == 0) {
+        ncp_send_noise(ncp);
+      }
+      ncp_send(ncp, header, payload);
+    }
+
+    gecko_get_rx_stats(&before);
+    n = 0;
+    while ((p = gecko_peek_event())) {
+      uint32_t header = wrap_event(n, payload);
+      CHECK(p->header == header, "reads of %u: event %u header %08x, not %08x",
+            chunks[c], n, p->header, header);
+      CHECK(p->header != header ||
+                !memcmp(p->data.payload, payload, BGLIB_MSG_LEN(header)),
+            "reads of %u: event %u payload differs", chunks[c], n);
+      n++;
+    }
+    gecko_get_rx_stats(&after);
+
+    CHECK(n == WRAP_FRAMES, "reads of %u: %u events, not %u", chunks[c], n,
+          WRAP_FRAMES);
+    CHECK(ncp->input_r == ncp->input_w, "reads of %u: %u bytes left unread",
+          chunks[c], ncp->input_w - ncp->input_r);
+    CHECK(after.frames - before.frames == WRAP_FRAMES,
+          "reads of %u: %u frames parsed", chunks[c],
+          after.frames - before.frames);
+    CHECK(after.bytes - before.bytes > 4 * BGLIB_RX_BUFFER_LEN,
+          "reads of %u: only %u bytes, the ring did not wrap", chunks[c],
+          after.bytes - before.bytes);
+  }
+}
+
+// Event n of a burst, its number and a pattern in length bytes
+static uint32_t burst_event(uint32_t n, uint32_t length, uint8_t *payload) {
+  uint32_t i;
+
+  for (i = 0; i < length; i++) {
+    payload[i] = i < 2 ? n >> (8 * i) : n + i;
+  }
+  return msg_header(gecko_evt_system_awake_id, length);
+}
+
+// Payload lengths of the events of the next burst
+static uint32_t _burst[MAX_BURST];
+static uint32_t _burst_count;
+
+// The burst, then the response
+static void answer_after_burst(Ncp *ncp, uint32_t header) {
+  uint8_t payload[BGLIB_MSG_MAX_PAYLOAD];
+  uint16_t result = 0;
+  uint32_t n;
+
+  for (n = 0; n < _burst_count; n++) {
+    ncp_send(ncp, burst_event(n, _burst[n], payload), payload);
+  }
+  ncp_send(ncp, msg_header(BGLIB_MSG_ID(header), sizeof(result)), &result);
+}
+
+// Offset the library writes the next event queue record at. Records are
+// padded to 4 bytes, one that does not fit before the end of the queue
+// goes to its start and the rest of the end is filler.
+static uint32_t _queue_w;
+
+// Add an event to the queue holding [start, _queue_w), 0 if it is full
+static int queue_add(uint32_t start, uint32_t length) {
+  uint32_t need = (BGLIB_MSG_HEADER_LEN + length + 3) & ~3u;
+  uint32_t room = BGLIB_QUEUE_BYTES - (_queue_w - start);
+  uint32_t to_end = BGLIB_QUEUE_BYTES - _queue_w % BGLIB_QUEUE_BYTES;
+
+  if (to_end < need) {
+    if (room < to_end + need) {
+      return 0;
+    }
+    _queue_w += to_end;
+  } else if (room < need) {
+    return 0;
+  }
+  _queue_w += need;
+  return 1;
+}
+
+// Answer a command with the burst, so every event is queued while the
+// command waits, then take them. The events that fit must come out
+// unchanged and the others be counted as dropped.
+static void run_burst(const char *what, uint32_t round) {
+  uint8_t payload[BGLIB_MSG_MAX_PAYLOAD];
+  uint32_t kept[MAX_BURST];
+  uint32_t start = _queue_w;
+  uint32_t count = 0;
+  uint32_t n = 0;
+  struct gecko_rx_stats before, after;
+  struct gecko_cmd_packet *p;
+
+  for (n = 0; n < _burst_count; n++) {
+    if (queue_add(start, _burst[n])) {
+      kept[count++] = n;
+    }
+  }
+
+  ncp_reset(0, 0, answer_after_burst);
+  gecko_get_rx_stats(&before);
+  gecko_cmd_system_hello();
+  n = 0;
+  while ((p = gecko_peek_event())) {
+    if (n < count) {
+      uint32_t header = burst_event(kept[n], _burst[kept[n]], payload);
+      CHECK(p->header == header &&
+                !memcmp(p->data.payload, payload, BGLIB_MSG_LEN(header)),
+            "%s %u: event %u of %u differs", what, round, kept[n],
+            _burst_count);
+    }
+    n++;
+  }
+  gecko_get_rx_stats(&after);
+
+  CHECK(n == count, "%s %u: %u events taken, not %u", what, round, n, count);
+  CHECK(after.dropped - before.dropped == _burst_count - count,
+        "%s %u: %u events dropped, not %u", what, round,
+        after.dropped - before.dropped, _burst_count - count);
+}
+
+// Queue empty events until the next record goes to offset
+static void move_queue(uint32_t offset) {
+  uint32_t n;
+
+  while (_queue_w % BGLIB_QUEUE_BYTES != offset) {
+    _burst_count = (offset - _queue_w) % BGLIB_QUEUE_BYTES / 4;
+    if (_burst_count > MAX_BURST) {
+      _burst_count = MAX_BURST;
+    }
+    for (n = 0; n < _burst_count; n++) {
+      _burst[n] = 0;
+    }
+    run_burst("move to", offset);
+  }
+}
+
+static void check_event_queue(void) {
+  // just past the start, just before the end and in between
+  static const uint32_t starts[] = {0,    4,    8,    40,   100,
+                                    200,  4096, 8000, 8100, 8188};
+  struct bglib_context *ctx = bglib_context_create();
+  uint32_t round;
+  uint32_t n;
+
+  // a fresh queue, so where records go is known
+  bglib_select(ctx);
+  BGLIB_INITIALIZE_BUFFERED(ncp_output, ncp_read, ncp_peek);
+  _queue_w = 0;
+
+  // bursts that fit, of 2 to 121 bytes, wrapping around many times
+  for (round = 0; round < BURST_ROUNDS; round++) {
+    _burst_count = 20 + round % 30;
+    for (n = 0; n < _burst_count; n++) {
+      _burst[n] = 2 + (round * 7 + n * 13) % 120;
+    }
+    run_burst("round", round);
+  }
+
+  // bursts larger than the queue from different starts, the last events
+  // that fit wrap around
+  for (round = 0; round < 2 * sizeof(starts) / sizeof(starts[0]); round++) {
+    move_queue(starts[round / 2]);
+    _burst_count = OVERFLOW_BURST;
+    for (n = 0; n < _burst_count; n++) {
+      _burst[n] = 20 + round * 9 + n % 2 * (round % 2) * 40;
+    }
+    run_burst("overflow", round);
+  }
+
+  bglib_select(bglib_default_context());
+  bglib_context_destroy(ctx);
+}
+
+// Event n of a scan burst: a scan response from one of a few addresses
+// with 3 or 10 bytes of data, or now and then another event
+static uint32_t scan_event(uint32_t n, uint8_t *payload) {
+  uint32_t length = n / SCAN_ADDRESSES % 3 == 2 ? 10 : 3;
+  uint32_t i;
+
+  if (n % 7 == 6) {
+    payload[0] = n;
+    return msg_header(gecko_evt_system_awake_id, 1);
+  }
+  memset(payload, 0, SCAN_HEADER_LEN);
+  payload[0] = n;                       // rssi
+  payload[2] = n % SCAN_ADDRESSES;      // address
+  payload[7] = 0xC0;
+  payload[10] = length;                 // data.len
+  for (i = 0; i < length; i++) {
+    payload[SCAN_HEADER_LEN + i] = n + i;
+  }
+  return msg_header(gecko_evt_le_gap_scan_response_id,
+                    SCAN_HEADER_LEN + length);
+}
+
+static void answer_with_scans(Ncp *ncp, uint32_t header) {
+  uint8_t payload[BGLIB_MSG_MAX_PAYLOAD];
+  uint16_t result = 0;
+  uint32_t n;
+
+  for (n = 0; n < SCAN_BURST; n++) {
+    ncp_send(ncp, scan_event(n, payload), payload);
+  }
+  ncp_send(ncp, msg_header(BGLIB_MSG_ID(header), sizeof(result)), &result);
+}
+
+static void check_coalesced_scans(void) {
+  // numbers of the events expected, in queue order
+  uint32_t expected[SCAN_BURST];
+  uint32_t expected_count = 0;
+  uint32_t coalesced = 0;
+  uint8_t payload[BGLIB_MSG_MAX_PAYLOAD];
+  uint8_t queued[BGLIB_MSG_MAX_PAYLOAD];
+  struct bglib_context *ctx = bglib_context_create();
+  struct gecko_rx_stats before, after;
+  struct gecko_cmd_packet *p;
+  uint32_t round;
+  uint32_t n, i;
+
+  for (n = 0; n < SCAN_BURST; n++) {
+    uint32_t header = scan_event(n, payload);
+
+    if (BGLIB_MSG_ID(header) != gecko_evt_le_gap_scan_response_id) {
+      expected[expected_count++] = n;
+      continue;
+    }
+    for (i = 0; i < expected_count; i++) {
+      uint32_t queued_header = scan_event(expected[i], queued);
+      if (BGLIB_MSG_ID(queued_header) == gecko_evt_le_gap_scan_response_id &&
+          queued[2] == payload[2]) {
+        break;
+      }
+    }
+    if (i < expected_count) {
+      coalesced++;
+      if (scan_event(expected[i], queued) == header) {
+        expected[i] = n;
+        continue;
+      }
+      memmove(&expected[i], &expected[i + 1],
+              (expected_count - i - 1) * sizeof(expected[0]));
+      expected_count--;
+    }
+    expected[expected_count++] = n;
+  }
+
+  bglib_select(ctx);
+  BGLIB_INITIALIZE_BUFFERED(ncp_output, ncp_read, ncp_peek);
+  gecko_filter_coalesce_scans(1);
+
+  // the second burst must not touch the events taken from the first
+  for (round = 0; round < 2; round++) {
+    ncp_reset(0, 0, answer_with_scans);
+    gecko_get_rx_stats(&before);
+    gecko_cmd_system_hello();
+    n = 0;
+    while ((p = gecko_peek_event())) {
+      if (n < expected_count) {
+        uint32_t header = scan_event(expected[n], payload);
+        CHECK(p->header == header &&
+                  !memcmp(p->data.payload, payload, BGLIB_MSG_LEN(header)),
+              "burst %u: event %u is not event %u of the burst", round, n,
+              expected[n]);
+      }
+      n++;
+    }
+    gecko_get_rx_stats(&after);
+    CHECK(n == expected_count, "burst %u: %u events, not %u", round, n,
+          expected_count);
+    CHECK(after.coalesced - before.coalesced == coalesced,
+          "burst %u: %u scan responses coalesced, not %u", round,
+          after.coalesced - before.coalesced, coalesced);
+    CHECK(after.dropped == before.dropped, "burst %u: %u events dropped",
+          round, after.dropped - before.dropped);
+  }
+
+  bglib_select(bglib_default_context());
+  bglib_context_destroy(ctx);
+}
+
+static uint32_t _commands;
+
+// An event numbered like the command, then the response with the number as
+// result
+static void answer_numbered(Ncp *ncp, uint32_t header) {
+  uint16_t result = _commands++;
+  uint8_t number = result;
+
+  ncp_send(ncp, msg_header(gecko_evt_system_awake_id, sizeof(number)),
+           &number);
+  ncp_send(ncp, msg_header(BGLIB_MSG_ID(header), sizeof(result)), &result);
+}
+
+// Events and callbacks in the order the application saw them
+static uint32_t _log[2 * ASYNC_COMMANDS];
+static uint32_t _log_length;
+
+static void log_append(uint32_t entry) {
+  if (_log_length < sizeof(_log) / sizeof(_log[0])) {
+    _log[_log_length] = entry;
+  }
+  _log_length++;
+}
+
+static const uint32_t _async_ids[] = {gecko_cmd_system_hello_id,
+                                      gecko_cmd_le_gap_end_procedure_id,
+                                      gecko_cmd_system_get_counters_id};
+
+static void numbered_completed(struct gecko_cmd_packet *response,
+                               void *context) {
+  uint32_t number = (uintptr_t)context;
+  uint32_t msg_id = _async_ids[number % 3];
+  uint16_t result = response->data.rsp_system_hello.result;
+
+  CHECK(BGLIB_MSG_ID(response->header) == msg_id,
+        "command %u answered by %08x, not %08x", number,
+        BGLIB_MSG_ID(response->header), msg_id);
+  CHECK(result == number, "command %u got the response of %u", number,
+        result);
+  log_append(number);
+}
+
+static void send_numbered(uint32_t number) {
+  void *context = (void *)(uintptr_t)number;
+
+  switch (number % 3) {
+  case 0:
+    GECKO_ASYNC(numbered_completed, context, gecko_cmd_system_hello());
+    break;
+  case 1:
+    GECKO_ASYNC(numbered_completed, context,
+                gecko_cmd_le_gap_end_procedure());
+    break;
+  default:
+    GECKO_ASYNC(numbered_completed, context,
+                gecko_cmd_system_get_counters(0));
+    break;
+  }
+}
+
+// Send count commands, then take every event and run every callback
+static void run_async(uint32_t count) {
+  struct gecko_cmd_packet *p;
+  uint32_t n;
+
+  ncp_reset(0, 0, answer_numbered);
+  _commands = 0;
+  _log_length = 0;
+  for (n = 0; n < count; n++) {
+    send_numbered(n);
+  }
+  while ((p = gecko_peek_event())) {
+    log_append(LOG_EVENT | p->data.payload[0]);
+  }
+  CHECK(gecko_async_pending() == 0, "%u of %u async commands pending",
+        gecko_async_pending(), count);
+  CHECK(_log_length == 2 * count, "%u events and callbacks, not %u",
+        _log_length, 2 * count);
+}
+
+static void check_async_fifo(void) {
+  uint32_t event, callback;
+  uint32_t n;
+
+  // all in flight at once, each callback right after its event
+  run_async(BGLIB_ASYNC_MAX_PENDING);
+  for (n = 0; n < _log_length && n < 2 * BGLIB_ASYNC_MAX_PENDING; n++) {
+    uint32_t expected = n % 2 ? n / 2 : LOG_EVENT | n / 2;
+    CHECK(_log[n] == expected, "entry %u is %03x, not %03x", n, _log[n],
+          expected);
+  }
+
+  // a full pipeline completes the oldest commands while sending, before
+  // the application takes their events, so only the order of each kind
+  // is kept
+  run_async(ASYNC_COMMANDS);
+  event = callback = 0;
+  for (n = 0; n < _log_length && n < 2 * ASYNC_COMMANDS; n++) {
+    if (_log[n] & LOG_EVENT) {
+      CHECK(_log[n] == (LOG_EVENT | event), "event %u came as %u", event,
+            _log[n] & ~LOG_EVENT);
+      event++;
+    } else {
+      CHECK(_log[n] == callback, "callback %u came as %u", callback, _log[n]);
+      CHECK(callback < event || callback + BGLIB_ASYNC_MAX_PENDING <
+                                    ASYNC_COMMANDS,
+            "callback %u before its event", callback);
+      callback++;
+    }
+  }
+}
+
+// More events than the reader queue holds, then the response
+static void answer_after_overflow(Ncp *ncp, uint32_t header) {
+  uint16_t result = 0;
+  uint32_t n;
+
+  for (n = 0; n < OVERFLOW_EVENTS; n++) {
+    ncp_send(ncp, msg_header(gecko_evt_system_awake_id, 0), NULL);
+  }
+  ncp_send(ncp, msg_header(BGLIB_MSG_ID(header), sizeof(result)), &result);
+}
+
+static uint32_t _hello_responses;
+
+static void hello_completed(struct gecko_cmd_packet *response, void *context) {
+  CHECK(BGLIB_MSG_ID(response->header) == gecko_rsp_system_hello_id,
+        "hello answered by %08x", BGLIB_MSG_ID(response->header));
+  _hello_responses++;
+}
+
+static void check_reader_keeps_responses(void) {
+  struct gecko_reader_stats stats;
+  uint64_t deadline = now_us() + TIMEOUT_US;
+  uint32_t events = 0;
+
+  ncp_reset(0, 0, answer_after_overflow);
+  _hello_responses = 0;
+  CHECK(gecko_reader_start() == 0, "reader thread did not start");
+
+  // the application is busy until the reader thread has read everything
+  GECKO_ASYNC(hello_completed, NULL, gecko_cmd_system_hello());
+  do {
+    usleep(1000);
+    gecko_get_reader_stats(&stats);
+  } while ((ncp_peek() || stats.dropped < OVERFLOW_EVENTS -
+                                              BGLIB_READER_QUEUE_LEN) &&
+           now_us() < deadline);
+
+  while (gecko_async_pending() && now_us() < deadline) {
+    if (gecko_peek_event()) {
+      events++;
+    }
+  }
+  gecko_get_reader_stats(&stats);
+  gecko_reader_stop();
+
+  CHECK(_hello_responses == 1, "response dropped with a full reader queue");
+  CHECK(stats.dropped == OVERFLOW_EVENTS - BGLIB_READER_QUEUE_LEN,
+        "%u messages dropped, not %u events", stats.dropped,
+        OVERFLOW_EVENTS - BGLIB_READER_QUEUE_LEN);
+  CHECK(events == BGLIB_READER_QUEUE_LEN, "%u events, not %u", events,
+        BGLIB_READER_QUEUE_LEN);
+}
+
+static uint32_t _answered[NUM_NCPS];
+
+// An event with the NCP's handle, then the response with it as result
+static void answer_with_handle(Ncp *ncp, uint32_t header) {
+  uint16_t result = ncp - _ncps;
+  uint8_t handle = result;
+
+  _answered[handle]++;
+  ncp_send(ncp, msg_header(gecko_evt_system_awake_id, sizeof(handle)),
+           &handle);
+  ncp_send(ncp, msg_header(BGLIB_MSG_ID(header), sizeof(result)), &result);
+}
+
+// Events of ctx waiting, checked to come from the NCP of handle
+static uint32_t take_events(struct bglib_context *ctx, uint32_t handle) {
+  struct gecko_cmd_packet *p;
+  uint32_t count = 0;
+
+  while ((p = bglib_get_event(ctx, 0))) {
+    CHECK(p->data.payload[0] == handle, "context %u got an event of NCP %u",
+          handle, p->data.payload[0]);
+    count++;
+  }
+  return count;
+}
+
+static void check_two_contexts(void) {
+  struct bglib_context *contexts[NUM_NCPS] = {bglib_default_context(),
+                                              bglib_context_create()};
+  struct gecko_rx_stats stats;
+  uint32_t round;
+  uint32_t i;
+
+  bglib_initialize_serial(contexts[1], 1, ncp_tx, ncp_rx, ncp_rx_peek);
+  for (i = 0; i < NUM_NCPS; i++) {
+    ncp_reset(i, 0, answer_with_handle);
+    _answered[i] = 0;
+  }
+  CHECK(bglib_reader_start(contexts[1]) == 0, "reader thread did not start");
+
+  for (round = 0; round < CONTEXT_ROUNDS; round++) {
+    for (i = 0; i < NUM_NCPS; i++) {
+      uint16_t result =
+          GECKO_CTX(contexts[i], gecko_cmd_system_hello())->result;
+      CHECK(result == i, "context %u answered by NCP %u", i, result);
+    }
+  }
+  for (i = 0; i < NUM_NCPS; i++) {
+    uint32_t events = take_events(contexts[i], i);
+    CHECK(events == CONTEXT_ROUNDS, "context %u: %u events, not %u", i,
+          events, CONTEXT_ROUNDS);
+  }
+
+  // a filter and a command on the second context while the first one is
+  // selected
+  bglib_select(contexts[0]);
+  bglib_filter_drop_event(contexts[1], gecko_evt_system_awake_id);
+  CHECK(bglib_hello(contexts[1], TIMEOUT_US / 1000) == 0,
+        "second NCP did not answer hello");
+  CHECK(bglib_selected() == contexts[0], "hello changed the selection");
+  gecko_cmd_system_hello();
+  CHECK(take_events(contexts[0], 0) == 1, "first context lost its event");
+  CHECK(take_events(contexts[1], 1) == 0, "filter did not drop the event");
+  for (i = 0; i < NUM_NCPS; i++) {
+    CHECK(_answered[i] == CONTEXT_ROUNDS + 1, "NCP %u got %u commands", i,
+          _answered[i]);
+    bglib_get_rx_stats(contexts[i], &stats);
+    CHECK(stats.filtered == i, "context %u: %u events filtered", i,
+          stats.filtered);
+  }
+
+  bglib_context_destroy(contexts[1]);
+}
+
+int main(void) {
+  BGLIB_INITIALIZE_BUFFERED(ncp_output, ncp_read, ncp_peek);
+
+  check_ring_wraparound();
+  check_event_queue();
+  check_coalesced_scans();
+  check_async_fifo();
+  check_reader_keeps_responses();
+  check_two_contexts();
+  return check_done("bglib_check");
+}
@@ -0,0 +1,43 @@
+/*******************************************************************************
+ * Copyright Arrow Electronics, Inc., 2019
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ ******************************************************************************/
+
+#ifndef __TEST_CHECK_H
+#define __TEST_CHECK_H
+
+#include <stdio.h>
+
+// Shared by the check programs run by make check. A failed CHECK prints
+// where and why and makes check_done() return nonzero, the program goes on
+// to the next check.
+
+static int _check_failures;
+
+#define CHECK(COND, ...)                                                       \
+  do {                                                                         \
+    if (!(COND)) {                                                             \
+      fprintf(stderr, "%s:%d: ", __FILE__, __LINE__);                          \
+      fprintf(stderr, __VA_ARGS__);                                            \
+      fputc('\n', stderr);                                                     \
+      _check_failures++;                                                       \
+    }                                                                          \
+  } while (0)
+
+// Exit status of the program
+static inline int check_done(const char *name) {
+  if (_check_failures) {
+    fprintf(stderr, "%s: %d checks failed\n", name, _check_failures);
+    return 1;
+  }
+  printf("%s: all checks passed\n", name);
+  return 0;
+}
+
+#endif // __TEST_CHECK_H
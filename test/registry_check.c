@@ -0,0 +1,169 @@
+/*******************************************************************************
+ * Copyright Arrow Electronics, Inc., 2019
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ ******************************************************************************/
+
+/*******************************************************************************
+ *  Sensor registry checks
+ *
+ *  Loads registry files written to a temporary file: valid ones must give
+ *  their sensors and fields, invalid ones the built-in Thunderboard Sense
+ *  profile.
+ *******************************************************************************/
+
+#include "check.h"
+#include "log.h"
+#include "sensor_registry.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_REGISTRY_LENGTH 4096
+
+#define LIGHT                                                                  \
+  "{\"name\": \"Light\", \"service\": \"181a\", \"uuid\": \"2a77\", "          \
+  "\"length\": 2, \"fields\": [{\"name\": \"lux\", \"position\": 0, "          \
+  "\"type\": \"uint16\", \"scale\": 0.5, \"offset\": -1}]}"
+
+#define GAS                                                                    \
+  "{\"name\": \"Gas\", \"service\": "                                          \
+  "\"efd658ae-c400-ef33-76e7-91b00019103b\", \"uuid\": "                       \
+  "\"efd658ae-c401-ef33-76e7-91b00019103b\", \"length\": 4, \"period\": "      \
+  "250, \"fields\": [{\"name\": \"co2\", \"type\": \"uint16\"}, "              \
+  "{\"name\": \"voc\", \"position\": 2, \"type\": \"int16\"}]}"
+
+typedef struct InvalidRegistry {
+  const char *what;
+  const char *json;
+} InvalidRegistry;
+
+static const InvalidRegistry _invalid[] = {
+    {"not JSON", "{\"sensors\": ["},
+    {"no sensors array", "{\"boards\": [" LIGHT "]}"},
+    {"empty sensors array", "{\"sensors\": []}"},
+    {"missing uuid",
+     "{\"sensors\": [{\"name\": \"Light\", \"service\": \"181a\"}]}"},
+    {"bad uuid", "{\"sensors\": [{\"name\": \"Light\", \"service\": "
+                 "\"181a\", \"uuid\": \"2a7\"}]}"},
+    {"too long", "{\"sensors\": [{\"name\": \"Light\", \"service\": "
+                 "\"181a\", \"uuid\": \"2a77\", \"length\": 65}]}"},
+    {"fractional length",
+     "{\"sensors\": [{\"name\": \"Light\", \"service\": \"181a\", "
+     "\"uuid\": \"2a77\", \"length\": 1.5}]}"},
+    {"unknown field type",
+     "{\"sensors\": [{\"name\": \"Light\", \"service\": \"181a\", "
+     "\"uuid\": \"2a77\", \"length\": 2, \"fields\": [{\"name\": \"lux\", "
+     "\"type\": \"float\"}]}]}"},
+    {"field past the end",
+     "{\"sensors\": [{\"name\": \"Light\", \"service\": \"181a\", "
+     "\"uuid\": \"2a77\", \"length\": 2, \"fields\": [{\"name\": \"lux\", "
+     "\"position\": 1, \"type\": \"uint16\"}]}]}"},
+    {"same uuid twice", "{\"sensors\": [" LIGHT ", " LIGHT "]}"},
+};
+
+static char _builtin_name[MAX_SENSOR_NAME_LENGTH];
+static uint32_t _builtin_count;
+
+static void load(const char *json) {
+  char path[] = "/tmp/registry_checkXXXXXX";
+  int fd = mkstemp(path);
+
+  if (fd < 0 || write(fd, json, strlen(json)) != (ssize_t)strlen(json)) {
+    perror("Could not write the registry file");
+    exit(1);
+  }
+  close(fd);
+  sensor_registry_load(path);
+  unlink(path);
+}
+
+static int builtin_loaded(void) {
+  return sensor_count() == _builtin_count &&
+         !strcmp(sensor_profile(0)->name, _builtin_name);
+}
+
+static void check_valid(void) {
+  const uint8_t light[] = {0x10, 0x00};
+  const uint8_t gas[] = {0x90, 0x01, 0xFE, 0xFF};
+  const SensorProfile *sensor;
+  UUID uuid = {2, {0x77, 0x2a}};  // little endian, as on the air
+
+  load("{\"sensors\": [" LIGHT ", " GAS "]}");
+  CHECK(sensor_count() == 2, "%u sensors, not 2", sensor_count());
+  CHECK(sensor_field_count() == 3, "%u fields, not 3", sensor_field_count());
+  CHECK(sensor_service_count() == 2, "%u services, not 2",
+        sensor_service_count());
+  if (sensor_count() != 2 || sensor_field_count() != 3) {
+    return;
+  }
+
+  sensor = sensor_profile(0);
+  CHECK(!strcmp(sensor->name, "Light"), "first sensor is %s", sensor->name);
+  CHECK(sensor->period_ms == SENSOR_PERIOD_MS, "default period %u ms",
+        sensor->period_ms);
+  CHECK(sensor_find(&uuid) == 0, "2a77 found at %d", sensor_find(&uuid));
+  CHECK(sensor_field_decode(sensor_field(0), light, sizeof(light)) == 7,
+        "lux decoded as %g, not 7",
+        sensor_field_decode(sensor_field(0), light, sizeof(light)));
+
+  sensor = sensor_profile(1);
+  CHECK(sensor->uuid.length == 16, "128-bit UUID of %u bytes",
+        sensor->uuid.length);
+  CHECK(sensor->period_ms == 250, "period %u ms, not 250", sensor->period_ms);
+  CHECK(sensor->first_field == 1 && sensor->field_count == 2,
+        "fields %u to %u", sensor->first_field,
+        sensor->first_field + sensor->field_count);
+  CHECK(sensor_field_decode(sensor_field(1), gas, sizeof(gas)) == 400,
+        "co2 decoded as %g, not 400",
+        sensor_field_decode(sensor_field(1), gas, sizeof(gas)));
+  CHECK(sensor_field_decode(sensor_field(2), gas, sizeof(gas)) == -2,
+        "voc decoded as %g, not -2",
+        sensor_field_decode(sensor_field(2), gas, sizeof(gas)));
+}
+
+static void check_invalid(void) {
+  char json[MAX_REGISTRY_LENGTH];
+  uint32_t length;
+  uint32_t i;
+
+  for (i = 0; i < sizeof(_invalid) / sizeof(_invalid[0]); i++) {
+    load("{\"sensors\": [" LIGHT "]}");
+    load(_invalid[i].json);
+    CHECK(builtin_loaded(), "%s: %u sensors loaded, not the built-in ones",
+          _invalid[i].what, sensor_count());
+  }
+
+  // one sensor more than fit, each of its own UUID
+  length = snprintf(json, sizeof(json), "{\"sensors\": [");
+  for (i = 0; i <= MAX_SENSORS; i++) {
+    length += snprintf(&json[length], sizeof(json) - length,
+                       "%s{\"name\": \"S%u\", \"service\": \"181a\", "
+                       "\"uuid\": \"%04x\"}",
+                       i ? ", " : "", i, 0x2a00 + i);
+  }
+  snprintf(&json[length], sizeof(json) - length, "]}");
+  load(json);
+  CHECK(builtin_loaded(), "%u sensors loaded of %u", sensor_count(),
+        MAX_SENSORS + 1);
+}
+
+int main(void) {
+  log_set_quiet(1);
+
+  // no file
+  sensor_registry_load("");
+  _builtin_count = sensor_count();
+  snprintf(_builtin_name, sizeof(_builtin_name), "%s",
+           sensor_profile(0)->name);
+
+  check_valid();
+  check_invalid();
+  return check_done("registry_check");
+}
@@ -0,0 +1,227 @@
+/*******************************************************************************
+ * Copyright Arrow Electronics, Inc., 2019
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ *******************************************************************************/
+
+/*******************************************************************************
+ *  Advert ingest benchmark
+ *
+ *  Builds scan responses of a number of beacons in memory, the kinds
+ *  ncp_sim -b sends, and feeds them to advert_ingest() the way the event
+ *  loop does in g300demo -a. Every beacon sends each kind in turn. Reports
+ *  adverts processed per second and the cost per advert for each kind:
+ *    - manufacturer specific data with temperature, humidity, pressure and
+ *      UV records
+ *    - Environmental Sensing service data of temperature and humidity
+ *    - an Eddystone-TLM frame
+ *    - a named advert without sensor data, which takes no table slot
+ *  then the cost of advert_take() copying out every beacon's reading after
+ *  each has changed, as the upload thread does each round.
+ *
+ *  Only decoding is measured, not the BGAPI framing before it nor the
+ *  uploads after it.
+ *
+ *  Usage: advert_bench [beacons] [rounds]
+ *******************************************************************************/
+
+#include "advert_ingest.h"
+#include "sensor_registry.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define DEFAULT_BEACONS 250
+#define DEFAULT_ROUNDS 4000
+#define EDDYSTONE_TLM_AD_LENGTH 18
+
+enum advert_kind {
+  ADVERT_MANUFACTURER,
+  ADVERT_SERVICE_DATA,
+  ADVERT_TLM,
+  ADVERT_NO_SENSORS,
+  NUM_ADVERT_KINDS
+};
+
+static const char *_kind_names[NUM_ADVERT_KINDS] = {
+    "manufacturer data", "service data", "Eddystone-TLM", "no sensor data"};
+
+static uint64_t now_ns() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+static void put_le(uint8_t *buffer, uint32_t value, uint32_t length) {
+  for (uint32_t i = 0; i < length; i++) {
+    buffer[i] = (value >> (8 * i)) & 0xFF;
+  }
+}
+
+static void put_be(uint8_t *buffer, uint32_t value, uint32_t length) {
+  for (uint32_t i = 0; i < length; i++) {
+    buffer[i] = (value >> (8 * (length - 1 - i))) & 0xFF;
+  }
+}
+
+// A 16-bit sensor UUID followed by a value of length bytes
+static uint8_t put_record(uint8_t *buffer, uint16_t uuid, uint32_t value,
+                          uint8_t length) {
+  put_le(buffer, uuid, 2);
+  put_le(buffer + 2, value, length);
+  return 2 + length;
+}
+
+static uint8_t put_service_data(uint8_t *buffer, uint16_t uuid,
+                                uint32_t value, uint8_t length) {
+  uint8_t record_length = put_record(buffer + 2, uuid, value, length);
+  buffer[0] = record_length + 1;
+  buffer[1] = AD_SERVICE_DATA_16;
+  return record_length + 2;
+}
+
+// Advert of the given kind from beacon index
+static void build_advert(struct gecko_cmd_packet *packet, uint32_t index,
+                         enum advert_kind kind) {
+  struct gecko_msg_le_gap_scan_response_evt_t *scan =
+      &packet->data.evt_le_gap_scan_response;
+  uint8_t *data = scan->data.data;
+  uint8_t length = 0;
+
+  memset(packet, 0, sizeof(*packet));
+  scan->rssi = -40 - index % 50;
+  scan->packet_type = 2;
+  put_le(scan->address.addr, index, 2);
+  scan->address.addr[3] = 0xBE;
+  scan->address.addr[4] = 0x0B;
+
+  switch (kind) {
+  case ADVERT_MANUFACTURER:
+    data[1] = AD_MANUFACTURER_DATA;
+    put_le(&data[2], ADVERT_COMPANY_ID, 2);
+    length = 4;
+    length += put_record(&data[length], 0x2A6E, 2200 + index, 2);
+    length += put_record(&data[length], 0x2A6F, 4500 + index, 2);
+    length += put_record(&data[length], 0x2A6D, 1013250 + index, 4);
+    length += put_record(&data[length], 0x2A76, index % 12, 1);
+    data[0] = length - 1;
+    break;
+
+  case ADVERT_SERVICE_DATA:
+    length += put_service_data(&data[length], 0x2A6E, 2200 + index, 2);
+    length += put_service_data(&data[length], 0x2A6F, 4500 + index, 2);
+    break;
+
+  case ADVERT_TLM:
+    // Version, battery mV, temperature in 8.8, advert and 0.1 s counts
+    data[0] = EDDYSTONE_TLM_AD_LENGTH - 1;
+    data[1] = AD_SERVICE_DATA_16;
+    put_le(&data[2], EDDYSTONE_UUID, 2);
+    data[4] = EDDYSTONE_TLM_FRAME;
+    data[5] = 0x00;
+    put_be(&data[6], 3000, 2);
+    put_be(&data[8], 22 << 8 | 0x80, 2);
+    put_be(&data[10], index, 4);
+    put_be(&data[14], index * 10, 4);
+    length = EDDYSTONE_TLM_AD_LENGTH;
+    break;
+
+  default:
+    data[0] = 2;
+    data[1] = AD_FLAGS;
+    data[2] = 0x06;
+    data[3] = 6;
+    data[4] = AD_COMPLETE_LOCAL_NAME;
+    memcpy(&data[5], "Phone", 5);
+    length = 10;
+    break;
+  }
+  scan->data.len = length;
+}
+
+int main(int argc, char **argv) {
+  uint32_t beacons = argc > 1 ? atoi(argv[1]) : DEFAULT_BEACONS;
+  uint32_t rounds = argc > 2 ? atoi(argv[2]) : DEFAULT_ROUNDS;
+  struct gecko_cmd_packet *packets;
+  static AdvertReading taken[ADVERT_MAX_BEACONS];
+  AdvertStats stats;
+  uint64_t total_ns = 0;
+  uint64_t adverts = 0;
+  uint32_t kind;
+  uint32_t round;
+  uint32_t i;
+
+  if (beacons == 0 || beacons > ADVERT_MAX_BEACONS || rounds == 0) {
+    fprintf(stderr, "Usage: %s [beacons, at most %u] [rounds]\n", argv[0],
+            ADVERT_MAX_BEACONS);
+    return 1;
+  }
+
+  // No registry file, the built-in table
+  sensor_registry_load("");
+
+  packets = malloc(NUM_ADVERT_KINDS * beacons * sizeof(*packets));
+  if (!packets) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+  for (kind = 0; kind < NUM_ADVERT_KINDS; kind++) {
+    for (i = 0; i < beacons; i++) {
+      build_advert(&packets[kind * beacons + i], i, kind);
+    }
+  }
+
+  printf("%u beacons, %u rounds\n", beacons, rounds);
+  for (kind = 0; kind < NUM_ADVERT_KINDS; kind++) {
+    struct gecko_cmd_packet *first = &packets[kind * beacons];
+    uint64_t start = now_ns();
+    uint64_t elapsed_ns;
+
+    for (round = 0; round < rounds; round++) {
+      for (i = 0; i < beacons; i++) {
+        advert_ingest(&first[i].data.evt_le_gap_scan_response, round);
+      }
+    }
+    elapsed_ns = now_ns() - start;
+    total_ns += elapsed_ns;
+    adverts += (uint64_t)rounds * beacons;
+    printf("  %-18s %6.1f ns/advert, %9.0f adverts/s\n", _kind_names[kind],
+           (double)elapsed_ns / rounds / beacons,
+           (double)rounds * beacons * 1e9 / elapsed_ns);
+  }
+  printf("  %-18s %6.1f ns/advert, %9.0f adverts/s\n", "all kinds",
+         (double)total_ns / adverts, adverts * 1e9 / total_ns);
+
+  // Every reading changed since the last take, as after a busy round
+  uint64_t take_ns = 0;
+  uint32_t count = 0;
+  advert_take(taken);
+  for (round = 0; round < rounds; round++) {
+    for (i = 0; i < beacons; i++) {
+      advert_ingest(&packets[i].data.evt_le_gap_scan_response, round);
+    }
+    uint64_t start = now_ns();
+    count = advert_take(taken);
+    take_ns += now_ns() - start;
+  }
+  printf("  advert_take        %6.1f us for %u readings\n",
+         take_ns / 1000.0 / rounds, count);
+
+  advert_get_stats(&stats);
+  if (advert_reading_count() != beacons || count != beacons) {
+    fprintf(stderr, "%u readings tracked and %u taken, expected %u\n",
+            advert_reading_count(), count, beacons);
+    return 1;
+  }
+  printf("%u adverts, %u with sensor values\n", stats.adverts, stats.decoded);
+  free(packets);
+  return 0;
+}
@@ -0,0 +1,452 @@
+/*******************************************************************************
+ * Copyright Arrow Electronics, Inc., 2019
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ *******************************************************************************/
+
+/*******************************************************************************
+ *  BGAPI receive path benchmark
+ *
+ *  Streams scan response events through a pseudo terminal and drains them
+ *  with gecko_peek_event() the same way main() does, once with the original
+ *  byte-exact reads, once with the buffered receive ring and once through the
+ *  reader thread. Every read() and FIONREAD ioctl issued by the receive
+ *  callbacks is counted.
+ *
+ *  A second pass sends timestamped events at a fixed interval and compares a
+ *  busy-spin loop with the poll() event loop: event-to-handler latency and
+ *  CPU used by the receiving thread.
+ *
+ *  A third pass feeds bursts of events followed by a command response from
+ *  memory while a synchronous command waits, so every event of a burst has
+ *  to be held in the event queue. It reports how many events the queue
+ *  holds and how fast they go through it.
+ *
+ *  Usage: bgapi_bench [frames] [paced frames]
+ *******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include "event_loop.h"
+#include "gecko_bglib.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_FRAMES 20000
+#define ADVERTISEMENT_DATA_LENGTH 31
+#define WRITE_CHUNK_SIZE 4096
+#define DEFAULT_PACED_FRAMES 2000
+#define PACED_INTERVAL_US 1000
+#define CAPACITY_BURST 1000
+#define THROUGHPUT_BURST 20
+#define THROUGHPUT_ROUNDS 20000
+
+enum event_kind { EVENT_SMALL, EVENT_SCAN, EVENT_MIXED };
+
+BGLIB_DEFINE();
+
+static int _master = -1;
+static int _slave = -1;
+static uint32_t _frames = DEFAULT_FRAMES;
+static uint32_t _syscalls = 0;
+static uint32_t _paced_frames = DEFAULT_PACED_FRAMES;
+static uint32_t _received = 0;
+static uint64_t _latency_total_us = 0;
+static uint64_t _latency_max_us = 0;
+static uint8_t *_stream = NULL;
+static uint32_t _stream_offset = 0;
+static uint32_t _stream_limit = 0;
+
+// Same semantics as uartRx()
+static int32_t bench_input(uint32_t length, uint8_t *data) {
+  uint32_t remaining = length;
+
+  while (remaining) {
+    ssize_t result = read(_slave, data, remaining);
+    _syscalls++;
+    if (result < 0) {
+      return -1;
+    }
+    remaining -= result;
+    data += result;
+  }
+
+  return length;
+}
+
+// Same semantics as uartRxNonBlocking()
+static int32_t bench_read(uint32_t length, uint8_t *data) {
+  _syscalls++;
+  return read(_slave, data, length);
+}
+
+// Same semantics as uartRxPeek()
+static int32_t bench_peek(void) {
+  int available = 0;
+
+  _syscalls++;
+  if (ioctl(_slave, FIONREAD, &available) == -1) {
+    return -1;
+  }
+
+  return available;
+}
+
+static void bench_output(uint32_t length, uint8_t *data) {}
+
+// Bulk read from _stream, never past the end of the current burst
+static int32_t memory_read(uint32_t length, uint8_t *data) {
+  if (length > _stream_limit - _stream_offset) {
+    length = _stream_limit - _stream_offset;
+  }
+  memcpy(data, &_stream[_stream_offset], length);
+  _stream_offset += length;
+  return length;
+}
+
+static int32_t memory_peek(void) { return _stream_limit - _stream_offset; }
+
+static void set_header(struct gecko_cmd_packet *packet, uint32_t id,
+                       uint32_t payload_length) {
+  packet->header = id | ((payload_length & 0xFF) << 8) |
+                   ((payload_length >> 8) & 0x07);
+}
+
+static uint32_t build_scan_response(uint8_t *buffer, uint32_t sequence,
+                                    uint64_t stamp) {
+  struct gecko_cmd_packet *packet = (struct gecko_cmd_packet *)buffer;
+  struct gecko_msg_le_gap_scan_response_evt_t *response =
+      &packet->data.evt_le_gap_scan_response;
+  uint32_t payload_length =
+      sizeof(*response) + ADVERTISEMENT_DATA_LENGTH;
+
+  set_header(packet, gecko_evt_le_gap_scan_response_id, payload_length);
+  response->rssi = -60;
+  response->packet_type = 0;
+  memset(response->address.addr, 0, sizeof(response->address.addr));
+  memcpy(response->address.addr, &sequence, sizeof(sequence));
+  response->address_type = le_gap_address_type_public;
+  response->bonding = 0xFF;
+  response->data.len = ADVERTISEMENT_DATA_LENGTH;
+  memset(response->data.data, 0xA5, ADVERTISEMENT_DATA_LENGTH);
+  memcpy(response->data.data, &stamp, sizeof(stamp));
+
+  return BGLIB_MSG_HEADER_LEN + payload_length;
+}
+
+static uint32_t build_procedure_completed(uint8_t *buffer) {
+  struct gecko_cmd_packet *packet = (struct gecko_cmd_packet *)buffer;
+  uint32_t payload_length = sizeof(packet->data.evt_gatt_procedure_completed);
+
+  set_header(packet, gecko_evt_gatt_procedure_completed_id, payload_length);
+  packet->data.evt_gatt_procedure_completed.connection = 1;
+  packet->data.evt_gatt_procedure_completed.result = 0;
+
+  return BGLIB_MSG_HEADER_LEN + payload_length;
+}
+
+// count events followed by the system_hello response that ends the burst
+static uint32_t build_burst(uint8_t *buffer, enum event_kind kind,
+                            uint32_t count) {
+  struct gecko_cmd_packet *response;
+  uint32_t used = 0;
+
+  for (uint32_t i = 0; i < count; i++) {
+    if (kind == EVENT_SCAN || (kind == EVENT_MIXED && i % 4 == 0)) {
+      used += build_scan_response(&buffer[used], i, 0);
+    } else {
+      used += build_procedure_completed(&buffer[used]);
+    }
+  }
+
+  response = (struct gecko_cmd_packet *)&buffer[used];
+  set_header(response, gecko_rsp_system_hello_id,
+             sizeof(response->data.rsp_system_hello));
+  response->data.rsp_system_hello.result = 0;
+  return used + BGLIB_MSG_HEADER_LEN + sizeof(response->data.rsp_system_hello);
+}
+
+static void *writer(void *arg) {
+  uint8_t chunk[WRITE_CHUNK_SIZE];
+  uint32_t used = 0;
+
+  for (uint32_t sequence = 0; sequence < _frames; sequence++) {
+    if (used + sizeof(struct gecko_cmd_packet) > sizeof(chunk)) {
+      if (write(_master, chunk, used) != used) {
+        perror("write");
+        exit(-1);
+      }
+      used = 0;
+    }
+    used += build_scan_response(&chunk[used], sequence, 0);
+  }
+
+  if (used && write(_master, chunk, used) != used) {
+    perror("write");
+    exit(-1);
+  }
+
+  return NULL;
+}
+
+static void *paced_writer(void *arg) {
+  uint8_t frame[sizeof(struct gecko_cmd_packet)];
+
+  for (uint32_t sequence = 0; sequence < _paced_frames; sequence++) {
+    uint32_t length =
+        build_scan_response(frame, sequence, event_loop_now_us());
+    if (write(_master, frame, length) != length) {
+      perror("write");
+      exit(-1);
+    }
+    usleep(PACED_INTERVAL_US);
+  }
+
+  return NULL;
+}
+
+static void record_latency(struct gecko_cmd_packet *event) {
+  uint64_t stamp;
+  uint64_t latency;
+
+  memcpy(&stamp, event->data.evt_le_gap_scan_response.data.data,
+         sizeof(stamp));
+  latency = event_loop_now_us() - stamp;
+  _latency_total_us += latency;
+  if (latency > _latency_max_us) {
+    _latency_max_us = latency;
+  }
+  _received++;
+}
+
+static int open_pty() {
+  struct termios attributes;
+
+  _master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (_master < 0 || grantpt(_master) || unlockpt(_master)) {
+    perror("posix_openpt");
+    return -1;
+  }
+
+  _slave = open(ptsname(_master), O_RDWR | O_NOCTTY);
+  if (_slave < 0) {
+    perror("open");
+    return -1;
+  }
+
+  // Configure the slave the way uartOpen(port, baud, 0, 100) does
+  tcgetattr(_slave, &attributes);
+  cfmakeraw(&attributes);
+  attributes.c_cc[VMIN] = 0;
+  attributes.c_cc[VTIME] = 1;
+  return tcsetattr(_slave, TCSANOW, &attributes);
+}
+
+static double elapsed_seconds(struct timespec *start, struct timespec *end) {
+  return (end->tv_sec - start->tv_sec) +
+         (end->tv_nsec - start->tv_nsec) / 1000000000.0;
+}
+
+static uint32_t reader_dropped() {
+  struct gecko_reader_stats stats;
+  gecko_get_reader_stats(&stats);
+  return stats.dropped;
+}
+
+static int run(const char *name, bool buffered, bool threaded) {
+  pthread_t writer_thread;
+  struct timespec start, end;
+  uint32_t received = 0;
+  uint32_t dropped_before = reader_dropped();
+
+  if (open_pty()) {
+    return -1;
+  }
+
+  if (buffered) {
+    BGLIB_INITIALIZE_BUFFERED(bench_output, bench_read, bench_peek);
+  } else {
+    BGLIB_INITIALIZE_NONBLOCK(bench_output, bench_input, bench_peek);
+  }
+  _syscalls = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (threaded && gecko_reader_start()) {
+    return -1;
+  }
+  pthread_create(&writer_thread, NULL, writer, NULL);
+
+  while (received + reader_dropped() - dropped_before < _frames) {
+    struct gecko_cmd_packet *event = gecko_peek_event();
+    if (event) {
+      if (BGLIB_MSG_ID(event->header) != gecko_evt_le_gap_scan_response_id) {
+        fprintf(stderr, "unexpected message 0x%X\n", event->header);
+        return -1;
+      }
+      received++;
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  pthread_join(writer_thread, NULL);
+  gecko_reader_stop();
+  close(_slave);
+  close(_master);
+
+  double seconds = elapsed_seconds(&start, &end);
+  printf("%-10s %10u %10u %10.3f %12.0f %16.2f\n", name, received,
+         reader_dropped() - dropped_before, seconds, received / seconds,
+         (double)_syscalls / received);
+
+  return 0;
+}
+
+static int serial_pending(void *context) { return gecko_event_buffered(); }
+
+static void serial_ready(void *context) {
+  struct gecko_cmd_packet *event;
+
+  while ((event = gecko_peek_event())) {
+    record_latency(event);
+  }
+
+  if (_received == _paced_frames) {
+    event_loop_stop();
+  }
+}
+
+static uint64_t thread_cpu_us() {
+  struct timespec now;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+  return ((uint64_t)now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+}
+
+static int run_paced(const char *name, bool use_event_loop) {
+  pthread_t writer_thread;
+
+  if (open_pty()) {
+    return -1;
+  }
+
+  BGLIB_INITIALIZE_BUFFERED(bench_output, bench_read, bench_peek);
+  _received = 0;
+  _latency_total_us = 0;
+  _latency_max_us = 0;
+
+  uint64_t start = event_loop_now_us();
+  uint64_t cpu_start = thread_cpu_us();
+  pthread_create(&writer_thread, NULL, paced_writer, NULL);
+
+  if (use_event_loop) {
+    event_loop_add_fd(_slave, serial_ready, serial_pending, NULL);
+    event_loop_run();
+    event_loop_remove_fd(_slave);
+  } else {
+    while (_received < _paced_frames) {
+      struct gecko_cmd_packet *event = gecko_peek_event();
+      if (event) {
+        record_latency(event);
+      }
+    }
+  }
+
+  uint64_t cpu = thread_cpu_us() - cpu_start;
+  uint64_t wall = event_loop_now_us() - start;
+  pthread_join(writer_thread, NULL);
+  close(_slave);
+  close(_master);
+
+  printf("%-10s %10u %14.1f %14llu %10.1f\n", name, _received,
+         (double)_latency_total_us / _received,
+         (unsigned long long)_latency_max_us, 100.0 * cpu / wall);
+
+  return 0;
+}
+
+static int run_queue(const char *name, enum event_kind kind, uint32_t burst,
+                     uint32_t rounds) {
+  uint32_t burst_length;
+  uint32_t received = 0;
+  struct gecko_rx_stats before, after;
+  struct timespec start, end;
+
+  _stream = malloc(burst * sizeof(struct gecko_cmd_packet));
+  if (!_stream) {
+    return -1;
+  }
+  burst_length = build_burst(_stream, kind, burst);
+
+  BGLIB_INITIALIZE_BUFFERED(bench_output, memory_read, memory_peek);
+  gecko_get_rx_stats(&before);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (uint32_t round = 0; round < rounds; round++) {
+    _stream_offset = 0;
+    _stream_limit = burst_length;
+    gecko_cmd_system_hello();
+    while (gecko_peek_event()) {
+      received++;
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  gecko_get_rx_stats(&after);
+  free(_stream);
+  _stream = NULL;
+
+  double seconds = elapsed_seconds(&start, &end);
+  printf("%-10s %8u %10u %10u %12.0f\n", name, burst, received / rounds,
+         (after.dropped - before.dropped) / rounds, received / seconds);
+
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1) {
+    _frames = atoi(argv[1]);
+  }
+  if (argc > 2) {
+    _paced_frames = atoi(argv[2]);
+  }
+
+  printf("%-10s %10s %10s %10s %12s %16s\n", "mode", "frames", "dropped",
+         "seconds", "frames/s", "syscalls/frame");
+  if (run("unbuffered", false, false) || run("buffered", true, false) ||
+      run("threaded", true, true)) {
+    return -1;
+  }
+
+  printf("\n%-10s %10s %14s %14s %10s\n", "loop", "frames", "avg latency us",
+         "max latency us", "cpu %");
+  if (run_paced("spin", false) || run_paced("poll", true)) {
+    return -1;
+  }
+
+  printf("\nevent queue: %d bytes\n", BGLIB_QUEUE_BYTES);
+  printf("%-10s %8s %10s %10s %12s\n", "events", "burst", "held", "dropped",
+         "events/s");
+  if (run_queue("small", EVENT_SMALL, CAPACITY_BURST, 1) ||
+      run_queue("scan", EVENT_SCAN, CAPACITY_BURST, 1) ||
+      run_queue("small", EVENT_SMALL, THROUGHPUT_BURST, THROUGHPUT_ROUNDS) ||
+      run_queue("scan", EVENT_SCAN, THROUGHPUT_BURST, THROUGHPUT_ROUNDS) ||
+      run_queue("mixed", EVENT_MIXED, THROUGHPUT_BURST, THROUGHPUT_ROUNDS)) {
+    return -1;
+  }
+
+  return 0;
+}
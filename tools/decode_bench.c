@@ -0,0 +1,153 @@
+/*******************************************************************************
+ * Copyright Arrow Electronics, Inc., 2019
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ *******************************************************************************/
+
+
+/*******************************************************************************
+ *  Sensor decode benchmark
+ *
+ *  Decodes random characteristic values of the built-in Thunderboard Sense
+ *  sensors three ways and reports the cost per sample, that is per value
+ *  of one sensor:
+ *    - every field of the value to a double with sensor_field_decode(), as
+ *      beacons are decoded
+ *    - every field to its raw integer with sensor_field_raw(), the work the
+ *      event loop does per value for the sample history
+ *    - the raw integers of a field converted a run at a time with
+ *      sensor_field_convert(), as the uploader does
+ *
+ *  Usage: decode_bench [samples per sensor] [rounds]
+ *******************************************************************************/
+
+#include "sensor_registry.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define DEFAULT_SAMPLES 128
+#define DEFAULT_ROUNDS 20000
+#define MAX_VALUE_LENGTH 8
+
+static uint64_t now_ns() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+int main(int argc, char **argv) {
+  uint32_t samples = argc > 1 ? atoi(argv[1]) : DEFAULT_SAMPLES;
+  uint32_t rounds = argc > 2 ? atoi(argv[2]) : DEFAULT_ROUNDS;
+  uint8_t(*values)[MAX_SENSORS][MAX_VALUE_LENGTH];
+  uint32_t(*raw)[MAX_SENSOR_FIELDS];
+  double *converted;
+  double checksum = 0;
+  uint64_t start;
+  uint64_t decode_ns;
+  uint64_t raw_ns;
+  uint64_t convert_ns;
+  uint32_t round;
+  uint32_t sensor;
+  uint32_t field;
+  uint32_t n;
+
+  if (samples == 0 || rounds == 0) {
+    fprintf(stderr, "Usage: %s [samples per sensor] [rounds]\n", argv[0]);
+    return 1;
+  }
+
+  // No registry file, the built-in table
+  sensor_registry_load("");
+
+  values = malloc(samples * sizeof(*values));
+  raw = malloc(samples * sizeof(*raw));
+  converted = malloc(samples * sizeof(*converted));
+  if (!values || !raw || !converted) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+  srand(1);
+  for (n = 0; n < samples; n++) {
+    for (sensor = 0; sensor < MAX_SENSORS; sensor++) {
+      for (field = 0; field < MAX_VALUE_LENGTH; field++) {
+        values[n][sensor][field] = rand();
+      }
+    }
+  }
+
+  start = now_ns();
+  for (round = 0; round < rounds; round++) {
+    for (n = 0; n < samples; n++) {
+      for (sensor = 0; sensor < sensor_count(); sensor++) {
+        const SensorProfile *profile = sensor_profile(sensor);
+        for (field = profile->first_field;
+             field < profile->first_field + profile->field_count; field++) {
+          checksum += sensor_field_decode(sensor_field(field),
+                                          values[n][sensor], profile->length);
+        }
+      }
+    }
+  }
+  decode_ns = now_ns() - start;
+
+  start = now_ns();
+  for (round = 0; round < rounds; round++) {
+    for (n = 0; n < samples; n++) {
+      for (sensor = 0; sensor < sensor_count(); sensor++) {
+        const SensorProfile *profile = sensor_profile(sensor);
+        for (field = profile->first_field;
+             field < profile->first_field + profile->field_count; field++) {
+          raw[n][field] = sensor_field_raw(sensor_field(field),
+                                           values[n][sensor], profile->length);
+        }
+      }
+    }
+    checksum += raw[round % samples][round % sensor_field_count()];
+  }
+  raw_ns = now_ns() - start;
+
+  // The history keeps a ring per field, so the raw integers go column wise
+  uint32_t *columns = malloc(samples * sizeof(uint32_t) * sensor_field_count());
+  if (!columns) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+  for (field = 0; field < sensor_field_count(); field++) {
+    for (n = 0; n < samples; n++) {
+      columns[field * samples + n] = raw[n][field];
+    }
+  }
+
+  start = now_ns();
+  for (round = 0; round < rounds; round++) {
+    for (field = 0; field < sensor_field_count(); field++) {
+      sensor_field_convert(sensor_field(field), &columns[field * samples],
+                           samples, converted);
+      checksum += converted[round % samples];
+    }
+  }
+  convert_ns = now_ns() - start;
+
+  double total = (double)rounds * samples * sensor_count();
+  printf("%u sensors with %u fields, %u samples per sensor, %u rounds\n",
+         sensor_count(), sensor_field_count(), samples, rounds);
+  printf("Decode to double:     %6.1f ns per sample\n", decode_ns / total);
+  printf("Raw integers:         %6.1f ns per sample\n", raw_ns / total);
+  printf("Batch convert:        %6.1f ns per sample\n", convert_ns / total);
+  printf("Checksum: %g\n", checksum);
+
+  free(columns);
+  free(converted);
+  free(raw);
+  free(values);
+  return 0;
+}
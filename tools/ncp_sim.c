@@ -0,0 +1,1525 @@
+/*******************************************************************************
+ * Copyright Arrow Electronics, Inc., 2019
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ *******************************************************************************/
+
+/*******************************************************************************
+ *  Mighty Gecko NCP simulator
+ *
+ *  Opens a pseudo terminal and answers BGAPI commands on it like the NCP
+ *  with N Thunderboard Sense devices in range: boot event after reset, scan
+ *  responses while discovering, connections, service and characteristic
+ *  discovery (also by UUID), single and multiple reads and notifications.
+ *  Commands it does not model get a response with result 0.
+ *
+ *  With -c the radio link is modelled as well: every ATT exchange waits for
+ *  the next connection event and takes one more for the response plus its
+ *  air time on the PHY in use, and connection parameter, PHY and MTU
+ *  updates are negotiated like a peripheral would.
+ *
+ *  With -o every connection drops after that many seconds and the board is
+ *  out of range for -O ms: it neither advertises nor answers a connection
+ *  attempt until then, a pending attempt completes once it is back.
+ *
+ *  Adverts are only heard during the scan window set with
+ *  le_gap_set_discovery_timing, and active scanning adds a scan response to
+ *  every Thunderboard advert. The time from the first scan to the first
+ *  connection of every board is printed.
+ *
+ *  With -b that many non-connectable beacons advertise sensor values, -e
+ *  times per second all together: manufacturer specific data records of
+ *  temperature, humidity, pressure and UV, Environmental Sensing service
+ *  data of temperature and humidity, and every tenth advert an
+ *  Eddystone-TLM frame.
+ *
+ *  Start it, then point the gateway at the printed device:
+ *      ncp_sim -n 4 -a 200 &
+ *      g300demo -n -s /dev/pts/N
+ *
+ *  Usage: ncp_sim [-n devices] [-a adverts/s] [-i other adverts/s]
+ *                 [-r notifications/s] [-l latency ms] [-d loss %] [-c]
+ *                 [-1] [-o drop period s] [-O outage ms]
+ *                 [-b beacons] [-e beacon adverts/s] [-v]
+ *******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include "gecko_bglib.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_DEVICES 64
+#define MAX_BEACONS 65536
+#define SCAN_DEFAULT_US 10000
+#define SCAN_TIMING_UNIT_US 625
+#define SILICON_LABS_COMPANY_ID 0x02FF
+#define EDDYSTONE_UUID 0xFEAA
+#define GATT_CLASS 0x09
+#define OUTPUT_QUEUE_LENGTH 4096
+#define INPUT_BUFFER_LENGTH 4096
+#define MAX_CATCH_UP 1000
+#define STATS_INTERVAL_US 5000000
+#define ATT_READ_RESPONSE 0x0b
+#define ATT_READ_MULTIPLE_RESPONSE 0x0f
+#define ATT_HANDLE_VALUE_NOTIFICATION 0x1b
+#define ATT_MTU 247
+#define ATT_DEFAULT_MTU 23
+
+// Link model: the interval connections open with unless the gateway sets
+// one and the shortest the peripheral accepts, in 1.25 ms units, connection events before a
+// parameter or PHY update takes effect, and LL packet payload and overhead
+// (preamble, header, MIC, CRC and inter frame space) in microseconds per
+// PHY
+#define LINK_INITIAL_INTERVAL 40
+#define LINK_MIN_INTERVAL 6
+#define LINK_UPDATE_EVENTS 6
+#define LINK_DATA_LENGTH 27
+#define LINK_OVERHEAD_1M_US 230
+#define LINK_OVERHEAD_2M_US 190
+
+#define PROPERTY_READ 0x02
+#define PROPERTY_WRITE 0x08
+#define PROPERTY_NOTIFY 0x10
+#define PROPERTY_INDICATE 0x20
+
+typedef struct SimService {
+  uint32_t handle;
+  uint8_t uuid_length;
+  uint8_t uuid[16];
+} SimService;
+
+typedef enum SimValue {
+  VALUE_NAME,
+  VALUE_TEMPERATURE,
+  VALUE_PRESSURE,
+  VALUE_HUMIDITY,
+  VALUE_UV,
+  VALUE_SOUND,
+  VALUE_CO2,
+  VALUE_VOC,
+  VALUE_LIGHT,
+  VALUE_ACCELERATION,
+  VALUE_ORIENTATION,
+  VALUE_SERVICE_CHANGED,
+  VALUE_MANUFACTURER,
+  VALUE_MODEL,
+  VALUE_FIRMWARE,
+  VALUE_BATTERY,
+  VALUE_DIGITAL
+} SimValue;
+
+typedef struct SimCharacteristic {
+  uint32_t service;
+  uint16_t handle;
+  uint8_t properties;
+  uint8_t uuid_length;
+  uint8_t uuid[16];
+  SimValue value;
+} SimCharacteristic;
+
+typedef struct SimDevice {
+  bd_addr address;
+  char name[24];
+  uint8_t connection; // 0 while advertising
+  uint32_t subscribed; // bit per characteristic index
+  uint32_t tick;
+
+  // A connection attempt waits while the board is out of range, the link
+  // drops at drop_us
+  bool pending;
+  bool connected_once;
+  uint64_t out_of_range_us;
+  uint64_t drop_us;
+  uint64_t dropped_us;
+
+  // Link model: connection events happen every interval from anchor_us,
+  // and every next_interval from update_us on if that is set. link_free_us
+  // is when the last queued ATT exchange is done.
+  uint16_t interval;
+  uint16_t next_interval;
+  uint8_t phy;
+  uint16_t mtu;
+  uint64_t anchor_us;
+  uint64_t update_us;
+  uint64_t link_free_us;
+} SimDevice;
+
+typedef struct SimMessage {
+  uint64_t due_us;
+  uint16_t length;
+  uint8_t data[sizeof(struct gecko_cmd_packet)];
+} SimMessage;
+
+// Thunderboard Sense GATT database, UUIDs in over the air (little endian)
+// order. Besides the sensors it has the services a client walking the whole
+// database has to go through.
+static const SimService _services[] = {
+    {0x00010005, 2, {0x00, 0x18}},
+    {0x00060009, 2, {0x01, 0x18}},
+    {0x00100018, 2, {0x1A, 0x18}},
+    {0x00200025, 16, {0x3B, 0x10, 0x19, 0x00, 0xB0, 0x91, 0xE7, 0x76, 0x33,
+                      0xEF, 0x00, 0xC4, 0xAE, 0x58, 0xD6, 0xEF}},
+    {0x00300035, 16, {0x8B, 0x36, 0x27, 0x11, 0xF5, 0xAB, 0x2C, 0x85, 0x48,
+                      0x45, 0xA7, 0x17, 0x4E, 0x4F, 0x4C, 0xD2}},
+    {0x00400045, 16, {0x9F, 0xDC, 0x9C, 0x81, 0xFF, 0xFE, 0x5D, 0x88, 0xE5,
+                      0x11, 0xE5, 0x4B, 0xF4, 0x49, 0xE6, 0xA4}},
+    {0x00500058, 2, {0x0A, 0x18}},
+    {0x00600062, 2, {0x0F, 0x18}},
+    {0x00700074, 2, {0x15, 0x18}},
+};
+
+static const SimCharacteristic _characteristics[] = {
+    {0x00010005, 0x0003, PROPERTY_READ, 2, {0x00, 0x2A}, VALUE_NAME},
+    {0x00060009,
+     0x0008,
+     PROPERTY_INDICATE,
+     2,
+     {0x05, 0x2A},
+     VALUE_SERVICE_CHANGED},
+    {0x00100018, 0x0012, PROPERTY_READ, 2, {0x6E, 0x2A}, VALUE_TEMPERATURE},
+    {0x00100018, 0x0014, PROPERTY_READ, 2, {0x6D, 0x2A}, VALUE_PRESSURE},
+    {0x00100018, 0x0016, PROPERTY_READ, 2, {0x6F, 0x2A}, VALUE_HUMIDITY},
+    {0x00100018, 0x0018, PROPERTY_READ, 2, {0x76, 0x2A}, VALUE_UV},
+    {0x00100018,
+     0x001A,
+     PROPERTY_READ,
+     16,
+     {0x2E, 0xA3, 0xF4, 0x54, 0x87, 0x9F, 0xDE, 0x8D, 0xEB, 0x45, 0x02, 0xBF,
+      0x13, 0x69, 0x54, 0xC8},
+     VALUE_SOUND},
+    {0x00200025,
+     0x0022,
+     PROPERTY_READ | PROPERTY_NOTIFY,
+     16,
+     {0x3B, 0x10, 0x19, 0x00, 0xB0, 0x91, 0xE7, 0x76, 0x33, 0xEF, 0x01, 0xC4,
+      0xAE, 0x58, 0xD6, 0xEF},
+     VALUE_CO2},
+    {0x00200025,
+     0x0025,
+     PROPERTY_READ | PROPERTY_NOTIFY,
+     16,
+     {0x3B, 0x10, 0x19, 0x00, 0xB0, 0x91, 0xE7, 0x76, 0x33, 0xEF, 0x02, 0xC4,
+      0xAE, 0x58, 0xD6, 0xEF},
+     VALUE_VOC},
+    {0x00300035,
+     0x0032,
+     PROPERTY_READ,
+     16,
+     {0x2E, 0xA3, 0xF4, 0x54, 0x87, 0x9F, 0xDE, 0x8D, 0xEB, 0x45, 0xD9, 0xBF,
+      0x13, 0x69, 0x54, 0xC8},
+     VALUE_LIGHT},
+    {0x00400045,
+     0x0042,
+     PROPERTY_NOTIFY,
+     16,
+     {0x9F, 0xDC, 0x9C, 0x81, 0xFF, 0xFE, 0x5D, 0x88, 0xE5, 0x11, 0xE5, 0x4B,
+      0xE2, 0xF6, 0xC1, 0xC4},
+     VALUE_ACCELERATION},
+    {0x00400045,
+     0x0045,
+     PROPERTY_NOTIFY,
+     16,
+     {0x9A, 0xF4, 0x94, 0xE9, 0xB5, 0xF3, 0x9F, 0xBA, 0xDD, 0x45, 0xE3, 0xBE,
+      0x94, 0xB6, 0xC4, 0xB7},
+     VALUE_ORIENTATION},
+    {0x00500058, 0x0052, PROPERTY_READ, 2, {0x29, 0x2A}, VALUE_MANUFACTURER},
+    {0x00500058, 0x0054, PROPERTY_READ, 2, {0x24, 0x2A}, VALUE_MODEL},
+    {0x00500058, 0x0056, PROPERTY_READ, 2, {0x26, 0x2A}, VALUE_FIRMWARE},
+    {0x00600062,
+     0x0062,
+     PROPERTY_READ | PROPERTY_NOTIFY,
+     2,
+     {0x19, 0x2A},
+     VALUE_BATTERY},
+    {0x00700074,
+     0x0072,
+     PROPERTY_READ | PROPERTY_WRITE,
+     2,
+     {0x56, 0x2A},
+     VALUE_DIGITAL},
+    {0x00700074,
+     0x0074,
+     PROPERTY_READ | PROPERTY_WRITE,
+     2,
+     {0x56, 0x2A},
+     VALUE_DIGITAL},
+};
+
+#define NUM_SERVICES (sizeof(_services) / sizeof(_services[0]))
+#define NUM_CHARACTERISTICS                                                    \
+  (sizeof(_characteristics) / sizeof(_characteristics[0]))
+
+static int _master = -1;
+static int _slave = -1;
+static SimDevice _devices[MAX_DEVICES];
+static uint32_t _num_devices = 1;
+static uint32_t _advert_rate = 10;
+static uint32_t _other_advert_rate = 0;
+static uint32_t _num_beacons = 0;
+static uint32_t _beacon_advert_rate = 100;
+static uint32_t _notify_rate = 1;
+static uint32_t _latency_us = 0;
+static uint32_t _loss_permille = 0;
+static bool _link_model = false;
+static bool _phy_2m = true;
+static uint32_t _drop_period_us = 0;
+static uint32_t _outage_us = 1000000;
+static uint16_t _max_mtu = ATT_DEFAULT_MTU;
+static uint16_t _initial_interval = LINK_INITIAL_INTERVAL;
+static bool _verbose = false;
+static bool _scanning = false;
+static bool _active_scan = false;
+static uint64_t _first_scan_us = 0;
+static uint32_t _scan_interval_us = SCAN_DEFAULT_US;
+static uint32_t _scan_window_us = SCAN_DEFAULT_US;
+
+static SimMessage _output[OUTPUT_QUEUE_LENGTH];
+static uint32_t _output_head = 0;
+static uint32_t _output_tail = 0;
+
+static struct {
+  uint32_t commands;
+  uint32_t events;
+  uint32_t lost;
+  uint32_t overflow;
+  uint64_t bytes;
+  uint32_t reconnects;
+  uint64_t reconnect_us;
+  uint32_t unheard;
+} _stats;
+
+static uint64_t now_us() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return ((uint64_t)now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+}
+
+static void set_header(struct gecko_cmd_packet *packet, uint32_t id,
+                       uint32_t payload_length) {
+  packet->header = id | ((payload_length & 0xFF) << 8) |
+                   ((payload_length >> 8) & 0x07);
+}
+
+// Queue a message to go out at due_us plus the configured latency. The
+// queue stays sorted by due time, a message goes after those due no later.
+static void send_at(struct gecko_cmd_packet *packet, bool lossy,
+                    uint64_t due_us) {
+  uint32_t length = BGLIB_MSG_HEADER_LEN + BGLIB_MSG_LEN(packet->header);
+  uint32_t position;
+  SimMessage *message;
+
+  if (lossy && _loss_permille && (uint32_t)(rand() % 1000) < _loss_permille) {
+    _stats.lost++;
+    return;
+  }
+  if (_output_head - _output_tail == OUTPUT_QUEUE_LENGTH) {
+    _stats.overflow++;
+    return;
+  }
+
+  due_us += _latency_us;
+  for (position = _output_head;
+       position != _output_tail &&
+       _output[(position - 1) % OUTPUT_QUEUE_LENGTH].due_us > due_us;
+       position--) {
+    _output[position % OUTPUT_QUEUE_LENGTH] =
+        _output[(position - 1) % OUTPUT_QUEUE_LENGTH];
+  }
+  message = &_output[position % OUTPUT_QUEUE_LENGTH];
+  message->due_us = due_us;
+  message->length = length;
+  memcpy(message->data, packet, length);
+  _output_head++;
+  if (packet->header & gecko_msg_type_evt) {
+    _stats.events++;
+  }
+}
+
+static void send(struct gecko_cmd_packet *packet, bool lossy) {
+  send_at(packet, lossy, now_us());
+}
+
+// First connection event of the device at or after time
+static uint64_t next_connection_event(SimDevice *device, uint64_t time) {
+  if (device->update_us && time >= device->update_us) {
+    device->anchor_us = device->update_us;
+    device->interval = device->next_interval;
+    device->update_us = 0;
+  }
+  uint64_t interval_us = device->interval * 1250;
+
+  if (time <= device->anchor_us) {
+    return device->anchor_us;
+  }
+  return device->anchor_us +
+         (time - device->anchor_us + interval_us - 1) / interval_us *
+             interval_us;
+}
+
+// Air time of an ATT PDU of length bytes, split into LL packets
+static uint64_t air_time_us(SimDevice *device, uint32_t length) {
+  uint32_t packets = (length + LINK_DATA_LENGTH - 1) / LINK_DATA_LENGTH;
+
+  if (device->phy == le_gap_phy_2m) {
+    return packets * LINK_OVERHEAD_2M_US + length * 4;
+  }
+  return packets * LINK_OVERHEAD_1M_US + length * 8;
+}
+
+// When exchanges ATT request and response pairs queued behind the ones
+// already in flight are done, the responses carrying length bytes in all.
+// Without the link model that is right away.
+static uint64_t link_exchange(SimDevice *device, uint32_t exchanges,
+                              uint32_t length) {
+  uint64_t now = now_us();
+
+  if (!_link_model) {
+    return now;
+  }
+  uint64_t start = device->link_free_us > now ? device->link_free_us : now;
+  uint64_t event = next_connection_event(device, start);
+  device->link_free_us = event + exchanges * device->interval * 1250 +
+                         air_time_us(device, length);
+  return device->link_free_us;
+}
+
+// Exchanges needed to return length bytes of attribute data in responses
+// of the current MTU, plus the one that finds nothing more
+static uint32_t discovery_exchanges(SimDevice *device, uint32_t length) {
+  uint32_t per_response = device->mtu - 2;
+
+  return (length + per_response - 1) / per_response + 1;
+}
+
+static void flush_output(uint64_t now) {
+  uint8_t buffer[16384];
+  uint32_t used = 0;
+
+  while (_output_tail != _output_head) {
+    SimMessage *message = &_output[_output_tail % OUTPUT_QUEUE_LENGTH];
+    if (message->due_us > now || used + message->length > sizeof(buffer)) {
+      break;
+    }
+    memcpy(&buffer[used], message->data, message->length);
+    used += message->length;
+    _output_tail++;
+  }
+
+  for (uint32_t written = 0; written < used;) {
+    ssize_t result = write(_master, &buffer[written], used - written);
+    if (result < 0) {
+      if (errno == EINTR || errno == EAGAIN) {
+        continue;
+      }
+      perror("write");
+      exit(-1);
+    }
+    written += result;
+  }
+  _stats.bytes += used;
+}
+
+static void respond_result(uint32_t id, uint16_t result) {
+  struct gecko_cmd_packet packet;
+
+  set_header(&packet, id, sizeof(uint16_t));
+  packet.data.payload[0] = result & 0xFF;
+  packet.data.payload[1] = result >> 8;
+  send(&packet, false);
+}
+
+static void procedure_completed(uint8_t connection, uint64_t due_us) {
+  struct gecko_cmd_packet packet;
+
+  set_header(&packet, gecko_evt_gatt_procedure_completed_id,
+             sizeof(packet.data.evt_gatt_procedure_completed));
+  packet.data.evt_gatt_procedure_completed.connection = connection;
+  packet.data.evt_gatt_procedure_completed.result = 0;
+  send_at(&packet, false, due_us);
+}
+
+static SimDevice *device_by_connection(uint8_t connection) {
+  if (connection == 0 || connection > _num_devices ||
+      _devices[connection - 1].connection != connection) {
+    return NULL;
+  }
+  return &_devices[connection - 1];
+}
+
+static int characteristic_index(uint16_t handle) {
+  for (uint32_t i = 0; i < NUM_CHARACTERISTICS; i++) {
+    if (_characteristics[i].handle == handle) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static void put_le(uint8_t *buffer, uint32_t value, uint32_t length) {
+  for (uint32_t i = 0; i < length; i++) {
+    buffer[i] = (value >> (8 * i)) & 0xFF;
+  }
+}
+
+static void put_be(uint8_t *buffer, uint32_t value, uint32_t length) {
+  for (uint32_t i = 0; i < length; i++) {
+    buffer[i] = (value >> (8 * (length - 1 - i))) & 0xFF;
+  }
+}
+
+// Current reading of a sensor, drifting a little on every call
+static uint8_t sensor_value(SimDevice *device, SimValue value,
+                            uint8_t *buffer) {
+  uint32_t wobble = device->tick++ % 16;
+
+  switch (value) {
+  case VALUE_NAME:
+    memcpy(buffer, device->name, strlen(device->name));
+    return strlen(device->name);
+  case VALUE_TEMPERATURE:
+    put_le(buffer, 2200 + wobble * 5, 2); // 0.01 C
+    return 2;
+  case VALUE_PRESSURE:
+    put_le(buffer, 1013250 + wobble * 10, 4); // 0.1 Pa
+    return 4;
+  case VALUE_HUMIDITY:
+    put_le(buffer, 4500 + wobble * 10, 2); // 0.01 %
+    return 2;
+  case VALUE_UV:
+    buffer[0] = wobble / 4;
+    return 1;
+  case VALUE_SOUND:
+    put_le(buffer, 4000 + wobble * 25, 2); // 0.01 dB
+    return 2;
+  case VALUE_CO2:
+    put_le(buffer, 400 + wobble, 2); // ppm
+    return 2;
+  case VALUE_VOC:
+    put_le(buffer, 50 + wobble, 2); // ppb
+    return 2;
+  case VALUE_LIGHT:
+    put_le(buffer, 250000 + wobble * 1000, 4); // 0.001 lux
+    return 4;
+  case VALUE_ACCELERATION:
+    put_le(buffer, wobble, 2); // 0.001 g
+    put_le(buffer + 2, 0, 2);
+    put_le(buffer + 4, 1000, 2);
+    return 6;
+  case VALUE_ORIENTATION:
+    put_le(buffer, wobble * 100, 2); // 0.01 degree
+    put_le(buffer + 2, 0, 2);
+    put_le(buffer + 4, 0, 2);
+    return 6;
+  case VALUE_SERVICE_CHANGED:
+    put_le(buffer, 0x0001, 2);
+    put_le(buffer + 2, 0xFFFF, 2);
+    return 4;
+  case VALUE_MANUFACTURER:
+    memcpy(buffer, "Silicon Labs", 12);
+    return 12;
+  case VALUE_MODEL:
+    memcpy(buffer, "BRD4166A", 8);
+    return 8;
+  case VALUE_FIRMWARE:
+    memcpy(buffer, "2.0.0", 5);
+    return 5;
+  case VALUE_BATTERY:
+    buffer[0] = 100 - wobble;
+    return 1;
+  case VALUE_DIGITAL:
+    buffer[0] = 0;
+    return 1;
+  }
+  return 0;
+}
+
+static void characteristic_value(SimDevice *device, uint16_t handle,
+                                 uint8_t opcode, const uint8_t *value,
+                                 uint8_t length, bool lossy, uint64_t due_us) {
+  struct gecko_cmd_packet packet;
+  struct gecko_msg_gatt_characteristic_value_evt_t *event =
+      &packet.data.evt_gatt_characteristic_value;
+
+  event->connection = device->connection;
+  event->characteristic = handle;
+  event->att_opcode = opcode;
+  event->offset = 0;
+  event->value.len = length;
+  memcpy(event->value.data, value, length);
+  set_header(&packet, gecko_evt_gatt_characteristic_value_id,
+             sizeof(*event) + length);
+  send_at(&packet, lossy, due_us);
+}
+
+// Adverts sent outside the scan window are missed. The random advDelay
+// every advertiser adds makes it drift against the scan interval, so an
+// advert falls in the window with the probability of window / interval.
+static bool scan_window_open() {
+  return rand() % _scan_interval_us < _scan_window_us;
+}
+
+static void send_advert(const bd_addr *address, uint8_t packet_type,
+                        const uint8_t *data, uint8_t length) {
+  struct gecko_cmd_packet packet;
+  struct gecko_msg_le_gap_scan_response_evt_t *event =
+      &packet.data.evt_le_gap_scan_response;
+
+  if (!scan_window_open()) {
+    _stats.unheard++;
+    return;
+  }
+
+  event->rssi = -40 - rand() % 50;
+  event->packet_type = packet_type;
+  event->address = *address;
+  event->address_type = le_gap_address_type_public;
+  event->bonding = 0xFF;
+  event->data.len = length;
+  memcpy(event->data.data, data, length);
+
+  set_header(&packet, gecko_evt_le_gap_scan_response_id,
+             sizeof(*event) + event->data.len);
+  send(&packet, true);
+}
+
+static void scan_response(const bd_addr *address, const char *name) {
+  uint8_t name_length = strlen(name);
+  uint8_t data[31];
+
+  // Flags, then the complete local name
+  data[0] = 2;
+  data[1] = 0x01;
+  data[2] = 0x06;
+  data[3] = name_length + 1;
+  data[4] = 0x09;
+  memcpy(&data[5], name, name_length);
+  send_advert(address, 0, data, 5 + name_length);
+
+  // The scan response repeats the name
+  if (_active_scan) {
+    send_advert(address, 4, &data[3], 2 + name_length);
+  }
+}
+
+static void advertise_next() {
+  static uint32_t next_device = 0;
+
+  for (uint32_t tries = 0; tries < _num_devices; tries++) {
+    SimDevice *device = &_devices[next_device++ % _num_devices];
+    if (!device->connection && now_us() >= device->out_of_range_us) {
+      scan_response(&device->address, device->name);
+      return;
+    }
+  }
+}
+
+static void advertise_other() {
+  static uint32_t sequence = 0;
+  bd_addr address = {{sequence & 0xFF, (sequence >> 8) & 0xFF, 0x42, 0x42,
+                      0x42, 0x42}};
+  sequence++;
+  scan_response(&address, (sequence % 2) ? "Phone" : "Beacon");
+}
+
+static uint8_t put_uuid_record(uint8_t *buffer, uint16_t uuid, SimDevice *sensor,
+                               SimValue value) {
+  put_le(buffer, uuid, 2);
+  return 2 + sensor_value(sensor, value, buffer + 2);
+}
+
+// Put a service data AD structure of one sensor value at buffer
+static uint8_t put_service_data(uint8_t *buffer, uint16_t uuid,
+                                SimDevice *sensor, SimValue value) {
+  uint8_t length = put_uuid_record(buffer + 2, uuid, sensor, value);
+  buffer[0] = length + 1;
+  buffer[1] = 0x16;
+  return length + 2;
+}
+
+static void advertise_beacon() {
+  static uint32_t sequence = 0;
+  uint32_t index = sequence % _num_beacons;
+  uint32_t round = sequence / _num_beacons;
+  bd_addr address = {{index & 0xFF, (index >> 8) & 0xFF, 0x00, 0xBE, 0x0B,
+                      0x00}};
+  SimDevice sensor = {.tick = round};
+  uint8_t data[31];
+  uint8_t length = 0;
+
+  sequence++;
+  switch (round % 10) {
+  case 9:
+    // Eddystone-TLM: version, battery mV, temperature in 8.8, advert and
+    // 0.1 s counts
+    data[0] = 17;
+    data[1] = 0x16;
+    put_le(&data[2], EDDYSTONE_UUID, 2);
+    data[4] = 0x20;
+    data[5] = 0x00;
+    put_be(&data[6], 3000, 2);
+    put_be(&data[8], 22 << 8 | 0x80, 2);
+    put_be(&data[10], round + 1, 4);
+    put_be(&data[14], round * 10, 4);
+    length = 18;
+    break;
+
+  case 1:
+  case 3:
+  case 5:
+  case 7:
+    length += put_service_data(&data[length], 0x2A6E, &sensor,
+                               VALUE_TEMPERATURE);
+    length +=
+        put_service_data(&data[length], 0x2A6F, &sensor, VALUE_HUMIDITY);
+    break;
+
+  default:
+    data[1] = 0xFF;
+    put_le(&data[2], SILICON_LABS_COMPANY_ID, 2);
+    length = 4;
+    length += put_uuid_record(&data[length], 0x2A6E, &sensor,
+                              VALUE_TEMPERATURE);
+    length +=
+        put_uuid_record(&data[length], 0x2A6F, &sensor, VALUE_HUMIDITY);
+    length +=
+        put_uuid_record(&data[length], 0x2A6D, &sensor, VALUE_PRESSURE);
+    length += put_uuid_record(&data[length], 0x2A76, &sensor, VALUE_UV);
+    data[0] = length - 1;
+    break;
+  }
+  // Non-connectable undirected
+  send_advert(&address, 2, data, length);
+}
+
+static void notify_subscribed() {
+  for (uint32_t i = 0; i < _num_devices; i++) {
+    SimDevice *device = &_devices[i];
+    if (!device->connection || device->pending) {
+      continue;
+    }
+    for (uint32_t c = 0; c < NUM_CHARACTERISTICS; c++) {
+      if (device->subscribed & (1u << c)) {
+        uint8_t value[32];
+        uint8_t length = sensor_value(device, _characteristics[c].value, value);
+        uint64_t due = now_us();
+        if (_link_model) {
+          due = next_connection_event(device, due) +
+                air_time_us(device, 3 + length);
+        }
+        characteristic_value(device, _characteristics[c].handle,
+                             ATT_HANDLE_VALUE_NOTIFICATION, value, length,
+                             true, due);
+      }
+    }
+  }
+}
+
+static void boot() {
+  struct gecko_cmd_packet packet;
+
+  memset(&packet, 0, sizeof(packet));
+  set_header(&packet, gecko_evt_system_boot_id,
+             sizeof(packet.data.evt_system_boot));
+  packet.data.evt_system_boot.major = 2;
+  packet.data.evt_system_boot.minor = 12;
+  send(&packet, false);
+}
+
+// GATT events of a closed connection that have not gone out yet never will
+static void purge_gatt_events(uint8_t connection) {
+  uint32_t kept = _output_tail;
+
+  for (uint32_t i = _output_tail; i != _output_head; i++) {
+    SimMessage *message = &_output[i % OUTPUT_QUEUE_LENGTH];
+    if ((message->data[0] & gecko_msg_type_evt) &&
+        message->data[2] == GATT_CLASS &&
+        message->data[BGLIB_MSG_HEADER_LEN] == connection) {
+      continue;
+    }
+    if (kept != i) {
+      _output[kept % OUTPUT_QUEUE_LENGTH] = *message;
+    }
+    kept++;
+  }
+  _output_head = kept;
+}
+
+static void connection_closed(SimDevice *device, uint16_t reason) {
+  struct gecko_cmd_packet packet;
+
+  purge_gatt_events(device->connection);
+
+  set_header(&packet, gecko_evt_le_connection_closed_id,
+             sizeof(packet.data.evt_le_connection_closed));
+  packet.data.evt_le_connection_closed.reason = reason;
+  packet.data.evt_le_connection_closed.connection = device->connection;
+  send(&packet, false);
+  device->connection = 0;
+  device->subscribed = 0;
+  device->pending = false;
+}
+
+static void reset() {
+  _scanning = false;
+  _active_scan = false;
+  _scan_interval_us = SCAN_DEFAULT_US;
+  _scan_window_us = SCAN_DEFAULT_US;
+  _max_mtu = ATT_DEFAULT_MTU;
+  _initial_interval = LINK_INITIAL_INTERVAL;
+  for (uint32_t i = 0; i < _num_devices; i++) {
+    _devices[i].connection = 0;
+    _devices[i].subscribed = 0;
+    _devices[i].pending = false;
+  }
+  // Whatever was still queued is lost with the reset
+  _output_tail = _output_head;
+  boot();
+}
+
+static void connection_opened(SimDevice *device);
+
+static void connect(struct gecko_msg_le_gap_connect_cmd_t *command) {
+  struct gecko_cmd_packet packet;
+  SimDevice *device = NULL;
+
+  for (uint32_t i = 0; i < _num_devices; i++) {
+    if (!memcmp(&_devices[i].address, &command->address, sizeof(bd_addr))) {
+      device = &_devices[i];
+    }
+  }
+
+  set_header(&packet, gecko_rsp_le_gap_connect_id,
+             sizeof(packet.data.rsp_le_gap_connect));
+  if (!device || device->connection) {
+    packet.data.rsp_le_gap_connect.result = bg_err_invalid_param;
+    packet.data.rsp_le_gap_connect.connection = 0;
+    send(&packet, false);
+    return;
+  }
+
+  device->connection = (device - _devices) + 1;
+  packet.data.rsp_le_gap_connect.result = 0;
+  packet.data.rsp_le_gap_connect.connection = device->connection;
+  send(&packet, false);
+
+  if (now_us() < device->out_of_range_us) {
+    device->pending = true;
+  } else {
+    connection_opened(device);
+  }
+}
+
+static void connection_opened(SimDevice *device) {
+  struct gecko_cmd_packet packet;
+
+  device->pending = false;
+  device->drop_us = _drop_period_us ? now_us() + _drop_period_us : 0;
+  if (!device->connected_once) {
+    device->connected_once = true;
+    fprintf(stderr, "%s connected %.1f ms after the first scan\n",
+            device->name, (now_us() - _first_scan_us) / 1000.0);
+  }
+  if (device->dropped_us) {
+    _stats.reconnects++;
+    _stats.reconnect_us += now_us() - device->dropped_us;
+    device->dropped_us = 0;
+  }
+  device->interval = _initial_interval;
+  device->update_us = 0;
+  device->phy = le_gap_phy_1m;
+  device->mtu = ATT_DEFAULT_MTU;
+  device->anchor_us = now_us();
+  device->link_free_us = device->anchor_us;
+
+  set_header(&packet, gecko_evt_le_connection_opened_id,
+             sizeof(packet.data.evt_le_connection_opened));
+  packet.data.evt_le_connection_opened.address = device->address;
+  packet.data.evt_le_connection_opened.address_type =
+      le_gap_address_type_public;
+  packet.data.evt_le_connection_opened.master = 1;
+  packet.data.evt_le_connection_opened.connection = device->connection;
+  packet.data.evt_le_connection_opened.bonding = 0xFF;
+  packet.data.evt_le_connection_opened.advertiser = 0xFF;
+  send(&packet, false);
+
+  set_header(&packet, gecko_evt_le_connection_parameters_id,
+             sizeof(packet.data.evt_le_connection_parameters));
+  packet.data.evt_le_connection_parameters.connection = device->connection;
+  packet.data.evt_le_connection_parameters.interval = device->interval;
+  packet.data.evt_le_connection_parameters.latency = 0;
+  packet.data.evt_le_connection_parameters.timeout = 100;
+  packet.data.evt_le_connection_parameters.security_mode = 0;
+  packet.data.evt_le_connection_parameters.txsize = LINK_DATA_LENGTH;
+  send(&packet, false);
+
+  // The stack exchanges the MTU on its own when its maximum is raised
+  if (_max_mtu > ATT_DEFAULT_MTU) {
+    device->mtu = _max_mtu < ATT_MTU ? _max_mtu : ATT_MTU;
+    set_header(&packet, gecko_evt_gatt_mtu_exchanged_id,
+               sizeof(packet.data.evt_gatt_mtu_exchanged));
+    packet.data.evt_gatt_mtu_exchanged.connection = device->connection;
+    packet.data.evt_gatt_mtu_exchanged.mtu = device->mtu;
+    send_at(&packet, false, link_exchange(device, 1, 2));
+  }
+}
+
+// Drop links that are due to and complete attempts to boards back in range,
+// returns when that is next needed
+static uint64_t update_links(uint64_t now) {
+  uint64_t wake = UINT64_MAX;
+
+  for (uint32_t i = 0; i < _num_devices; i++) {
+    SimDevice *device = &_devices[i];
+    if (!device->connection) {
+      continue;
+    }
+    if (device->pending) {
+      if (now >= device->out_of_range_us) {
+        connection_opened(device);
+      } else if (device->out_of_range_us < wake) {
+        wake = device->out_of_range_us;
+      }
+    }
+    if (!device->pending && device->drop_us) {
+      if (now >= device->drop_us) {
+        device->out_of_range_us = now + _outage_us;
+        device->dropped_us = now;
+        connection_closed(device, bg_err_bt_connection_timeout);
+      } else if (device->drop_us < wake) {
+        wake = device->drop_us;
+      }
+    }
+  }
+  return wake;
+}
+
+static bool uuid_matches(const uint8_t *uuid, uint8_t uuid_length,
+                         const uint8array *wanted) {
+  return wanted->len == uuid_length && !memcmp(uuid, wanted->data, uuid_length);
+}
+
+static bool service_matches(uint32_t index, const uint8array *uuid) {
+  return !uuid || uuid_matches(_services[index].uuid,
+                               _services[index].uuid_length, uuid);
+}
+
+static void discover_services(SimDevice *device, const uint8array *uuid) {
+  struct gecko_cmd_packet packet;
+  struct gecko_msg_gatt_service_evt_t *event = &packet.data.evt_gatt_service;
+  uint32_t length = 0;
+
+  // Read by group type returns handles and UUID, find by type value only
+  // the handles
+  for (uint32_t i = 0; i < NUM_SERVICES; i++) {
+    if (service_matches(i, uuid)) {
+      length += uuid ? 4 : 4 + _services[i].uuid_length;
+    }
+  }
+  uint64_t due =
+      link_exchange(device, discovery_exchanges(device, length), length);
+
+  for (uint32_t i = 0; i < NUM_SERVICES; i++) {
+    if (!service_matches(i, uuid)) {
+      continue;
+    }
+    event->connection = device->connection;
+    event->service = _services[i].handle;
+    event->uuid.len = _services[i].uuid_length;
+    memcpy(event->uuid.data, _services[i].uuid, _services[i].uuid_length);
+    set_header(&packet, gecko_evt_gatt_service_id,
+               sizeof(*event) + event->uuid.len);
+    send_at(&packet, false, due);
+  }
+  procedure_completed(device->connection, due);
+}
+
+static void discover_characteristics(SimDevice *device, uint32_t service,
+                                     const uint8array *uuid) {
+  struct gecko_cmd_packet packet;
+  struct gecko_msg_gatt_characteristic_evt_t *event =
+      &packet.data.evt_gatt_characteristic;
+  uint32_t length = 0;
+
+  // Read by type walks every declaration of the service, by UUID too
+  for (uint32_t i = 0; i < NUM_CHARACTERISTICS; i++) {
+    if (_characteristics[i].service == service) {
+      length += 5 + _characteristics[i].uuid_length;
+    }
+  }
+  uint64_t due =
+      link_exchange(device, discovery_exchanges(device, length), length);
+
+  for (uint32_t i = 0; i < NUM_CHARACTERISTICS; i++) {
+    const SimCharacteristic *characteristic = &_characteristics[i];
+    if (characteristic->service != service ||
+        (uuid && !uuid_matches(characteristic->uuid,
+                               characteristic->uuid_length, uuid))) {
+      continue;
+    }
+    event->connection = device->connection;
+    event->characteristic = characteristic->handle;
+    event->properties = characteristic->properties;
+    event->uuid.len = characteristic->uuid_length;
+    memcpy(event->uuid.data, characteristic->uuid,
+           characteristic->uuid_length);
+    set_header(&packet, gecko_evt_gatt_characteristic_id,
+               sizeof(*event) + event->uuid.len);
+    send_at(&packet, false, due);
+  }
+  procedure_completed(device->connection, due);
+}
+
+static void read_value(SimDevice *device, uint16_t handle) {
+  int index = characteristic_index(handle);
+  uint8_t value[32];
+  uint8_t length = 0;
+
+  if (index >= 0) {
+    length = sensor_value(device, _characteristics[index].value, value);
+  }
+  uint64_t due = link_exchange(device, 1, 1 + length);
+  if (index >= 0) {
+    characteristic_value(device, handle, ATT_READ_RESPONSE, value, length,
+                         false, due);
+  }
+  procedure_completed(device->connection, due);
+}
+
+// One read multiple response carrying every value back to back
+static void read_multiple(SimDevice *device, const uint8array *handles) {
+  uint8_t values[ATT_MTU];
+  uint32_t length = 0;
+
+  for (uint32_t i = 0; i + 1 < handles->len; i += 2) {
+    int index = characteristic_index(handles->data[i] |
+                                     (handles->data[i + 1] << 8));
+    uint8_t value[32];
+    uint8_t value_length;
+
+    if (index < 0) {
+      continue;
+    }
+    value_length = sensor_value(device, _characteristics[index].value, value);
+    if (length + value_length > device->mtu - 1u) {
+      break;
+    }
+    memcpy(&values[length], value, value_length);
+    length += value_length;
+  }
+  uint64_t due = link_exchange(device, 1, 1 + length);
+  characteristic_value(device, 0, ATT_READ_MULTIPLE_RESPONSE, values, length,
+                       false, due);
+  procedure_completed(device->connection, due);
+}
+
+// When a link layer control procedure started now takes effect. Data keeps
+// flowing until then.
+static uint64_t link_instant(SimDevice *device) {
+  uint64_t now = now_us();
+
+  if (!_link_model) {
+    return now;
+  }
+  uint64_t event = next_connection_event(device, now);
+  return event + LINK_UPDATE_EVENTS * device->interval * 1250;
+}
+
+// The peripheral takes the shortest interval offered, not below its minimum
+static void update_parameters(
+    SimDevice *device,
+    struct gecko_msg_le_connection_set_parameters_cmd_t *command) {
+  struct gecko_cmd_packet packet;
+  uint16_t interval = command->min_interval;
+  uint64_t instant = link_instant(device);
+
+  if (interval < LINK_MIN_INTERVAL) {
+    interval = command->max_interval < LINK_MIN_INTERVAL ? LINK_MIN_INTERVAL
+                                                         : command->max_interval;
+  }
+  if (_link_model) {
+    device->next_interval = interval;
+    device->update_us = instant;
+  } else {
+    device->interval = interval;
+  }
+
+  set_header(&packet, gecko_evt_le_connection_parameters_id,
+             sizeof(packet.data.evt_le_connection_parameters));
+  packet.data.evt_le_connection_parameters.connection = device->connection;
+  packet.data.evt_le_connection_parameters.interval = interval;
+  packet.data.evt_le_connection_parameters.latency = command->latency;
+  packet.data.evt_le_connection_parameters.timeout = command->timeout;
+  packet.data.evt_le_connection_parameters.security_mode = 0;
+  packet.data.evt_le_connection_parameters.txsize = LINK_DATA_LENGTH;
+  send_at(&packet, false, instant);
+}
+
+// 2M if both the request and the peripheral allow it, else 1M
+static void update_phy(SimDevice *device, uint8_t phys) {
+  struct gecko_cmd_packet packet;
+
+  device->phy =
+      (_phy_2m && (phys & le_gap_phy_2m)) ? le_gap_phy_2m : le_gap_phy_1m;
+  set_header(&packet, gecko_evt_le_connection_phy_status_id,
+             sizeof(packet.data.evt_le_connection_phy_status));
+  packet.data.evt_le_connection_phy_status.connection = device->connection;
+  packet.data.evt_le_connection_phy_status.phy = device->phy;
+  send_at(&packet, false, link_instant(device));
+}
+
+static void handle_command(struct gecko_cmd_packet *command) {
+  uint32_t id = BGLIB_MSG_ID(command->header);
+  SimDevice *device;
+
+  _stats.commands++;
+  if (_verbose) {
+    fprintf(stderr, "command 0x%08X\n", id);
+  }
+
+  switch (id) {
+  case gecko_cmd_system_reset_id:
+    reset();
+    break;
+
+  case gecko_cmd_le_gap_start_discovery_id:
+    _scanning = true;
+    if (!_first_scan_us) {
+      _first_scan_us = now_us();
+    }
+    respond_result(id, 0);
+    break;
+
+  case gecko_cmd_le_gap_set_discovery_timing_id: {
+    struct gecko_msg_le_gap_set_discovery_timing_cmd_t *timing =
+        &command->data.cmd_le_gap_set_discovery_timing;
+    if (!timing->scan_window || timing->scan_window > timing->scan_interval) {
+      respond_result(id, bg_err_invalid_param);
+      break;
+    }
+    _scan_interval_us = timing->scan_interval * SCAN_TIMING_UNIT_US;
+    _scan_window_us = timing->scan_window * SCAN_TIMING_UNIT_US;
+    respond_result(id, 0);
+  } break;
+
+  case gecko_cmd_le_gap_set_discovery_type_id:
+    _active_scan = command->data.cmd_le_gap_set_discovery_type.scan_type;
+    respond_result(id, 0);
+    break;
+
+  case gecko_cmd_le_gap_end_procedure_id:
+    _scanning = false;
+    respond_result(id, 0);
+    break;
+
+  case gecko_cmd_le_gap_connect_id:
+    connect(&command->data.cmd_le_gap_connect);
+    break;
+
+  case gecko_cmd_le_connection_close_id:
+    device = device_by_connection(command->data.cmd_le_connection_close.connection);
+    respond_result(id, device ? 0 : bg_err_invalid_conn_handle);
+    if (device) {
+      connection_closed(device, bg_err_bt_connection_terminated_by_local_host);
+    }
+    break;
+
+  case gecko_cmd_gatt_discover_primary_services_id:
+    device = device_by_connection(
+        command->data.cmd_gatt_discover_primary_services.connection);
+    respond_result(id, device ? 0 : bg_err_invalid_conn_handle);
+    if (device) {
+      discover_services(device, NULL);
+    }
+    break;
+
+  case gecko_cmd_gatt_discover_primary_services_by_uuid_id:
+    device = device_by_connection(
+        command->data.cmd_gatt_discover_primary_services_by_uuid.connection);
+    respond_result(id, device ? 0 : bg_err_invalid_conn_handle);
+    if (device) {
+      discover_services(
+          device,
+          &command->data.cmd_gatt_discover_primary_services_by_uuid.uuid);
+    }
+    break;
+
+  case gecko_cmd_gatt_discover_characteristics_id:
+    device = device_by_connection(
+        command->data.cmd_gatt_discover_characteristics.connection);
+    respond_result(id, device ? 0 : bg_err_invalid_conn_handle);
+    if (device) {
+      discover_characteristics(
+          device,
+          command->data.cmd_gatt_discover_characteristics.service, NULL);
+    }
+    break;
+
+  case gecko_cmd_gatt_discover_characteristics_by_uuid_id:
+    device = device_by_connection(
+        command->data.cmd_gatt_discover_characteristics_by_uuid.connection);
+    respond_result(id, device ? 0 : bg_err_invalid_conn_handle);
+    if (device) {
+      discover_characteristics(
+          device,
+          command->data.cmd_gatt_discover_characteristics_by_uuid.service,
+          &command->data.cmd_gatt_discover_characteristics_by_uuid.uuid);
+    }
+    break;
+
+  case gecko_cmd_gatt_set_characteristic_notification_id: {
+    struct gecko_msg_gatt_set_characteristic_notification_cmd_t *notification =
+        &command->data.cmd_gatt_set_characteristic_notification;
+    int index = characteristic_index(notification->characteristic);
+
+    device = device_by_connection(notification->connection);
+    respond_result(id, device ? 0 : bg_err_invalid_conn_handle);
+    if (device) {
+      if (index >= 0 && notification->flags) {
+        device->subscribed |= 1u << index;
+      } else if (index >= 0) {
+        device->subscribed &= ~(1u << index);
+      }
+      // Writing the client characteristic configuration is one exchange
+      procedure_completed(device->connection, link_exchange(device, 1, 5));
+    }
+  } break;
+
+  case gecko_cmd_gatt_read_characteristic_value_id:
+    device = device_by_connection(
+        command->data.cmd_gatt_read_characteristic_value.connection);
+    respond_result(id, device ? 0 : bg_err_invalid_conn_handle);
+    if (device) {
+      read_value(device,
+                 command->data.cmd_gatt_read_characteristic_value.characteristic);
+    }
+    break;
+
+  case gecko_cmd_gatt_read_multiple_characteristic_values_id:
+    device = device_by_connection(
+        command->data.cmd_gatt_read_multiple_characteristic_values.connection);
+    respond_result(id, device ? 0 : bg_err_invalid_conn_handle);
+    if (device) {
+      read_multiple(device, &command->data
+                                 .cmd_gatt_read_multiple_characteristic_values
+                                 .characteristic_list);
+    }
+    break;
+
+  case gecko_cmd_le_gap_set_conn_parameters_id: {
+    uint16_t interval = command->data.cmd_le_gap_set_conn_parameters.min_interval;
+    _initial_interval = interval < LINK_MIN_INTERVAL ? LINK_MIN_INTERVAL
+                                                     : interval;
+    respond_result(id, 0);
+  } break;
+
+  case gecko_cmd_le_connection_set_parameters_id:
+    device = device_by_connection(
+        command->data.cmd_le_connection_set_parameters.connection);
+    respond_result(id, device ? 0 : bg_err_invalid_conn_handle);
+    if (device) {
+      update_parameters(device, &command->data.cmd_le_connection_set_parameters);
+    }
+    break;
+
+  case gecko_cmd_le_connection_set_phy_id:
+    device =
+        device_by_connection(command->data.cmd_le_connection_set_phy.connection);
+    respond_result(id, device ? 0 : bg_err_invalid_conn_handle);
+    if (device) {
+      update_phy(device, command->data.cmd_le_connection_set_phy.phy);
+    }
+    break;
+
+  case gecko_cmd_gatt_set_max_mtu_id: {
+    struct gecko_cmd_packet packet;
+    _max_mtu = command->data.cmd_gatt_set_max_mtu.max_mtu;
+    set_header(&packet, gecko_rsp_gatt_set_max_mtu_id,
+               sizeof(packet.data.rsp_gatt_set_max_mtu));
+    packet.data.rsp_gatt_set_max_mtu.result = 0;
+    packet.data.rsp_gatt_set_max_mtu.max_mtu =
+        command->data.cmd_gatt_set_max_mtu.max_mtu;
+    send(&packet, false);
+  } break;
+
+  default:
+    // Every response starts with its result, the rest reads as zero
+    respond_result(id, 0);
+    break;
+  }
+}
+
+// Frame and handle every complete command in buffer, returns bytes used
+static uint32_t parse_commands(uint8_t *buffer, uint32_t length) {
+  uint32_t offset = 0;
+
+  while (offset < length) {
+    struct gecko_cmd_packet command;
+    uint32_t header;
+    uint32_t payload_length;
+
+    // resynchronize on the command header byte
+    if ((buffer[offset] & 0xF8) != gecko_dev_type_gecko) {
+      offset++;
+      continue;
+    }
+    if (length - offset < BGLIB_MSG_HEADER_LEN) {
+      break;
+    }
+    memcpy(&header, &buffer[offset], BGLIB_MSG_HEADER_LEN);
+    payload_length = BGLIB_MSG_LEN(header);
+    if (length - offset < BGLIB_MSG_HEADER_LEN + payload_length) {
+      break;
+    }
+
+    memset(&command, 0, sizeof(command));
+    memcpy(&command, &buffer[offset], BGLIB_MSG_HEADER_LEN + payload_length);
+    handle_command(&command);
+    offset += BGLIB_MSG_HEADER_LEN + payload_length;
+  }
+
+  return offset;
+}
+
+static int open_pty() {
+  struct termios attributes;
+
+  _master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (_master < 0 || grantpt(_master) || unlockpt(_master)) {
+    perror("posix_openpt");
+    return -1;
+  }
+
+  // Keep the slave open so the gateway can close and reopen it, and make it
+  // raw right away so nothing is echoed before the gateway configures it
+  _slave = open(ptsname(_master), O_RDWR | O_NOCTTY);
+  if (_slave < 0) {
+    perror("open");
+    return -1;
+  }
+  tcgetattr(_slave, &attributes);
+  cfmakeraw(&attributes);
+  return tcsetattr(_slave, TCSANOW, &attributes);
+}
+
+static void print_stats(uint64_t elapsed_us) {
+  fprintf(stderr,
+          "%u commands, %u events (%.0f/s), %.1f kB/s, %u lost, "
+          "%u overflowed, %u adverts outside the scan window",
+          _stats.commands, _stats.events,
+          _stats.events * 1000000.0 / elapsed_us,
+          _stats.bytes * 1000.0 / elapsed_us, _stats.lost, _stats.overflow,
+          _stats.unheard);
+  if (_drop_period_us) {
+    fprintf(stderr, ", %u reconnects (%.1f ms after the drop)",
+            _stats.reconnects,
+            _stats.reconnects ? _stats.reconnect_us / 1000.0 / _stats.reconnects
+                              : 0.0);
+  }
+  fprintf(stderr, "\n");
+  memset(&_stats, 0, sizeof(_stats));
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [-n devices] [-a adverts/s] [-i other adverts/s]\n"
+          "          [-r notifications/s] [-l latency ms] [-d loss %%] [-c]\n"
+          "          [-1] [-o drop period s] [-O outage ms]\n"
+          "          [-b beacons] [-e beacon adverts/s] [-v]\n"
+          " -n  Thunderboards in range (default 1, max %d)\n"
+          " -a  Thunderboard scan responses per second, all devices together\n"
+          "     (default 10)\n"
+          " -i  Scan responses per second from other devices (default 0)\n"
+          " -r  Notifications per second per subscribed characteristic\n"
+          "     (default 1)\n"
+          " -l  Latency added to every response and event in ms (default 0)\n"
+          " -d  Percentage of scan responses and notifications lost\n"
+          " -c  Model connection events, air time, parameter, PHY and MTU\n"
+          "     updates\n"
+          " -1  Peripherals support the 1M PHY only\n"
+          " -o  Drop every connection after this many seconds (default never)\n"
+          " -O  Board out of range for this many ms after a drop\n"
+          "     (default 1000)\n"
+          " -b  Beacons advertising sensor values (default 0, max %d)\n"
+          " -e  Beacon adverts per second, all beacons together (default 100)\n"
+          " -v  Print every command\n",
+          name, MAX_DEVICES, MAX_BEACONS);
+}
+
+// Next time a periodic source is due, catching up at most MAX_CATCH_UP
+static uint32_t due_count(uint64_t *next_us, uint32_t rate, uint64_t now) {
+  uint32_t count = 0;
+
+  if (!rate) {
+    *next_us = UINT64_MAX;
+    return 0;
+  }
+  while (*next_us <= now && count < MAX_CATCH_UP) {
+    *next_us += 1000000 / rate;
+    count++;
+  }
+  if (*next_us <= now) {
+    *next_us = now + 1000000 / rate;
+  }
+  return count;
+}
+
+int main(int argc, char **argv) {
+  uint8_t input[INPUT_BUFFER_LENGTH];
+  uint32_t input_length = 0;
+  int option;
+
+  while ((option = getopt(argc, argv, "n:a:i:r:l:d:c1o:O:b:e:vh")) != -1) {
+    switch (option) {
+    case 'n':
+      _num_devices = atoi(optarg);
+      break;
+    case 'a':
+      _advert_rate = atoi(optarg);
+      break;
+    case 'i':
+      _other_advert_rate = atoi(optarg);
+      break;
+    case 'r':
+      _notify_rate = atoi(optarg);
+      break;
+    case 'l':
+      _latency_us = atoi(optarg) * 1000;
+      break;
+    case 'd':
+      _loss_permille = atof(optarg) * 10;
+      break;
+    case 'c':
+      _link_model = true;
+      break;
+    case '1':
+      _phy_2m = false;
+      break;
+    case 'o':
+      _drop_period_us = atof(optarg) * 1000000;
+      break;
+    case 'O':
+      _outage_us = atoi(optarg) * 1000;
+      break;
+    case 'b':
+      _num_beacons = atoi(optarg);
+      break;
+    case 'e':
+      _beacon_advert_rate = atoi(optarg);
+      break;
+    case 'v':
+      _verbose = true;
+      break;
+    default:
+      usage(argv[0]);
+      return -1;
+    }
+  }
+  if (_num_devices < 1 || _num_devices > MAX_DEVICES ||
+      _num_beacons > MAX_BEACONS) {
+    usage(argv[0]);
+    return -1;
+  }
+
+  for (uint32_t i = 0; i < _num_devices; i++) {
+    // Silicon Labs OUI, sent least significant byte first
+    bd_addr address = {{i + 1, 0x00, 0xAA, 0x57, 0x0B, 0x00}};
+    _devices[i].address = address;
+    snprintf(_devices[i].name, sizeof(_devices[i].name), "Thunder Sense #%05u",
+             i + 1);
+  }
+
+  if (open_pty()) {
+    return -1;
+  }
+  printf("%s\n", ptsname(_master));
+  fflush(stdout);
+
+  uint64_t start = now_us();
+  uint64_t next_advert = start;
+  uint64_t next_other = start;
+  uint64_t next_beacon = start;
+  uint64_t next_notify = start;
+  uint64_t next_stats = start + STATS_INTERVAL_US;
+
+  while (1) {
+    uint64_t now = now_us();
+    uint32_t count;
+
+    count = due_count(&next_advert, _advert_rate, now);
+    while (_scanning && count--) {
+      advertise_next();
+    }
+    count = due_count(&next_other, _other_advert_rate, now);
+    while (_scanning && count--) {
+      advertise_other();
+    }
+    count = due_count(&next_beacon, _num_beacons ? _beacon_advert_rate : 0,
+                      now);
+    while (_scanning && count--) {
+      advertise_beacon();
+    }
+    count = due_count(&next_notify, _notify_rate, now);
+    while (count--) {
+      notify_subscribed();
+    }
+    uint64_t link_wake = update_links(now);
+    flush_output(now);
+
+    if (now >= next_stats) {
+      print_stats(now - next_stats + STATS_INTERVAL_US);
+      next_stats = now + STATS_INTERVAL_US;
+    }
+
+    uint64_t wake = next_stats;
+    if (_scanning && next_advert < wake) {
+      wake = next_advert;
+    }
+    if (_scanning && next_other < wake) {
+      wake = next_other;
+    }
+    if (_scanning && next_beacon < wake) {
+      wake = next_beacon;
+    }
+    if (next_notify < wake) {
+      wake = next_notify;
+    }
+    if (link_wake < wake) {
+      wake = link_wake;
+    }
+    if (_output_tail != _output_head &&
+        _output[_output_tail % OUTPUT_QUEUE_LENGTH].due_us < wake) {
+      wake = _output[_output_tail % OUTPUT_QUEUE_LENGTH].due_us;
+    }
+
+    struct pollfd pfd = {.fd = _master, .events = POLLIN};
+    now = now_us();
+    int timeout = wake > now ? (wake - now + 999) / 1000 : 0;
+    if (poll(&pfd, 1, timeout) > 0 && (pfd.revents & POLLIN)) {
+      ssize_t result =
+          read(_master, &input[input_length], sizeof(input) - input_length);
+      if (result > 0) {
+        input_length += result;
+        uint32_t used = parse_commands(input, input_length);
+        memmove(input, &input[used], input_length - used);
+        input_length -= used;
+      }
+    }
+  }
+
+  return 0;
+}